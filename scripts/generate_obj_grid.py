@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+
+# Writes a triangulated grid with positions, texture coordinates and normals as an OBJ file, an input of a given
+# size for the obj-benchmark, e.g. 10M triangles: scripts/generate_obj_grid.py -t 10000000 grid_10M.obj
+
+import argparse
+import math
+import sys
+
+parser = argparse.ArgumentParser(description="Generate a synthetic OBJ grid")
+parser.add_argument("-t", "--triangles", type=int, default=10_000_000, help="approximate number of triangles")
+parser.add_argument("-s", "--shapes", type=int, default=1, help="number of `o' shapes the faces are split into")
+parser.add_argument("output", metavar="output", action="store")
+
+args = parser.parse_args()
+
+if args.triangles < 2 or args.shapes < 1:
+    print("Need at least two triangles and one shape")
+    sys.exit(1)
+
+# n x n quads, two triangles each.
+n = max(1, math.isqrt(args.triangles // 2))
+rows_per_shape = max(1, -(-n // args.shapes))
+
+with open(args.output, "w", buffering=1 << 24) as f:
+    f.write(f"# Synthetic grid of {n} x {n} quads, {2 * n * n} triangles\n")
+    for j in range(n + 1):
+        y = j / n
+        f.write("".join(f"v {i / n:.6f} {y:.6f} 0.0\n" for i in range(n + 1)))
+    for j in range(n + 1):
+        y = j / n
+        f.write("".join(f"vt {i / n:.6f} {y:.6f}\n" for i in range(n + 1)))
+    f.write("vn 0.0 0.0 1.0\n")
+
+    for j in range(n):
+        if j % rows_per_shape == 0:
+            f.write(f"o grid_{j // rows_per_shape}\n")
+        lines = []
+        for i in range(n):
+            a = j * (n + 1) + i + 1
+            b = a + 1
+            c = a + n + 1
+            d = c + 1
+            lines.append(f"f {a}/{a}/1 {b}/{b}/1 {d}/{d}/1\nf {a}/{a}/1 {d}/{d}/1 {c}/{c}/1\n")
+        f.write("".join(lines))
+
+print(f"Wrote {2 * n * n} triangles to {args.output}")
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <cmath>
 #include <limits>
 
 #include "glm/glm.hpp"
@@ -12,6 +13,13 @@
 #include "Geometry/utils.h"
 
 namespace xe {
+
+    template<typename glm::length_t L, typename F = typename glm::vec3::value_type>
+    struct BoundingSphere {
+        glm::vec<L, F> center;
+        F radius;
+    };
+
     template<typename glm::length_t L, typename F = typename glm::vec3::value_type>
     class BoundingBox {
     public:
@@ -19,7 +27,13 @@ namespace xe {
 
         BoundingBox() : n_points_(0),
                         min_(std::numeric_limits<F>::max()),
-                        max_(std::numeric_limits<F>::min()) {}
+                        max_(std::numeric_limits<F>::lowest()) {}
+
+        /**
+         * Box with the given corners, e.g. restored from a file. `n_points` only matters for empty().
+         */
+        BoundingBox(const vec_t &min, const vec_t &max, size_t n_points = 2) : n_points_(n_points),
+                                                                                min_(min), max_(max) {}
 
         void add(const vec_t &p) {
             n_points_++;
@@ -27,6 +41,39 @@ namespace xe {
             max_ = glm::max(max_, p);
         }
 
+        /**
+         * Extends the box to contain `other`.
+         */
+        void merge(const BoundingBox &other) {
+            if (other.empty())
+                return;
+            n_points_ += other.n_points_;
+            min_ = glm::min(min_, other.min_);
+            max_ = glm::max(max_, other.max_);
+        }
+
+        /**
+         * Smallest axis aligned box containing this box transformed by the affine matrix `m`. Uses the center and
+         * extent form, so it costs one matrix-vector product instead of transforming the eight corners.
+         */
+        BoundingBox transform(const glm::mat<L + 1, L + 1, F> &m) const {
+            if (empty())
+                return *this;
+            auto c = center();
+            auto e = extent();
+            vec_t tc, te;
+            for (glm::length_t i = 0; i < L; ++i) {
+                tc[i] = m[L][i];
+                te[i] = F(0);
+                for (glm::length_t j = 0; j < L; ++j) {
+                    tc[i] += m[j][i] * c[j];
+                    te[i] += std::abs(m[j][i]) * e[j];
+                }
+            }
+            return BoundingBox(tc - te, tc + te, n_points_);
+        }
+
+        bool empty() const { return n_points_ == 0; }
 
         auto n_points() const { return n_points_; }
 
@@ -34,10 +81,22 @@ namespace xe {
 
         auto max() const { return max_; }
 
+        vec_t center() const { return empty() ? vec_t(F(0)) : F(0.5) * (min_ + max_); }
+
+        /**
+         * Half of the size of the box along each axis.
+         */
+        vec_t extent() const { return empty() ? vec_t(F(0)) : F(0.5) * (max_ - min_); }
+
+        /**
+         * Sphere around the center of the box passing through its corners.
+         */
+        BoundingSphere<L, F> sphere() const { return {center(), glm::length(extent())}; }
+
 
     private:
         size_t n_points_;
         vec_t min_;
         vec_t max_;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,145 @@
+#include "mapped_file.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+namespace xe {
+
+#ifdef _WIN32
+
+    MappedFile::MappedFile() : data_(nullptr), size_(0), is_open_(false), file_(nullptr), mapping_(nullptr) {}
+
+    bool MappedFile::open(const std::string &path) {
+        close();
+        auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            CloseHandle(file);
+            return false;
+        }
+        file_ = file;
+        size_ = static_cast<size_t>(size.QuadPart);
+        is_open_ = true;
+        if (size_ == 0)
+            return true;
+
+        mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_ == nullptr) {
+            close();
+            return false;
+        }
+        data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (data_ == nullptr) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (data_ != nullptr)
+            UnmapViewOfFile(data_);
+        if (mapping_ != nullptr)
+            CloseHandle(mapping_);
+        if (file_ != nullptr)
+            CloseHandle(file_);
+        data_ = nullptr;
+        mapping_ = nullptr;
+        file_ = nullptr;
+        size_ = 0;
+        is_open_ = false;
+    }
+
+    void MappedFile::swap(MappedFile &other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(is_open_, other.is_open_);
+        std::swap(file_, other.file_);
+        std::swap(mapping_, other.mapping_);
+    }
+
+#else
+
+    MappedFile::MappedFile() : data_(nullptr), size_(0), is_open_(false), fd_(-1) {}
+
+    bool MappedFile::open(const std::string &path) {
+        close();
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        fd_ = fd;
+        size_ = static_cast<size_t>(st.st_size);
+        is_open_ = true;
+        if (size_ == 0)
+            return true;
+
+        auto ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (ptr == MAP_FAILED) {
+            close();
+            return false;
+        }
+        // The file is consumed front to back by every chunk, so ask the kernel to read ahead aggressively.
+        madvise(ptr, size_, MADV_WILLNEED);
+        data_ = static_cast<const char *>(ptr);
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (data_ != nullptr)
+            munmap(const_cast<char *>(data_), size_);
+        if (fd_ >= 0)
+            ::close(fd_);
+        data_ = nullptr;
+        fd_ = -1;
+        size_ = 0;
+        is_open_ = false;
+    }
+
+    void MappedFile::swap(MappedFile &other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(is_open_, other.is_open_);
+        std::swap(fd_, other.fd_);
+    }
+
+#endif
+
+    MappedFile::MappedFile(const std::string &path) : MappedFile() {
+        open(path);
+    }
+
+    MappedFile::MappedFile(MappedFile &&other) noexcept: MappedFile() {
+        swap(other);
+    }
+
+    MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            close();
+            swap(other);
+        }
+        return *this;
+    }
+}
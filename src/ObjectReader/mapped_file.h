@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace xe {
+
+    /**
+     * Read-only memory mapping of a whole file. The mapping is released when the object is destroyed.
+     */
+    class MappedFile {
+    public:
+        MappedFile();
+
+        explicit MappedFile(const std::string &path);
+
+        MappedFile(const MappedFile &) = delete;
+
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        MappedFile(MappedFile &&other) noexcept;
+
+        MappedFile &operator=(MappedFile &&other) noexcept;
+
+        ~MappedFile() { close(); }
+
+        bool open(const std::string &path);
+
+        void close();
+
+        bool is_open() const { return is_open_; }
+
+        const char *data() const { return data_; }
+
+        size_t size() const { return size_; }
+
+        const char *begin() const { return data_; }
+
+        const char *end() const { return data_ + size_; }
+
+    private:
+        void swap(MappedFile &other) noexcept;
+
+        const char *data_;
+        size_t size_;
+        bool is_open_;
+#ifdef _WIN32
+        void *file_;
+        void *mapping_;
+#else
+        int fd_;
+#endif
+    };
+
+}
@@ -0,0 +1,106 @@
+#include "memory_usage.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+
+#include <mach/mach.h>
+#include <sys/resource.h>
+
+#endif
+
+namespace {
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+
+    /**
+     * Value in bytes of a `kB` field of /proc/self/status.
+     */
+    size_t proc_status_field(const char *name) {
+        auto file = std::fopen("/proc/self/status", "r");
+        if (!file)
+            return 0;
+        char line[256];
+        size_t value = 0;
+        auto length = std::strlen(name);
+        while (std::fgets(line, sizeof(line), file)) {
+            if (std::strncmp(line, name, length) == 0 && line[length] == ':') {
+                unsigned long long kb = 0;
+                if (std::sscanf(line + length + 1, "%llu", &kb) == 1)
+                    value = static_cast<size_t>(kb) * 1024;
+                break;
+            }
+        }
+        std::fclose(file);
+        return value;
+    }
+
+#endif
+
+}
+
+namespace xe {
+
+#ifdef _WIN32
+
+    size_t current_rss() {
+        PROCESS_MEMORY_COUNTERS counters;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+        return counters.WorkingSetSize;
+    }
+
+    size_t peak_rss() {
+        PROCESS_MEMORY_COUNTERS counters;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return 0;
+        return counters.PeakWorkingSetSize;
+    }
+
+    bool reset_peak_rss() { return false; }
+
+#elif defined(__APPLE__)
+
+    size_t current_rss() {
+        mach_task_basic_info_data_t info;
+        mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+        if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) !=
+            KERN_SUCCESS)
+            return 0;
+        return info.resident_size;
+    }
+
+    size_t peak_rss() {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+        // Bytes on macOS, unlike Linux.
+        return static_cast<size_t>(usage.ru_maxrss);
+    }
+
+    bool reset_peak_rss() { return false; }
+
+#else
+
+    size_t current_rss() { return proc_status_field("VmRSS"); }
+
+    size_t peak_rss() { return proc_status_field("VmHWM"); }
+
+    bool reset_peak_rss() {
+        auto file = std::fopen("/proc/self/clear_refs", "w");
+        if (!file)
+            return false;
+        auto ok = std::fputs("5", file) >= 0;
+        return std::fclose(file) == 0 && ok;
+    }
+
+#endif
+
+}
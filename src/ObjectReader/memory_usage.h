@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+namespace xe {
+
+    /**
+     * Resident set size of the process in bytes, 0 where it cannot be read.
+     */
+    size_t current_rss();
+
+    /**
+     * Largest resident set size of the process in bytes since it started or since the last successful
+     * reset_peak_rss, 0 where it cannot be read.
+     */
+    size_t peak_rss();
+
+    /**
+     * Starts a new peak measurement. Only Linux can do it (through /proc/self/clear_refs), elsewhere the peak covers
+     * the whole life of the process and false is returned.
+     *
+     * The reset is process wide: it also restarts the peak seen by any other measurement running at the same time and
+     * clears the soft-dirty bits of all the pages, which tools tracking written memory rely on.
+     */
+    bool reset_peak_rss();
+
+}
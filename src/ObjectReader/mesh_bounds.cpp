@@ -0,0 +1,149 @@
+#include "mesh_bounds.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define XE_BOUNDS_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define XE_BOUNDS_NEON
+#endif
+
+#include "spdlog/spdlog.h"
+
+#include "parallel.h"
+
+namespace {
+
+    const size_t ITEMS_PER_TASK = 1u << 16;
+
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "vertex_coords are read as a flat array of floats");
+
+    /**
+     * Box of the points [begin, end). Four points are twelve floats, i.e. three registers whose lanes hold the
+     * coordinates in the order x y z x | y z x y | z x y z, so the points are reduced without any shuffles and the
+     * lanes are only sorted out at the end.
+     */
+    xe::BoundingBox<3> chunk_box(const glm::vec3 *points, size_t begin, size_t end) {
+        glm::vec3 lo(std::numeric_limits<float>::max());
+        glm::vec3 hi(std::numeric_limits<float>::lowest());
+        auto i = begin;
+#if defined(XE_BOUNDS_SSE2) || defined(XE_BOUNDS_NEON)
+        if (end - begin >= 4) {
+            auto p = reinterpret_cast<const float *>(points + begin);
+            alignas(16) float l[12], h[12];
+#if defined(XE_BOUNDS_SSE2)
+            auto l0 = _mm_loadu_ps(p), l1 = _mm_loadu_ps(p + 4), l2 = _mm_loadu_ps(p + 8);
+            auto h0 = l0, h1 = l1, h2 = l2;
+            for (i += 4, p += 12; i + 4 <= end; i += 4, p += 12) {
+                auto v0 = _mm_loadu_ps(p), v1 = _mm_loadu_ps(p + 4), v2 = _mm_loadu_ps(p + 8);
+                l0 = _mm_min_ps(l0, v0);
+                l1 = _mm_min_ps(l1, v1);
+                l2 = _mm_min_ps(l2, v2);
+                h0 = _mm_max_ps(h0, v0);
+                h1 = _mm_max_ps(h1, v1);
+                h2 = _mm_max_ps(h2, v2);
+            }
+            _mm_store_ps(l, l0);
+            _mm_store_ps(l + 4, l1);
+            _mm_store_ps(l + 8, l2);
+            _mm_store_ps(h, h0);
+            _mm_store_ps(h + 4, h1);
+            _mm_store_ps(h + 8, h2);
+#else
+            auto l0 = vld1q_f32(p), l1 = vld1q_f32(p + 4), l2 = vld1q_f32(p + 8);
+            auto h0 = l0, h1 = l1, h2 = l2;
+            for (i += 4, p += 12; i + 4 <= end; i += 4, p += 12) {
+                auto v0 = vld1q_f32(p), v1 = vld1q_f32(p + 4), v2 = vld1q_f32(p + 8);
+                l0 = vminq_f32(l0, v0);
+                l1 = vminq_f32(l1, v1);
+                l2 = vminq_f32(l2, v2);
+                h0 = vmaxq_f32(h0, v0);
+                h1 = vmaxq_f32(h1, v1);
+                h2 = vmaxq_f32(h2, v2);
+            }
+            vst1q_f32(l, l0);
+            vst1q_f32(l + 4, l1);
+            vst1q_f32(l + 8, l2);
+            vst1q_f32(h, h0);
+            vst1q_f32(h + 4, h1);
+            vst1q_f32(h + 8, h2);
+#endif
+            // Lane k of the twelve holds coordinate k % 3.
+            for (int k = 0; k < 12; k++) {
+                lo[k % 3] = std::min(lo[k % 3], l[k]);
+                hi[k % 3] = std::max(hi[k % 3], h[k]);
+            }
+        }
+#endif
+        for (; i < end; i++) {
+            lo = glm::min(lo, points[i]);
+            hi = glm::max(hi, points[i]);
+        }
+        return xe::BoundingBox<3>(lo, hi, end - begin);
+    }
+}
+
+namespace xe {
+
+    BoundingBox<3> bounding_box(const std::vector<glm::vec3> &points, unsigned int n_threads) {
+        auto n = points.size();
+        auto n_tasks = (n + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK;
+        std::vector<BoundingBox<3>> boxes(n_tasks);
+        parallel_for(n_tasks, n_threads, [&](size_t task) {
+            auto begin = task * ITEMS_PER_TASK;
+            boxes[task] = chunk_box(points.data(), begin, std::min(begin + ITEMS_PER_TASK, n));
+        });
+        BoundingBox<3> bb;
+        for (auto &&b: boxes)
+            bb.merge(b);
+        return bb;
+    }
+
+    std::vector<BoundingBox<3>> submesh_bounding_boxes(const sMesh &mesh, unsigned int n_threads) {
+        auto &&sms = mesh.submeshes;
+        auto &&p = mesh.vertex_coords;
+        std::vector<BoundingBox<3>> boxes(sms.size());
+
+        // Faces are split into chunks, each chunk collects the boxes of the submeshes it overlaps.
+        struct Part {
+            size_t submesh;
+            BoundingBox<3> bb;
+        };
+        auto n_faces = mesh.faces.size();
+        auto n_tasks = (n_faces + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK;
+        std::vector<std::vector<Part>> parts(n_tasks);
+        parallel_for(n_tasks, n_threads, [&](size_t task) {
+            auto begin = task * ITEMS_PER_TASK;
+            auto end = std::min(begin + ITEMS_PER_TASK, n_faces);
+            for (size_t s = 0; s < sms.size(); s++) {
+                auto first = std::max<size_t>(begin, sms[s].start / 3);
+                auto last = std::min<size_t>(end, sms[s].end / 3);
+                if (first >= last)
+                    continue;
+                Part part{s, {}};
+                for (auto f = first; f < last; f++)
+                    for (auto v: mesh.faces[f].v)
+                        part.bb.add(p[v]);
+                parts[task].push_back(part);
+            }
+        });
+        for (auto &&task_parts: parts)
+            for (auto &&part: task_parts)
+                boxes[part.submesh].merge(part.bb);
+        return boxes;
+    }
+
+    void compute_bounds(sMesh &mesh, unsigned int n_threads) {
+        mesh.bb = bounding_box(mesh.vertex_coords, n_threads);
+        mesh.submesh_bb = submesh_bounding_boxes(mesh, n_threads);
+        auto c = mesh.bb.center();
+        auto e = mesh.bb.extent();
+        spdlog::debug("Mesh bounds center ({} {} {}) extent ({} {} {})", c.x, c.y, c.z, e.x, e.y, e.z);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include "sMesh.h"
+
+namespace xe {
+
+    /**
+     * Bounding box of the points, reduced in parallel chunks of SSE/NEON min/max using `n_threads` threads (0 means
+     * all).
+     */
+    BoundingBox<3> bounding_box(const std::vector<glm::vec3> &points, unsigned int n_threads = 0);
+
+    /**
+     * Bounding box of the vertices used by each submesh, in the order of `mesh.submeshes`.
+     */
+    std::vector<BoundingBox<3>> submesh_bounding_boxes(const sMesh &mesh, unsigned int n_threads = 0);
+
+    /**
+     * Fills `mesh.bb` and `mesh.submesh_bb`. Called by xe::load_smesh_from_obj; meshes built or modified by hand
+     * have to call it themselves.
+     */
+    void compute_bounds(sMesh &mesh, unsigned int n_threads = 0);
+
+}
@@ -0,0 +1,258 @@
+#include "mesh_normals.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define XE_NORMALS_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define XE_NORMALS_NEON
+#endif
+
+#include "spdlog/spdlog.h"
+
+#include "parallel.h"
+#include "vertex_welder.h"
+
+namespace {
+
+    const size_t ITEMS_PER_TASK = 1u << 16;
+
+    /**
+     * Calls `f(begin, end)` for consecutive chunks of [0, n) in parallel.
+     */
+    template<typename F>
+    void parallel_chunks(size_t n, unsigned int n_threads, F &&f) {
+        auto n_tasks = (n + ITEMS_PER_TASK - 1) / ITEMS_PER_TASK;
+        xe::parallel_for(n_tasks, n_threads, [&](size_t task) {
+            auto begin = task * ITEMS_PER_TASK;
+            f(begin, std::min(begin + ITEMS_PER_TASK, n));
+        });
+    }
+
+    /**
+     * Compressed rows of the face corners (3 * face + corner) sharing the same key.
+     */
+    struct CornerRows {
+        std::vector<uint32_t> first;
+        std::vector<uint32_t> corners;
+
+        template<typename Key>
+        CornerRows(const xe::sMesh &mesh, size_t n_keys, Key &&key) : first(n_keys + 1, 0),
+                                                                     corners(3 * mesh.faces.size()) {
+            for (auto &&f: mesh.faces)
+                for (auto v: f.v)
+                    first[key(v) + 1]++;
+            for (size_t k = 0; k < n_keys; k++)
+                first[k + 1] += first[k];
+            auto fill = first;
+            for (uint32_t f = 0; f < mesh.faces.size(); f++)
+                for (uint32_t c = 0; c < 3; c++)
+                    corners[fill[key(mesh.faces[f].v[c])]++] = 3 * f + c;
+        }
+    };
+
+    inline glm::vec3 cross_scalar(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+        return glm::cross(b - a, c - a);
+    }
+
+    /**
+     * Unnormalized face normals, their length is twice the face area, which gives the area weighting for free.
+     */
+    void face_normals(const xe::sMesh &mesh, size_t begin, size_t end, glm::vec3 *out) {
+        auto &&p = mesh.vertex_coords;
+        auto &&faces = mesh.faces;
+        auto f = begin;
+#if defined(XE_NORMALS_SSE2) || defined(XE_NORMALS_NEON)
+        // Four faces at a time in structure of arrays form.
+        alignas(16) float nx[4], ny[4], nz[4];
+        for (; f + 4 <= end; f += 4) {
+            const glm::vec3 *a[4], *b[4], *c[4];
+            for (int k = 0; k < 4; k++) {
+                a[k] = &p[faces[f + k].v[0]];
+                b[k] = &p[faces[f + k].v[1]];
+                c[k] = &p[faces[f + k].v[2]];
+            }
+#if defined(XE_NORMALS_SSE2)
+#define XE_LANES(q, m) _mm_setr_ps(q[0]->m, q[1]->m, q[2]->m, q[3]->m)
+            auto ax = XE_LANES(a, x), ay = XE_LANES(a, y), az = XE_LANES(a, z);
+            auto e1x = _mm_sub_ps(XE_LANES(b, x), ax);
+            auto e1y = _mm_sub_ps(XE_LANES(b, y), ay);
+            auto e1z = _mm_sub_ps(XE_LANES(b, z), az);
+            auto e2x = _mm_sub_ps(XE_LANES(c, x), ax);
+            auto e2y = _mm_sub_ps(XE_LANES(c, y), ay);
+            auto e2z = _mm_sub_ps(XE_LANES(c, z), az);
+#undef XE_LANES
+            _mm_store_ps(nx, _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y)));
+            _mm_store_ps(ny, _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z)));
+            _mm_store_ps(nz, _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x)));
+#else
+            alignas(16) float lanes[9][4];
+            for (int k = 0; k < 4; k++) {
+                lanes[0][k] = a[k]->x;
+                lanes[1][k] = a[k]->y;
+                lanes[2][k] = a[k]->z;
+                lanes[3][k] = b[k]->x;
+                lanes[4][k] = b[k]->y;
+                lanes[5][k] = b[k]->z;
+                lanes[6][k] = c[k]->x;
+                lanes[7][k] = c[k]->y;
+                lanes[8][k] = c[k]->z;
+            }
+            auto ax = vld1q_f32(lanes[0]), ay = vld1q_f32(lanes[1]), az = vld1q_f32(lanes[2]);
+            auto e1x = vsubq_f32(vld1q_f32(lanes[3]), ax);
+            auto e1y = vsubq_f32(vld1q_f32(lanes[4]), ay);
+            auto e1z = vsubq_f32(vld1q_f32(lanes[5]), az);
+            auto e2x = vsubq_f32(vld1q_f32(lanes[6]), ax);
+            auto e2y = vsubq_f32(vld1q_f32(lanes[7]), ay);
+            auto e2z = vsubq_f32(vld1q_f32(lanes[8]), az);
+            vst1q_f32(nx, vsubq_f32(vmulq_f32(e1y, e2z), vmulq_f32(e1z, e2y)));
+            vst1q_f32(ny, vsubq_f32(vmulq_f32(e1z, e2x), vmulq_f32(e1x, e2z)));
+            vst1q_f32(nz, vsubq_f32(vmulq_f32(e1x, e2y), vmulq_f32(e1y, e2x)));
+#endif
+            for (int k = 0; k < 4; k++)
+                out[f + k] = glm::vec3(nx[k], ny[k], nz[k]);
+        }
+#endif
+        for (; f < end; f++)
+            out[f] = cross_scalar(p[faces[f].v[0]], p[faces[f].v[1]], p[faces[f].v[2]]);
+    }
+
+    /**
+     * Any unit vector perpendicular to `n`.
+     */
+    glm::vec3 perpendicular(const glm::vec3 &n) {
+        auto axis = std::abs(n.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        return glm::normalize(axis - n * glm::dot(n, axis));
+    }
+
+    float corner_angle(const glm::vec3 &p, const glm::vec3 &q, const glm::vec3 &r) {
+        auto e1 = q - p;
+        auto e2 = r - p;
+        auto l = glm::length(e1) * glm::length(e2);
+        if (l <= 0.0f)
+            return 0.0f;
+        return std::acos(std::max(-1.0f, std::min(1.0f, glm::dot(e1, e2) / l)));
+    }
+}
+
+namespace xe {
+
+    void compute_normals(sMesh &mesh, unsigned int n_threads) {
+        auto n_vertices = mesh.vertex_coords.size();
+        auto n_faces = mesh.faces.size();
+
+        std::vector<glm::vec3> normals(n_faces);
+        parallel_chunks(n_faces, n_threads, [&](size_t begin, size_t end) {
+            face_normals(mesh, begin, end, normals.data());
+        });
+
+        auto group = position_groups(mesh.vertex_coords);
+        CornerRows rows(mesh, n_vertices, [&group](uint32_t v) { return group[v]; });
+
+        mesh.vertex_normals.resize(n_vertices);
+        auto &&out = mesh.vertex_normals;
+        // Sum at the first vertex of every group...
+        parallel_chunks(n_vertices, n_threads, [&](size_t begin, size_t end) {
+            for (auto v = begin; v < end; v++) {
+                if (group[v] != v)
+                    continue;
+                glm::vec3 sum(0.0f);
+                for (auto i = rows.first[v]; i < rows.first[v + 1]; i++)
+                    sum += normals[rows.corners[i] / 3];
+                auto l = glm::length(sum);
+                out[v] = l > 0.0f ? sum / l : glm::vec3(0.0f, 0.0f, 1.0f);
+            }
+        });
+        // ...and copy it to the other vertices.
+        parallel_chunks(n_vertices, n_threads, [&](size_t begin, size_t end) {
+            for (auto v = begin; v < end; v++)
+                if (group[v] != v)
+                    out[v] = out[group[v]];
+        });
+        mesh.has_normals = true;
+        spdlog::debug("Generated normals for {} vertices", n_vertices);
+    }
+
+    bool compute_tangents(sMesh &mesh, unsigned int texcoord_set, unsigned int n_threads) {
+        auto n_vertices = mesh.vertex_coords.size();
+        auto n_faces = mesh.faces.size();
+        if (texcoord_set >= sMesh::MAX_TEXCOORDS || !mesh.has_texcoords[texcoord_set] ||
+            mesh.vertex_texcoords[texcoord_set].size() != n_vertices || !mesh.has_normals ||
+            mesh.vertex_normals.size() != n_vertices) {
+            spdlog::warn("Cannot generate tangents without normals and texcoords");
+            return false;
+        }
+        auto &&p = mesh.vertex_coords;
+        auto &&uv = mesh.vertex_texcoords[texcoord_set];
+        auto &&normals = mesh.vertex_normals;
+
+        // Tangent direction of every face (zero if the texcoords are degenerate), its orientation in texture space
+        // and the angles at its corners.
+        std::vector<glm::vec4> face_tangents(n_faces);
+        std::vector<glm::vec3> angles(n_faces);
+        parallel_chunks(n_faces, n_threads, [&](size_t begin, size_t end) {
+            for (auto f = begin; f < end; f++) {
+                auto &&v = mesh.faces[f].v;
+                auto e1 = p[v[1]] - p[v[0]];
+                auto e2 = p[v[2]] - p[v[0]];
+                auto d1 = uv[v[1]] - uv[v[0]];
+                auto d2 = uv[v[2]] - uv[v[0]];
+                auto signed_area = d1.x * d2.y - d2.x * d1.y;
+                auto orientation = signed_area >= 0.0f ? 1.0f : -1.0f;
+                auto t = (e1 * d2.y - e2 * d1.y) * orientation;
+                auto l = glm::length(t);
+                face_tangents[f] = l > 0.0f && signed_area != 0.0f ? glm::vec4(t / l, orientation) : glm::vec4(0.0f);
+                angles[f] = glm::vec3(corner_angle(p[v[0]], p[v[1]], p[v[2]]),
+                                      corner_angle(p[v[1]], p[v[2]], p[v[0]]),
+                                      corner_angle(p[v[2]], p[v[0]], p[v[1]]));
+            }
+        });
+
+        CornerRows rows(mesh, n_vertices, [](uint32_t v) { return v; });
+
+        mesh.vertex_tangents.resize(n_vertices);
+        auto &&out = mesh.vertex_tangents;
+        parallel_chunks(n_vertices, n_threads, [&](size_t begin, size_t end) {
+            for (auto v = begin; v < end; v++) {
+                auto n = normals[v];
+                glm::vec3 sum(0.0f);
+                float handedness = 0.0f;
+                for (auto i = rows.first[v]; i < rows.first[v + 1]; i++) {
+                    auto corner = rows.corners[i];
+                    auto ft = face_tangents[corner / 3];
+                    if (ft.w == 0.0f)
+                        continue;
+                    auto t = glm::vec3(ft) - n * glm::dot(n, glm::vec3(ft));
+                    auto l = glm::length(t);
+                    if (l <= 0.0f)
+                        continue;
+                    auto weight = angles[corner / 3][corner % 3];
+                    sum += t / l * weight;
+                    handedness += ft.w * weight;
+                }
+                // Remove what is left of the normal after the weighted sum.
+                sum -= n * glm::dot(n, sum);
+                auto l = glm::length(sum);
+                out[v] = glm::vec4(l > 0.0f ? sum / l : perpendicular(n), handedness < 0.0f ? -1.0f : 1.0f);
+            }
+        });
+        mesh.has_tangents = true;
+        spdlog::debug("Generated tangents for {} vertices", n_vertices);
+        return true;
+    }
+
+    sMesh *generate_normals(const sMesh &s_mesh) {
+        auto mesh = new sMesh(s_mesh);
+        compute_normals(*mesh);
+        if (mesh->has_texcoords[0])
+            compute_tangents(*mesh);
+        return mesh;
+    }
+}
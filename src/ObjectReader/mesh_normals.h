@@ -0,0 +1,24 @@
+#pragma once
+
+#include "sMesh.h"
+
+namespace xe {
+
+    /**
+     * Fills `vertex_normals` with area weighted averages of the normals of the adjacent faces and sets
+     * `has_normals`. Vertices at the same position (split by texcoords) get the same normal, so UV seams do not show
+     * in the shading. Face normals are computed four at a time with SSE/NEON, faces and vertices are processed in
+     * parallel chunks using `n_threads` threads (0 means all).
+     */
+    void compute_normals(sMesh &mesh, unsigned int n_threads = 0);
+
+    /**
+     * Fills `vertex_tangents` with tangents following the MikkTSpace conventions: per corner tangents from the
+     * texcoord derivatives weighted by the corner angle, Gram-Schmidt orthogonalized against the vertex normal, with
+     * the bitangent sign in `w` (bitangent = w * cross(normal, tangent)). Vertices are not split, so a vertex shared
+     * by faces with mirrored texcoords gets the sign of the majority. Requires normals and the `texcoord_set`;
+     * returns false and leaves the mesh unchanged if they are missing.
+     */
+    bool compute_tangents(sMesh &mesh, unsigned int texcoord_set = 0, unsigned int n_threads = 0);
+
+}
@@ -0,0 +1,478 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+#include "mesh_bounds.h"
+#include "parallel.h"
+
+namespace {
+
+    using Face = std::array<uint32_t, 3>;
+
+    const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    // Constants from Tom Forsyth, "Linear-Speed Vertex Cache Optimisation".
+    const float CACHE_DECAY_POWER = 1.5f;
+    const float LAST_TRI_SCORE = 0.75f;
+    const float VALENCE_BOOST_SCALE = 2.0f;
+    const float VALENCE_BOOST_POWER = 0.5f;
+    const uint32_t MAX_TABLED_VALENCE = 32;
+
+    class VertexScore {
+    public:
+        explicit VertexScore(unsigned int cache_size) : cache_(cache_size), valence_(MAX_TABLED_VALENCE + 1) {
+            for (unsigned int i = 0; i < cache_size; i++) {
+                if (i < 3) {
+                    // The vertices of the last triangle get a fixed score, so the same triangle is not favoured
+                    // just because it shares an edge with the last one.
+                    cache_[i] = LAST_TRI_SCORE;
+                } else {
+                    auto scaler = 1.0f / static_cast<float>(cache_size - 3);
+                    cache_[i] = std::pow(1.0f - static_cast<float>(i - 3) * scaler, CACHE_DECAY_POWER);
+                }
+            }
+            for (uint32_t i = 1; i <= MAX_TABLED_VALENCE; i++)
+                valence_[i] = valence_boost(i);
+        }
+
+        float operator()(uint32_t cache_position, uint32_t remaining) const {
+            if (remaining == 0)
+                return -1.0f;
+            auto score = cache_position == NONE ? 0.0f : cache_[cache_position];
+            return score + (remaining <= MAX_TABLED_VALENCE ? valence_[remaining] : valence_boost(remaining));
+        }
+
+    private:
+        static float valence_boost(uint32_t remaining) {
+            // Vertices with few triangles left are boosted to get rid of them and avoid lone triangles later.
+            return VALENCE_BOOST_SCALE * std::pow(static_cast<float>(remaining), -VALENCE_BOOST_POWER);
+        }
+
+        std::vector<float> cache_;
+        std::vector<float> valence_;
+    };
+
+    /**
+     * Forsyth's greedy reordering of `faces` whose vertices are numbered [0, n_vertices). Writes the new order to
+     * `out`.
+     */
+    void forsyth_order(const std::vector<Face> &faces, uint32_t n_vertices, unsigned int cache_size,
+                       const VertexScore &vertex_score, Face *out) {
+        auto n_faces = faces.size();
+
+        // Triangles adjacent to every vertex in compressed rows; the first `remaining[v]` entries of a row are the
+        // triangles not emitted yet.
+        std::vector<uint32_t> remaining(n_vertices, 0);
+        for (auto &&f: faces)
+            for (auto v: f)
+                remaining[v]++;
+        std::vector<uint32_t> first(n_vertices + 1, 0);
+        for (uint32_t v = 0; v < n_vertices; v++)
+            first[v + 1] = first[v] + remaining[v];
+        std::vector<uint32_t> adjacent(first[n_vertices]);
+        {
+            auto fill = first;
+            for (uint32_t t = 0; t < n_faces; t++)
+                for (auto v: faces[t])
+                    adjacent[fill[v]++] = t;
+        }
+
+        std::vector<uint32_t> cache_position(n_vertices, NONE);
+        std::vector<float> score(n_vertices);
+        for (uint32_t v = 0; v < n_vertices; v++)
+            score[v] = vertex_score(NONE, remaining[v]);
+
+        std::vector<bool> emitted(n_faces, false);
+        std::vector<uint32_t> cache, new_cache;
+        cache.reserve(cache_size + 3);
+        new_cache.reserve(cache_size + 3);
+
+        size_t cursor = 0;
+        uint32_t best = n_faces > 0 ? 0 : NONE;
+        for (size_t n_emitted = 0; n_emitted < n_faces; n_emitted++) {
+            if (best == NONE) {
+                // Dead end: no triangle touches the cache, continue with the next triangle in the input order.
+                while (emitted[cursor])
+                    cursor++;
+                best = static_cast<uint32_t>(cursor);
+            }
+
+            auto &&tri = faces[best];
+            out[n_emitted] = tri;
+            emitted[best] = true;
+
+            new_cache.clear();
+            for (auto v: tri) {
+                auto row = adjacent.begin() + first[v];
+                auto live_end = row + remaining[v];
+                std::iter_swap(std::find(row, live_end, best), live_end - 1);
+                remaining[v]--;
+                new_cache.push_back(v);
+            }
+            for (auto v: cache) {
+                if (v != tri[0] && v != tri[1] && v != tri[2])
+                    new_cache.push_back(v);
+            }
+            for (size_t i = cache_size; i < new_cache.size(); i++) {
+                auto v = new_cache[i];
+                cache_position[v] = NONE;
+                score[v] = vertex_score(NONE, remaining[v]);
+            }
+            if (new_cache.size() > cache_size)
+                new_cache.resize(cache_size);
+            for (uint32_t i = 0; i < new_cache.size(); i++) {
+                auto v = new_cache[i];
+                cache_position[v] = i;
+                score[v] = vertex_score(i, remaining[v]);
+            }
+            std::swap(cache, new_cache);
+
+            // Only triangles touching the cache have changed their score.
+            best = NONE;
+            float best_score = -1.0f;
+            for (auto v: cache) {
+                for (auto i = first[v]; i < first[v] + remaining[v]; i++) {
+                    auto t = adjacent[i];
+                    auto &&f = faces[t];
+                    auto s = score[f[0]] + score[f[1]] + score[f[2]];
+                    if (s > best_score) {
+                        best_score = s;
+                        best = t;
+                    }
+                }
+            }
+        }
+    }
+
+    struct Cluster {
+        size_t start;
+        size_t end;
+        float sort_key;
+    };
+
+    /**
+     * Splits faces [first, last) into clusters, see xe::optimize_overdraw. `inserted` must be filled with NONE and
+     * is left that way.
+     */
+    void split_clusters(const std::vector<xe::sMesh::Face> &faces, size_t first, size_t last, unsigned int cache_size,
+                        float threshold, std::vector<uint32_t> &inserted, std::vector<Cluster> *clusters) {
+        std::vector<uint8_t> face_misses(last - first);
+        uint32_t misses = 0;
+        for (auto f = first; f < last; f++) {
+            uint8_t m = 0;
+            for (auto v: faces[f].v) {
+                if (inserted[v] == NONE || misses - inserted[v] >= cache_size) {
+                    inserted[v] = misses;
+                    misses++;
+                    m++;
+                }
+            }
+            face_misses[f - first] = m;
+        }
+        for (auto f = first; f < last; f++)
+            for (auto v: faces[f].v)
+                inserted[v] = NONE;
+
+        // The clusters get reordered, so each is judged by its ACMR with a cold cache at its start. Bumping the miss
+        // counter by the cache size evicts everything.
+        auto target = threshold * static_cast<float>(misses) / static_cast<float>(last - first);
+        auto start = first;
+        uint32_t cluster_misses = 0;
+        misses = 0;
+        for (auto f = first; f < last; f++) {
+            // A triangle missing on all three vertices restarts the cache anyway, a natural cluster boundary.
+            bool hard = face_misses[f - first] == 3;
+            bool soft = static_cast<float>(cluster_misses) <= target * static_cast<float>(f - start);
+            if (f > start && (hard || soft)) {
+                clusters->push_back({start, f, 0.0f});
+                start = f;
+                cluster_misses = 0;
+                misses += cache_size;
+            }
+            for (auto v: faces[f].v) {
+                if (inserted[v] == NONE || misses - inserted[v] >= cache_size) {
+                    inserted[v] = misses;
+                    misses++;
+                    cluster_misses++;
+                }
+            }
+        }
+        for (auto f = first; f < last; f++)
+            for (auto v: faces[f].v)
+                inserted[v] = NONE;
+        clusters->push_back({start, last, 0.0f});
+    }
+
+    inline float edge(const glm::vec3 &a, const glm::vec3 &b, float x, float y) {
+        return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+    }
+
+    /**
+     * Rasterizes the triangle with the depth test, returns the number of fragments that passed it.
+     */
+    size_t rasterize(glm::vec3 a, glm::vec3 b, glm::vec3 c, int resolution, float *depth) {
+        auto area = edge(a, b, c.x, c.y);
+        if (area == 0.0f)
+            return 0;
+        if (area < 0.0f) {
+            std::swap(b, c);
+            area = -area;
+        }
+        auto x0 = std::max(0, static_cast<int>(std::floor(std::min({a.x, b.x, c.x}))));
+        auto x1 = std::min(resolution - 1, static_cast<int>(std::ceil(std::max({a.x, b.x, c.x}))));
+        auto y0 = std::max(0, static_cast<int>(std::floor(std::min({a.y, b.y, c.y}))));
+        auto y1 = std::min(resolution - 1, static_cast<int>(std::ceil(std::max({a.y, b.y, c.y}))));
+
+        size_t shaded = 0;
+        auto inv_area = 1.0f / area;
+        for (auto y = y0; y <= y1; y++) {
+            auto py = static_cast<float>(y) + 0.5f;
+            for (auto x = x0; x <= x1; x++) {
+                auto px = static_cast<float>(x) + 0.5f;
+                auto w0 = edge(b, c, px, py);
+                auto w1 = edge(c, a, px, py);
+                auto w2 = edge(a, b, px, py);
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                    continue;
+                auto z = (w0 * a.z + w1 * b.z + w2 * c.z) * inv_area;
+                auto &d = depth[y * resolution + x];
+                if (z < d) {
+                    d = z;
+                    shaded++;
+                }
+            }
+        }
+        return shaded;
+    }
+
+    void log_stats(const char *label, const xe::VertexCacheStats &stats) {
+        spdlog::debug("Vertex cache {}: ACMR {:.3f} ATVR {:.3f}", label, stats.acmr, stats.atvr);
+    }
+}
+
+namespace xe {
+
+    VertexCacheStats analyze_vertex_cache(const sMesh &mesh, unsigned int cache_size) {
+        // A vertex is in the FIFO if it was inserted less than `cache_size` misses ago.
+        std::vector<uint32_t> inserted(mesh.vertex_coords.size(), NONE);
+        uint32_t misses = 0;
+        size_t n_used = 0;
+        for (auto &&f: mesh.faces) {
+            for (auto v: f.v) {
+                if (inserted[v] == NONE)
+                    n_used++;
+                if (inserted[v] == NONE || misses - inserted[v] >= cache_size) {
+                    inserted[v] = misses;
+                    misses++;
+                }
+            }
+        }
+        VertexCacheStats stats{0.0f, 0.0f};
+        if (!mesh.faces.empty())
+            stats.acmr = static_cast<float>(misses) / static_cast<float>(mesh.faces.size());
+        if (n_used > 0)
+            stats.atvr = static_cast<float>(misses) / static_cast<float>(n_used);
+        return stats;
+    }
+
+    VertexCacheReport optimize_vertex_cache(sMesh &mesh, unsigned int cache_size) {
+        cache_size = std::max(4u, cache_size);
+        VertexCacheReport report;
+        report.before = analyze_vertex_cache(mesh, cache_size);
+
+        VertexScore vertex_score(cache_size);
+        std::vector<uint32_t> local(mesh.vertex_coords.size(), NONE);
+        std::vector<uint32_t> touched;
+        std::vector<Face> faces;
+
+        for (auto &&sm: mesh.submeshes) {
+            auto first = static_cast<size_t>(sm.start / 3);
+            auto last = static_cast<size_t>(sm.end / 3);
+            if (last - first < 2)
+                continue;
+
+            // Number the vertices of the submesh from zero, so the work is proportional to its size.
+            faces.clear();
+            touched.clear();
+            for (auto f = first; f < last; f++) {
+                Face face;
+                for (int c = 0; c < 3; c++) {
+                    auto v = mesh.faces[f].v[c];
+                    if (local[v] == NONE) {
+                        local[v] = static_cast<uint32_t>(touched.size());
+                        touched.push_back(v);
+                    }
+                    face[c] = local[v];
+                }
+                faces.push_back(face);
+            }
+
+            std::vector<Face> ordered(faces.size());
+            forsyth_order(faces, static_cast<uint32_t>(touched.size()), cache_size, vertex_score, ordered.data());
+
+            for (size_t i = 0; i < ordered.size(); i++) {
+                for (int c = 0; c < 3; c++)
+                    mesh.faces[first + i].v[c] = touched[ordered[i][c]];
+            }
+            for (auto v: touched)
+                local[v] = NONE;
+        }
+
+        optimize_vertex_fetch(mesh);
+
+        report.after = analyze_vertex_cache(mesh, cache_size);
+        log_stats("before", report.before);
+        log_stats("after ", report.after);
+        return report;
+    }
+
+    void optimize_vertex_fetch(sMesh &mesh) {
+        auto n_vertices = mesh.vertex_coords.size();
+        std::vector<uint32_t> new_index(n_vertices, NONE);
+        uint32_t next = 0;
+        for (auto &&f: mesh.faces) {
+            for (auto &&v: f.v) {
+                if (new_index[v] == NONE)
+                    new_index[v] = next++;
+                v = new_index[v];
+            }
+        }
+        if (next < n_vertices)
+            spdlog::debug("Dropping {} unreferenced vertices", n_vertices - next);
+
+        auto permute = [&](auto &attribute) {
+            if (attribute.size() != n_vertices)
+                return;
+            typename std::remove_reference<decltype(attribute)>::type permuted(next);
+            for (size_t i = 0; i < n_vertices; i++) {
+                if (new_index[i] != NONE)
+                    permuted[new_index[i]] = attribute[i];
+            }
+            attribute.swap(permuted);
+        };
+
+        permute(mesh.vertex_coords);
+        for (auto &&t: mesh.vertex_texcoords)
+            permute(t);
+        permute(mesh.vertex_normals);
+        permute(mesh.vertex_tangents);
+        permute(mesh.vertex_colors);
+    }
+
+    void optimize_overdraw(sMesh &mesh, float threshold) {
+        auto &&faces = mesh.faces;
+        if (faces.empty())
+            return;
+
+        glm::vec3 center(0.0f);
+        double total_area = 0.0;
+        glm::dvec3 weighted(0.0);
+        for (auto &&f: faces) {
+            auto &&a = mesh.vertex_coords[f.v[0]];
+            auto &&b = mesh.vertex_coords[f.v[1]];
+            auto &&c = mesh.vertex_coords[f.v[2]];
+            auto area = glm::length(glm::cross(b - a, c - a));
+            weighted += glm::dvec3((a + b + c) * (area / 3.0f));
+            total_area += area;
+        }
+        if (total_area > 0.0)
+            center = glm::vec3(weighted / total_area);
+
+        std::vector<uint32_t> inserted(mesh.vertex_coords.size(), NONE);
+        std::vector<Cluster> clusters;
+        std::vector<sMesh::Face> sorted;
+        size_t n_clusters = 0;
+        for (auto &&sm: mesh.submeshes) {
+            auto first = static_cast<size_t>(sm.start / 3);
+            auto last = static_cast<size_t>(sm.end / 3);
+            if (last - first < 2)
+                continue;
+
+            clusters.clear();
+            split_clusters(faces, first, last, 16, threshold, inserted, &clusters);
+            n_clusters += clusters.size();
+
+            for (auto &&cl: clusters) {
+                glm::vec3 normal(0.0f);
+                glm::vec3 centroid(0.0f);
+                float area = 0.0f;
+                for (auto f = cl.start; f < cl.end; f++) {
+                    auto &&a = mesh.vertex_coords[faces[f].v[0]];
+                    auto &&b = mesh.vertex_coords[faces[f].v[1]];
+                    auto &&c = mesh.vertex_coords[faces[f].v[2]];
+                    auto n = glm::cross(b - a, c - a);
+                    auto l = glm::length(n);
+                    normal += n;
+                    centroid += (a + b + c) * (l / 3.0f);
+                    area += l;
+                }
+                auto n_length = glm::length(normal);
+                if (area > 0.0f && n_length > 0.0f)
+                    cl.sort_key = glm::dot(centroid / area - center, normal / n_length);
+            }
+            std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) {
+                return a.sort_key > b.sort_key;
+            });
+
+            sorted.clear();
+            for (auto &&cl: clusters)
+                sorted.insert(sorted.end(), faces.begin() + cl.start, faces.begin() + cl.end);
+            std::copy(sorted.begin(), sorted.end(), faces.begin() + first);
+        }
+        spdlog::debug("Overdraw optimization sorted {} clusters in {} submeshes", n_clusters, mesh.submeshes.size());
+    }
+
+    OverdrawStats estimate_overdraw(const sMesh &mesh, unsigned int n_views, unsigned int resolution) {
+        OverdrawStats stats{0.0f, 0, 0};
+        if (mesh.faces.empty() || n_views == 0 || resolution == 0)
+            return stats;
+
+        auto sphere = bounding_box(mesh.vertex_coords).sphere();
+        auto center = sphere.center;
+        auto radius = sphere.radius;
+        if (radius <= 0.0f)
+            return stats;
+        auto scale = 0.5f * static_cast<float>(resolution) / radius;
+
+        auto res = static_cast<int>(resolution);
+        std::vector<size_t> shaded(n_views, 0), covered(n_views, 0);
+        xe::parallel_for(n_views, 0, [&](size_t view) {
+            // Directions on a Fibonacci sphere.
+            auto z = 1.0f - (2.0f * static_cast<float>(view) + 1.0f) / static_cast<float>(n_views);
+            auto r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            auto phi = 2.399963f * static_cast<float>(view);
+            glm::vec3 dir(r * std::cos(phi), r * std::sin(phi), z);
+            auto up = std::abs(dir.z) < 0.9f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+            auto u = glm::normalize(glm::cross(up, dir));
+            auto v = glm::cross(dir, u);
+
+            std::vector<glm::vec3> projected(mesh.vertex_coords.size());
+            for (size_t i = 0; i < projected.size(); i++) {
+                auto p = mesh.vertex_coords[i] - center;
+                projected[i] = glm::vec3((glm::dot(p, u) + radius) * scale, (glm::dot(p, v) + radius) * scale,
+                                         glm::dot(p, dir));
+            }
+
+            std::vector<float> depth(resolution * resolution, std::numeric_limits<float>::infinity());
+            size_t n = 0;
+            for (auto &&f: mesh.faces)
+                n += rasterize(projected[f.v[0]], projected[f.v[1]], projected[f.v[2]], res, depth.data());
+            shaded[view] = n;
+            covered[view] = static_cast<size_t>(std::count_if(depth.begin(), depth.end(), [](float d) {
+                return d != std::numeric_limits<float>::infinity();
+            }));
+        });
+
+        for (unsigned int i = 0; i < n_views; i++) {
+            stats.shaded += shaded[i];
+            stats.covered += covered[i];
+        }
+        if (stats.covered > 0)
+            stats.overdraw = static_cast<float>(stats.shaded) / static_cast<float>(stats.covered);
+        return stats;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "sMesh.h"
+
+namespace xe {
+
+    /**
+     * Post-transform vertex cache efficiency of a triangle order, simulated with a FIFO cache.
+     * ACMR is the average number of cache misses per triangle (0.5 is the ideal for a large regular grid, 3 the worst),
+     * ATVR is the number of misses per referenced vertex (1 is ideal).
+     */
+    struct VertexCacheStats {
+        float acmr;
+        float atvr;
+    };
+
+    struct VertexCacheReport {
+        VertexCacheStats before;
+        VertexCacheStats after;
+    };
+
+    VertexCacheStats analyze_vertex_cache(const sMesh &mesh, unsigned int cache_size = 16);
+
+    /**
+     * Reorders the faces of every submesh for the post-transform vertex cache using Tom Forsyth's linear-speed
+     * algorithm; submesh ranges and materials are left untouched. Then renumbers the vertices with
+     * optimize_vertex_fetch. ACMR and ATVR before and after, both for a FIFO cache of `cache_size` vertices, are logged
+     * and returned.
+     */
+    VertexCacheReport optimize_vertex_cache(sMesh &mesh, unsigned int cache_size = 32);
+
+    /**
+     * Renumbers the vertices in the order of their first use by the faces and permutes all the vertex attributes
+     * accordingly, so the vertex fetch walks memory almost sequentially. Vertices not used by any face are dropped.
+     */
+    void optimize_vertex_fetch(sMesh &mesh);
+
+    /**
+     * Reduces overdraw while keeping most of the vertex cache efficiency of the current triangle order (run it after
+     * optimize_vertex_cache). Every submesh is split into clusters at the points where the vertex cache would be
+     * restarted anyway, or where the ACMR of the cluster so far is within `threshold` of the ACMR of the submesh.
+     * The clusters are then sorted so that the ones facing away from the center of the mesh, which are likely to
+     * occlude the others, are drawn first. Vertex numbering is not changed, follow with optimize_vertex_fetch.
+     */
+    void optimize_overdraw(sMesh &mesh, float threshold = 1.05f);
+
+    /**
+     * Average overdraw: the number of fragments passing the depth test divided by the number of covered pixels.
+     */
+    struct OverdrawStats {
+        float overdraw;
+        size_t shaded;
+        size_t covered;
+    };
+
+    /**
+     * Estimates the overdraw of the mesh drawn in its current order by rasterizing it with a depth buffer of
+     * `resolution` x `resolution` pixels in orthographic views from `n_views` directions spread evenly over the sphere.
+     * Faces are not culled, as in Mesh::draw with culling disabled.
+     */
+    OverdrawStats estimate_overdraw(const sMesh &mesh, unsigned int n_views = 16, unsigned int resolution = 256);
+
+}
@@ -0,0 +1,112 @@
+#include "meshlets.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+
+    const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    // Cones wider than this can never be back-facing as a whole and are not worth testing.
+    const float MIN_CONE_DOT = 0.1f;
+
+    void compute_bounds(const xe::sMesh &mesh, xe::sMesh::Meshlet *meshlet) {
+        auto first = static_cast<size_t>(meshlet->start / 3);
+        auto last = static_cast<size_t>(meshlet->end / 3);
+
+        glm::vec3 lo(std::numeric_limits<float>::max());
+        glm::vec3 hi(std::numeric_limits<float>::lowest());
+        glm::vec3 normal_sum(0.0f);
+        for (auto f = first; f < last; f++) {
+            auto &&a = mesh.vertex_coords[mesh.faces[f].v[0]];
+            auto &&b = mesh.vertex_coords[mesh.faces[f].v[1]];
+            auto &&c = mesh.vertex_coords[mesh.faces[f].v[2]];
+            lo = glm::min(lo, glm::min(a, glm::min(b, c)));
+            hi = glm::max(hi, glm::max(a, glm::max(b, c)));
+            auto n = glm::cross(b - a, c - a);
+            auto l = glm::length(n);
+            if (l > 0.0f)
+                normal_sum += n / l;
+        }
+
+        auto center = 0.5f * (lo + hi);
+        float radius2 = 0.0f;
+        for (auto f = first; f < last; f++)
+            for (auto v: mesh.faces[f].v) {
+                auto d = mesh.vertex_coords[v] - center;
+                radius2 = std::max(radius2, glm::dot(d, d));
+            }
+        meshlet->center = center;
+        meshlet->radius = std::sqrt(radius2);
+
+        meshlet->cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+        meshlet->cone_cutoff = 1.0f;
+        auto axis_length = glm::length(normal_sum);
+        if (axis_length <= 0.0f)
+            return;
+        auto axis = normal_sum / axis_length;
+
+        auto min_dot = 1.0f;
+        for (auto f = first; f < last; f++) {
+            auto &&a = mesh.vertex_coords[mesh.faces[f].v[0]];
+            auto &&b = mesh.vertex_coords[mesh.faces[f].v[1]];
+            auto &&c = mesh.vertex_coords[mesh.faces[f].v[2]];
+            auto n = glm::cross(b - a, c - a);
+            auto l = glm::length(n);
+            if (l > 0.0f)
+                min_dot = std::min(min_dot, glm::dot(n / l, axis));
+        }
+        meshlet->cone_axis = axis;
+        if (min_dot > MIN_CONE_DOT)
+            meshlet->cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+    }
+}
+
+namespace xe {
+
+    void build_meshlets(sMesh &mesh, unsigned int max_vertices, unsigned int max_triangles) {
+        max_vertices = std::max(3u, max_vertices);
+        max_triangles = std::max(1u, max_triangles);
+        mesh.meshlets.clear();
+
+        // Meshlet that has last seen every vertex, so counting distinct vertices needs no clearing.
+        std::vector<uint32_t> seen(mesh.vertex_coords.size(), NONE);
+        for (size_t s = 0; s < mesh.submeshes.size(); s++) {
+            auto &&sm = mesh.submeshes[s];
+            auto first = static_cast<size_t>(sm.start / 3);
+            auto last = static_cast<size_t>(sm.end / 3);
+
+            size_t start = first;
+            unsigned int n_vertices = 0;
+            auto id = static_cast<uint32_t>(mesh.meshlets.size());
+            for (auto f = first; f < last; f++) {
+                unsigned int n_new = 0;
+                for (auto v: mesh.faces[f].v)
+                    if (seen[v] != id)
+                        n_new++;
+                if (f > start && (n_vertices + n_new > max_vertices || f - start >= max_triangles)) {
+                    mesh.meshlets.push_back({int(3 * start), int(3 * f), int(s)});
+                    start = f;
+                    n_vertices = 0;
+                    id = static_cast<uint32_t>(mesh.meshlets.size());
+                }
+                for (auto v: mesh.faces[f].v) {
+                    if (seen[v] != id) {
+                        seen[v] = id;
+                        n_vertices++;
+                    }
+                }
+            }
+            if (last > start)
+                mesh.meshlets.push_back({int(3 * start), int(3 * last), int(s)});
+        }
+
+        for (auto &&m: mesh.meshlets)
+            compute_bounds(mesh, &m);
+
+        spdlog::debug("Built {} meshlets from {} faces", mesh.meshlets.size(), mesh.faces.size());
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "sMesh.h"
+
+namespace xe {
+
+    /**
+     * Partitions every submesh into meshlets of consecutive faces with at most `max_vertices` distinct vertices and
+     * `max_triangles` triangles, computes their bounding spheres and normal cones and stores them in `mesh.meshlets`.
+     *
+     * Faces are not reordered, the meshlets are as good as the locality of the face order, so run it after
+     * optimize_vertex_cache and optimize_overdraw. Any later reordering of the faces invalidates the meshlets.
+     */
+    void build_meshlets(sMesh &mesh, unsigned int max_vertices = 64, unsigned int max_triangles = 124);
+
+}
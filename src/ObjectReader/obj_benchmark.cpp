@@ -0,0 +1,77 @@
+/**
+ * Regression benchmark of load_smesh_from_obj.
+ *
+ * Loads every OBJ file given on the command line (Models/blue_marble.obj if none) a few times and prints the best
+ * time, and the time per face. Build bigger inputs with scripts/generate_obj_grid.py: with a linear loader the time
+ * per face stays about the same from thousands to millions of faces.
+ *
+ * Usage: obj-benchmark [-r repeats] [-t threads] [file.obj ...]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/obj_reader.h"
+
+namespace {
+
+    std::string directory_of(const std::string &path) {
+        auto slash = path.find_last_of("/\\");
+        return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+    }
+
+    int usage(const char *program) {
+        std::fprintf(stderr, "Usage: %s [-r repeats] [-t threads] [file.obj ...]\n", program);
+        return 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = 3;
+    unsigned int n_threads = 0;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            repeats = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            n_threads = static_cast<unsigned int>(std::max(0, std::atoi(argv[++i])));
+        else if (argv[i][0] == '-')
+            return usage(argv[0]);
+        else
+            paths.emplace_back(argv[i]);
+    }
+    if (paths.empty())
+        paths.push_back(std::string(ROOT_DIR) + "/Models/blue_marble.obj");
+
+    spdlog::set_level(spdlog::level::warn);
+    std::printf("%-40s %12s %12s %12s %12s\n", "file", "faces", "vertices", "best [ms]", "ns/face");
+    for (auto &&path: paths) {
+        auto best = std::numeric_limits<double>::max();
+        size_t n_faces = 0;
+        size_t n_vertices = 0;
+        for (int r = 0; r < repeats; r++) {
+            auto start = std::chrono::steady_clock::now();
+            auto mesh = xe::load_smesh_from_obj(path, directory_of(path), n_threads);
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = std::min(best, seconds);
+            n_faces = mesh.faces.size();
+            n_vertices = mesh.vertex_coords.size();
+        }
+        if (n_faces == 0) {
+            std::fprintf(stderr, "No faces read from `%s'\n", path.c_str());
+            return 1;
+        }
+        auto name = path.substr(path.find_last_of("/\\") + 1);
+        std::printf("%-40s %12zu %12zu %12.1f %12.1f\n", name.c_str(), n_faces, n_vertices, 1e3 * best,
+                    1e9 * best / n_faces);
+    }
+    return 0;
+}
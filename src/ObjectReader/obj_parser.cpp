@@ -0,0 +1,638 @@
+#include "obj_parser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory_resource>
+#include <set>
+#include <sstream>
+
+#include "spdlog/spdlog.h"
+
+#include "mapped_file.h"
+#include "parallel.h"
+
+namespace {
+
+    using index_t = tinyobj::index_t;
+
+    // Files smaller than that are not worth splitting.
+    const size_t MIN_CHUNK_SIZE = 1u << 20;
+
+    enum FixupMask : unsigned char {
+        FIX_VERTEX = 1u, FIX_TEXCOORD = 2u, FIX_NORMAL = 4u
+    };
+
+    /**
+     * Negative (relative) OBJ indices can be resolved only relative to the chunk beginning. The corners that contain
+     * them are remembered and shifted by the chunk offsets during merge.
+     */
+    struct Fixup {
+        size_t corner;
+        unsigned char mask;
+    };
+
+    /**
+     * `usemtl`, `o` and `g` statements. `face` is the chunk local index of the first triangle they apply to.
+     */
+    struct NamedEvent {
+        size_t face;
+        std::string name;
+    };
+
+    /**
+     * Sizes of the arrays of a chunk, counted by a quick pass over its lines before parsing. Fixups are an upper
+     * bound: all the corners of faces with a minus sign anywhere.
+     */
+    struct ChunkCounts {
+        size_t vertices = 0;
+        size_t texcoords = 0;
+        size_t normals = 0;
+        size_t corners = 0;
+        size_t fixups = 0;
+
+        size_t bytes() const {
+            // Colors have as many floats as the vertices. Slack for the alignment of each of the six arrays.
+            return (2 * vertices + texcoords + normals) * sizeof(float) + corners * sizeof(index_t) +
+                   fixups * sizeof(Fixup) + 6 * alignof(std::max_align_t);
+        }
+    };
+
+    struct Chunk {
+        Chunk(const char *begin, const char *end, const ChunkCounts &counts)
+                : begin(begin), end(end), counts(counts), arena(counts.bytes()), vertices(&arena),
+                  colors(&arena), texcoords(&arena), normals(&arena), indices(&arena), fixups(&arena) {}
+
+        const char *begin;
+        const char *end;
+        ChunkCounts counts;
+
+        // Holds the arrays below, one allocation of the counted size that is given back at once by `release`.
+        std::pmr::monotonic_buffer_resource arena;
+        std::pmr::vector<float> vertices;
+        // White for the vertices without a color, as tinyobj does by default.
+        std::pmr::vector<float> colors;
+        std::pmr::vector<float> texcoords;
+        std::pmr::vector<float> normals;
+        std::pmr::vector<index_t> indices;
+        std::pmr::vector<Fixup> fixups;
+
+        std::vector<NamedEvent> materials;
+        std::vector<NamedEvent> objects;
+        std::vector<std::string> mtllibs;
+
+        std::string warn;
+        std::string error;
+
+        size_t n_faces() const { return indices.size() / 3; }
+
+        void reserve() {
+            vertices.reserve(counts.vertices);
+            colors.reserve(counts.vertices);
+            texcoords.reserve(counts.texcoords);
+            normals.reserve(counts.normals);
+            indices.reserve(counts.corners);
+            fixups.reserve(counts.fixups);
+        }
+
+        void release() {
+            for (auto v: {&vertices, &colors, &texcoords, &normals}) {
+                v->clear();
+                v->shrink_to_fit();
+            }
+            indices.clear();
+            indices.shrink_to_fit();
+            fixups.clear();
+            fixups.shrink_to_fit();
+            arena.release();
+        }
+    };
+
+    struct ShapeRange {
+        size_t start;
+        size_t end;
+        std::string name;
+    };
+
+    inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    inline const char *skip_space(const char *p, const char *end) {
+        while (p < end && is_space(*p))
+            ++p;
+        return p;
+    }
+
+    inline bool keyword(const char *p, const char *end, const char *kw, size_t len) {
+        return static_cast<size_t>(end - p) > len && std::memcmp(p, kw, len) == 0 && is_space(p[len]);
+    }
+
+    std::string rest_of_line(const char *p, const char *end) {
+        p = skip_space(p, end);
+        while (end > p && is_space(end[-1]))
+            --end;
+        return std::string(p, end);
+    }
+
+    const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    /**
+     * Locale independent float parser working on a non null terminated range, in the spirit of std::from_chars.
+     * Up to 19 significant digits are accumulated in an integer and scaled by an exact power of ten, which is
+     * correctly rounded for all the values that appear in practice in OBJ files. Returns nullptr if no number was found.
+     */
+    const char *parse_float(const char *p, const char *end, float *value) {
+        p = skip_space(p, end);
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            ++p;
+        }
+
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        int n_digits = 0;
+        bool any_digit = false;
+        for (; p < end && is_digit(*p); ++p) {
+            any_digit = true;
+            if (n_digits < 19) {
+                mantissa = 10 * mantissa + (*p - '0');
+                if (mantissa != 0)
+                    ++n_digits;
+            } else {
+                ++exponent;
+            }
+        }
+        if (p < end && *p == '.') {
+            for (++p; p < end && is_digit(*p); ++p) {
+                any_digit = true;
+                if (n_digits < 19) {
+                    mantissa = 10 * mantissa + (*p - '0');
+                    if (mantissa != 0)
+                        ++n_digits;
+                    --exponent;
+                }
+            }
+        }
+        if (!any_digit)
+            return nullptr;
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            auto q = p + 1;
+            bool exp_negative = false;
+            if (q < end && (*q == '-' || *q == '+')) {
+                exp_negative = *q == '-';
+                ++q;
+            }
+            if (q < end && is_digit(*q)) {
+                int e = 0;
+                for (; q < end && is_digit(*q); ++q) {
+                    if (e < 10000)
+                        e = 10 * e + (*q - '0');
+                }
+                exponent += exp_negative ? -e : e;
+                p = q;
+            }
+        }
+
+        double v = static_cast<double>(mantissa);
+        if (mantissa != 0) {
+            if (exponent < 0) {
+                if (exponent >= -22)
+                    v /= POW10[-exponent];
+                else
+                    v *= std::pow(10.0, exponent);
+            } else if (exponent > 0) {
+                if (exponent <= 22)
+                    v *= POW10[exponent];
+                else
+                    v *= std::pow(10.0, exponent);
+            }
+        }
+        *value = static_cast<float>(negative ? -v : v);
+        return p;
+    }
+
+    const char *parse_int(const char *p, const char *end, int *value) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            ++p;
+        }
+        if (p == end || !is_digit(*p))
+            return nullptr;
+        int64_t v = 0;
+        for (; p < end && is_digit(*p); ++p) {
+            if (v < INT32_MAX)
+                v = 10 * v + (*p - '0');
+        }
+        v = std::min<int64_t>(v, INT32_MAX);
+        *value = static_cast<int>(negative ? -v : v);
+        return p;
+    }
+
+    /**
+     * Parses up to `n` floats, missing trailing values are set to zero. Returns the number of the values read.
+     */
+    int parse_floats(const char *p, const char *end, float *values, int n) {
+        int n_read = 0;
+        for (int i = 0; i < n; ++i) {
+            values[i] = 0.0f;
+            if (p != nullptr)
+                p = parse_float(p, end, values + i);
+            if (p != nullptr)
+                n_read++;
+        }
+        return n_read;
+    }
+
+    /**
+     * Converts an OBJ index (1 based, negative relative to the end) into 0 based index. Relative indices are resolved
+     * with respect to the chunk beginning and flagged for a fixup.
+     */
+    inline int resolve_index(int raw, size_t n_defined, unsigned char bit, unsigned char *mask) {
+        if (raw > 0)
+            return raw - 1;
+        *mask |= bit;
+        return static_cast<int>(n_defined) + raw;
+    }
+
+    bool parse_face(Chunk &chunk, const char *p, const char *end, std::vector<index_t> &polygon,
+                    std::vector<unsigned char> &masks) {
+        polygon.clear();
+        masks.clear();
+        auto n_v = chunk.vertices.size() / 3;
+        auto n_vt = chunk.texcoords.size() / 2;
+        auto n_vn = chunk.normals.size() / 3;
+
+        p = skip_space(p, end);
+        while (p < end) {
+            int v = 0, vt = 0, vn = 0;
+            p = parse_int(p, end, &v);
+            if (p == nullptr || v == 0)
+                return false;
+            if (p < end && *p == '/') {
+                ++p;
+                if (p < end && *p != '/') {
+                    p = parse_int(p, end, &vt);
+                    if (p == nullptr || vt == 0)
+                        return false;
+                }
+                if (p < end && *p == '/') {
+                    ++p;
+                    p = parse_int(p, end, &vn);
+                    if (p == nullptr || vn == 0)
+                        return false;
+                }
+            }
+            if (p < end && !is_space(*p))
+                return false;
+
+            unsigned char mask = 0;
+            index_t idx;
+            idx.vertex_index = resolve_index(v, n_v, FIX_VERTEX, &mask);
+            idx.texcoord_index = vt != 0 ? resolve_index(vt, n_vt, FIX_TEXCOORD, &mask) : -1;
+            idx.normal_index = vn != 0 ? resolve_index(vn, n_vn, FIX_NORMAL, &mask) : -1;
+            polygon.push_back(idx);
+            masks.push_back(mask);
+            p = skip_space(p, end);
+        }
+
+        if (polygon.size() < 3) {
+            chunk.warn += "Skipping face with less then three vertices.\n";
+            return true;
+        }
+
+        // Triangulate as a fan. tinyobj clips ears instead, which gives the same triangles for convex polygons
+        // without repeated vertices only, see ObjParser.
+        for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+            for (auto k: {size_t(0), i, i + 1}) {
+                if (masks[k] != 0)
+                    chunk.fixups.push_back({chunk.indices.size(), masks[k]});
+                chunk.indices.push_back(polygon[k]);
+            }
+        }
+        return true;
+    }
+
+    void parse_chunk(Chunk &chunk) {
+        chunk.reserve();
+        std::vector<index_t> polygon;
+        std::vector<unsigned char> masks;
+
+        auto p = chunk.begin;
+        while (p < chunk.end) {
+            auto line_end = static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+            if (line_end == nullptr)
+                line_end = chunk.end;
+
+            auto q = skip_space(p, line_end);
+            if (q < line_end) {
+                float values[6];
+                switch (*q) {
+                    case 'v':
+                        if (keyword(q, line_end, "v", 1)) {
+                            // The optional vertex color extension: `v x y z r g b`.
+                            if (parse_floats(q + 2, line_end, values, 6) < 6)
+                                values[3] = values[4] = values[5] = 1.0f;
+                            chunk.vertices.insert(chunk.vertices.end(), values, values + 3);
+                            chunk.colors.insert(chunk.colors.end(), values + 3, values + 6);
+                        } else if (keyword(q, line_end, "vt", 2)) {
+                            parse_floats(q + 3, line_end, values, 2);
+                            chunk.texcoords.insert(chunk.texcoords.end(), values, values + 2);
+                        } else if (keyword(q, line_end, "vn", 2)) {
+                            parse_floats(q + 3, line_end, values, 3);
+                            chunk.normals.insert(chunk.normals.end(), values, values + 3);
+                        }
+                        break;
+                    case 'f':
+                        if (keyword(q, line_end, "f", 1) && !parse_face(chunk, q + 2, line_end, polygon, masks)) {
+                            chunk.error = "Invalid face `" + rest_of_line(p, line_end) + "'";
+                            return;
+                        }
+                        break;
+                    case 'u':
+                        if (keyword(q, line_end, "usemtl", 6))
+                            chunk.materials.push_back({chunk.n_faces(), rest_of_line(q + 7, line_end)});
+                        break;
+                    case 'm':
+                        if (keyword(q, line_end, "mtllib", 6))
+                            chunk.mtllibs.push_back(rest_of_line(q + 7, line_end));
+                        break;
+                    case 'o':
+                    case 'g':
+                        if (keyword(q, line_end, q[0] == 'o' ? "o" : "g", 1))
+                            chunk.objects.push_back({chunk.n_faces(), rest_of_line(q + 2, line_end)});
+                        break;
+                    default:
+                        break;
+                }
+            }
+            p = line_end + 1;
+        }
+    }
+
+    ChunkCounts count_chunk(const char *p, const char *end) {
+        ChunkCounts counts;
+        while (p < end) {
+            auto line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+            if (line_end == nullptr)
+                line_end = end;
+
+            auto q = skip_space(p, line_end);
+            if (q < line_end && *q == 'v') {
+                if (keyword(q, line_end, "v", 1))
+                    counts.vertices += 3;
+                else if (keyword(q, line_end, "vt", 2))
+                    counts.texcoords += 2;
+                else if (keyword(q, line_end, "vn", 2))
+                    counts.normals += 3;
+            } else if (q < line_end && *q == 'f' && keyword(q, line_end, "f", 1)) {
+                size_t n_corners = 0;
+                bool relative = false;
+                for (auto r = skip_space(q + 2, line_end); r < line_end; r = skip_space(r, line_end)) {
+                    n_corners++;
+                    for (; r < line_end && !is_space(*r); ++r)
+                        relative |= *r == '-';
+                }
+                if (n_corners >= 3) {
+                    counts.corners += 3 * (n_corners - 2);
+                    if (relative)
+                        counts.fixups += 3 * (n_corners - 2);
+                }
+            }
+            p = line_end + 1;
+        }
+        return counts;
+    }
+
+    /**
+     * Splits the file into line aligned chunks and counts their statements in parallel.
+     */
+    std::deque<Chunk> split(const xe::MappedFile &file, unsigned int n_threads) {
+        auto size = file.size();
+        auto n_chunks = std::max<size_t>(1, std::min<size_t>(size / MIN_CHUNK_SIZE, 4 * n_threads));
+
+        std::vector<const char *> bounds(n_chunks + 1);
+        bounds[0] = file.begin();
+        for (size_t i = 0; i < n_chunks; ++i) {
+            auto end = file.end();
+            if (i + 1 < n_chunks) {
+                end = std::max(bounds[i], file.begin() + (i + 1) * size / n_chunks);
+                auto eol = static_cast<const char *>(std::memchr(end, '\n', file.end() - end));
+                end = eol == nullptr ? file.end() : eol + 1;
+            }
+            bounds[i + 1] = end;
+        }
+
+        std::vector<ChunkCounts> counts(n_chunks);
+        xe::parallel_for(n_chunks, n_threads, [&](size_t i) { counts[i] = count_chunk(bounds[i], bounds[i + 1]); });
+
+        // A deque, the chunks own their arenas and cannot move.
+        std::deque<Chunk> chunks;
+        for (size_t i = 0; i < n_chunks; ++i)
+            chunks.emplace_back(bounds[i], bounds[i + 1], counts[i]);
+        return chunks;
+    }
+
+    void load_materials(const std::deque<Chunk> &chunks, const std::string &mtl_base_dir,
+                        std::vector<tinyobj::material_t> *materials, std::map<std::string, int> *material_map,
+                        std::string *warn, std::string *err) {
+        std::string base_dir = mtl_base_dir;
+        if (!base_dir.empty() && base_dir.back() != '/' && base_dir.back() != '\\')
+            base_dir += '/';
+        tinyobj::MaterialFileReader reader(base_dir);
+
+        std::set<std::string> loaded;
+        for (auto &&chunk: chunks) {
+            for (auto &&lib: chunk.mtllibs) {
+                if (!loaded.insert(lib).second)
+                    continue;
+                std::istringstream names(lib);
+                std::string name;
+                bool found = false;
+                while (!found && names >> name) {
+                    std::string warn_mtl, err_mtl;
+                    found = reader(name, materials, material_map, &warn_mtl, &err_mtl);
+                    *warn += warn_mtl;
+                    *err += err_mtl;
+                }
+                if (!found)
+                    *warn += "Failed to load material file(s). Use default material.\n";
+            }
+        }
+    }
+
+    bool check_range(const std::pmr::vector<index_t> &indices, size_t n_v, size_t n_vt, size_t n_vn) {
+        for (auto &&idx: indices) {
+            if (idx.vertex_index < 0 || static_cast<size_t>(idx.vertex_index) >= n_v)
+                return false;
+            if (idx.texcoord_index >= 0 && static_cast<size_t>(idx.texcoord_index) >= n_vt)
+                return false;
+            if (idx.normal_index >= 0 && static_cast<size_t>(idx.normal_index) >= n_vn)
+                return false;
+        }
+        return true;
+    }
+
+}
+
+namespace xe {
+
+    ObjParser::ObjParser(unsigned int n_threads) : n_threads_(resolve_n_threads(n_threads)) {}
+
+    bool ObjParser::parse(const std::string &path, const std::string &mtl_base_dir,
+                          tinyobj::attrib_t *attrib,
+                          std::vector<tinyobj::shape_t> *shapes,
+                          std::vector<tinyobj::material_t> *materials) {
+        warn_.clear();
+        err_.clear();
+
+        MappedFile file(path);
+        if (!file.is_open()) {
+            err_ = "Cannot open file `" + path + "'\n";
+            return false;
+        }
+
+        auto chunks = split(file, n_threads_);
+        size_t arena_bytes = 0;
+        for (auto &&chunk: chunks)
+            arena_bytes += chunk.counts.bytes();
+        spdlog::debug("Parsing `{}' ({} bytes) in {} chunks using {} threads, {} bytes of chunk arenas", path,
+                      file.size(), chunks.size(), n_threads_, arena_bytes);
+        parallel_for(chunks.size(), n_threads_, [&](size_t i) { parse_chunk(chunks[i]); });
+        // Everything needed was copied out of the text, its pages need not stay resident during the merge.
+        file.close();
+
+        for (auto &&chunk: chunks) {
+            warn_ += chunk.warn;
+            if (!chunk.error.empty())
+                err_ += chunk.error + "\n";
+        }
+        if (!err_.empty())
+            return false;
+
+        std::map<std::string, int> material_map;
+        load_materials(chunks, mtl_base_dir, materials, &material_map, &warn_, &err_);
+
+        // Prefix sums of the per chunk counts give the position of every chunk in the merged arrays.
+        auto n_chunks = chunks.size();
+        std::vector<size_t> v_offset(n_chunks + 1, 0), vt_offset(n_chunks + 1, 0), vn_offset(n_chunks + 1, 0);
+        std::vector<size_t> face_offset(n_chunks + 1, 0);
+        for (size_t i = 0; i < n_chunks; ++i) {
+            v_offset[i + 1] = v_offset[i] + chunks[i].vertices.size();
+            vt_offset[i + 1] = vt_offset[i] + chunks[i].texcoords.size();
+            vn_offset[i + 1] = vn_offset[i] + chunks[i].normals.size();
+            face_offset[i + 1] = face_offset[i] + chunks[i].n_faces();
+        }
+        auto n_faces = face_offset[n_chunks];
+
+        // Material state is carried over chunk boundaries, so it has to be resolved sequentially.
+        std::vector<int> start_material(n_chunks);
+        std::vector<std::vector<int>> material_ids(n_chunks);
+        auto material = -1;
+        for (size_t i = 0; i < n_chunks; ++i) {
+            start_material[i] = material;
+            for (auto &&ev: chunks[i].materials) {
+                auto it = material_map.find(ev.name);
+                material = it != material_map.end() ? it->second : -1;
+                material_ids[i].push_back(material);
+            }
+        }
+
+        // `o` and `g` statements split the faces into shapes, empty shapes are dropped as in tinyobj.
+        std::vector<ShapeRange> ranges;
+        ranges.push_back({0, 0, ""});
+        for (size_t i = 0; i < n_chunks; ++i) {
+            for (auto &&ev: chunks[i].objects) {
+                ranges.back().end = face_offset[i] + ev.face;
+                ranges.push_back({face_offset[i] + ev.face, 0, ev.name});
+            }
+        }
+        ranges.back().end = n_faces;
+        ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                    [](const ShapeRange &r) { return r.end <= r.start; }), ranges.end());
+
+        attrib->vertices.resize(v_offset[n_chunks]);
+        attrib->texcoords.resize(vt_offset[n_chunks]);
+        attrib->normals.resize(vn_offset[n_chunks]);
+        attrib->colors.resize(v_offset[n_chunks]);
+
+        shapes->resize(ranges.size());
+        for (size_t s = 0; s < ranges.size(); ++s) {
+            auto n = ranges[s].end - ranges[s].start;
+            auto &mesh = (*shapes)[s].mesh;
+            (*shapes)[s].name = ranges[s].name;
+            mesh.indices.resize(3 * n);
+            mesh.num_face_vertices.assign(n, 3);
+            mesh.material_ids.resize(n);
+        }
+
+        auto n_v = v_offset[n_chunks] / 3;
+        auto n_vt = vt_offset[n_chunks] / 2;
+        auto n_vn = vn_offset[n_chunks] / 3;
+
+        parallel_for(n_chunks, n_threads_, [&](size_t i) {
+            auto &chunk = chunks[i];
+            std::copy(chunk.vertices.begin(), chunk.vertices.end(), attrib->vertices.begin() + v_offset[i]);
+            std::copy(chunk.colors.begin(), chunk.colors.end(), attrib->colors.begin() + v_offset[i]);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), attrib->texcoords.begin() + vt_offset[i]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), attrib->normals.begin() + vn_offset[i]);
+
+            for (auto &&fix: chunk.fixups) {
+                auto &idx = chunk.indices[fix.corner];
+                if (fix.mask & FIX_VERTEX)
+                    idx.vertex_index += static_cast<int>(v_offset[i] / 3);
+                if (fix.mask & FIX_TEXCOORD)
+                    idx.texcoord_index += static_cast<int>(vt_offset[i] / 2);
+                if (fix.mask & FIX_NORMAL)
+                    idx.normal_index += static_cast<int>(vn_offset[i] / 3);
+            }
+            if (!check_range(chunk.indices, n_v, n_vt, n_vn)) {
+                chunk.error = "Face index out of range";
+                return;
+            }
+
+            auto n_chunk_faces = chunk.n_faces();
+            if (n_chunk_faces == 0) {
+                chunk.release();
+                return;
+            }
+
+            auto first = face_offset[i];
+            auto s = static_cast<size_t>(std::upper_bound(ranges.begin(), ranges.end(), first,
+                                                          [](size_t f, const ShapeRange &r) {
+                                                              return f < r.start;
+                                                          }) - ranges.begin()) - 1;
+            auto mtl = start_material[i];
+            size_t next_event = 0;
+            for (size_t f = 0; f < n_chunk_faces; ++s) {
+                auto f_end = std::min(ranges[s].end - first, n_chunk_faces);
+                auto &mesh = (*shapes)[s].mesh;
+                auto shape_f = first + f - ranges[s].start;
+                std::copy(chunk.indices.begin() + 3 * f, chunk.indices.begin() + 3 * f_end,
+                          mesh.indices.begin() + 3 * shape_f);
+                for (; f < f_end; ++f, ++shape_f) {
+                    while (next_event < chunk.materials.size() && chunk.materials[next_event].face <= f)
+                        mtl = material_ids[i][next_event++];
+                    mesh.material_ids[shape_f] = mtl;
+                }
+            }
+            chunk.release();
+        });
+
+        auto ok = true;
+        for (auto &&chunk: chunks) {
+            if (!chunk.error.empty()) {
+                err_ += chunk.error + "\n";
+                ok = false;
+            }
+        }
+        return ok;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "3rdParty/tinyobjloader/tiny_obj_loader.h"
+
+namespace xe {
+
+    /**
+     * Parallel replacement for tinyobj::LoadObj.
+     *
+     * The file is memory mapped and split into line aligned chunks that are parsed concurrently.  The per chunk
+     * results are then merged into the same attrib_t/shape_t structures that tinyobj produces, so the rest of the
+     * reader does not care which parser was used, vertex colors (`v x y z r g b`, white if missing) included.
+     *
+     * Polygons are triangulated as a fan, which is not what tinyobj does: it clips ears, which for convex polygons
+     * without repeated vertices gives the same triangles. For concave polygons the triangles differ, and polygons
+     * with repeated or collinear vertices, for which tinyobj drops triangles, give more of them here, so the index
+     * counts are not the same for such files.
+     * Materials are read with the tinyobj MTL reader.
+     */
+    class ObjParser {
+    public:
+        /**
+         * @param n_threads number of threads to use, 0 means std::thread::hardware_concurrency().
+         */
+        explicit ObjParser(unsigned int n_threads = 0);
+
+        bool parse(const std::string &path, const std::string &mtl_base_dir,
+                   tinyobj::attrib_t *attrib,
+                   std::vector<tinyobj::shape_t> *shapes,
+                   std::vector<tinyobj::material_t> *materials);
+
+        unsigned int n_threads() const { return n_threads_; }
+
+        const std::string &warning() const { return warn_; }
+
+        const std::string &error() const { return err_; }
+
+    private:
+        unsigned int n_threads_;
+        std::string warn_;
+        std::string err_;
+    };
+
+}
@@ -3,7 +3,13 @@
 //
 
 #include "obj_reader.h"
+#include "obj_parser.h"
+#include "mesh_bounds.h"
+#include "vertex_welder.h"
+#include "memory_usage.h"
 
+#include <algorithm>
+#include <memory_resource>
 #include <tuple>
 
 #include "spdlog/spdlog.h"
@@ -15,40 +21,35 @@
 
 
 namespace {
-    xe::Triangle get_face(tinyobj::shape_t sh, size_t index_offset, const tinyobj::attrib_t &attrib) {
-
-        xe::Triangle triangle;
-        std::vector<glm::vec3> p(3);
-        for (size_t v = 0; v < 3; v++) {
-            // access to vertex
-            tinyobj::index_t idx = sh.mesh.indices[index_offset + v];
-
-            p[v].x = attrib.vertices[3 * idx.vertex_index + 0];
-            p[v].y = attrib.vertices[3 * idx.vertex_index + 1];
-            p[v].z = attrib.vertices[3 * idx.vertex_index + 2];
-
-            triangle.position[v] = p[v];
-
-            glm::vec2 t;
-
+    /**
+     * Copies the attributes of a single welded vertex straight into the preallocated arrays of `mesh`.
+     * Returns false if the vertex lacks an attribute that the mesh has.
+     */
+    bool copy_corner(xe::sMesh &mesh, size_t v, const tinyobj::index_t &idx, const tinyobj::attrib_t &attrib) {
+        auto &&p = attrib.vertices;
+        auto i = 3 * static_cast<size_t>(idx.vertex_index);
+        mesh.vertex_coords[v] = glm::vec3(p[i + 0], p[i + 1], p[i + 2]);
+
+        bool complete = true;
+        if (mesh.has_texcoords[0]) {
             if (idx.texcoord_index >= 0) {
-                t.x = attrib.texcoords[2 * idx.texcoord_index + 0];
-                t.y = attrib.texcoords[2 * idx.texcoord_index + 1];
-                triangle.tex_coord[v] = t;
-                triangle.has_texcoord[v] = true;
+                auto &&t = attrib.texcoords;
+                auto j = 2 * static_cast<size_t>(idx.texcoord_index);
+                mesh.vertex_texcoords[0][v] = glm::vec2(t[j + 0], t[j + 1]);
+            } else {
+                complete = false;
             }
-
-
+        }
+        if (mesh.has_normals) {
             if (idx.normal_index >= 0) {
-                glm::vec3 normal;
-                normal.x = attrib.normals[3 * idx.normal_index + 0];
-                normal.y = attrib.normals[3 * idx.normal_index + 1];
-                normal.z = attrib.normals[3 * idx.normal_index + 2];
-                triangle.normal[v] = normal;
-                triangle.has_normals[v] = true;
+                auto &&n = attrib.normals;
+                auto j = 3 * static_cast<size_t>(idx.normal_index);
+                mesh.vertex_normals[v] = glm::vec3(n[j + 0], n[j + 1], n[j + 2]);
+            } else {
+                complete = false;
             }
         }
-        return triangle;
+        return complete;
     }
 
     void push_sub_mesh(xe::sMesh &s_mesh, const xe::sMesh::SubMesh sub_mesh) {
@@ -63,82 +64,131 @@ namespace {
         return xe::sMesh::SubMesh{sub_mesh.end, 0, sub_mesh.mat_idx};
     }
 
-    int create_smesh(xe::sMesh &mesh, const tinyobj::attrib_t &attrib, const std::vector<tinyobj::shape_t> &shapes) {
+    template<typename T>
+    void release(std::vector<T> &v) {
+        std::vector<T>().swap(v);
+    }
+
+    template<typename T>
+    size_t heap_bytes(const std::vector<T> &v) {
+        return v.capacity() * sizeof(T);
+    }
+
+    size_t heap_bytes(const xe::sMesh &mesh) {
+        auto bytes = heap_bytes(mesh.vertex_coords) + heap_bytes(mesh.vertex_normals) +
+                     heap_bytes(mesh.vertex_tangents) + heap_bytes(mesh.vertex_colors) + heap_bytes(mesh.faces) +
+                     heap_bytes(mesh.materials) + heap_bytes(mesh.submeshes) + heap_bytes(mesh.meshlets) +
+                     heap_bytes(mesh.lods) + heap_bytes(mesh.submesh_bb);
+        for (auto &&t: mesh.vertex_texcoords)
+            bytes += heap_bytes(t);
+        for (auto &&lod: mesh.lods)
+            bytes += heap_bytes(lod.faces) + heap_bytes(lod.submeshes);
+        return bytes;
+    }
+
+    /**
+     * Builds the mesh out of the parsed OBJ data, which is consumed: the indices of every shape are released as soon
+     * as its faces are built and the attributes once they are copied into the vertices.
+     */
+    int create_smesh(xe::sMesh &mesh, tinyobj::attrib_t &attrib, std::vector<tinyobj::shape_t> &shapes) {
 
         mesh.has_normals = !attrib.normals.empty();
         mesh.has_texcoords[0] = !attrib.texcoords.empty();
 
+        size_t n_faces = 0;
+        for (auto &&sh: shapes) {
+            for (auto fv: sh.mesh.num_face_vertices) {
+                if (fv != 3) {
+                    spdlog::error("Reading a non triangular face");
+                    return 1;
+                }
+            }
+            n_faces += sh.mesh.num_face_vertices.size();
+        }
+
+        mesh.faces.resize(n_faces);
+
+        // Corners sharing the same (position, texcoord, normal) triple are welded into one vertex. There are at least
+        // as many vertices as the largest attribute array has entries, the welder arena is sized for that.
+        auto n_positions = attrib.vertices.size() / 3;
+        auto expected_vertices = std::max({n_positions, attrib.texcoords.size() / 2, attrib.normals.size() / 3});
+        std::pmr::monotonic_buffer_resource arena(xe::VertexWelder::memory_size(n_positions, expected_vertices));
+        xe::VertexWelder welder(n_positions, expected_vertices, &arena);
+
         int index = 0;
+        size_t face = 0;
 
         auto mat_idx = -1;
         xe::sMesh::SubMesh sub_mesh;
         sub_mesh.start = index;
         sub_mesh.mat_idx = mat_idx;
-        for (auto sh: shapes) {
-            spdlog::debug("Processing shape {}",sh.name);
-            size_t index_offset = 0;
-
-            for (size_t f = 0; f < sh.mesh.num_face_vertices.size(); f++) {
-                if (sh.mesh.material_ids[f] != mat_idx) {
+        for (auto &&sh: shapes) {
+            spdlog::debug("Processing shape {}", sh.name);
+            auto &&indices = sh.mesh.indices;
+            auto &&material_ids = sh.mesh.material_ids;
+            auto n_shape_faces = sh.mesh.num_face_vertices.size();
+
+            for (size_t f = 0; f < n_shape_faces; f++, face++) {
+                if (material_ids[f] != mat_idx) {
                     sub_mesh.end = index;
                     sub_mesh = emit_submesh(mesh, sub_mesh);
 
-                    mat_idx = sh.mesh.material_ids[f];
+                    mat_idx = material_ids[f];
                     sub_mesh.mat_idx = mat_idx;
                 }
-                int fv = sh.mesh.num_face_vertices[f];
-                if (fv != 3) {
-                    spdlog::error("Reading a non triangular face");
-                    return 1;
-                }
-                auto triangle = get_face(sh, index_offset, attrib);
-                xe::sMesh::Face face;
-                for (size_t v = 0; v < fv; v++) {
-                    mesh.vertex_coords.push_back(triangle.position[v]);
-                    if (triangle.has_texcoord[v]) {
-                        if (!mesh.has_texcoords[0]) {
-                            spdlog::warn("Some vertices have texcoord and some do not in OBJ file.");
-                            return 2;
-                        }
-                        mesh.vertex_texcoords[0].push_back(triangle.tex_coord[v]);
-                    }
-                    if (triangle.has_normals[v]) {
-                        if (!mesh.has_normals) {
-                            spdlog::warn("Some vertices have normals and some do not in OBJ file.");
-                            return 3;
-                        }
-                        mesh.vertex_normals.push_back(triangle.normal[v]);
-                    }
-                    face.v[v] = index;
-                    index++;
+                auto &&v = mesh.faces[face].v;
+                for (size_t c = 0; c < 3; c++, index++) {
+                    v[c] = welder.insert(indices[3 * f + c]);
                 }
-                mesh.faces.push_back(face);
-                index_offset += fv;
             }
             sub_mesh.end = index;
-            sub_mesh=emit_submesh(mesh, sub_mesh);
+            sub_mesh = emit_submesh(mesh, sub_mesh);
 
+            release(sh.mesh.indices);
+            release(sh.mesh.material_ids);
+            release(sh.mesh.num_face_vertices);
+        }
+        release(shapes);
+
+        auto n_vertices = welder.n_vertices();
+        spdlog::debug("Welded {} face corners into {} vertices, dedup ratio {:.2f}", welder.n_corners(), n_vertices,
+                      welder.dedup_ratio());
+
+        // Every array is sized once and then filled in place.
+        mesh.vertex_coords.resize(n_vertices);
+        if (mesh.has_texcoords[0])
+            mesh.vertex_texcoords[0].resize(n_vertices);
+        if (mesh.has_normals)
+            mesh.vertex_normals.resize(n_vertices);
+
+        size_t incomplete = 0;
+        auto &&unique = welder.unique();
+        for (size_t i = 0; i < n_vertices; i++) {
+            if (!copy_corner(mesh, i, unique[i], attrib))
+                incomplete++;
         }
+        if (incomplete > 0) {
+            spdlog::warn("{} vertices lack texcoords or normals present in other vertices of the OBJ file.",
+                         incomplete);
+        }
+        release(attrib.vertices);
+        release(attrib.texcoords);
+        release(attrib.normals);
         return 0;
     }
 
 
-    bool read_obj(std::string name, std::string mtl_base_dir, tinyobj::attrib_t *attrib,
+    bool read_obj(std::string name, std::string mtl_base_dir, unsigned int n_threads, tinyobj::attrib_t *attrib,
                   std::vector<tinyobj::shape_t> *shapes,
                   std::vector<tinyobj::material_t> *materials) {
-        std::string err, warn;
-
-        bool ret;
-        if (mtl_base_dir.empty())
-            ret = tinyobj::LoadObj(attrib, shapes, materials, &warn, &err, name.c_str());
-        else
-            ret = tinyobj::LoadObj(attrib, shapes, materials, &warn, &err, name.c_str(), mtl_base_dir.c_str());
+        xe::ObjParser parser(n_threads);
+        auto ret = parser.parse(name, mtl_base_dir, attrib, shapes, materials);
 
-        if (!warn.empty()) {
-            spdlog::warn(warn);
+        if (!parser.warning().empty()) {
+            spdlog::warn(parser.warning());
         }
-        if (!err.empty()) {
-            spdlog::error(err);
+        if (!parser.error().empty()) {
+            spdlog::error(parser.error());
         }
         return ret;
     }
@@ -147,25 +197,47 @@ namespace {
 
 namespace xe {
     xe::sMesh load_smesh_from_obj(std::string name, std::string mtl_base_dir) {
+        return load_smesh_from_obj(name, mtl_base_dir, 0);
+    }
+
+    xe::sMesh load_smesh_from_obj(std::string name, std::string mtl_base_dir, unsigned int n_threads,
+                                  ObjLoadStats *stats) {
         spdlog::debug("Loading obj file `{}'", name);
+        ObjLoadStats load_stats;
+        if (stats) {
+            reset_peak_rss();
+            load_stats.start_rss = current_rss();
+        }
         xe::sMesh s_mesh;
 
-        tinyobj::attrib_t attrib;
-        std::vector<tinyobj::shape_t> shapes;
-
-        auto ret = read_obj(name, mtl_base_dir, &attrib, &shapes, &s_mesh.materials);
-        if (!ret) {
-            spdlog::error("Error reading obj file {} {}", name, mtl_base_dir);
-            return s_mesh;
-        }
+        {
+            tinyobj::attrib_t attrib;
+            std::vector<tinyobj::shape_t> shapes;
 
-        if (attrib.vertices.empty()) {
-            spdlog::error("No vertices in obj file {}", name);
-            return s_mesh;
-        }
+            auto ret = read_obj(name, mtl_base_dir, n_threads, &attrib, &shapes, &s_mesh.materials);
+            if (!ret) {
+                spdlog::error("Error reading obj file {} {}", name, mtl_base_dir);
+                return s_mesh;
+            }
 
-        create_smesh(s_mesh, attrib, shapes);
+            if (attrib.vertices.empty()) {
+                spdlog::error("No vertices in obj file {}", name);
+                return s_mesh;
+            }
 
+            create_smesh(s_mesh, attrib, shapes);
+        }
+        xe::compute_bounds(s_mesh, n_threads);
+
+        if (stats) {
+            load_stats.peak_rss = peak_rss();
+            load_stats.mesh_bytes = heap_bytes(s_mesh);
+            const double MB = 1024.0 * 1024.0;
+            spdlog::debug("Loaded `{}': mesh {:.1f} MB, peak RSS {:.1f} MB, {:.1f} MB above the start", name,
+                          load_stats.mesh_bytes / MB, load_stats.peak_rss / MB,
+                          (double(load_stats.peak_rss) - double(load_stats.start_rss)) / MB);
+            *stats = load_stats;
+        }
         return s_mesh;
 
     }
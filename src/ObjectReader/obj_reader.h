@@ -17,19 +17,28 @@
 
 namespace xe {
 
-    struct Triangle {
-        Triangle() : has_normals{false, false, false},
-                     has_texcoord{false, false, false} {};
-
-        glm::vec3 position[3];
-        glm::vec2 tex_coord[3];
-        glm::vec3 normal[3];
-
-        bool has_normals[3];
-        bool has_texcoord[3];
+    /**
+     * Memory used by a load_smesh_from_obj call.
+     */
+    struct ObjLoadStats {
+        // Resident set size of the process when the load started.
+        size_t start_rss = 0;
+        // Peak resident set size during the load on Linux, of the whole life of the process elsewhere. The peak is
+        // per process, loads running at the same time share it.
+        size_t peak_rss = 0;
+        // Heap memory held by the returned mesh.
+        size_t mesh_bytes = 0;
     };
 
-
     xe::sMesh load_smesh_from_obj(std::string name, std::string mtl_base_dir);
+
+    /**
+     * Same as above but the OBJ file is parsed using `n_threads` threads, 0 means all the available hardware threads.
+     * If `stats` is given the memory used is measured, logged and stored in it. The measurement resets the peak
+     * resident set size of the whole process, see reset_peak_rss, so do not pass `stats` while other code relies on
+     * that peak.
+     */
+    xe::sMesh load_smesh_from_obj(std::string name, std::string mtl_base_dir, unsigned int n_threads,
+                                  ObjLoadStats *stats = nullptr);
 }
 
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace xe {
+
+    /**
+     * Number of worker threads to use when the caller asks for `n_threads`. Zero means "as many as the hardware has".
+     */
+    inline unsigned int resolve_n_threads(unsigned int n_threads) {
+        if (n_threads == 0)
+            n_threads = std::thread::hardware_concurrency();
+        return std::max(1u, n_threads);
+    }
+
+    /**
+     * Calls `f(i)` for every i in [0, n_tasks) using at most `n_threads` threads (the calling thread included).
+     * Tasks are handed out dynamically, so uneven tasks are balanced between the threads.
+     */
+    template<typename F>
+    void parallel_for(size_t n_tasks, unsigned int n_threads, F &&f) {
+        n_threads = static_cast<unsigned int>(std::min<size_t>(resolve_n_threads(n_threads), n_tasks));
+        if (n_threads <= 1) {
+            for (size_t i = 0; i < n_tasks; ++i)
+                f(i);
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            for (auto i = next++; i < n_tasks; i = next++)
+                f(i);
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(n_threads - 1);
+        for (unsigned int t = 1; t < n_threads; ++t)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &&t: threads)
+            t.join();
+    }
+
+}
@@ -30,7 +30,7 @@ namespace xe {
         };
 
         struct Face {
-            std::array<uint16_t, 3> v;
+            std::array<uint32_t, 3> v;
         };
 
 
@@ -40,6 +40,22 @@ namespace xe {
             int mat_idx;
         };
 
+        /**
+         * Cluster of consecutive faces of one submesh, see xe::build_meshlets. `start` and `end` are counted in
+         * indices like in SubMesh. A cluster whose faces all point away from the viewer can be skipped when
+         * `dot(center - eye, cone_axis) >= cone_cutoff * length(center - eye) + radius`.
+         */
+        struct Meshlet {
+            int start;
+            int end;
+            int submesh;
+            // Filled in once the faces of the cluster are known.
+            glm::vec3 center = glm::vec3(0.0f);
+            float radius = 0.0f;
+            glm::vec3 cone_axis = glm::vec3(0.0f);
+            float cone_cutoff = 1.0f;
+        };
+
 
         std::vector <glm::vec3> vertex_coords;
         std::vector <glm::vec2> vertex_texcoords[MAX_TEXCOORDS];
@@ -50,8 +66,24 @@ namespace xe {
 
         std::vector <mtl_material_t> materials;
         std::vector <SubMesh> submeshes;
+        std::vector <Meshlet> meshlets;
+
+        /**
+         * Simplified version of the faces using the same vertices, see xe::simplify. `error` is the largest
+         * geometric error introduced, relative to the radius of the mesh bounding box.
+         */
+        struct Lod {
+            std::vector <Face> faces;
+            std::vector <SubMesh> submeshes;
+            float error;
+        };
+
+        // Levels of detail after the full resolution faces, from the finest to the coarsest.
+        std::vector <Lod> lods;
 
+        // Bounds of all the vertices and of the vertices of each submesh, see xe::compute_bounds.
         xe::BoundingBox<3> bb;
+        std::vector <xe::BoundingBox<3>> submesh_bb;
 
         bool has_texcoords[MAX_TEXCOORDS];
         bool has_normals;
@@ -60,6 +92,10 @@ namespace xe {
 
     };
 
+    /**
+     * Copy of the mesh with generated normals and, if it has texcoords, tangents. See compute_normals and
+     * compute_tangents in mesh_normals.h.
+     */
     sMesh* generate_normals(const sMesh& s_mesh) ;
 
 
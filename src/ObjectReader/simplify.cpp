@@ -0,0 +1,321 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+#include "mesh_bounds.h"
+#include "vertex_welder.h"
+
+namespace {
+
+    using Face = xe::sMesh::Face;
+    using SubMesh = xe::sMesh::SubMesh;
+
+    const uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    // Faces whose normal turns by more than this (cosine) are considered flipped.
+    const float MIN_NORMAL_DOT = 0.2f;
+
+    /**
+     * Symmetric 4x4 matrix of the sum of squared distances to a set of planes, weighted by their areas.
+     */
+    struct Quadric {
+        double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+        double w;
+
+        void add_plane(const glm::dvec3 &n, double d, double weight) {
+            a00 += weight * n.x * n.x;
+            a01 += weight * n.x * n.y;
+            a02 += weight * n.x * n.z;
+            a03 += weight * n.x * d;
+            a11 += weight * n.y * n.y;
+            a12 += weight * n.y * n.z;
+            a13 += weight * n.y * d;
+            a22 += weight * n.z * n.z;
+            a23 += weight * n.z * d;
+            a33 += weight * d * d;
+            w += weight;
+        }
+
+        Quadric &operator+=(const Quadric &q) {
+            a00 += q.a00;
+            a01 += q.a01;
+            a02 += q.a02;
+            a03 += q.a03;
+            a11 += q.a11;
+            a12 += q.a12;
+            a13 += q.a13;
+            a22 += q.a22;
+            a23 += q.a23;
+            a33 += q.a33;
+            w += q.w;
+            return *this;
+        }
+
+        double operator()(const glm::vec3 &p) const {
+            double x = p.x, y = p.y, z = p.z;
+            auto e = x * (a00 * x + 2.0 * (a01 * y + a02 * z + a03)) +
+                     y * (a11 * y + 2.0 * (a12 * z + a13)) +
+                     z * (a22 * z + 2.0 * a23) + a33;
+            return std::max(0.0, e);
+        }
+    };
+
+    struct Collapse {
+        double cost;
+        uint32_t from;
+        uint32_t to;
+    };
+
+    inline uint64_t edge_key(uint32_t a, uint32_t b) {
+        if (a > b)
+            std::swap(a, b);
+        return (uint64_t(a) << 32) | b;
+    }
+
+    /**
+     * Vertices that must stay: seams, borders between submeshes, open and non-manifold edges.
+     */
+    std::vector<bool> locked_vertices(const xe::sMesh &mesh, const std::vector<Face> &faces,
+                                      const std::vector<int> &face_submesh, const std::vector<uint32_t> &group) {
+        auto n = mesh.vertex_coords.size();
+        std::vector<bool> locked(n, false);
+
+        std::vector<uint32_t> group_size(n, 0);
+        for (size_t v = 0; v < n; v++)
+            group_size[group[v]]++;
+        for (size_t v = 0; v < n; v++)
+            if (group_size[group[v]] > 1)
+                locked[v] = true;
+
+        std::vector<int> submesh_of(n, -1);
+        for (size_t f = 0; f < faces.size(); f++) {
+            for (auto v: faces[f].v) {
+                if (submesh_of[v] == -1)
+                    submesh_of[v] = face_submesh[f];
+                else if (submesh_of[v] != face_submesh[f])
+                    locked[v] = true;
+            }
+        }
+
+        std::vector<uint64_t> edges;
+        edges.reserve(3 * faces.size());
+        for (auto &&f: faces)
+            for (int c = 0; c < 3; c++)
+                edges.push_back(edge_key(group[f.v[c]], group[f.v[(c + 1) % 3]]));
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size();) {
+            auto j = i;
+            while (j < edges.size() && edges[j] == edges[i])
+                j++;
+            if (j - i != 2) {
+                // Lock the whole position group, all the vertices at the ends of the edge.
+                locked[uint32_t(edges[i] >> 32)] = true;
+                locked[uint32_t(edges[i])] = true;
+            }
+            i = j;
+        }
+        for (size_t v = 0; v < n; v++)
+            if (locked[group[v]])
+                locked[v] = true;
+        return locked;
+    }
+
+    inline glm::vec3 face_normal(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+        return glm::cross(b - a, c - a);
+    }
+
+    xe::sMesh::Lod simplify_faces(const xe::sMesh &mesh, const std::vector<Face> &input,
+                                  const std::vector<SubMesh> &submeshes, size_t target, float max_error) {
+        xe::sMesh::Lod lod{input, submeshes, 0.0f};
+        auto &&faces = lod.faces;
+        auto radius = xe::bounding_box(mesh.vertex_coords).sphere().radius;
+        if (faces.size() <= target || radius <= 0.0f)
+            return lod;
+
+        auto n = mesh.vertex_coords.size();
+        auto &&p = mesh.vertex_coords;
+
+        std::vector<int> face_submesh(faces.size(), 0);
+        for (size_t s = 0; s < submeshes.size(); s++)
+            for (auto f = submeshes[s].start / 3; f < submeshes[s].end / 3; f++)
+                face_submesh[f] = int(s);
+
+        auto group = xe::position_groups(mesh.vertex_coords);
+        auto locked = locked_vertices(mesh, faces, face_submesh, group);
+
+        std::vector<Quadric> quadrics(n);
+        std::memset(quadrics.data(), 0, n * sizeof(Quadric));
+        for (auto &&f: faces) {
+            glm::dvec3 a(p[f.v[0]]), b(p[f.v[1]]), c(p[f.v[2]]);
+            auto normal = glm::cross(b - a, c - a);
+            auto area = glm::length(normal);
+            if (area <= 0.0)
+                continue;
+            normal /= area;
+            auto d = -glm::dot(normal, a);
+            for (auto v: f.v)
+                quadrics[v].add_plane(normal, d, 0.5 * area);
+        }
+
+        // Costs are compared as squared distances relative to the radius.
+        auto max_cost = double(max_error) * double(max_error) * double(radius) * double(radius);
+        auto cost_of = [&quadrics, &p](uint32_t from, uint32_t to) {
+            auto q = quadrics[from];
+            q += quadrics[to];
+            return q.w > 0.0 ? q(p[to]) / q.w : 0.0;
+        };
+
+        std::vector<uint32_t> first(n + 1), adjacent;
+        std::vector<Collapse> candidates;
+        std::vector<bool> touched(n);
+        std::vector<uint32_t> collapse(n);
+        double applied_cost = 0.0;
+
+        auto n_live = faces.size();
+        while (n_live > target) {
+            // Faces around every vertex.
+            std::fill(first.begin(), first.end(), 0);
+            for (auto &&f: faces)
+                for (auto v: f.v)
+                    first[v + 1]++;
+            for (size_t v = 0; v < n; v++)
+                first[v + 1] += first[v];
+            adjacent.resize(first[n]);
+            {
+                auto fill = first;
+                for (uint32_t f = 0; f < faces.size(); f++)
+                    for (auto v: faces[f].v)
+                        adjacent[fill[v]++] = f;
+            }
+
+            // The cheapest collapse of every free vertex onto one of its neighbours.
+            candidates.clear();
+            for (uint32_t u = 0; u < n; u++) {
+                if (locked[u] || first[u] == first[u + 1])
+                    continue;
+                Collapse best{std::numeric_limits<double>::max(), u, NONE};
+                for (auto i = first[u]; i < first[u + 1]; i++) {
+                    for (auto v: faces[adjacent[i]].v) {
+                        if (v == u)
+                            continue;
+                        auto cost = cost_of(u, v);
+                        if (cost < best.cost)
+                            best = {cost, u, v};
+                    }
+                }
+                if (best.to != NONE)
+                    candidates.push_back(best);
+            }
+            std::sort(candidates.begin(), candidates.end(), [](const Collapse &a, const Collapse &b) {
+                return a.cost < b.cost;
+            });
+
+            std::fill(touched.begin(), touched.end(), false);
+            for (uint32_t v = 0; v < n; v++)
+                collapse[v] = v;
+            size_t n_collapsed = 0;
+            auto n_remaining = n_live;
+            for (auto &&c: candidates) {
+                if (c.cost > max_cost || n_remaining <= target)
+                    break;
+                if (touched[c.from] || touched[c.to])
+                    continue;
+
+                // Reject collapses that flip or squash any of the remaining faces.
+                size_t n_removed = 0;
+                bool flips = false;
+                for (auto i = first[c.from]; i < first[c.from + 1] && !flips; i++) {
+                    auto &&f = faces[adjacent[i]].v;
+                    if (f[0] == c.to || f[1] == c.to || f[2] == c.to) {
+                        n_removed++;
+                        continue;
+                    }
+                    glm::vec3 q[3] = {p[f[0]], p[f[1]], p[f[2]]};
+                    auto before = face_normal(q[0], q[1], q[2]);
+                    for (int k = 0; k < 3; k++)
+                        if (f[k] == c.from)
+                            q[k] = p[c.to];
+                    auto after = face_normal(q[0], q[1], q[2]);
+                    auto bl = glm::length(before), al = glm::length(after);
+                    flips = al <= 0.0f || (bl > 0.0f && glm::dot(before, after) < MIN_NORMAL_DOT * bl * al);
+                }
+                if (flips)
+                    continue;
+
+                collapse[c.from] = c.to;
+                quadrics[c.to] += quadrics[c.from];
+                applied_cost = std::max(applied_cost, c.cost);
+                n_remaining -= n_removed;
+                n_collapsed++;
+                // The whole neighbourhood changes, its other candidates are no longer valid in this pass.
+                for (auto i = first[c.from]; i < first[c.from + 1]; i++)
+                    for (auto v: faces[adjacent[i]].v)
+                        touched[v] = true;
+            }
+            if (n_collapsed == 0)
+                break;
+
+            size_t out = 0;
+            for (size_t f = 0; f < faces.size(); f++) {
+                auto v = faces[f].v;
+                for (auto &&i: v)
+                    i = collapse[i];
+                if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
+                    continue;
+                faces[out].v = v;
+                face_submesh[out] = face_submesh[f];
+                out++;
+            }
+            faces.resize(out);
+            face_submesh.resize(out);
+            n_live = out;
+        }
+
+        // Faces kept their order, so every submesh is still a contiguous range.
+        auto &&sms = lod.submeshes;
+        size_t f = 0;
+        for (size_t s = 0; s < sms.size(); s++) {
+            sms[s].start = int(3 * f);
+            while (f < faces.size() && face_submesh[f] == int(s))
+                f++;
+            sms[s].end = int(3 * f);
+        }
+        lod.error = float(std::sqrt(applied_cost)) / radius;
+        return lod;
+    }
+}
+
+namespace xe {
+
+    sMesh::Lod simplify(const sMesh &mesh, float target_ratio, float max_error) {
+        auto target = static_cast<size_t>(std::max(0.0f, target_ratio) * float(mesh.faces.size()));
+        return simplify_faces(mesh, mesh.faces, mesh.submeshes, target, max_error);
+    }
+
+    void build_lod_chain(sMesh &mesh, const std::vector<float> &ratios, float max_error) {
+        mesh.lods.clear();
+        auto n_faces = mesh.faces.size();
+        const std::vector<Face> *faces = &mesh.faces;
+        const std::vector<SubMesh> *submeshes = &mesh.submeshes;
+        for (auto ratio: ratios) {
+            auto target = static_cast<size_t>(std::max(0.0f, ratio) * float(n_faces));
+            auto lod = simplify_faces(mesh, *faces, *submeshes, target, max_error);
+            // Errors of the successive simplifications add up at worst.
+            if (!mesh.lods.empty())
+                lod.error += mesh.lods.back().error;
+            // A level that barely differs from the previous one only costs memory.
+            if (lod.faces.size() > 0.9 * faces->size())
+                break;
+            spdlog::debug("LOD {}: {} faces ({:.1f}%), error {:.4f}", mesh.lods.size() + 1, lod.faces.size(),
+                          100.0 * double(lod.faces.size()) / double(n_faces), lod.error);
+            mesh.lods.push_back(std::move(lod));
+            faces = &mesh.lods.back().faces;
+            submeshes = &mesh.lods.back().submeshes;
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+
+#include "sMesh.h"
+
+namespace xe {
+
+    /**
+     * Simplifies the mesh to about `target_ratio` of its faces by quadric error driven half-edge collapses. The
+     * vertices are not moved, a collapsed vertex is replaced by one of its neighbours, so the result indexes the
+     * vertex arrays of `mesh` and can share its vertex buffer.
+     *
+     * Vertices on UV or normal seams (several vertices at the same position), on borders between submeshes and on
+     * open borders are never removed, so seams, material borders and silhouettes of open surfaces are preserved
+     * exactly and every submesh keeps its material. Collapses that would flip a face are rejected. Simplification
+     * stops early when the next collapse would introduce an error larger than `max_error`, measured relative to the
+     * radius of the mesh bounding box.
+     */
+    sMesh::Lod simplify(const sMesh &mesh, float target_ratio, float max_error);
+
+    /**
+     * Fills `mesh.lods` with one level per entry of `ratios` (fractions of the full face count, decreasing). Each
+     * level is simplified from the previous one. Levels that could not be reduced noticeably below the previous one
+     * are not stored.
+     */
+    void build_lod_chain(sMesh &mesh, const std::vector<float> &ratios, float max_error);
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "3rdParty/tinyobjloader/tiny_obj_loader.h"
+
+namespace xe {
+
+    /**
+     * Maps OBJ (position, texcoord, normal) index triples onto consecutive vertex indices, so face corners that refer
+     * to the same triple share a single vertex. The vertices are looked up by their position index: `first` holds the
+     * latest vertex of every position and `next` chains the vertices sharing a position, which are few (seams). Unlike
+     * a hash table, this keeps the locality of the OBJ indices, so the cost per corner does not grow with the mesh.
+     * All the arrays are allocated from `resource`, e.g. an arena of `memory_size(n_positions, expected_vertices)`
+     * bytes.
+     */
+    class VertexWelder {
+    public:
+        explicit VertexWelder(size_t n_positions = 0, size_t expected_vertices = 0,
+                              std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+                : first_(resource), next_(resource), unique_(resource), n_corners_(0) {
+            first_.assign(n_positions, EMPTY);
+            next_.reserve(expected_vertices);
+            unique_.reserve(expected_vertices);
+        }
+
+        /**
+         * Bytes allocated by a welder of `n_positions` positions that gets no more than `expected_vertices` vertices.
+         */
+        static size_t memory_size(size_t n_positions, size_t expected_vertices) {
+            return n_positions * sizeof(uint32_t) + expected_vertices * (sizeof(uint32_t) + sizeof(tinyobj::index_t)) +
+                   3 * alignof(std::max_align_t);
+        }
+
+        /**
+         * Returns the vertex index of the triple, adding a new vertex if the triple was not seen before.
+         */
+        uint32_t insert(const tinyobj::index_t &idx) {
+            n_corners_++;
+            auto p = static_cast<size_t>(idx.vertex_index);
+            if (p >= first_.size())
+                first_.resize(p + 1, EMPTY);
+
+            for (auto v = first_[p]; v != EMPTY; v = next_[v]) {
+                if (equal(unique_[v], idx))
+                    return v;
+            }
+            auto v = static_cast<uint32_t>(unique_.size());
+            unique_.push_back(idx);
+            next_.push_back(first_[p]);
+            first_[p] = v;
+            return v;
+        }
+
+        /**
+         * Index triples of the welded vertices, in the order of their first use.
+         */
+        const std::pmr::vector<tinyobj::index_t> &unique() const { return unique_; }
+
+        size_t n_vertices() const { return unique_.size(); }
+
+        size_t n_corners() const { return n_corners_; }
+
+        /**
+         * Number of face corners per emitted vertex, 1.0 means nothing was shared.
+         */
+        double dedup_ratio() const {
+            return unique_.empty() ? 1.0 : static_cast<double>(n_corners_) / unique_.size();
+        }
+
+    private:
+        static constexpr uint32_t EMPTY = 0xffffffffu;
+
+        static bool equal(const tinyobj::index_t &a, const tinyobj::index_t &b) {
+            return a.texcoord_index == b.texcoord_index && a.normal_index == b.normal_index &&
+                   a.vertex_index == b.vertex_index;
+        }
+
+        std::pmr::vector<uint32_t> first_;
+        std::pmr::vector<uint32_t> next_;
+        std::pmr::vector<tinyobj::index_t> unique_;
+        size_t n_corners_;
+    };
+
+    /**
+     * Groups vertices by position: every vertex gets the index of the first vertex with a bit-identical position.
+     * Welded vertices that differ only in texcoords or normals (seams) end up in the same group.
+     */
+    inline std::vector<uint32_t> position_groups(const std::vector<glm::vec3> &positions) {
+        auto n = positions.size();
+        std::vector<uint32_t> order(n);
+        for (uint32_t i = 0; i < n; i++)
+            order[i] = i;
+        auto &&p = positions;
+        std::sort(order.begin(), order.end(), [&p](uint32_t a, uint32_t b) {
+            if (p[a].x != p[b].x) return p[a].x < p[b].x;
+            if (p[a].y != p[b].y) return p[a].y < p[b].y;
+            if (p[a].z != p[b].z) return p[a].z < p[b].z;
+            return a < b;
+        });
+        std::vector<uint32_t> group(n);
+        for (size_t i = 0; i < n; i++) {
+            auto v = order[i];
+            group[v] = (i > 0 && p[order[i - 1]] == p[v]) ? group[order[i - 1]] : v;
+        }
+        return group;
+    }
+
+}
@@ -0,0 +1,388 @@
+#include "BufferArena.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "GLState.h"
+
+namespace {
+    // Blocks of at least 64 vertices and 256 bytes of indices, which keeps the index offsets aligned for any type.
+    const size_t MIN_VERTEX_BLOCK = 64;
+    const size_t MIN_INDEX_BLOCK = 256;
+    const size_t INITIAL_VERTEX_BUFFER_SIZE = size_t(4) << 20;
+    const size_t INITIAL_INDEX_BUFFER_SIZE = size_t(1) << 20;
+    const size_t INITIAL_DECODINGS = 16;
+
+    bool same_attributes(const xe::VertexAttribute &a, const xe::VertexAttribute &b) {
+        return a.index == b.index && a.size == b.size && a.type == b.type && a.normalized == b.normalized &&
+               a.offset == b.offset;
+    }
+}
+
+namespace xe {
+
+    BuddyAllocator::BuddyAllocator(size_t min_block, size_t capacity) : min_block_(std::max<size_t>(min_block, 1)),
+                                                                         max_order_(0) {
+        while ((min_block_ << max_order_) < capacity)
+            max_order_++;
+        free_.resize(max_order_ + 1);
+        free_[max_order_].insert(0);
+    }
+
+    int BuddyAllocator::order_of(size_t size) const {
+        int order = 0;
+        while ((min_block_ << order) < size)
+            order++;
+        return order;
+    }
+
+    size_t BuddyAllocator::allocate(size_t size) {
+        auto order = order_of(size);
+        auto o = order;
+        while (o <= max_order_ && free_[o].empty())
+            o++;
+        if (o > max_order_)
+            return npos;
+
+        auto offset = *free_[o].begin();
+        free_[o].erase(free_[o].begin());
+        // Split down to the size asked for, the upper halves stay free.
+        while (o > order) {
+            o--;
+            free_[o].insert(offset + (min_block_ << o));
+        }
+        blocks_[offset] = {order, size};
+        allocated_ += min_block_ << order;
+        requested_ += size;
+        return offset;
+    }
+
+    void BuddyAllocator::insert_free(size_t offset, int order) {
+        while (order < max_order_) {
+            auto buddy = offset ^ (min_block_ << order);
+            if (free_[order].erase(buddy) == 0)
+                break;
+            offset = std::min(offset, buddy);
+            order++;
+        }
+        free_[order].insert(offset);
+    }
+
+    void BuddyAllocator::free(size_t offset) {
+        auto it = blocks_.find(offset);
+        if (it == blocks_.end()) {
+            spdlog::error("Freeing block at {} that was not allocated", offset);
+            return;
+        }
+        auto block = it->second;
+        blocks_.erase(it);
+        allocated_ -= min_block_ << block.order;
+        requested_ -= block.size;
+        insert_free(offset, block.order);
+    }
+
+    void BuddyAllocator::grow() {
+        auto old_capacity = capacity();
+        max_order_++;
+        free_.emplace_back();
+        insert_free(old_capacity, max_order_ - 1);
+    }
+
+    size_t BuddyAllocator::free_blocks() const {
+        size_t n = 0;
+        for (auto &&f: free_)
+            n += f.size();
+        return n;
+    }
+
+    size_t BuddyAllocator::largest_free_block() const {
+        for (auto o = max_order_; o >= 0; o--)
+            if (!free_[o].empty())
+                return min_block_ << o;
+        return 0;
+    }
+
+    size_t BuddyAllocator::high_water() const {
+        size_t end = 0;
+        for (auto &&[offset, block]: blocks_)
+            end = std::max(end, offset + (min_block_ << block.order));
+        return end;
+    }
+
+    BufferArena &BufferArena::global() {
+        static BufferArena arena;
+        return arena;
+    }
+
+    BufferArena::Pool::Pool(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride)
+            : attributes(attributes, attributes + n_attributes), stride(stride),
+              vertices(MIN_VERTEX_BLOCK, INITIAL_VERTEX_BUFFER_SIZE / size_t(stride)),
+              indices(MIN_INDEX_BLOCK, INITIAL_INDEX_BUFFER_SIZE) {}
+
+    size_t BufferArena::find_pool(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride) {
+        for (size_t p = 0; p < pools_.size(); p++) {
+            auto &&pool = *pools_[p];
+            if (pool.stride == stride && pool.attributes.size() == n_attributes &&
+                std::equal(pool.attributes.begin(), pool.attributes.end(), attributes, same_attributes))
+                return p;
+        }
+
+        auto pool = std::make_unique<Pool>(attributes, n_attributes, stride);
+        glGenVertexArrays(1, &pool->vertex_array);
+        resize_buffer(&pool->vertex_buffer, 0, 0, pool->vertices.capacity() * size_t(stride));
+        resize_buffer(&pool->index_buffer, 0, 0, pool->indices.capacity());
+        setup_vertex_array(*pool);
+        pools_.push_back(std::move(pool));
+        return pools_.size() - 1;
+    }
+
+    void BufferArena::setup_vertex_array(Pool &pool) {
+        auto &state = GLState::current();
+        state.bind_vertex_array(pool.vertex_array);
+        state.bind_buffer(GL_ARRAY_BUFFER, pool.vertex_buffer);
+        // The ranges are addressed with the base vertex, so the attributes start at the beginning of the buffer.
+        for (auto &&a: pool.attributes) {
+            glEnableVertexAttribArray(a.index);
+            glVertexAttribPointer(a.index, a.size, a.type, a.normalized, pool.stride,
+                                  reinterpret_cast<void *>(static_cast<uintptr_t>(a.offset)));
+        }
+        state.bind_buffer(GL_ELEMENT_ARRAY_BUFFER, pool.index_buffer);
+    }
+
+    void BufferArena::resize_buffer(GLuint *buffer, size_t old_size, size_t copy_size, size_t new_size) {
+        auto &state = GLState::current();
+        GLuint resized = 0;
+        glGenBuffers(1, &resized);
+        state.bind_buffer(GL_COPY_WRITE_BUFFER, resized);
+        glBufferData(GL_COPY_WRITE_BUFFER, GLsizeiptr(new_size), nullptr, GL_STATIC_DRAW);
+        if (*buffer != 0) {
+            if (copy_size > 0) {
+                state.bind_buffer(GL_COPY_READ_BUFFER, *buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                                    GLsizeiptr(std::min(copy_size, old_size)));
+            }
+            state.delete_buffers(1, buffer);
+        }
+        *buffer = resized;
+    }
+
+    size_t BufferArena::allocate(Pool &pool, BuddyAllocator &allocator, GLuint *buffer, size_t unit, size_t size) {
+        auto offset = allocator.allocate(size);
+        while (offset == BuddyAllocator::npos && 2 * allocator.capacity() * unit <= MAX_BUFFER_SIZE) {
+            auto old_size = allocator.capacity() * unit;
+            allocator.grow();
+            resize_buffer(buffer, old_size, allocator.high_water() * unit, allocator.capacity() * unit);
+            setup_vertex_array(pool);
+            grows_++;
+            offset = allocator.allocate(size);
+        }
+        return offset;
+    }
+
+    ArenaRange *BufferArena::allocate(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride,
+                                      size_t vertex_size, const void *vertices, size_t index_size,
+                                      const void *indices, const VertexDecoding &decoding) {
+        if (stride <= 0 || vertex_size % size_t(stride) != 0) {
+            spdlog::error("Vertex data of {} bytes is not a multiple of the stride {}", vertex_size, stride);
+            return nullptr;
+        }
+        auto p = find_pool(attributes, n_attributes, stride);
+        auto &&pool = *pools_[p];
+        auto unit = size_t(stride);
+        auto n_vertices = vertex_size / unit;
+
+        auto first_vertex = allocate(pool, pool.vertices, &pool.vertex_buffer, unit, n_vertices);
+        if (first_vertex == BuddyAllocator::npos)
+            return nullptr;
+        auto index_offset = allocate(pool, pool.indices, &pool.index_buffer, 1, index_size);
+        if (index_offset == BuddyAllocator::npos) {
+            pool.vertices.free(first_vertex);
+            return nullptr;
+        }
+
+        auto &state = GLState::current();
+        if (vertices != nullptr && vertex_size > 0) {
+            state.bind_buffer(GL_ARRAY_BUFFER, pool.vertex_buffer);
+            glBufferSubData(GL_ARRAY_BUFFER, GLintptr(first_vertex * unit), GLsizeiptr(vertex_size), vertices);
+        }
+        if (indices != nullptr && index_size > 0) {
+            // Not through GL_ELEMENT_ARRAY_BUFFER, which would need the vertex array bound.
+            state.bind_buffer(GL_COPY_WRITE_BUFFER, pool.index_buffer);
+            glBufferSubData(GL_COPY_WRITE_BUFFER, GLintptr(index_offset), GLsizeiptr(index_size), indices);
+        }
+
+        ranges_.push_back(std::make_unique<ArenaRange>(
+                ArenaRange{p, first_vertex, n_vertices, index_offset, index_size, ranges_.size(),
+                           acquire_decoding(decoding)}));
+        return ranges_.back().get();
+    }
+
+    void BufferArena::free(ArenaRange *range) {
+        if (range == nullptr)
+            return;
+        auto &&pool = *pools_[range->pool];
+        pool.vertices.free(range->first_vertex);
+        pool.indices.free(range->index_offset);
+        release_decoding(range->decoding);
+        auto slot = range->slot;
+        std::swap(ranges_[slot], ranges_.back());
+        ranges_[slot]->slot = slot;
+        ranges_.pop_back();
+    }
+
+    void BufferArena::set_decoding(ArenaRange *range, const VertexDecoding &decoding) {
+        auto entry = acquire_decoding(decoding);
+        release_decoding(range->decoding);
+        range->decoding = entry;
+    }
+
+    size_t BufferArena::acquire_decoding(const VertexDecoding &decoding) {
+        auto entry = decodings_.size();
+        for (size_t d = 0; d < decodings_.size(); d++) {
+            if (decoding_refs_[d] == 0) {
+                entry = std::min(entry, d);
+            } else if (std::memcmp(&decodings_[d], &decoding, sizeof(VertexDecoding)) == 0) {
+                decoding_refs_[d]++;
+                return d;
+            }
+        }
+        if (entry == decodings_.size()) {
+            decodings_.push_back(decoding);
+            decoding_refs_.push_back(1);
+        } else {
+            decodings_[entry] = decoding;
+            decoding_refs_[entry] = 1;
+        }
+
+        auto &state = GLState::current();
+        if (decoding_stride_ == 0) {
+            GLint alignment = 0;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            if (alignment <= 0)
+                alignment = 256;
+            decoding_stride_ = (sizeof(VertexDecoding) + size_t(alignment) - 1) / size_t(alignment) * size_t(alignment);
+        }
+        if (decodings_.size() > decoding_capacity_) {
+            // The table is small, the larger buffer is filled again from the copy kept here.
+            decoding_capacity_ = std::max(INITIAL_DECODINGS, 2 * decoding_capacity_);
+            if (decoding_buffer_ == 0)
+                glGenBuffers(1, &decoding_buffer_);
+            state.bind_buffer(GL_UNIFORM_BUFFER, decoding_buffer_);
+            glBufferData(GL_UNIFORM_BUFFER, GLsizeiptr(decoding_capacity_ * decoding_stride_), nullptr, GL_STATIC_DRAW);
+            for (size_t d = 0; d < decodings_.size(); d++)
+                glBufferSubData(GL_UNIFORM_BUFFER, GLintptr(d * decoding_stride_), sizeof(VertexDecoding),
+                                &decodings_[d]);
+        } else {
+            state.bind_buffer(GL_UNIFORM_BUFFER, decoding_buffer_);
+            glBufferSubData(GL_UNIFORM_BUFFER, GLintptr(entry * decoding_stride_), sizeof(VertexDecoding),
+                            &decodings_[entry]);
+        }
+        return entry;
+    }
+
+    void BufferArena::release_decoding(size_t entry) {
+        decoding_refs_[entry]--;
+    }
+
+    void BufferArena::defragment() {
+        auto &state = GLState::current();
+        for (size_t p = 0; p < pools_.size(); p++) {
+            auto &&pool = *pools_[p];
+            auto unit = size_t(pool.stride);
+            std::vector<ArenaRange *> ranges;
+            for (auto &&r: ranges_)
+                if (r->pool == p)
+                    ranges.push_back(r.get());
+
+            // Buddy blocks allocated from the largest down are packed without holes.
+            BuddyAllocator vertices(MIN_VERTEX_BLOCK, INITIAL_VERTEX_BUFFER_SIZE / unit);
+            BuddyAllocator indices(MIN_INDEX_BLOCK, INITIAL_INDEX_BUFFER_SIZE);
+            std::vector<size_t> first_vertices(ranges.size()), index_offsets(ranges.size());
+            auto pack = [&ranges](BuddyAllocator &allocator, size_t ArenaRange::*size, std::vector<size_t> *offsets) {
+                std::vector<size_t> order(ranges.size());
+                for (size_t i = 0; i < order.size(); i++)
+                    order[i] = i;
+                std::stable_sort(order.begin(), order.end(), [&ranges, size](size_t a, size_t b) {
+                    return ranges[a]->*size > ranges[b]->*size;
+                });
+                for (auto i: order) {
+                    auto offset = allocator.allocate(ranges[i]->*size);
+                    while (offset == BuddyAllocator::npos) {
+                        allocator.grow();
+                        offset = allocator.allocate(ranges[i]->*size);
+                    }
+                    (*offsets)[i] = offset;
+                }
+            };
+            pack(vertices, &ArenaRange::n_vertices, &first_vertices);
+            pack(indices, &ArenaRange::index_size, &index_offsets);
+
+            GLuint vertex_buffer = 0, index_buffer = 0;
+            resize_buffer(&vertex_buffer, 0, 0, vertices.capacity() * unit);
+            resize_buffer(&index_buffer, 0, 0, indices.capacity());
+            for (size_t i = 0; i < ranges.size(); i++) {
+                auto &&r = *ranges[i];
+                state.bind_buffer(GL_COPY_READ_BUFFER, pool.vertex_buffer);
+                state.bind_buffer(GL_COPY_WRITE_BUFFER, vertex_buffer);
+                if (r.n_vertices > 0)
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GLintptr(r.first_vertex * unit),
+                                        GLintptr(first_vertices[i] * unit), GLsizeiptr(r.n_vertices * unit));
+                state.bind_buffer(GL_COPY_READ_BUFFER, pool.index_buffer);
+                state.bind_buffer(GL_COPY_WRITE_BUFFER, index_buffer);
+                if (r.index_size > 0)
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GLintptr(r.index_offset),
+                                        GLintptr(index_offsets[i]), GLsizeiptr(r.index_size));
+                r.first_vertex = first_vertices[i];
+                r.index_offset = index_offsets[i];
+            }
+
+            GLuint old_buffers[] = {pool.vertex_buffer, pool.index_buffer};
+            state.delete_buffers(2, old_buffers);
+            pool.vertex_buffer = vertex_buffer;
+            pool.index_buffer = index_buffer;
+            pool.vertices = std::move(vertices);
+            pool.indices = std::move(indices);
+            setup_vertex_array(pool);
+        }
+        defragmentations_++;
+    }
+
+    BufferArenaStats BufferArena::stats() const {
+        BufferArenaStats stats;
+        stats.pools = pools_.size();
+        stats.ranges = ranges_.size();
+        for (auto &&pool: pools_) {
+            auto unit = size_t(pool->stride);
+            stats.vertex_capacity += pool->vertices.capacity() * unit;
+            stats.vertex_allocated += pool->vertices.allocated() * unit;
+            stats.vertex_requested += pool->vertices.requested() * unit;
+            stats.index_capacity += pool->indices.capacity();
+            stats.index_allocated += pool->indices.allocated();
+            stats.index_requested += pool->indices.requested();
+            stats.free_blocks += pool->vertices.free_blocks() + pool->indices.free_blocks();
+            stats.largest_free_block = std::max({stats.largest_free_block, pool->vertices.largest_free_block() * unit,
+                                                 pool->indices.largest_free_block()});
+        }
+        stats.grows = grows_;
+        stats.defragmentations = defragmentations_;
+        return stats;
+    }
+
+    void BufferArena::log_stats() const {
+        auto s = stats();
+        auto percent = [](size_t part, size_t whole) { return whole > 0 ? 100.0 * double(part) / double(whole) : 0.0; };
+        spdlog::info("Buffer arena: {} ranges in {} pools, vertices {:.1f}/{:.1f} MB ({:.1f}% used, {:.1f}% of it "
+                     "padding), indices {:.1f}/{:.1f} MB ({:.1f}% used, {:.1f}% of it padding), {} free blocks, "
+                     "largest {:.1f} MB, {} grows, {} defragmentations", s.ranges, s.pools,
+                     s.vertex_allocated / 1048576.0, s.vertex_capacity / 1048576.0,
+                     percent(s.vertex_allocated, s.vertex_capacity),
+                     percent(s.vertex_allocated - s.vertex_requested, s.vertex_allocated),
+                     s.index_allocated / 1048576.0, s.index_capacity / 1048576.0,
+                     percent(s.index_allocated, s.index_capacity),
+                     percent(s.index_allocated - s.index_requested, s.index_allocated), s.free_blocks,
+                     s.largest_free_block / 1048576.0, s.grows, s.defragmentations);
+    }
+
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "glad/gl.h"
+
+#include "Mesh.h"
+
+namespace xe {
+
+    /**
+     * Binary buddy allocator of ranges of `capacity` units in blocks of `min_block` times a power of two units.
+     * Blocks start at multiples of their size, freed blocks are merged with their free buddies at once.
+     */
+    class BuddyAllocator {
+    public:
+        static constexpr size_t npos = SIZE_MAX;
+
+        /**
+         * `capacity` is rounded up to `min_block` times a power of two.
+         */
+        BuddyAllocator(size_t min_block, size_t capacity);
+
+        /**
+         * Returns the offset of a block of at least `size` units, npos if there is no free block large enough.
+         */
+        size_t allocate(size_t size);
+
+        void free(size_t offset);
+
+        /**
+         * Doubles the capacity, the new upper half is free.
+         */
+        void grow();
+
+        size_t capacity() const { return min_block_ << max_order_; }
+
+        size_t min_block() const { return min_block_; }
+
+        /**
+         * Units in allocated blocks and in the sizes asked for, the difference is lost to the rounding.
+         */
+        size_t allocated() const { return allocated_; }
+
+        size_t requested() const { return requested_; }
+
+        size_t free_blocks() const;
+
+        size_t largest_free_block() const;
+
+        /**
+         * Offset of the end of the last allocated block, the part of the range worth copying.
+         */
+        size_t high_water() const;
+
+    private:
+        int order_of(size_t size) const;
+
+        void insert_free(size_t offset, int order);
+
+        struct Block {
+            int order;
+            size_t size;
+        };
+
+        size_t min_block_;
+        int max_order_;
+        // Free blocks of every order by offset, the lowest is taken first.
+        std::vector<std::set<size_t>> free_;
+        std::unordered_map<size_t, Block> blocks_;
+        size_t allocated_ = 0;
+        size_t requested_ = 0;
+    };
+
+    struct BufferArenaStats {
+        // Vertex formats, each with its own vertex array.
+        size_t pools = 0;
+        size_t ranges = 0;
+        // In bytes: the sizes of the buffers, of the allocated blocks and of the data put in them.
+        size_t vertex_capacity = 0;
+        size_t vertex_allocated = 0;
+        size_t vertex_requested = 0;
+        size_t index_capacity = 0;
+        size_t index_allocated = 0;
+        size_t index_requested = 0;
+        // Free blocks of all the buffers and the largest of them in bytes.
+        size_t free_blocks = 0;
+        size_t largest_free_block = 0;
+        size_t grows = 0;
+        size_t defragmentations = 0;
+    };
+
+    /**
+     * Vertices and indices of one mesh in the buffers of a BufferArena. The offsets can change with
+     * BufferArena::defragment, read them when drawing.
+     */
+    struct ArenaRange {
+        // Index of the pool of the vertex format in the arena.
+        size_t pool;
+        // In vertices of the format.
+        size_t first_vertex;
+        size_t n_vertices;
+        // In bytes.
+        size_t index_offset;
+        size_t index_size;
+        // Position in the arena list of ranges.
+        size_t slot;
+        // Entry of the vertex decoding in the arena table of decodings.
+        size_t decoding;
+    };
+
+    /**
+     * Vertex and index buffers shared by many meshes. Meshes with the same vertex format (attributes and stride) get
+     * ranges of the same pair of buffers, suballocated by BuddyAllocator, and draw with the same vertex array. The
+     * vertices of a mesh are addressed with the base vertex, its indices with the offset in the index buffer.
+     *
+     * A full buffer is replaced by one twice as large, the contents copied with glCopyBufferSubData, so the ranges
+     * keep their offsets. `defragment` repacks the live ranges of every pool into buffers just large enough for
+     * them, which moves them; call it between the frames, not between queuing and submitting the draws.
+     *
+     * The vertex decodings of the ranges go to one uniform buffer, each distinct decoding once at an offset aligned
+     * for glBindBufferRange, so the meshes in the arena own no GL objects at all.
+     *
+     * Needs a current GL context. The buffers are not deleted with the arena, they go with the context.
+     */
+    class BufferArena {
+    public:
+        BufferArena() = default;
+
+        BufferArena(const BufferArena &) = delete;
+
+        BufferArena &operator=(const BufferArena &) = delete;
+
+        /**
+         * Arena used by load_mesh_from_obj when MeshLoadOptions::buffer_arena is not set.
+         */
+        static BufferArena &global();
+
+        /**
+         * Allocates `vertex_size` bytes of vertices in the format of `attributes` and `stride` and `index_size` bytes
+         * of indices and fills them with `vertices` and `indices`, if not null. Returns nullptr if the ranges do not
+         * fit even in the largest buffers, see MAX_BUFFER_SIZE.
+         */
+        ArenaRange *allocate(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride,
+                             size_t vertex_size, const void *vertices, size_t index_size, const void *indices,
+                             const VertexDecoding &decoding = VertexDecoding::identity());
+
+        void free(ArenaRange *range);
+
+        void set_decoding(ArenaRange *range, const VertexDecoding &decoding);
+
+        /**
+         * The uniform buffer with the decodings and the offset of the one of `range` in it.
+         */
+        GLuint decoding_buffer() const { return decoding_buffer_; }
+
+        GLintptr decoding_offset(const ArenaRange &range) const { return GLintptr(range.decoding * decoding_stride_); }
+
+        GLuint vertex_array(const ArenaRange &range) const { return pools_[range.pool]->vertex_array; }
+
+        GLuint vertex_buffer(const ArenaRange &range) const { return pools_[range.pool]->vertex_buffer; }
+
+        GLuint index_buffer(const ArenaRange &range) const { return pools_[range.pool]->index_buffer; }
+
+        GLsizei stride(const ArenaRange &range) const { return pools_[range.pool]->stride; }
+
+        /**
+         * Moves the ranges of every pool to the start of new buffers, largest first, and frees the old ones.
+         */
+        void defragment();
+
+        BufferArenaStats stats() const;
+
+        /**
+         * Logs the stats at the info level. Not called by the loaders, call it when the numbers are wanted.
+         */
+        void log_stats() const;
+
+        static constexpr size_t MAX_BUFFER_SIZE = size_t(1) << 30;
+
+    private:
+        struct Pool {
+            std::vector<VertexAttribute> attributes;
+            GLsizei stride;
+            GLuint vertex_array = 0;
+            GLuint vertex_buffer = 0;
+            GLuint index_buffer = 0;
+            // In vertices and in bytes.
+            BuddyAllocator vertices;
+            BuddyAllocator indices;
+
+            Pool(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride);
+        };
+
+        size_t find_pool(const VertexAttribute *attributes, size_t n_attributes, GLsizei stride);
+
+        /**
+         * Points the vertex array of the pool at its current buffers.
+         */
+        void setup_vertex_array(Pool &pool);
+
+        /**
+         * Allocates with `allocator` growing it, and the buffer, until the block fits or the buffer would exceed
+         * MAX_BUFFER_SIZE bytes.
+         */
+        size_t allocate(Pool &pool, BuddyAllocator &allocator, GLuint *buffer, size_t unit, size_t size);
+
+        static void resize_buffer(GLuint *buffer, size_t old_size, size_t copy_size, size_t new_size);
+
+        /**
+         * Returns the entry of `decoding` in the table, adding it if no range uses it yet.
+         */
+        size_t acquire_decoding(const VertexDecoding &decoding);
+
+        void release_decoding(size_t entry);
+
+        std::vector<std::unique_ptr<Pool>> pools_;
+        std::vector<std::unique_ptr<ArenaRange>> ranges_;
+        size_t grows_ = 0;
+        size_t defragmentations_ = 0;
+
+        // Entries used by no range are reused first.
+        std::vector<VertexDecoding> decodings_;
+        std::vector<size_t> decoding_refs_;
+        GLuint decoding_buffer_ = 0;
+        // In bytes and in entries.
+        size_t decoding_stride_ = 0;
+        size_t decoding_capacity_ = 0;
+    };
+
+}
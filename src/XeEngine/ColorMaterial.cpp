@@ -5,38 +5,59 @@
 #include "ColorMaterial.h"
 
 #include "Application/utils.h"
+#include "XeEngine/GLState.h"
+#include "XeEngine/utils.h"
 
 #include "spdlog/spdlog.h"
 
-#include "3rdParty/stb/stb_image.h"
+#include "XeEngine/ImageDecoder.h"
+#include "XeEngine/TextureUploader.h"
 
 namespace xe {
 
     GLuint ColorMaterial::shader_ = 0u;
     GLuint ColorMaterial::color_uniform_buffer_ = 0u;
     GLint  ColorMaterial::uniform_map_Kd_location_ = 0;
+    GLuint ColorMaterial::instanced_shader_ = 0u;
+    GLint  ColorMaterial::uniform_instanced_map_Kd_location_ = 0;
+    GLuint ColorMaterial::indirect_shader_ = 0u;
+    GLint  ColorMaterial::uniform_indirect_map_Kd_location_ = 0;
 
     void ColorMaterial::bind() {
-        glUseProgram(program());
+        bind_program(shader_, uniform_map_Kd_location_);
+    }
+
+    void ColorMaterial::bind_instanced() {
+        bind_program(instanced_shader_, uniform_instanced_map_Kd_location_);
+    }
+
+    void ColorMaterial::bind_program(GLuint program, GLint map_Kd_location) {
+        auto &state = GLState::current();
+        state.use_program(program);
         int use_map_Kd = 0;
         if (texture_ > 0) {
-            OGL_CALL(glUniform1i(uniform_map_Kd_location_, texture_unit_));
-            OGL_CALL(glActiveTexture(GL_TEXTURE0 + texture_unit_));
-            OGL_CALL(glBindTexture(GL_TEXTURE_2D, texture_));
+            OGL_CALL(glUniform1i(map_Kd_location, texture_unit_));
+            state.bind_texture(texture_unit_, GL_TEXTURE_2D, texture_);
             use_map_Kd = 1;
         }
-        OGL_CALL(glBindBufferBase(GL_UNIFORM_BUFFER, 0, color_uniform_buffer_));
-
-        glBindBuffer(GL_UNIFORM_BUFFER, color_uniform_buffer_);
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 0, color_uniform_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, color_uniform_buffer_);
         glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::vec4), &Kd_[0]);
         glBufferSubData(GL_UNIFORM_BUFFER, 4 * sizeof(float), sizeof(GLint), &use_map_Kd);
-        OGL_CALL(glBindBuffer(GL_UNIFORM_BUFFER, 0u));
+    }
 
+    void ColorMaterial::bind_indirect() {
+        auto &state = GLState::current();
+        state.use_program(indirect_shader_);
+        if (texture_ > 0) {
+            OGL_CALL(glUniform1i(uniform_indirect_map_Kd_location_, texture_unit_));
+            state.bind_texture(texture_unit_, GL_TEXTURE_2D, texture_);
+        }
     }
 
-    void ColorMaterial::unbind() {
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-        glBindTexture(GL_TEXTURE_2D, 0u);
+    void ColorMaterial::indirect_parameters(IndirectMaterialBlock *block) const {
+        block->Kd = Kd_;
+        block->use_map_Kd = texture_ > 0 ? 1 : 0;
     }
 
     void ColorMaterial::init() {
@@ -54,9 +75,8 @@ namespace xe {
 
         glGenBuffers(1, &color_uniform_buffer_);
 
-        glBindBuffer(GL_UNIFORM_BUFFER, color_uniform_buffer_);
+        GLState::current().bind_buffer(GL_UNIFORM_BUFFER, color_uniform_buffer_);
         glBufferData(GL_UNIFORM_BUFFER, sizeof(glm::vec4) + sizeof(GLint), nullptr, GL_STATIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
 #if __APPLE__
         auto u_modifiers_index = glGetUniformBlockIndex(shader_, "Color");
         if (u_modifiers_index == -1) {
@@ -75,41 +95,55 @@ namespace xe {
         }
 #endif
 
+#if __APPLE__
+        auto u_decoding_index = glGetUniformBlockIndex(shader_, "VertexDecoding");
+        if (u_decoding_index == -1) {
+            spdlog::warn("Cannot find  {} uniform block in program", "VertexDecoding");
+        } else {
+            glUniformBlockBinding(program, u_decoding_index, 4);
+        }
+#endif
+
 
         uniform_map_Kd_location_ = glGetUniformLocation(shader_, "map_Kd");
         if (uniform_map_Kd_location_ == -1) {
             spdlog::warn("Cannot get uniform {} location", "map_Kd");
         }
 
+        // Without it every node is drawn on its own.
+        instanced_shader_ = xe::utils::create_program(
+                {{GL_VERTEX_SHADER,   std::string(PROJECT_DIR) + "/shaders/color_instanced_vs.glsl"},
+                 {GL_FRAGMENT_SHADER, std::string(PROJECT_DIR) + "/shaders/color_fs.glsl"}});
+        if (!instanced_shader_) {
+            spdlog::warn("Invalid instanced color program, drawing without instancing");
+        } else {
+#if __APPLE__
+            uniform_block_binding(instanced_shader_, "Color", 0);
+            uniform_block_binding(instanced_shader_, "VertexDecoding", 4);
+#endif
+            uniform_instanced_map_Kd_location_ = glGetUniformLocation(instanced_shader_, "map_Kd");
+        }
+
+#if !__APPLE__
+        // Without it the draws just go through `bind`.
+        indirect_shader_ = xe::utils::create_program(
+                {{GL_VERTEX_SHADER,   std::string(PROJECT_DIR) + "/shaders/color_indirect_vs.glsl"},
+                 {GL_FRAGMENT_SHADER, std::string(PROJECT_DIR) + "/shaders/color_indirect_fs.glsl"}});
+        if (!indirect_shader_) {
+            spdlog::warn("Invalid indirect color program, drawing without glMultiDrawElementsIndirect");
+        } else {
+            uniform_indirect_map_Kd_location_ = glGetUniformLocation(indirect_shader_, "map_Kd");
+        }
+#endif
     }
 
 
     GLuint create_texture(const std::string &name) {
-
-        stbi_set_flip_vertically_on_load(true);
-        GLint width, height, channels;
-        auto img = stbi_load(name.c_str(), &width, &height, &channels, 0);
-        if (!img) {
-            spdlog::warn("Could not read image from file `{}'", name);
+        Image image;
+        if (!load_image(name, &image, ImageLoadOptions{}))
             return 0;
-        }
-        GLenum format;
-        if (channels == 3)
-            format = GL_RGB;
-        else if (channels == 4) {
-            format = GL_RGBA;
-        }
-
-        GLuint texture;
-        glGenTextures(1, &texture);
-        glBindTexture(GL_TEXTURE_2D, texture);
-
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, format, GL_UNSIGNED_BYTE, img);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        glBindTexture(GL_TEXTURE_2D, 0u);
-
-        return texture;
+        // A single upload does not pay for the pixel buffers.
+        TextureUploader uploader(0, 0);
+        return uploader.upload(image);
     }
 }
\ No newline at end of file
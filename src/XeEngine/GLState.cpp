@@ -0,0 +1,290 @@
+#include "GLState.h"
+
+#include "spdlog/spdlog.h"
+
+namespace xe {
+
+    GLState &GLState::current() {
+        static GLState state;
+        return state;
+    }
+
+    GLState::GLState() {
+        invalidate();
+    }
+
+    int GLState::buffer_slot(GLenum target) {
+        switch (target) {
+            case GL_ARRAY_BUFFER:
+                return 0;
+            case GL_UNIFORM_BUFFER:
+                return 1;
+            case GL_PIXEL_PACK_BUFFER:
+                return 2;
+            case GL_PIXEL_UNPACK_BUFFER:
+                return 3;
+            case GL_COPY_READ_BUFFER:
+                return 4;
+            case GL_COPY_WRITE_BUFFER:
+                return 5;
+            case GL_DRAW_INDIRECT_BUFFER:
+                return 6;
+#if !__APPLE__
+            case GL_SHADER_STORAGE_BUFFER:
+                return 7;
+#endif
+            default:
+                return -1;
+        }
+    }
+
+    int GLState::texture_slot(GLenum target) {
+        switch (target) {
+            case GL_TEXTURE_2D:
+                return 0;
+            case GL_TEXTURE_2D_ARRAY:
+                return 1;
+            case GL_TEXTURE_CUBE_MAP:
+                return 2;
+            case GL_TEXTURE_3D:
+                return 3;
+            default:
+                return -1;
+        }
+    }
+
+    int GLState::capability_slot(GLenum capability) {
+        switch (capability) {
+            case GL_CULL_FACE:
+                return 0;
+            case GL_DEPTH_TEST:
+                return 1;
+            case GL_BLEND:
+                return 2;
+            case GL_SCISSOR_TEST:
+                return 3;
+            case GL_STENCIL_TEST:
+                return 4;
+            case GL_POLYGON_OFFSET_FILL:
+                return 5;
+            default:
+                return -1;
+        }
+    }
+
+    void GLState::use_program(GLuint program) {
+        if (changed(&program_, program))
+            glUseProgram(program);
+    }
+
+    void GLState::bind_vertex_array(GLuint vertex_array) {
+        if (changed(&vertex_array_, vertex_array))
+            glBindVertexArray(vertex_array);
+    }
+
+    void GLState::bind_buffer(GLenum target, GLuint buffer) {
+        if (target == GL_ELEMENT_ARRAY_BUFFER) {
+            if (vertex_array_ == UNKNOWN) {
+                counters_.issued++;
+                glBindBuffer(target, buffer);
+                return;
+            }
+            auto it = element_buffers_.try_emplace(vertex_array_, UNKNOWN).first;
+            if (changed(&it->second, buffer))
+                glBindBuffer(target, buffer);
+            return;
+        }
+        auto slot = buffer_slot(target);
+        if (slot < 0) {
+            counters_.issued++;
+            glBindBuffer(target, buffer);
+            return;
+        }
+        if (changed(&buffers_[slot], buffer))
+            glBindBuffer(target, buffer);
+    }
+
+    GLState::IndexedBinding *GLState::indexed_binding(GLenum target, GLuint index) {
+        if (index >= MAX_BUFFER_INDICES)
+            return nullptr;
+        if (target == GL_UNIFORM_BUFFER)
+            return &uniform_bindings_[index];
+#if !__APPLE__
+        if (target == GL_SHADER_STORAGE_BUFFER)
+            return &storage_bindings_[index];
+#endif
+        return nullptr;
+    }
+
+    void GLState::bind_indexed(GLenum target, GLuint index, const IndexedBinding &binding) {
+        auto shadow = indexed_binding(target, index);
+        if (shadow != nullptr && *shadow == binding) {
+            counters_.skipped++;
+            return;
+        }
+        if (shadow != nullptr)
+            *shadow = binding;
+        counters_.issued++;
+        if (binding.size == 0)
+            glBindBufferBase(target, index, binding.buffer);
+        else
+            glBindBufferRange(target, index, binding.buffer, binding.offset, binding.size);
+        auto slot = buffer_slot(target);
+        if (slot >= 0)
+            buffers_[slot] = binding.buffer;
+    }
+
+    void GLState::bind_buffer_base(GLenum target, GLuint index, GLuint buffer) {
+        bind_indexed(target, index, {buffer, 0, 0});
+    }
+
+    void GLState::bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+        bind_indexed(target, index, {buffer, offset, size});
+    }
+
+    void GLState::active_texture(GLuint unit) {
+        if (changed(&active_texture_, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    void GLState::bind_texture(GLuint unit, GLenum target, GLuint texture) {
+        auto slot = texture_slot(target);
+        if (slot >= 0 && unit < MAX_TEXTURE_UNITS && textures_[unit][slot] == texture) {
+            counters_.skipped++;
+            return;
+        }
+        active_texture(unit);
+        bind_texture(target, texture);
+    }
+
+    void GLState::bind_texture(GLenum target, GLuint texture) {
+        auto slot = texture_slot(target);
+        if (slot < 0 || active_texture_ >= MAX_TEXTURE_UNITS) {
+            counters_.issued++;
+            glBindTexture(target, texture);
+            return;
+        }
+        if (changed(&textures_[active_texture_][slot], texture))
+            glBindTexture(target, texture);
+    }
+
+    void GLState::bind_framebuffer(GLenum target, GLuint framebuffer) {
+        if (target == GL_FRAMEBUFFER) {
+            if (draw_framebuffer_ == framebuffer && read_framebuffer_ == framebuffer) {
+                counters_.skipped++;
+                return;
+            }
+            draw_framebuffer_ = read_framebuffer_ = framebuffer;
+            counters_.issued++;
+            glBindFramebuffer(target, framebuffer);
+            return;
+        }
+        auto shadow = target == GL_DRAW_FRAMEBUFFER ? &draw_framebuffer_ : &read_framebuffer_;
+        if (changed(shadow, framebuffer))
+            glBindFramebuffer(target, framebuffer);
+    }
+
+    void GLState::set_enabled(GLenum capability, bool enabled) {
+        auto slot = capability_slot(capability);
+        if (slot < 0)
+            counters_.issued++;
+        else if (!changed(&capabilities_[slot], enabled ? 1u : 0u))
+            return;
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    void GLState::front_face(GLenum mode) {
+        if (changed(&front_face_, mode))
+            glFrontFace(mode);
+    }
+
+    void GLState::color_mask(bool enabled) {
+        if (changed(&color_mask_, enabled ? 1u : 0u)) {
+            auto flag = enabled ? GL_TRUE : GL_FALSE;
+            glColorMask(flag, flag, flag, flag);
+        }
+    }
+
+    void GLState::delete_buffers(GLsizei n, const GLuint *buffers) {
+        glDeleteBuffers(n, buffers);
+        for (GLsizei i = 0; i < n; i++) {
+            auto buffer = buffers[i];
+            if (buffer == 0)
+                continue;
+            for (auto &&b: buffers_)
+                if (b == buffer)
+                    b = UNKNOWN;
+            for (auto &&b: uniform_bindings_)
+                if (b.buffer == buffer)
+                    b.buffer = UNKNOWN;
+            for (auto &&b: storage_bindings_)
+                if (b.buffer == buffer)
+                    b.buffer = UNKNOWN;
+            for (auto &&[vao, b]: element_buffers_)
+                if (b == buffer)
+                    b = UNKNOWN;
+        }
+    }
+
+    void GLState::delete_textures(GLsizei n, const GLuint *textures) {
+        glDeleteTextures(n, textures);
+        for (GLsizei i = 0; i < n; i++) {
+            if (textures[i] == 0)
+                continue;
+            for (auto &&unit: textures_)
+                for (auto &&t: unit)
+                    if (t == textures[i])
+                        t = UNKNOWN;
+        }
+    }
+
+    void GLState::delete_framebuffers(GLsizei n, const GLuint *framebuffers) {
+        glDeleteFramebuffers(n, framebuffers);
+        for (GLsizei i = 0; i < n; i++) {
+            if (framebuffers[i] == 0)
+                continue;
+            if (draw_framebuffer_ == framebuffers[i])
+                draw_framebuffer_ = UNKNOWN;
+            if (read_framebuffer_ == framebuffers[i])
+                read_framebuffer_ = UNKNOWN;
+        }
+    }
+
+    void GLState::delete_vertex_arrays(GLsizei n, const GLuint *vertex_arrays) {
+        glDeleteVertexArrays(n, vertex_arrays);
+        for (GLsizei i = 0; i < n; i++) {
+            if (vertex_arrays[i] == 0)
+                continue;
+            if (vertex_array_ == vertex_arrays[i])
+                vertex_array_ = UNKNOWN;
+            element_buffers_.erase(vertex_arrays[i]);
+        }
+    }
+
+    void GLState::invalidate() {
+        program_ = UNKNOWN;
+        vertex_array_ = UNKNOWN;
+        element_buffers_.clear();
+        buffers_.fill(UNKNOWN);
+        uniform_bindings_.fill({UNKNOWN, 0, 0});
+        storage_bindings_.fill({UNKNOWN, 0, 0});
+        active_texture_ = UNKNOWN;
+        for (auto &&unit: textures_)
+            unit.fill(UNKNOWN);
+        draw_framebuffer_ = UNKNOWN;
+        read_framebuffer_ = UNKNOWN;
+        capabilities_.fill(UNKNOWN);
+        front_face_ = UNKNOWN;
+        color_mask_ = UNKNOWN;
+    }
+
+    void GLState::log_counters() const {
+        auto total = counters_.issued + counters_.skipped;
+        spdlog::info("GL state: {} calls issued, {} skipped ({:.1f}%)", counters_.issued, counters_.skipped,
+                     total > 0 ? 100.0 * double(counters_.skipped) / double(total) : 0.0);
+    }
+
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <unordered_map>
+
+#include "glad/gl.h"
+
+namespace xe {
+
+    struct GLStateCounters {
+        // Calls passed on to GL.
+        size_t issued = 0;
+        // Calls dropped because they would not change the state.
+        size_t skipped = 0;
+    };
+
+    /**
+     * Shadow copy of the GL binding state. The engine makes its binds through it and calls that would set what is
+     * already set never reach the driver, so e.g. consecutive submeshes sharing a material bind the program,
+     * buffers and textures once. Nothing is unbound after drawing any more.
+     *
+     * Values not known to the shadow (at start, after `invalidate` or after deleting a bound object) are always
+     * set. Code changing the state behind its back must call `invalidate`; Scene::draw does it at the beginning
+     * of every frame in case the application made its own GL calls.
+     *
+     * Element array buffers are vertex array state, they are remembered per vertex array.
+     *
+     * There is one shadow, for the single GL context of the engine, used only from the thread owning it.
+     */
+    class GLState {
+    public:
+        static GLState &current();
+
+        void use_program(GLuint program);
+
+        void bind_vertex_array(GLuint vertex_array);
+
+        void bind_buffer(GLenum target, GLuint buffer);
+
+        /**
+         * Indexed bindings, they set the generic binding of `target` too.
+         */
+        void bind_buffer_base(GLenum target, GLuint index, GLuint buffer);
+
+        void bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+        /**
+         * Texture unit index, i.e. without GL_TEXTURE0.
+         */
+        void active_texture(GLuint unit);
+
+        /**
+         * Binds the texture to the unit, switching the active unit only if the binding changes.
+         */
+        void bind_texture(GLuint unit, GLenum target, GLuint texture);
+
+        /**
+         * Binds the texture to the active unit.
+         */
+        void bind_texture(GLenum target, GLuint texture);
+
+        void bind_framebuffer(GLenum target, GLuint framebuffer);
+
+        /**
+         * glEnable or glDisable.
+         */
+        void set_enabled(GLenum capability, bool enabled);
+
+        void front_face(GLenum mode);
+
+        /**
+         * Writing of all the colour channels.
+         */
+        void color_mask(bool enabled);
+
+        /**
+         * Delete the objects and forget their bindings; GL unbinds deleted objects and reuses their names.
+         */
+        void delete_buffers(GLsizei n, const GLuint *buffers);
+
+        void delete_textures(GLsizei n, const GLuint *textures);
+
+        void delete_framebuffers(GLsizei n, const GLuint *framebuffers);
+
+        void delete_vertex_arrays(GLsizei n, const GLuint *vertex_arrays);
+
+        /**
+         * Forgets the whole state, the next call of every kind is issued.
+         */
+        void invalidate();
+
+        const GLStateCounters &counters() const { return counters_; }
+
+        void reset_counters() { counters_ = {}; }
+
+        void log_counters() const;
+
+    private:
+        static constexpr GLuint UNKNOWN = 0xffffffffu;
+        static constexpr int MAX_TEXTURE_UNITS = 32;
+        static constexpr int MAX_BUFFER_INDICES = 32;
+
+        // Size 0 is the whole buffer, bound with glBindBufferBase.
+        struct IndexedBinding {
+            GLuint buffer;
+            GLintptr offset;
+            GLsizeiptr size;
+
+            bool operator==(const IndexedBinding &other) const {
+                return buffer == other.buffer && offset == other.offset && size == other.size;
+            }
+        };
+
+        GLState();
+
+        bool changed(GLuint *shadow, GLuint value) {
+            if (*shadow == value) {
+                counters_.skipped++;
+                return false;
+            }
+            *shadow = value;
+            counters_.issued++;
+            return true;
+        }
+
+        IndexedBinding *indexed_binding(GLenum target, GLuint index);
+
+        void bind_indexed(GLenum target, GLuint index, const IndexedBinding &binding);
+
+        static int buffer_slot(GLenum target);
+
+        static int texture_slot(GLenum target);
+
+        static int capability_slot(GLenum capability);
+
+        GLuint program_;
+        GLuint vertex_array_;
+        std::unordered_map<GLuint, GLuint> element_buffers_;
+        std::array<GLuint, 8> buffers_;
+        std::array<IndexedBinding, MAX_BUFFER_INDICES> uniform_bindings_;
+        std::array<IndexedBinding, MAX_BUFFER_INDICES> storage_bindings_;
+        GLuint active_texture_;
+        std::array<std::array<GLuint, 4>, MAX_TEXTURE_UNITS> textures_;
+        GLuint draw_framebuffer_;
+        GLuint read_framebuffer_;
+        std::array<GLuint, 6> capabilities_;
+        GLuint front_face_;
+        GLuint color_mask_;
+
+        GLStateCounters counters_;
+    };
+
+}
@@ -0,0 +1,125 @@
+#include "ImageDecoder.h"
+
+#include "spdlog/spdlog.h"
+
+#include "3rdParty/stb/stb_image.h"
+
+#include "ObjectReader/mapped_file.h"
+#include "ObjectReader/parallel.h"
+#include "XeEngine/block_compression.h"
+#include "XeEngine/content_hash.h"
+#include "XeEngine/ktx2_cache.h"
+#include "XeEngine/mipmaps.h"
+
+namespace xe {
+
+    bool decode_image(const void *data, size_t size, Image *image, bool flip_vertically) {
+        // The thread local flag leaves the global one, and other threads decoding at the same time, alone.
+        stbi_set_flip_vertically_on_load_thread(flip_vertically ? 1 : 0);
+        auto pixels = stbi_load_from_memory(static_cast<const stbi_uc *>(data), static_cast<int>(size), &image->width,
+                                            &image->height, &image->channels, 0);
+        if (!pixels)
+            return false;
+        image->pixels = {pixels, stbi_image_free};
+        return true;
+    }
+
+    bool decode_image(const std::string &path, Image *image, bool flip_vertically) {
+        MappedFile file(path);
+        if (!file.is_open()) {
+            spdlog::warn("Could not read image from file `{}'", path);
+            return false;
+        }
+        image->hash = content_hash(file.data(), file.size());
+        if (!decode_image(file.data(), file.size(), image, flip_vertically)) {
+            spdlog::warn("Could not decode image from file `{}': {}", path, stbi_failure_reason());
+            return false;
+        }
+        return true;
+    }
+
+    bool load_image(const std::string &path, Image *image, const ImageLoadOptions &options) {
+        if (options.compress && options.use_cache && load_ktx2_cache(path, options.flip_vertically, image))
+            return true;
+        if (!decode_image(path, image, options.flip_vertically))
+            return false;
+        if (options.compress) {
+            if (compress_image(image, options.compress_threads)) {
+                if (options.use_cache)
+                    save_ktx2_cache(path, options.flip_vertically, *image);
+                return true;
+            }
+        }
+        if (options.mipmaps)
+            generate_mipmaps(image);
+        return true;
+    }
+
+    ImageDecoder::ImageDecoder(unsigned int n_threads, const ImageLoadOptions &options) : options_(options) {
+        n_threads = resolve_n_threads(n_threads);
+        workers_.reserve(n_threads);
+        for (unsigned int i = 0; i < n_threads; i++)
+            workers_.emplace_back(&ImageDecoder::work, this);
+    }
+
+    ImageDecoder::~ImageDecoder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        job_ready_.notify_all();
+        for (auto &&worker: workers_)
+            worker.join();
+    }
+
+    size_t ImageDecoder::submit(std::string path) {
+        size_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ticket = submitted_++;
+            jobs_.push_back({ticket, std::move(path)});
+        }
+        job_ready_.notify_one();
+        return ticket;
+    }
+
+    bool ImageDecoder::next(Result *result) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (returned_ == submitted_)
+            return false;
+        result_ready_.wait(lock, [this] { return !results_.empty(); });
+        *result = std::move(results_.front());
+        results_.pop_front();
+        returned_++;
+        return true;
+    }
+
+    size_t ImageDecoder::pending() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return submitted_ - returned_;
+    }
+
+    void ImageDecoder::work() {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                // Queued jobs are finished before stopping, the destructor waits for them.
+                job_ready_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+                if (jobs_.empty())
+                    return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+
+            Result result{job.ticket, std::move(job.path), false, Image{}};
+            result.ok = load_image(result.path, &result.image, options_);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                results_.push_back(std::move(result));
+            }
+            result_ready_.notify_one();
+        }
+    }
+
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "XeEngine/Texture.h"
+
+namespace xe {
+
+    /**
+     * Decoded 8 bit image. With the vertical flip (the default) the first row is the bottom one, as glTexImage2D
+     * expects it.
+     */
+    struct Image {
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        std::unique_ptr<unsigned char, void (*)(void *)> pixels{nullptr, nullptr};
+
+        // Mip levels present, level 0 are the `pixels` and the levels 1 and up follow each other in `mips`.
+        int levels = 1;
+        std::vector<unsigned char> mips;
+
+        // Block compressed images have no pixels, all their levels follow each other in `blocks`.
+        BlockFormat block_format = BlockFormat::None;
+        std::vector<unsigned char> blocks;
+
+        // Hash of the encoded file content.
+        uint64_t hash = 0;
+
+        bool compressed() const { return block_format != BlockFormat::None; }
+
+        size_t size() const { return size_t(width) * size_t(height) * size_t(channels); }
+
+        int level_width(int level) const { return std::max(1, width >> level); }
+
+        int level_height(int level) const { return std::max(1, height >> level); }
+
+        size_t level_size(int level) const {
+            if (compressed())
+                return size_t((level_width(level) + 3) / 4) * size_t((level_height(level) + 3) / 4) *
+                       block_bytes(block_format);
+            return size_t(level_width(level)) * size_t(level_height(level)) * size_t(channels);
+        }
+
+        const unsigned char *level_data(int level) const {
+            if (level == 0 && !compressed())
+                return pixels.get();
+            size_t offset = 0;
+            for (int l = compressed() ? 0 : 1; l < level; l++)
+                offset += level_size(l);
+            return (compressed() ? blocks.data() : mips.data()) + offset;
+        }
+    };
+
+    /**
+     * Decodes an encoded image held in memory, leaving `image->hash` unchanged. The vertical flip is set for this call
+     * only, so any number of threads can decode at the same time.
+     */
+    bool decode_image(const void *data, size_t size, Image *image, bool flip_vertically = true);
+
+    /**
+     * Reads, hashes and decodes the image file at `path` on the calling thread. Returns false if the file cannot be
+     * read or decoded.
+     */
+    bool decode_image(const std::string &path, Image *image, bool flip_vertically = true);
+
+    struct ImageLoadOptions {
+        bool flip_vertically = true;
+
+        /**
+         * Build the full mip chain, see generate_mipmaps.
+         */
+        bool mipmaps = false;
+
+        /**
+         * Block compress the full mip chain, see compress_image. With `use_cache` the blocks are read from the
+         * `.ktx2` cache next to the image when it is up to date and written to it otherwise, see load_ktx2_cache.
+         * The cache is off by default, as it writes next to the assets.
+         */
+        bool compress = false;
+        bool use_cache = false;
+
+        /**
+         * Threads compressing the blocks of one image, 0 means all.
+         */
+        unsigned int compress_threads = 0;
+    };
+
+    /**
+     * Decodes the image file and processes it as the options say. Returns false if the file cannot be read or
+     * decoded.
+     */
+    bool load_image(const std::string &path, Image *image, const ImageLoadOptions &options);
+
+    /**
+     * Loads images on a pool of worker threads. Images are handed back by `next` in the order they finish, so the
+     * caller (usually the thread owning the GL context) can upload every image as soon as it is ready.
+     */
+    class ImageDecoder {
+    public:
+        struct Result {
+            // Value returned by `submit` for this image.
+            size_t ticket;
+            std::string path;
+            bool ok;
+            Image image;
+        };
+
+        /**
+         * @param n_threads number of worker threads, 0 means std::thread::hardware_concurrency().
+         * @param options how the workers load every image, see load_image.
+         */
+        explicit ImageDecoder(unsigned int n_threads = 0, const ImageLoadOptions &options = {});
+
+        ImageDecoder(const ImageDecoder &) = delete;
+
+        ImageDecoder &operator=(const ImageDecoder &) = delete;
+
+        /**
+         * Waits for the workers to finish the submitted images.
+         */
+        ~ImageDecoder();
+
+        /**
+         * Queues the image for decoding and returns its ticket, tickets are numbered from 0 in submission order.
+         */
+        size_t submit(std::string path);
+
+        /**
+         * Waits for the next decoded image. Returns false when every submitted image was already returned.
+         */
+        bool next(Result *result);
+
+        /**
+         * Submitted images not returned by `next` yet.
+         */
+        size_t pending() const;
+
+    private:
+        struct Job {
+            size_t ticket;
+            std::string path;
+        };
+
+        void work();
+
+        ImageLoadOptions options_;
+        std::vector<std::thread> workers_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable job_ready_;
+        std::condition_variable result_ready_;
+        std::deque<Job> jobs_;
+        std::deque<Result> results_;
+        size_t submitted_ = 0;
+        size_t returned_ = 0;
+        bool stop_ = false;
+    };
+
+}
@@ -10,6 +10,15 @@
 
 namespace xe {
 
+    /**
+     * Entry of the material storage buffer (std430 `Material` at binding 5) read by the programs drawing with
+     * glMultiDrawElementsIndirect.
+     */
+    struct IndirectMaterialBlock {
+        glm::vec4 Kd;
+        GLint use_map_Kd;
+        GLint padding[3];
+    };
 
     class Material {
     public:
@@ -19,6 +28,38 @@ namespace xe {
 
         virtual void unbind() {};
 
+        /**
+         * Program and texture bound by `bind`, used by RenderQueue to group the draws sharing them.
+         */
+        virtual GLuint sort_program() const { return 0u; }
+
+        virtual GLuint sort_texture() const { return 0u; }
+
+        /**
+         * Transparent materials are drawn after the opaque ones, back to front and blended.
+         */
+        virtual bool transparent() const { return false; }
+
+        /**
+         * Whether RenderQueue can batch the draws of this material, sharing its program and texture, into one
+         * glMultiDrawElementsIndirect. The per draw parameters then come from `indirect_parameters` through the
+         * material storage buffer instead of `bind`, and `bind_indirect` binds the rest.
+         */
+        virtual bool indirect() const { return false; }
+
+        virtual void bind_indirect() {}
+
+        virtual void indirect_parameters(IndirectMaterialBlock *block) const {}
+
+        /**
+         * Whether RenderQueue can draw the nodes sharing a mesh and this material with one instanced draw per
+         * submesh. `bind_instanced` binds the same parameters as `bind` with a program reading the node matrices
+         * from the instance attributes, see Mesh::draw_instanced.
+         */
+        virtual bool instanced() const { return false; }
+
+        virtual void bind_instanced() {}
+
 
     protected:
 
@@ -2,100 +2,411 @@
 // Created by Piotr Białas on 12/11/2021.
 //
 
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 
 
 #include "Mesh.h"
 
+#include "BufferArena.h"
+#include "GLState.h"
 #include "Material.h"
+#include "mesh_indices.h"
 
+namespace {
+    /**
+     * Uniform buffer with VertexDecoding::identity() shared by all the meshes that do not need another, created on
+     * the first use. It goes with the context.
+     */
+    GLuint identity_decoding_buffer() {
+        static GLuint buffer = 0;
+        if (buffer == 0) {
+            auto identity = xe::VertexDecoding::identity();
+            glGenBuffers(1, &buffer);
+            xe::GLState::current().bind_buffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(xe::VertexDecoding), &identity, GL_STATIC_DRAW);
+        }
+        return buffer;
+    }
+}
 
-void xe::Mesh::draw() const {
-    glBindVertexArray(vao_);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
-    for (auto i = 0; i < submeshes_.size(); i++) {
-        auto sm = submeshes_[i];
-        auto mtl = materials_[i];
-        if (mtl != nullptr) {
-            mtl->bind();
+
+const xe::SubMesh &xe::Mesh::submesh(size_t lod, size_t i) const {
+    return lod == 0 ? submeshes_[i] : lods_[lod - 1].submeshes[i];
+}
+
+xe::Material *xe::Mesh::material(size_t lod, size_t i) const {
+    return lod == 0 ? materials_[i] : lods_[lod - 1].materials[i];
+}
+
+void xe::Mesh::frustum_planes(const glm::mat4 &PVM, glm::vec4 *planes) {
+    // Gribb & Hartmann, normalized so the sphere test is a distance check.
+    auto row = [&PVM](int i) { return glm::vec4(PVM[0][i], PVM[1][i], PVM[2][i], PVM[3][i]); };
+    for (int i = 0; i < 3; i++) {
+        planes[2 * i] = row(3) + row(i);
+        planes[2 * i + 1] = row(3) - row(i);
+    }
+    for (int i = 0; i < 6; i++)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+size_t xe::Mesh::visible_ranges(size_t lod, size_t i, const glm::vec4 *planes, const glm::vec3 &eye,
+                                std::vector<GLsizei> *counts, std::vector<const void *> *offsets) const {
+    auto &&sm = submesh(lod, i);
+    if (lod != 0 || planes == nullptr || clusters_.empty() || cluster_offsets_.size() != submeshes_.size() + 1) {
+        counts->push_back(GLsizei(sm.count()));
+        offsets->push_back(reinterpret_cast<const void *>(index_offset() + index_size_ * sm.start));
+        return 1;
+    }
+
+    auto n = counts->size();
+    auto index_offset = this->index_offset();
+    GLuint run_start = 0, run_end = 0;
+    for (auto c = cluster_offsets_[i]; c < cluster_offsets_[i + 1]; c++) {
+        auto &&cl = clusters_[c];
+        bool visible = true;
+        for (int p = 0; p < 6; p++) {
+            if (glm::dot(glm::vec3(planes[p]), cl.center) + planes[p].w < -cl.radius) {
+                visible = false;
+                break;
+            }
         }
-        if (sm.cull_face) {
-            glEnable(GL_CULL_FACE);
-        } else {
-            glDisable(GL_CULL_FACE);
+        if (visible && sm.cull_face) {
+            auto d = cl.center - eye;
+            visible = glm::dot(d, cl.cone_axis) < cl.cone_cutoff * glm::length(d) + cl.radius;
         }
-        glDrawElements(GL_TRIANGLES, sm.count(), GL_UNSIGNED_SHORT,
-                       reinterpret_cast<void *>(sizeof(GLushort) * sm.start));
-        if (mtl != nullptr) {
-            mtl->unbind();
+        if (!visible)
+            continue;
+        if (run_end != cl.start) {
+            if (run_end > run_start) {
+                counts->push_back(GLsizei(run_end - run_start));
+                offsets->push_back(reinterpret_cast<const void *>(index_offset + index_size_ * run_start));
+            }
+            run_start = cl.start;
+        }
+        run_end = cl.end;
+    }
+    if (run_end > run_start) {
+        counts->push_back(GLsizei(run_end - run_start));
+        offsets->push_back(reinterpret_cast<const void *>(index_offset + index_size_ * run_start));
+    }
+    return counts->size() - n;
+}
+
+void xe::Mesh::draw_ranges(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n) const {
+    if (n == 0)
+        return;
+    auto &&sm = submesh(lod, i);
+    // The element buffer is part of the vertex array state, bound with it.
+    auto &state = GLState::current();
+    bind_vertex_decoding();
+    state.bind_vertex_array(vertex_array());
+    state.set_enabled(GL_CULL_FACE, sm.cull_face);
+    auto base_vertex = first_vertex() + sm.base_vertex;
+    if (n > 1) {
+        base_vertices_.assign(n, base_vertex);
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts, index_type_, offsets, GLsizei(n), base_vertices_.data());
+    } else if (base_vertex != 0) {
+        glDrawElementsBaseVertex(GL_TRIANGLES, counts[0], index_type_, offsets[0], base_vertex);
+    } else {
+        glDrawElements(GL_TRIANGLES, counts[0], index_type_, offsets[0]);
+    }
+}
+
+void xe::Mesh::indirect_commands(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n,
+                                 std::vector<DrawElementsIndirectCommand> *commands) const {
+    auto &&sm = submesh(lod, i);
+    for (size_t r = 0; r < n; r++) {
+        auto first = GLuint(reinterpret_cast<uintptr_t>(offsets[r]) / index_size_);
+        commands->push_back({GLuint(counts[r]), 1u, first, first_vertex() + sm.base_vertex, 0u});
+    }
+}
+
+void xe::Mesh::draw_indirect(size_t lod, size_t i, GLintptr offset, GLsizei n) const {
+#if !__APPLE__
+    if (n == 0)
+        return;
+    auto &state = GLState::current();
+    state.bind_vertex_array(vertex_array());
+    state.set_enabled(GL_CULL_FACE, submesh(lod, i).cull_face);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, index_type_, reinterpret_cast<const void *>(offset), n, 0);
+#endif
+}
+
+void xe::Mesh::draw_instanced(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n,
+                              GLuint instance_buffer, GLintptr instance_offset, GLsizei n_instances) const {
+    if (n == 0 || n_instances == 0)
+        return;
+    auto &&sm = submesh(lod, i);
+    auto &state = GLState::current();
+    bind_vertex_decoding();
+    state.bind_vertex_array(vertex_array());
+    state.set_enabled(GL_CULL_FACE, sm.cull_face);
+
+    // The instance attributes stay in the vertex array, only their offset changes from draw to draw.
+    state.bind_buffer(GL_ARRAY_BUFFER, instance_buffer);
+    for (GLuint c = 0; c < 8; c++) {
+        auto index = InstanceTransforms::location + c;
+        if (!instance_attributes_) {
+            glEnableVertexAttribArray(index);
+            glVertexAttribDivisor(index, 1);
         }
+        glVertexAttribPointer(index, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceTransforms),
+                              reinterpret_cast<const void *>(instance_offset + GLintptr(c * sizeof(glm::vec4))));
     }
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0u);
-    glBindVertexArray(0u);
+    instance_attributes_ = true;
+
+    auto base_vertex = first_vertex() + sm.base_vertex;
+    for (size_t r = 0; r < n; r++) {
+        if (base_vertex != 0)
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, counts[r], index_type_, offsets[r], n_instances,
+                                              base_vertex);
+        else
+            glDrawElementsInstanced(GL_TRIANGLES, counts[r], index_type_, offsets[r], n_instances);
+    }
+}
+
+void xe::Mesh::draw_submeshes(size_t lod, const glm::vec4 *planes, const glm::vec3 &eye) const {
+    for (size_t i = 0; i < n_submeshes(lod); i++) {
+        counts_.clear();
+        offsets_.clear();
+        auto n = visible_ranges(lod, i, planes, eye, &counts_, &offsets_);
+        if (n == 0)
+            continue;
+        auto mtl = material(lod, i);
+        if (mtl != nullptr)
+            mtl->bind();
+        draw_ranges(lod, i, counts_.data(), offsets_.data(), n);
+        if (mtl != nullptr)
+            mtl->unbind();
+    }
+}
+
+void xe::Mesh::draw() const {
+    draw_submeshes(0, nullptr, glm::vec3(0.0f));
 }
 
-void xe::Mesh::vertex_attrib_pointer(GLuint index, GLuint size, GLenum type, GLsizei stride, GLsizeiptr offset) {
-    glBindVertexArray(vao_);
-    glBindBuffer(GL_ARRAY_BUFFER, v_buffer_);
+size_t xe::Mesh::select_lod(float screen_radius, float threshold) const {
+    size_t lod = 0;
+    for (size_t i = 0; i < lods_.size(); i++) {
+        if (lods_[i].error * screen_radius > threshold)
+            break;
+        lod = i + 1;
+    }
+    return lod;
+}
+
+void xe::Mesh::draw(const glm::mat4 &PVM, const glm::vec3 &eye, size_t lod) const {
+    if (lod == 0 || lod > lods_.size()) {
+        draw(PVM, eye);
+        return;
+    }
+    draw_submeshes(lod, nullptr, eye);
+}
+
+void xe::Mesh::set_clusters(std::vector<MeshCluster> clusters) {
+    clusters_ = std::move(clusters);
+    cluster_offsets_.assign(submeshes_.size() + 1, 0);
+    for (auto &&c: clusters_)
+        cluster_offsets_[c.submesh + 1]++;
+    for (size_t i = 0; i < submeshes_.size(); i++)
+        cluster_offsets_[i + 1] += cluster_offsets_[i];
+}
+
+void xe::Mesh::draw(const glm::mat4 &PVM, const glm::vec3 &eye) const {
+    glm::vec4 planes[6];
+    frustum_planes(PVM, planes);
+    draw_submeshes(0, planes, eye);
+}
+
+void xe::Mesh::vertex_attrib_pointer(GLuint index, GLuint size, GLenum type, GLsizei stride, GLsizeiptr offset,
+                                     GLboolean normalized) {
+    if (!own_buffers())
+        return;
+    auto &state = GLState::current();
+    state.bind_vertex_array(vao_);
+    state.bind_buffer(GL_ARRAY_BUFFER, v_buffer_);
     glEnableVertexAttribArray(index);
-    glVertexAttribPointer(index, size, type, GL_FALSE, stride, reinterpret_cast<void *>(offset));
-    glBindBuffer(GL_ARRAY_BUFFER, 0u);
-    glBindVertexArray(0u);
+    glVertexAttribPointer(index, size, type, normalized, stride, reinterpret_cast<void *>(offset));
 }
 
+void xe::Mesh::vertex_attrib_pointers(const VertexAttribute *attributes, size_t n, GLsizei stride) {
+    if (!own_buffers())
+        return;
+    auto &state = GLState::current();
+    state.bind_vertex_array(vao_);
+    state.bind_buffer(GL_ARRAY_BUFFER, v_buffer_);
+    for (size_t i = 0; i < n; i++) {
+        auto &&a = attributes[i];
+        glEnableVertexAttribArray(a.index);
+        glVertexAttribPointer(a.index, a.size, a.type, a.normalized, stride,
+                              reinterpret_cast<void *>(static_cast<uintptr_t>(a.offset)));
+    }
+}
+
+xe::Mesh::Mesh() : index_type_(GL_UNSIGNED_SHORT), index_size_(sizeof(GLushort)),
+                   decoding_(VertexDecoding::identity()), center_(0.0f), radius_(0.0f) {}
+
+xe::Mesh::~Mesh() {
+    if (arena_ != nullptr)
+        arena_->free(range_);
+    auto &state = GLState::current();
+    if (vao_ != 0)
+        state.delete_vertex_arrays(1, &vao_);
+    GLuint buffers[] = {v_buffer_, i_buffer_, u_decoding_buffer_};
+    state.delete_buffers(3, buffers);
+}
 
-xe::Mesh::Mesh() {
+bool xe::Mesh::own_buffers() {
+    if (range_ != nullptr)
+        return false;
+    if (vao_ != 0)
+        return true;
     glGenVertexArrays(1, &vao_);
     glGenBuffers(1, &v_buffer_);
     glGenBuffers(1, &i_buffer_);
-    glBindVertexArray(vao_);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
-    glBindVertexArray(0u);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0u);
+    auto &state = GLState::current();
+    state.bind_vertex_array(vao_);
+    state.bind_buffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
+    return true;
+}
+
+bool xe::Mesh::allocate_in_arena(BufferArena &arena, const VertexAttribute *attributes, size_t n_attributes,
+                                 GLsizei stride, size_t vertex_size, const void *vertices, size_t index_size,
+                                 const void *indices) {
+    auto range = arena.allocate(attributes, n_attributes, stride, vertex_size, vertices, index_size, indices,
+                                decoding_);
+    if (range == nullptr)
+        return false;
+    if (arena_ != nullptr)
+        arena_->free(range_);
+    arena_ = &arena;
+    range_ = range;
+    if (u_decoding_buffer_ != 0) {
+        GLState::current().delete_buffers(1, &u_decoding_buffer_);
+        u_decoding_buffer_ = 0;
+    }
+    return true;
+}
+
+bool xe::Mesh::shares_vertex_array(const Mesh &other) const {
+    return vertex_array() == other.vertex_array() && index_type_ == other.index_type_;
 }
 
-void xe::Mesh::allocate_index_buffer(size_t size, GLenum hint) {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0u);
+GLuint xe::Mesh::vertex_array() const {
+    return range_ != nullptr ? arena_->vertex_array(*range_) : vao_;
+}
+
+GLuint xe::Mesh::vertex_buffer() const {
+    return range_ != nullptr ? arena_->vertex_buffer(*range_) : v_buffer_;
+}
+
+GLint xe::Mesh::first_vertex() const {
+    return range_ != nullptr ? GLint(range_->first_vertex) : 0;
+}
+
+size_t xe::Mesh::index_offset() const {
+    return range_ != nullptr ? range_->index_offset : 0;
+}
+
+void xe::Mesh::set_vertex_decoding(const VertexDecoding &decoding) {
+    decoding_ = decoding;
+    if (range_ != nullptr) {
+        arena_->set_decoding(range_, decoding_);
+        return;
+    }
+    auto identity = VertexDecoding::identity();
+    if (u_decoding_buffer_ == 0 && std::memcmp(&decoding_, &identity, sizeof(VertexDecoding)) == 0)
+        return;
+    auto &state = GLState::current();
+    if (u_decoding_buffer_ == 0) {
+        glGenBuffers(1, &u_decoding_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, u_decoding_buffer_);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(VertexDecoding), &decoding_, GL_STATIC_DRAW);
+        return;
+    }
+    state.bind_buffer(GL_UNIFORM_BUFFER, u_decoding_buffer_);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(VertexDecoding), &decoding_);
+}
+
+void xe::Mesh::bind_vertex_decoding() const {
+    auto &state = GLState::current();
+    if (range_ != nullptr)
+        state.bind_buffer_range(GL_UNIFORM_BUFFER, 4, arena_->decoding_buffer(), arena_->decoding_offset(*range_),
+                                sizeof(VertexDecoding));
+    else
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 4,
+                               u_decoding_buffer_ != 0 ? u_decoding_buffer_ : identity_decoding_buffer());
+}
+
+void xe::Mesh::set_index_type(GLenum type) {
+    index_type_ = type;
+    index_size_ = index_type_size(type);
+}
+
+void xe::Mesh::bind_index_buffer() const {
+    // Binding an element buffer changes the bound vertex array, so bind ours, which already has it.
+    auto &state = GLState::current();
+    state.bind_vertex_array(vertex_array());
+    state.bind_buffer(GL_ELEMENT_ARRAY_BUFFER, range_ != nullptr ? arena_->index_buffer(*range_) : i_buffer_);
+}
+
+void xe::Mesh::allocate_index_buffer(size_t size, GLenum hint, const void *data) {
+    if (!own_buffers())
+        return;
+    bind_index_buffer();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
 }
 
 void xe::Mesh::load_indices(size_t offset, size_t size, const void *data) {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
-    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, data);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0u);
+    own_buffers();
+    bind_index_buffer();
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, GLintptr(index_offset() + offset), size, data);
 }
 
 
-void xe::Mesh::allocate_vertex_buffer(size_t size, GLenum hint) {
-    glBindBuffer(GL_ARRAY_BUFFER, v_buffer_);
-    glBufferData(GL_ARRAY_BUFFER, size, nullptr, hint);
-    glBindBuffer(GL_ARRAY_BUFFER, 0u);
+void xe::Mesh::allocate_vertex_buffer(size_t size, GLenum hint, const void *data) {
+    if (!own_buffers())
+        return;
+    GLState::current().bind_buffer(GL_ARRAY_BUFFER, v_buffer_);
+    glBufferData(GL_ARRAY_BUFFER, size, data, hint);
 }
 
 void xe::Mesh::
 load_vertices(size_t offset, size_t size, const void *data) {
-    glBindBuffer(GL_ARRAY_BUFFER, v_buffer_);
-    glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
-    glBindBuffer(GL_ARRAY_BUFFER, 0u);
+    own_buffers();
+    GLState::current().bind_buffer(GL_ARRAY_BUFFER, vertex_buffer());
+    auto base = range_ != nullptr ? range_->first_vertex * size_t(arena_->stride(*range_)) : 0;
+    glBufferSubData(GL_ARRAY_BUFFER, GLintptr(base + offset), size, data);
 }
 
 void *xe::Mesh::map_vertex_buffer() {
-    glBindBuffer(GL_ARRAY_BUFFER, v_buffer_);
+    own_buffers();
+    GLState::current().bind_buffer(GL_ARRAY_BUFFER, vertex_buffer());
+    if (range_ != nullptr) {
+        auto stride = size_t(arena_->stride(*range_));
+        return glMapBufferRange(GL_ARRAY_BUFFER, GLintptr(range_->first_vertex * stride),
+                                GLsizeiptr(range_->n_vertices * stride), GL_MAP_WRITE_BIT);
+    }
     return glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
 }
 
 void xe::Mesh::unmap_vertex_buffer() {
-    glBindBuffer(GL_ARRAY_BUFFER, v_buffer_);
+    GLState::current().bind_buffer(GL_ARRAY_BUFFER, vertex_buffer());
     glUnmapBuffer(GL_ARRAY_BUFFER);
 }
 
 void *xe::Mesh::map_index_buffer() {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
+    own_buffers();
+    bind_index_buffer();
+    if (range_ != nullptr)
+        return glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, GLintptr(range_->index_offset),
+                                GLsizeiptr(range_->index_size), GL_MAP_WRITE_BIT);
     return glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
 }
 
 void xe::Mesh::unmap_index_buffer() {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, i_buffer_);
+    bind_index_buffer();
     glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
 }
@@ -6,22 +6,93 @@
 
 #include <vector>
 #include "glad/gl.h"
+#include "glm/glm.hpp"
 
+#include "Geometry/bounding_box.h"
 
 namespace xe {
 
     class Material;
 
+    class BufferArena;
+
+    struct ArenaRange;
+
     struct SubMesh {
-        SubMesh(GLuint start, GLuint end, bool cull_face = false) : start(start), end(end), cull_face(cull_face) {}
+        SubMesh(GLuint start, GLuint end, bool cull_face = false, GLint base_vertex = 0) : start(start), end(end),
+                                                                                           cull_face(cull_face),
+                                                                                           base_vertex(base_vertex) {}
 
         GLuint start;
         GLuint end;
         bool cull_face;
+        GLint base_vertex;
 
         GLuint count() const { return end - start; }
     };
 
+    /**
+     * Layout of the commands read by glMultiDrawElementsIndirect from GL_DRAW_INDIRECT_BUFFER.
+     */
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    /**
+     * Parameters of one glVertexAttribPointer call, `offset` is in bytes from the start of the vertex.
+     */
+    struct VertexAttribute {
+        GLuint index;
+        GLint size;
+        GLenum type;
+        GLboolean normalized;
+        GLuint offset;
+    };
+
+    /**
+     * Cluster of consecutive indices of one submesh with its bounds, used to cull parts of the mesh.
+     * `start` and `end` are counted in indices, `submesh` is the index of the submesh in the Mesh. The cluster is
+     * back-facing as a whole when `dot(center - eye, cone_axis) >= cone_cutoff * length(center - eye) + radius`.
+     */
+    struct MeshCluster {
+        GLuint start;
+        GLuint end;
+        GLint submesh;
+        glm::vec3 center;
+        float radius;
+        glm::vec3 cone_axis;
+        float cone_cutoff;
+    };
+
+    /**
+     * How the vertex shader decodes the attributes of a mesh, see xe::VertexEncoding. Uploaded as the std140 uniform
+     * block `VertexDecoding` at binding 4: the position is `position_offset + position_scale * a_vertex_position` and
+     * with `normal_encoding` equal to 1 the normal is stored octahedrally in its x and y components.
+     */
+    struct VertexDecoding {
+        glm::vec4 position_scale;
+        glm::vec4 position_offset;
+        GLint normal_encoding;
+        GLint padding[3];
+
+        static VertexDecoding identity() { return {glm::vec4(1.0f), glm::vec4(0.0f), 0, {0, 0, 0}}; }
+    };
+
+    /**
+     * Per instance attributes read by the instanced programs: the PVM matrix at locations 7 to 10 and VM at 11 to 14,
+     * one column per location, see Mesh::draw_instanced.
+     */
+    struct InstanceTransforms {
+        glm::mat4 PVM;
+        glm::mat4 VM;
+
+        static constexpr GLuint location = 7;
+    };
+
     class Mesh {
     public:
 
@@ -32,22 +103,72 @@ namespace xe {
 
         Mesh();
 
-        void allocate_vertex_buffer(size_t size, GLenum hint);
+        Mesh(const Mesh &) = delete;
+
+        Mesh &operator=(const Mesh &) = delete;
 
-        void allocate_index_buffer(size_t size, GLenum hint);
+        ~Mesh();
+
+        /**
+         * Puts the vertices in the format of `attributes` and `stride` and the indices in ranges of the buffers of
+         * `arena` shared with other meshes instead of buffers of its own, and draws with the vertex array of the
+         * format, see BufferArena. Returns false if they do not fit. The other allocate_ and vertex_attrib_ functions
+         * are not used then, load_ and map_ write to the ranges.
+         */
+        bool allocate_in_arena(BufferArena &arena, const VertexAttribute *attributes, size_t n_attributes,
+                               GLsizei stride, size_t vertex_size, const void *vertices, size_t index_size,
+                               const void *indices);
+
+        bool in_arena() const { return range_ != nullptr; }
+
+        /**
+         * Whether the draws of both meshes can go in one glMultiDrawElementsIndirect: they are in the same pool of a
+         * BufferArena, with the same index type. Their decodings may differ, the indirect programs read the decoding
+         * of every command, see RenderQueue.
+         */
+        bool shares_vertex_array(const Mesh &other) const;
+
+        /**
+         * Allocates the buffer and, if `data` is not null, fills it in the same glBufferData call.
+         */
+        void allocate_vertex_buffer(size_t size, GLenum hint, const void *data = nullptr);
+
+        void allocate_index_buffer(size_t size, GLenum hint, const void *data = nullptr);
 
         void load_vertices(size_t offset, size_t size, const void *data);
 
         void load_indices(size_t offset, size_t size, const void *data);
 
-        void vertex_attrib_pointer(GLuint index, GLuint size, GLenum type, GLsizei stride, GLsizeiptr offset);
+        void vertex_attrib_pointer(GLuint index, GLuint size, GLenum type, GLsizei stride, GLsizeiptr offset,
+                                   GLboolean normalized = GL_FALSE);
 
-        void add_submesh(GLuint start, GLuint end, Material *mtl = nullptr, bool cull_face = false) {
-            submeshes_.push_back({start, end, cull_face});
+        /**
+         * Sets up all the attributes of an interleaved vertex buffer, binding the vertex array only once.
+         */
+        void vertex_attrib_pointers(const VertexAttribute *attributes, size_t n, GLsizei stride);
+
+        /**
+         * Meshes in a BufferArena keep the decoding in the arena table. Of the others, meshes with the identity
+         * decoding share one uniform buffer and the rest get one of their own, deleted with the mesh.
+         */
+        void set_vertex_decoding(const VertexDecoding &decoding);
+
+        const VertexDecoding &vertex_decoding() const { return decoding_; }
+
+        void add_submesh(GLuint start, GLuint end, Material *mtl = nullptr, bool cull_face = false,
+                         GLint base_vertex = 0) {
+            submeshes_.push_back({start, end, cull_face, base_vertex});
             materials_.push_back(mtl);
 
         }
 
+        /**
+         * Type of the indices in the index buffer: GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT (default) or GL_UNSIGNED_INT.
+         */
+        void set_index_type(GLenum type);
+
+        GLenum index_type() const { return index_type_; }
+
         void *map_vertex_buffer();
 
         void unmap_vertex_buffer();
@@ -58,17 +179,188 @@ namespace xe {
         void unmap_index_buffer();
 
 
+        /**
+         * Clusters must be sorted by submesh and by start within the submesh.
+         */
+        void set_clusters(std::vector<MeshCluster> clusters);
+
+        size_t n_clusters() const { return clusters_.size(); }
+
         void draw() const;
 
+        /**
+         * Draws only the clusters that intersect the view frustum of `PVM` and, for submeshes with face culling
+         * enabled, are not back-facing as seen from `eye` (camera position in model coordinates). Neighbouring visible
+         * clusters are merged into one draw, the draws of a submesh are issued with one glMultiDrawElementsBaseVertex.
+         * Without clusters this is the same as draw().
+         */
+        void draw(const glm::mat4 &PVM, const glm::vec3 &eye) const;
+
+        /**
+         * Adds a coarser level of detail drawn from the same vertex buffer and returns its number (level 0 is the
+         * full resolution mesh). `error` is the simplification error relative to the bounding sphere radius.
+         * Levels must be added from the finest to the coarsest.
+         */
+        size_t add_lod(float error) {
+            lods_.push_back({error, {}, {}});
+            return lods_.size();
+        }
+
+        void add_lod_submesh(size_t lod, GLuint start, GLuint end, Material *mtl = nullptr, bool cull_face = false,
+                             GLint base_vertex = 0) {
+            lods_[lod - 1].submeshes.push_back({start, end, cull_face, base_vertex});
+            lods_[lod - 1].materials.push_back(mtl);
+        }
+
+        size_t n_lods() const { return lods_.size() + 1; }
+
+        /**
+         * The coarsest level whose error, projected on the screen, stays below `threshold`. `screen_radius` is the
+         * radius of the bounding sphere projected on the screen and both are in normalized device coordinates.
+         */
+        size_t select_lod(float screen_radius, float threshold) const;
+
+        /**
+         * Draws the given level of detail. Clusters are only culled at level 0.
+         */
+        void draw(const glm::mat4 &PVM, const glm::vec3 &eye, size_t lod) const;
+
+        void set_bounding_sphere(const glm::vec3 &center, float radius) {
+            center_ = center;
+            radius_ = radius;
+        }
+
+        /**
+         * Sets the bounding box in model coordinates and the bounding sphere around it.
+         */
+        void set_bounding_box(const BoundingBox<3> &bb) {
+            bb_ = bb;
+            auto sphere = bb.sphere();
+            set_bounding_sphere(sphere.center, sphere.radius);
+        }
+
+        const BoundingBox<3> &bounding_box() const { return bb_; }
+
+        /**
+         * Bounding boxes of the submeshes, in the order they were added.
+         */
+        void set_submesh_bounding_boxes(std::vector<BoundingBox<3>> boxes) { submesh_bb_ = std::move(boxes); }
+
+        size_t n_submeshes() const { return submeshes_.size(); }
+
+        size_t n_submeshes(size_t lod) const { return lod == 0 ? submeshes_.size() : lods_[lod - 1].submeshes.size(); }
+
+        const SubMesh &submesh(size_t lod, size_t i) const;
+
+        Material *material(size_t lod, size_t i) const;
+
+        /**
+         * The six planes of the view frustum of `PVM` in model coordinates, normalized, pointing inside.
+         */
+        static void frustum_planes(const glm::mat4 &PVM, glm::vec4 *planes);
+
+        /**
+         * Appends to `counts` and `offsets` the index ranges of submesh `i` of level `lod` left after culling its
+         * clusters against `planes` and `eye`, as in draw(PVM, eye), and returns how many were appended. Without
+         * clusters, at levels other than 0 or with null `planes` that is the whole submesh.
+         */
+        size_t visible_ranges(size_t lod, size_t i, const glm::vec4 *planes, const glm::vec3 &eye,
+                              std::vector<GLsizei> *counts, std::vector<const void *> *offsets) const;
+
+        /**
+         * Draws index ranges of submesh `i` of level `lod` without binding its material, which is up to the
+         * caller, see RenderQueue.
+         */
+        void draw_ranges(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n) const;
+
+        /**
+         * Appends the commands drawing the index ranges of submesh `i` of level `lod`, one instance each.
+         */
+        void indirect_commands(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n,
+                               std::vector<DrawElementsIndirectCommand> *commands) const;
+
+        /**
+         * Draws `n` commands of the bound GL_DRAW_INDIRECT_BUFFER starting at byte `offset`, with the face culling of
+         * submesh `i` of level `lod`. The vertex decoding is not bound, the program reads the decoding of every
+         * command from the storage buffer at binding 7. Not available with GL 4.1.
+         */
+        void draw_indirect(size_t lod, size_t i, GLintptr offset, GLsizei n) const;
+
+        /**
+         * Draws index ranges of submesh `i` of level `lod` `n_instances` times, the transforms of the instances are
+         * read from `instance_buffer` starting at byte `instance_offset`, as consecutive InstanceTransforms.
+         */
+        void draw_instanced(size_t lod, size_t i, const GLsizei *counts, const void *const *offsets, size_t n,
+                            GLuint instance_buffer, GLintptr instance_offset, GLsizei n_instances) const;
+
+        const BoundingBox<3> &submesh_bounding_box(size_t i) const { return submesh_bb_.at(i); }
+
+        glm::vec3 center() const { return center_; }
+
+        float radius() const { return radius_; }
+
     private:
+        struct Lod {
+            float error;
+            std::vector<SubMesh> submeshes;
+            std::vector<Material *> materials;
+        };
+
+        /**
+         * Creates the vertex array and the buffers of a mesh not in a BufferArena on the first use, false for meshes
+         * in one.
+         */
+        bool own_buffers();
+
+        void bind_index_buffer() const;
+
+        GLuint vertex_array() const;
 
-        GLuint vao_;
-        GLuint v_buffer_;
-        GLuint i_buffer_;
+        GLuint vertex_buffer() const;
+
+        // Of the range in the arena, in vertices and bytes, 0 for the own buffers.
+        GLint first_vertex() const;
+
+        size_t index_offset() const;
+
+        void bind_vertex_decoding() const;
+
+        /**
+         * Draws the visible ranges of every submesh of the level, each with its material; no culling if `planes` is
+         * null.
+         */
+        void draw_submeshes(size_t lod, const glm::vec4 *planes, const glm::vec3 &eye) const;
+
+        GLuint vao_ = 0;
+        GLuint v_buffer_ = 0;
+        GLuint i_buffer_ = 0;
+        BufferArena *arena_ = nullptr;
+        ArenaRange *range_ = nullptr;
+        GLenum index_type_;
+        GLsizeiptr index_size_;
+        // Zero with the identity decoding and in a BufferArena.
+        GLuint u_decoding_buffer_ = 0;
+        VertexDecoding decoding_;
 
         std::vector<SubMesh> submeshes_;
         std::vector<Material *> materials_;
 
+        std::vector<Lod> lods_;
+        glm::vec3 center_;
+        float radius_;
+        BoundingBox<3> bb_;
+        std::vector<BoundingBox<3>> submesh_bb_;
+
+        std::vector<MeshCluster> clusters_;
+        // Clusters of submesh i are [cluster_offsets_[i], cluster_offsets_[i + 1]).
+        std::vector<size_t> cluster_offsets_;
+
+        mutable std::vector<GLsizei> counts_;
+        mutable std::vector<const void *> offsets_;
+        mutable std::vector<GLint> base_vertices_;
+        // Whether the instance attributes are enabled in the vertex array.
+        mutable bool instance_attributes_ = false;
+
     };
 
 }
@@ -4,11 +4,15 @@
 
 #include "Node.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "glm/gtc/type_ptr.hpp"
 #include "glm/gtx/string_cast.hpp"
 #include "spdlog/spdlog.h"
 
 #include "Camera.h"
+#include "RenderQueue.h"
 #include "Scene.h"
 
 #include "Mesh.h"
@@ -39,7 +43,7 @@ namespace xe {
         parent_ = nullptr;
     }
 
-    void Node::draw(Scene *scene) {
+    void Node::enqueue(Scene *scene, RenderQueue *queue) {
 
         if (parent_ != nullptr) {
             global_ = parent_->global_ * local_;
@@ -50,26 +54,32 @@ namespace xe {
             global_orientation_ = local_orientation_;
             spdlog::debug("Drawing node {}", name_, global_orientation_);
         }
-        if (global_orientation_ > 0) {
-            glFrontFace(GL_CCW);
-        } else {
-            glFrontFace(GL_CW);
-        }
 
-        auto VM = scene->camera()->view() * global_;
-        auto PVM = scene->camera()->projection() *VM;
-        auto R = glm::mat3(VM);
-        auto N = glm::mat3(glm::cross(R[1], R[2]), glm::cross(R[2], R[0]), glm::cross(R[0], R[1]));
-        scene->load_transform(glm::value_ptr(PVM));
-        scene->load_matrices(VM,N);
-
-        for (auto &&m: meshes_) {
-            m->draw();
+        if (!meshes_.empty()) {
+            auto VM = scene->camera()->view() * global_;
+            auto PVM = scene->camera()->projection() * VM;
+            auto transform = queue->add_transform(PVM, VM);
+
+            // Clusters are culled in model coordinates.
+            auto eye = glm::vec3(glm::inverse(global_) * glm::vec4(scene->camera()->position(), 1.0f));
+            // The level of detail is chosen from the radius of the bounding sphere projected on the screen.
+            auto P = scene->camera()->projection();
+            auto scale = std::sqrt(std::max({glm::dot(global_[0], global_[0]), glm::dot(global_[1], global_[1]),
+                                             glm::dot(global_[2], global_[2])}));
+            for (auto &&m: meshes_) {
+                auto center = glm::vec3(VM * glm::vec4(m->center(), 1.0f));
+                auto distance = std::max(-center.z, 1e-6f);
+                size_t lod = 0;
+                if (m->n_lods() > 1) {
+                    auto screen_radius = m->radius() * scale * P[1][1] / distance;
+                    lod = m->select_lod(screen_radius, scene->lod_threshold());
+                }
+                queue->add_mesh(*m, lod, transform, PVM, eye, distance, global_orientation_ > 0);
+            }
         }
 
-
         for (auto &&ch: children_) {
-            ch->draw(scene);
+            ch->enqueue(scene, queue);
         }
     }
 
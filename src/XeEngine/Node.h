@@ -17,6 +17,8 @@ namespace xe {
 
     class Mesh;
 
+    class RenderQueue;
+
     class Node {
     public:
 
@@ -46,7 +48,10 @@ namespace xe {
             children_.push_back(node);
         }
 
-        void draw(Scene *scene);
+        /**
+         * Updates the global transforms of the subtree and queues its meshes.
+         */
+        void enqueue(Scene *scene, RenderQueue *queue);
 
         void add_mesh(std::shared_ptr<xe::Mesh> pMesh);
 
@@ -5,6 +5,7 @@
 #include "PhongMaterial.h"
 
 #include "Application/utils.h"
+#include "XeEngine/GLState.h"
 #include "XeEngine/utils.h"
 #include "spdlog/spdlog.h"
 
@@ -13,28 +14,30 @@ namespace xe {
     GLuint PhongMaterial::shader_ = 0u;
     GLuint PhongMaterial::material_uniform_buffer_ = 0u;
     GLint  PhongMaterial::uniform_map_Kd_location_ = 0;
+    GLuint PhongMaterial::instanced_shader_ = 0u;
+    GLint  PhongMaterial::uniform_instanced_map_Kd_location_ = 0;
 
     void PhongMaterial::bind() {
-        glUseProgram(program());
+        bind_program(shader_, uniform_map_Kd_location_);
+    }
+
+    void PhongMaterial::bind_instanced() {
+        bind_program(instanced_shader_, uniform_instanced_map_Kd_location_);
+    }
+
+    void PhongMaterial::bind_program(GLuint program, GLint map_Kd_location) {
+        auto &state = GLState::current();
+        state.use_program(program);
         int use_map_Kd = 0;
         if (map_Kd_ > 0) {
-            OGL_CALL(glUniform1i(uniform_map_Kd_location_, map_Kd_unit_));
-            OGL_CALL(glActiveTexture(GL_TEXTURE0 + map_Kd_unit_));
-            OGL_CALL(glBindTexture(GL_TEXTURE_2D, map_Kd_));
+            OGL_CALL(glUniform1i(map_Kd_location, map_Kd_unit_));
+            state.bind_texture(map_Kd_unit_, GL_TEXTURE_2D, map_Kd_);
             use_map_Kd = 1;
         }
-        OGL_CALL(glBindBufferBase(GL_UNIFORM_BUFFER, 0, material_uniform_buffer_));
-
-        glBindBuffer(GL_UNIFORM_BUFFER, material_uniform_buffer_);
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 0, material_uniform_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, material_uniform_buffer_);
         glBufferSubData(GL_UNIFORM_BUFFER, 4* sizeof(float), sizeof(glm::vec4), &Kd_[0]);
         glBufferSubData(GL_UNIFORM_BUFFER, 15 * sizeof(float), sizeof(GLint), &use_map_Kd);
-        OGL_CALL(glBindBuffer(GL_UNIFORM_BUFFER, 0u));
-
-    }
-
-    void PhongMaterial::unbind() {
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-        glBindTexture(GL_TEXTURE_2D, 0u);
     }
 
     void PhongMaterial::init() {
@@ -52,9 +55,8 @@ namespace xe {
 
         glGenBuffers(1, &material_uniform_buffer_);
 
-        glBindBuffer(GL_UNIFORM_BUFFER, material_uniform_buffer_);
+        GLState::current().bind_buffer(GL_UNIFORM_BUFFER, material_uniform_buffer_);
         glBufferData(GL_UNIFORM_BUFFER, 18* sizeof(float), nullptr, GL_STATIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
 #if __APPLE__
         uniform_block_binding(shader_, "Material",0);
 #endif
@@ -71,12 +73,30 @@ namespace xe {
         uniform_block_binding(shader_, "Lights",3);
 #endif
 
+#if __APPLE__
+        uniform_block_binding(shader_, "VertexDecoding",4);
+#endif
+
 
         uniform_map_Kd_location_ = glGetUniformLocation(shader_, "map_Kd");
         if (uniform_map_Kd_location_ == -1) {
             spdlog::warn("Cannot get uniform {} location", "map_Kd");
         }
 
+        // Without it every node is drawn on its own.
+        instanced_shader_ = xe::utils::create_program(
+                {{GL_VERTEX_SHADER,   std::string(PROJECT_DIR) + "/shaders/phong_instanced_vs.glsl"},
+                 {GL_FRAGMENT_SHADER, std::string(PROJECT_DIR) + "/shaders/phong_fs.glsl"}});
+        if (!instanced_shader_) {
+            spdlog::warn("Invalid instanced phong program, drawing without instancing");
+        } else {
+#if __APPLE__
+            uniform_block_binding(instanced_shader_, "Material", 0);
+            uniform_block_binding(instanced_shader_, "Lights", 3);
+            uniform_block_binding(instanced_shader_, "VertexDecoding", 4);
+#endif
+            uniform_instanced_map_Kd_location_ = glGetUniformLocation(instanced_shader_, "map_Kd");
+        }
     }
 
 
@@ -6,8 +6,11 @@
 
 #include "Material.h"
 
+#include <memory>
 #include <string>
 
+#include "XeEngine/Texture.h"
+
 namespace xe {
     class PhongMaterial : public Material {
     public:
@@ -25,19 +28,40 @@ namespace xe {
 
         void set_texture(GLuint tex) { map_Kd_ = tex; }
 
+        /**
+         * Uses a shared texture, the material keeps it alive.
+         */
+        void set_texture(std::shared_ptr<Texture> tex) {
+            map_Kd_ = tex ? tex->id() : 0;
+            texture_handle_ = std::move(tex);
+        }
+
         void bind() override;
 
-        void unbind() override;
+        GLuint sort_program() const override { return shader_; }
+
+        GLuint sort_texture() const override { return map_Kd_; }
+
+        bool transparent() const override { return Kd_.w < 1.0f; }
+
+        bool instanced() const override { return instanced_shader_ != 0; }
+
+        void bind_instanced() override;
 
 
     private:
 
+        void bind_program(GLuint program, GLint map_Kd_location);
+
         static GLuint shader_;
         static GLuint material_uniform_buffer_;
         static GLint uniform_map_Kd_location_;
+        static GLuint instanced_shader_;
+        static GLint uniform_instanced_map_Kd_location_;
 
         glm::vec4 Kd_;
         GLuint map_Kd_;
+        std::shared_ptr<Texture> texture_handle_;
         GLboolean use_map_Kd_;
         GLuint map_Kd_unit_;
     };
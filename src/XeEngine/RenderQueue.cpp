@@ -0,0 +1,455 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "glm/gtc/type_ptr.hpp"
+
+#include "GLState.h"
+#include "Material.h"
+#include "Mesh.h"
+
+namespace {
+    const GLsizeiptr TRANSFORMATIONS_SIZE = 16 * sizeof(float);
+    const GLsizeiptr MATRICES_SIZE = 32 * sizeof(float);
+
+    size_t align_up(size_t size, size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    uint64_t field(uint32_t value, int bits, int shift) {
+        auto max = (uint64_t(1) << bits) - 1;
+        return std::min(uint64_t(value), max) << shift;
+    }
+
+    // Fields of the opaque keys below the pass, from the highest.
+    const int OPAQUE_PROGRAM_BITS = 11;
+    const int OPAQUE_PROGRAM_SHIFT = 51;
+    const int OPAQUE_TEXTURE_BITS = 12;
+    const int OPAQUE_TEXTURE_SHIFT = 39;
+    const int OPAQUE_MATERIAL_BITS = 14;
+    const int OPAQUE_MATERIAL_SHIFT = 25;
+    const int OPAQUE_CCW_BITS = 1;
+    const int OPAQUE_CCW_SHIFT = 24;
+    const int OPAQUE_DEPTH_BITS = 24;
+    const int OPAQUE_DEPTH_SHIFT = 0;
+
+    // Fields of the transparent keys below the pass, from the highest.
+    const int TRANSPARENT_DEPTH_BITS = 24;
+    const int TRANSPARENT_DEPTH_SHIFT = 38;
+    const int TRANSPARENT_PROGRAM_BITS = 11;
+    const int TRANSPARENT_PROGRAM_SHIFT = 27;
+    const int TRANSPARENT_TEXTURE_BITS = 12;
+    const int TRANSPARENT_TEXTURE_SHIFT = 15;
+    const int TRANSPARENT_MATERIAL_BITS = 14;
+    const int TRANSPARENT_MATERIAL_SHIFT = 1;
+    const int TRANSPARENT_CCW_BITS = 1;
+    const int TRANSPARENT_CCW_SHIFT = 0;
+
+    // How the material of the current draw is bound.
+    enum class MaterialBinding {
+        Regular, Indirect, Instanced
+    };
+}
+
+namespace xe {
+
+    uint64_t opaque_sort_key(uint32_t program, uint32_t texture, uint32_t material, bool ccw, uint32_t depth) {
+        return (uint64_t(RenderPass::Opaque) << 62) |
+               field(program, OPAQUE_PROGRAM_BITS, OPAQUE_PROGRAM_SHIFT) |
+               field(texture, OPAQUE_TEXTURE_BITS, OPAQUE_TEXTURE_SHIFT) |
+               field(material, OPAQUE_MATERIAL_BITS, OPAQUE_MATERIAL_SHIFT) |
+               field(ccw ? 1u : 0u, OPAQUE_CCW_BITS, OPAQUE_CCW_SHIFT) |
+               field(depth & 0xFFFFFFu, OPAQUE_DEPTH_BITS, OPAQUE_DEPTH_SHIFT);
+    }
+
+    uint64_t transparent_sort_key(uint32_t program, uint32_t texture, uint32_t material, bool ccw, uint32_t depth) {
+        return (uint64_t(RenderPass::Transparent) << 62) |
+               field(~depth & 0xFFFFFFu, TRANSPARENT_DEPTH_BITS, TRANSPARENT_DEPTH_SHIFT) |
+               field(program, TRANSPARENT_PROGRAM_BITS, TRANSPARENT_PROGRAM_SHIFT) |
+               field(texture, TRANSPARENT_TEXTURE_BITS, TRANSPARENT_TEXTURE_SHIFT) |
+               field(material, TRANSPARENT_MATERIAL_BITS, TRANSPARENT_MATERIAL_SHIFT) |
+               field(ccw ? 1u : 0u, TRANSPARENT_CCW_BITS, TRANSPARENT_CCW_SHIFT);
+    }
+
+    uint32_t depth_bits(float distance) {
+        distance = std::max(distance, 0.0f);
+        uint32_t bits;
+        std::memcpy(&bits, &distance, sizeof(bits));
+        return bits >> 8;
+    }
+
+    RenderQueue::RenderQueue() {
+        GLint alignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        if (alignment <= 0)
+            alignment = 256;
+        matrices_offset_ = align_up(TRANSFORMATIONS_SIZE, alignment);
+        transform_stride_ = matrices_offset_ + align_up(MATRICES_SIZE, alignment);
+        glGenBuffers(1, &transform_buffer_);
+        glGenBuffers(1, &instance_buffer_);
+
+#if __APPLE__
+        indirect_ = false;
+#else
+        GLint storage_alignment = 0;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+        storage_alignment_ = std::max<size_t>(1, size_t(storage_alignment) / sizeof(GLuint));
+        glGenBuffers(1, &command_buffer_);
+        glGenBuffers(1, &material_buffer_);
+        glGenBuffers(1, &draw_material_buffer_);
+        glGenBuffers(1, &draw_decoding_buffer_);
+#endif
+    }
+
+    RenderQueue::~RenderQueue() {
+        GLuint buffers[] = {transform_buffer_, command_buffer_, material_buffer_, draw_material_buffer_,
+                            draw_decoding_buffer_, instance_buffer_};
+        GLState::current().delete_buffers(6, buffers);
+    }
+
+    void RenderQueue::clear() {
+        packets_.clear();
+        items_.clear();
+        sorted_ = true;
+        counts_.clear();
+        offsets_.clear();
+        programs_.clear();
+        textures_.clear();
+        materials_.clear();
+        transforms_.clear();
+        indirect_indices_.clear();
+        indirect_materials_.clear();
+        instance_heads_.clear();
+        n_instance_groups_ = 0;
+    }
+
+    uint32_t RenderQueue::index_of(std::unordered_map<uintptr_t, uint32_t> *indices, uintptr_t value) {
+        // 0 is left for draws without a material.
+        return indices->try_emplace(value, uint32_t(indices->size() + 1)).first->second;
+    }
+
+    uint32_t RenderQueue::add_transform(const glm::mat4 &PVM, const glm::mat4 &VM) {
+        auto index = uint32_t(transforms_.size() / transform_stride_);
+        transforms_.resize(transforms_.size() + transform_stride_);
+        auto dst = transforms_.data() + size_t(index) * transform_stride_;
+        std::memcpy(dst, glm::value_ptr(PVM), 16 * sizeof(float));
+
+        // std140 Matrices block: VM and the normal matrix as three vec4 columns.
+        auto R = glm::mat3(VM);
+        auto N = glm::mat3(glm::cross(R[1], R[2]), glm::cross(R[2], R[0]), glm::cross(R[0], R[1]));
+        auto matrices = dst + matrices_offset_;
+        std::memcpy(matrices, glm::value_ptr(VM), 16 * sizeof(float));
+        for (int i = 0; i < 3; i++)
+            std::memcpy(matrices + (16 + 4 * i) * sizeof(float), glm::value_ptr(N[i]), 3 * sizeof(float));
+        return index;
+    }
+
+    void RenderQueue::add_mesh(const Mesh &mesh, size_t lod, uint32_t transform, const glm::mat4 &PVM,
+                               const glm::vec3 &eye, float distance, bool ccw) {
+        glm::vec4 planes[6];
+        const glm::vec4 *culling = nullptr;
+        if (lod == 0 && mesh.n_clusters() > 0) {
+            Mesh::frustum_planes(PVM, planes);
+            culling = planes;
+        }
+        auto depth = depth_bits(distance);
+
+        for (size_t i = 0; i < mesh.n_submeshes(lod); i++) {
+            auto first = counts_.size();
+            auto n = mesh.visible_ranges(lod, i, culling, eye, &counts_, &offsets_);
+            if (n == 0)
+                continue;
+
+            auto mtl = mesh.material(lod, i);
+            auto front_face = GLenum(ccw ? GL_CCW : GL_CW);
+            if (instancing_ && mtl != nullptr && mtl->instanced() && !mtl->transparent()) {
+                if (add_instance(mesh, lod, i, mtl, front_face, transform, first, n)) {
+                    counts_.resize(first);
+                    offsets_.resize(first);
+                    continue;
+                }
+                instance_heads_[&mesh].push_back(uint32_t(packets_.size()));
+            }
+
+            uint32_t program = 0, texture = 0, material = 0, indirect_material = NO_INDIRECT;
+            bool transparent = false;
+            if (mtl != nullptr) {
+                program = index_of(&programs_, mtl->sort_program());
+                texture = index_of(&textures_, mtl->sort_texture());
+                transparent = mtl->transparent();
+                if (indirect_ && mtl->indirect()) {
+                    auto it = indirect_indices_.try_emplace(reinterpret_cast<uintptr_t>(mtl),
+                                                            uint32_t(indirect_materials_.size()));
+                    if (it.second) {
+                        indirect_materials_.emplace_back();
+                        mtl->indirect_parameters(&indirect_materials_.back());
+                    }
+                    indirect_material = it.first->second;
+                } else {
+                    material = index_of(&materials_, reinterpret_cast<uintptr_t>(mtl));
+                }
+            }
+            auto key = transparent ? transparent_sort_key(program, texture, material, ccw, depth)
+                                   : opaque_sort_key(program, texture, material, ccw, depth);
+            items_.push_back({key, uint32_t(packets_.size())});
+            packets_.push_back({&mesh, mtl, uint32_t(lod), uint32_t(i), transform, uint32_t(first), uint32_t(n),
+                                front_face, indirect_material, NO_INSTANCES});
+        }
+        sorted_ = false;
+    }
+
+    bool RenderQueue::add_instance(const Mesh &mesh, size_t lod, size_t i, Material *material, GLenum front_face,
+                                   uint32_t transform, size_t first, size_t n) {
+        auto heads = instance_heads_.find(&mesh);
+        if (heads == instance_heads_.end())
+            return false;
+        for (auto &&head: heads->second) {
+            auto &&p = packets_[head];
+            if (p.lod != lod || p.submesh != i || p.material != material || p.front_face != front_face ||
+                p.n_ranges != n)
+                continue;
+            if (!std::equal(counts_.begin() + first, counts_.begin() + first + n, counts_.begin() + p.first_range) ||
+                !std::equal(offsets_.begin() + first, offsets_.begin() + first + n, offsets_.begin() + p.first_range))
+                continue;
+
+            if (p.instances == NO_INSTANCES) {
+                if (n_instance_groups_ == instance_groups_.size())
+                    instance_groups_.emplace_back();
+                instance_groups_[n_instance_groups_].transforms.assign(1, p.transform);
+                p.instances = uint32_t(n_instance_groups_++);
+                if (p.indirect_material != NO_INDIRECT) {
+                    // Drawn on its own again, the material has to split the sort groups. Until the queue is sorted
+                    // its items are in the order of the packets.
+                    p.indirect_material = NO_INDIRECT;
+                    auto material_mask = field(~0u, OPAQUE_MATERIAL_BITS, OPAQUE_MATERIAL_SHIFT);
+                    auto index = index_of(&materials_, reinterpret_cast<uintptr_t>(material));
+                    items_[head].key = (items_[head].key & ~material_mask) |
+                                       field(index, OPAQUE_MATERIAL_BITS, OPAQUE_MATERIAL_SHIFT);
+                }
+            }
+            instance_groups_[p.instances].transforms.push_back(transform);
+            return true;
+        }
+        return false;
+    }
+
+    void RenderQueue::sort() {
+        // The packets are reordered, later ones cannot be gathered with them any more.
+        instance_heads_.clear();
+        if (sorted_)
+            return;
+        sorted_ = true;
+        if (items_.size() < 2)
+            return;
+
+        // Least significant byte first, counting all the bytes in one pass over the keys.
+        std::array<std::array<size_t, 256>, 8> counts{};
+        for (auto &&item: items_)
+            for (int b = 0; b < 8; b++)
+                counts[b][(item.key >> (8 * b)) & 0xFFu]++;
+
+        scratch_.resize(items_.size());
+        for (int b = 0; b < 8; b++) {
+            auto &&count = counts[b];
+            // Every key has the same byte here, the pass would not move anything.
+            if (count[(items_[0].key >> (8 * b)) & 0xFFu] == items_.size())
+                continue;
+            size_t sum = 0;
+            for (auto &&c: count) {
+                auto n = c;
+                c = sum;
+                sum += n;
+            }
+            for (auto &&item: items_)
+                scratch_[count[(item.key >> (8 * b)) & 0xFFu]++] = item;
+            std::swap(items_, scratch_);
+        }
+    }
+
+    void RenderQueue::upload(GLenum target, GLuint buffer, size_t *capacity, const void *data, size_t size) {
+        if (size == 0)
+            return;
+        GLState::current().bind_buffer(target, buffer);
+        *capacity = std::max(size, *capacity);
+        // Orphaning the storage lets the driver hand out a new one while the last frame still reads the old.
+        glBufferData(target, GLsizeiptr(*capacity), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(target, 0, GLsizeiptr(size), data);
+    }
+
+    void RenderQueue::upload_transforms() {
+        upload(GL_UNIFORM_BUFFER, transform_buffer_, &transform_capacity_, transforms_.data(), transforms_.size());
+    }
+
+    void RenderQueue::upload_instances() {
+        instance_data_.clear();
+        for (size_t g = 0; g < n_instance_groups_; g++) {
+            auto &&group = instance_groups_[g];
+            group.first = instance_data_.size();
+            for (auto &&transform: group.transforms) {
+                auto src = transforms_.data() + size_t(transform) * transform_stride_;
+                InstanceTransforms instance;
+                std::memcpy(glm::value_ptr(instance.PVM), src, 16 * sizeof(float));
+                std::memcpy(glm::value_ptr(instance.VM), src + matrices_offset_, 16 * sizeof(float));
+                instance_data_.push_back(instance);
+            }
+        }
+        upload(GL_ARRAY_BUFFER, instance_buffer_, &instance_capacity_, instance_data_.data(),
+               instance_data_.size() * sizeof(InstanceTransforms));
+    }
+
+    bool RenderQueue::same_batch(const Packet &first, const SortItem &first_item, const SortItem &item) const {
+        auto &&p = packets_[item.packet];
+        return p.indirect_material != NO_INDIRECT && p.transform == first.transform &&
+               (p.mesh == first.mesh || p.mesh->shares_vertex_array(*first.mesh)) &&
+               p.front_face == first.front_face && (item.key >> 62) == (first_item.key >> 62) &&
+               p.mesh->submesh(p.lod, p.submesh).cull_face == first.mesh->submesh(first.lod, first.submesh).cull_face &&
+               p.material->sort_program() == first.material->sort_program() &&
+               p.material->sort_texture() == first.material->sort_texture();
+    }
+
+    void RenderQueue::build_batches() {
+        batches_.clear();
+        commands_.clear();
+        draw_materials_.clear();
+        draw_decodings_.clear();
+        if (!indirect_ || indirect_materials_.empty())
+            return;
+
+        for (size_t k = 0; k < items_.size();) {
+            auto &&first = packets_[items_[k].packet];
+            if (first.indirect_material == NO_INDIRECT) {
+                k++;
+                continue;
+            }
+            Batch batch{k, k, commands_.size(), 0, align_up(draw_materials_.size(), storage_alignment_)};
+            draw_materials_.resize(batch.draw_offset, 0u);
+            // A multiple of the alignment in elements is one in bytes too, as the decodings are larger.
+            draw_decodings_.resize(batch.draw_offset, VertexDecoding::identity());
+            while (batch.end < items_.size() && same_batch(first, items_[k], items_[batch.end])) {
+                auto &&p = packets_[items_[batch.end].packet];
+                p.mesh->indirect_commands(p.lod, p.submesh, counts_.data() + p.first_range,
+                                          offsets_.data() + p.first_range, p.n_ranges, &commands_);
+                draw_materials_.insert(draw_materials_.end(), p.n_ranges, p.indirect_material);
+                draw_decodings_.insert(draw_decodings_.end(), p.n_ranges, p.mesh->vertex_decoding());
+                batch.end++;
+            }
+            batch.n_commands = commands_.size() - batch.first_command;
+            batches_.push_back(batch);
+            k = batch.end;
+        }
+
+#if !__APPLE__
+        upload(GL_DRAW_INDIRECT_BUFFER, command_buffer_, &command_capacity_, commands_.data(),
+               commands_.size() * sizeof(DrawElementsIndirectCommand));
+        upload(GL_SHADER_STORAGE_BUFFER, material_buffer_, &material_capacity_, indirect_materials_.data(),
+               indirect_materials_.size() * sizeof(IndirectMaterialBlock));
+        upload(GL_SHADER_STORAGE_BUFFER, draw_material_buffer_, &draw_material_capacity_, draw_materials_.data(),
+               draw_materials_.size() * sizeof(GLuint));
+        upload(GL_SHADER_STORAGE_BUFFER, draw_decoding_buffer_, &draw_decoding_capacity_, draw_decodings_.data(),
+               draw_decodings_.size() * sizeof(VertexDecoding));
+#endif
+    }
+
+    void RenderQueue::draw_batch(const Batch &batch) {
+#if !__APPLE__
+        auto &&p = packets_[items_[batch.begin].packet];
+        auto &state = GLState::current();
+        state.bind_buffer(GL_DRAW_INDIRECT_BUFFER, command_buffer_);
+        state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 5, material_buffer_);
+        state.bind_buffer_range(GL_SHADER_STORAGE_BUFFER, 6, draw_material_buffer_,
+                                GLintptr(batch.draw_offset * sizeof(GLuint)),
+                                GLsizeiptr(batch.n_commands * sizeof(GLuint)));
+        state.bind_buffer_range(GL_SHADER_STORAGE_BUFFER, 7, draw_decoding_buffer_,
+                                GLintptr(batch.draw_offset * sizeof(VertexDecoding)),
+                                GLsizeiptr(batch.n_commands * sizeof(VertexDecoding)));
+        p.mesh->draw_indirect(p.lod, p.submesh, GLintptr(batch.first_command * sizeof(DrawElementsIndirectCommand)),
+                              GLsizei(batch.n_commands));
+        stats_.indirect_draws++;
+        stats_.indirect_packets += batch.end - batch.begin;
+#endif
+    }
+
+    void RenderQueue::submit() {
+        sort();
+        upload_transforms();
+        upload_instances();
+        build_batches();
+
+        stats_ = {};
+        stats_.packets = packets_.size();
+        auto &state = GLState::current();
+        Material *material = nullptr;
+        auto binding = MaterialBinding::Regular;
+        bool first = true, transform_bound = false, blending = false;
+        uint32_t transform = 0;
+        size_t next_batch = 0;
+        for (size_t k = 0; k < items_.size();) {
+            auto &&item = items_[k];
+            auto &&p = packets_[item.packet];
+            if (!blending && (item.key >> 62) == uint64_t(RenderPass::Transparent)) {
+                state.set_enabled(GL_BLEND, true);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                blending = true;
+            }
+            auto batch = next_batch < batches_.size() && batches_[next_batch].begin == k ? &batches_[next_batch] : nullptr;
+            auto packet_binding = batch != nullptr ? MaterialBinding::Indirect :
+                                  p.instances != NO_INSTANCES ? MaterialBinding::Instanced : MaterialBinding::Regular;
+            if (first || p.material != material || packet_binding != binding) {
+                if (material != nullptr)
+                    material->unbind();
+                material = p.material;
+                binding = packet_binding;
+                if (material != nullptr) {
+                    if (binding == MaterialBinding::Indirect)
+                        material->bind_indirect();
+                    else if (binding == MaterialBinding::Instanced)
+                        material->bind_instanced();
+                    else
+                        material->bind();
+                    stats_.material_binds++;
+                }
+            }
+            first = false;
+            state.front_face(p.front_face);
+
+            if (binding == MaterialBinding::Instanced) {
+                // The matrices come from the instance attributes.
+                auto &&group = instance_groups_[p.instances];
+                p.mesh->draw_instanced(p.lod, p.submesh, counts_.data() + p.first_range,
+                                       offsets_.data() + p.first_range, p.n_ranges, instance_buffer_,
+                                       GLintptr(group.first * sizeof(InstanceTransforms)),
+                                       GLsizei(group.transforms.size()));
+                stats_.instanced_draws++;
+                stats_.instances += group.transforms.size();
+                k++;
+                continue;
+            }
+
+            if (!transform_bound || p.transform != transform) {
+                transform = p.transform;
+                transform_bound = true;
+                auto offset = GLintptr(size_t(transform) * transform_stride_);
+                state.bind_buffer_range(GL_UNIFORM_BUFFER, 1, transform_buffer_, offset, TRANSFORMATIONS_SIZE);
+                state.bind_buffer_range(GL_UNIFORM_BUFFER, 2, transform_buffer_, offset + GLintptr(matrices_offset_),
+                                        MATRICES_SIZE);
+                stats_.transform_binds++;
+            }
+            if (batch != nullptr) {
+                draw_batch(*batch);
+                next_batch++;
+                k = batch->end;
+            } else {
+                p.mesh->draw_ranges(p.lod, p.submesh, counts_.data() + p.first_range,
+                                    offsets_.data() + p.first_range, p.n_ranges);
+                k++;
+            }
+        }
+        if (material != nullptr)
+            material->unbind();
+        if (blending)
+            state.set_enabled(GL_BLEND, false);
+    }
+
+}
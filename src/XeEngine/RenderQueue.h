@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "glad/gl.h"
+#include "glm/glm.hpp"
+
+#include "Material.h"
+#include "Mesh.h"
+
+namespace xe {
+
+    enum class RenderPass : uint32_t {
+        Opaque = 0, Transparent = 1
+    };
+
+    /**
+     * 64 bit sort keys of the draws, the pass in the two highest bits. Opaque draws are grouped by program, texture,
+     * material and front face, front to back within a group; transparent ones go back to front, then by state.
+     * `program`, `texture` and `material` are small per frame indices, larger ones saturate, `depth` is a 24 bit
+     * monotonic code of the view distance, see depth_bits. Materials drawn indirectly leave `material` 0, their
+     * packets of one mesh and node stay together.
+     *
+     *     opaque:      | pass 2 | program 11 | texture 12 | material 14 | front face 1 | depth 24 |
+     *     transparent: | pass 2 | ~depth 24  | program 11 | texture 12  | material 14  | front face 1 |
+     */
+    uint64_t opaque_sort_key(uint32_t program, uint32_t texture, uint32_t material, bool ccw, uint32_t depth);
+
+    uint64_t transparent_sort_key(uint32_t program, uint32_t texture, uint32_t material, bool ccw, uint32_t depth);
+
+    /**
+     * The high 24 bits of the float, for non-negative distances they grow with the distance.
+     */
+    uint32_t depth_bits(float distance);
+
+    struct RenderQueueStats {
+        size_t packets = 0;
+        size_t material_binds = 0;
+        size_t transform_binds = 0;
+        // glMultiDrawElementsIndirect calls and the packets drawn by them.
+        size_t indirect_draws = 0;
+        size_t indirect_packets = 0;
+        // Instanced draws and the nodes drawn by them.
+        size_t instanced_draws = 0;
+        size_t instances = 0;
+    };
+
+    /**
+     * Draws of one frame, collected from the scene graph, sorted and then submitted in one loop.
+     *
+     * The traversal adds the transforms of every node with `add_transform` and the meshes drawn with them with
+     * `add_mesh`, which culls the clusters of the submeshes and queues a packet for each visible one. `submit`
+     * radix sorts the packets by their keys, uploads all the transforms in one buffer and issues the draws, binding
+     * materials only when they change and the transforms of a node with glBindBufferRange on uniform buffer
+     * bindings 1 (Transformations) and 2 (Matrices). Other state goes through GLState, so consecutive draws sharing
+     * it do not touch it at all.
+     *
+     * Consecutive packets of the same node and mesh, or meshes sharing a BufferArena pool, whose materials support
+     * it (Material::indirect) and share the program, texture and face state are drawn by a single
+     * glMultiDrawElementsIndirect: their commands go to a GL_DRAW_INDIRECT_BUFFER and the material of every command to
+     * the storage buffer at binding 6, which the program reads with gl_DrawID to index the material parameters at
+     * binding 5. The vertex decoding of every command goes to the storage buffer at binding 7, so meshes quantized
+     * differently share the draw too. Such materials do not split the sort groups. Not available with GL 4.1.
+     *
+     * Opaque submeshes of nodes sharing the mesh, the level of detail, the material (Material::instanced) and the
+     * visible ranges are gathered already by `add_mesh` into one packet drawn with one instanced draw. The matrices of
+     * its nodes go to an instance buffer, see Mesh::draw_instanced, and the packet is ordered by the distance of the
+     * first of them.
+     *
+     * Needs a current GL context for its whole life.
+     */
+    class RenderQueue {
+    public:
+        RenderQueue();
+
+        RenderQueue(const RenderQueue &) = delete;
+
+        RenderQueue &operator=(const RenderQueue &) = delete;
+
+        ~RenderQueue();
+
+        void clear();
+
+        /**
+         * Queues the matrices of a node and returns their index for `add_mesh`.
+         */
+        uint32_t add_transform(const glm::mat4 &PVM, const glm::mat4 &VM);
+
+        /**
+         * Queues the visible submeshes of the level `lod` of `mesh`. `PVM` and `eye` (camera position in model
+         * coordinates) cull the clusters at level 0, `distance` from the camera orders the draws, `ccw` is the
+         * front face.
+         */
+        void add_mesh(const Mesh &mesh, size_t lod, uint32_t transform, const glm::mat4 &PVM, const glm::vec3 &eye,
+                      float distance, bool ccw);
+
+        void sort();
+
+        /**
+         * Sorts and issues the queued draws. The queue is kept until `clear`.
+         */
+        void submit();
+
+        size_t size() const { return packets_.size(); }
+
+        /**
+         * Enables the glMultiDrawElementsIndirect batches, on by default where supported.
+         */
+        void set_indirect(bool indirect) { indirect_ = indirect; }
+
+        /**
+         * Enables gathering the nodes sharing a mesh into instanced draws, on by default.
+         */
+        void set_instancing(bool instancing) { instancing_ = instancing; }
+
+        const RenderQueueStats &stats() const { return stats_; }
+
+    private:
+        struct Packet {
+            const Mesh *mesh;
+            Material *material;
+            uint32_t lod;
+            uint32_t submesh;
+            uint32_t transform;
+            uint32_t first_range;
+            uint32_t n_ranges;
+            GLenum front_face;
+            // Index in indirect_materials_, NO_INDIRECT if drawn one by one.
+            uint32_t indirect_material;
+            // Index in instance_groups_, NO_INSTANCES if drawn for the single node `transform`.
+            uint32_t instances;
+        };
+
+        struct InstanceGroup {
+            std::vector<uint32_t> transforms;
+            // In InstanceTransforms of instance_data_.
+            size_t first;
+        };
+
+        // Sorted items [begin, end) drawn by one glMultiDrawElementsIndirect.
+        struct Batch {
+            size_t begin;
+            size_t end;
+            size_t first_command;
+            size_t n_commands;
+            // In elements of draw_materials_ and draw_decodings_, aligned for glBindBufferRange.
+            size_t draw_offset;
+        };
+
+        static constexpr uint32_t NO_INDIRECT = 0xffffffffu;
+        static constexpr uint32_t NO_INSTANCES = 0xffffffffu;
+
+        struct SortItem {
+            uint64_t key;
+            uint32_t packet;
+        };
+
+        static uint32_t index_of(std::unordered_map<uintptr_t, uint32_t> *indices, uintptr_t value);
+
+        void upload_transforms();
+
+        /**
+         * Adds the node `transform` to a packet queued before with the same mesh, material and ranges as the ranges
+         * appended last, from `first`, and returns whether it found one.
+         */
+        bool add_instance(const Mesh &mesh, size_t lod, size_t i, Material *material, GLenum front_face,
+                          uint32_t transform, size_t first, size_t n);
+
+        void upload_instances();
+
+        bool same_batch(const Packet &first, const SortItem &first_item, const SortItem &item) const;
+
+        void build_batches();
+
+        void draw_batch(const Batch &batch);
+
+        static void upload(GLenum target, GLuint buffer, size_t *capacity, const void *data, size_t size);
+
+        std::vector<Packet> packets_;
+        std::vector<SortItem> items_;
+        std::vector<SortItem> scratch_;
+        bool sorted_ = true;
+
+        std::vector<GLsizei> counts_;
+        std::vector<const void *> offsets_;
+
+        std::unordered_map<uintptr_t, uint32_t> programs_;
+        std::unordered_map<uintptr_t, uint32_t> textures_;
+        std::unordered_map<uintptr_t, uint32_t> materials_;
+
+        // Transformations and Matrices blocks of every node, each at an offset aligned for glBindBufferRange.
+        std::vector<uint8_t> transforms_;
+        size_t matrices_offset_;
+        size_t transform_stride_;
+        GLuint transform_buffer_ = 0;
+        size_t transform_capacity_ = 0;
+
+        bool indirect_ = true;
+        std::unordered_map<uintptr_t, uint32_t> indirect_indices_;
+        std::vector<IndirectMaterialBlock> indirect_materials_;
+        std::vector<Batch> batches_;
+        std::vector<DrawElementsIndirectCommand> commands_;
+        std::vector<GLuint> draw_materials_;
+        std::vector<VertexDecoding> draw_decodings_;
+        size_t storage_alignment_ = 1;
+        GLuint command_buffer_ = 0;
+        GLuint material_buffer_ = 0;
+        GLuint draw_material_buffer_ = 0;
+        GLuint draw_decoding_buffer_ = 0;
+        size_t command_capacity_ = 0;
+        size_t material_capacity_ = 0;
+        size_t draw_material_capacity_ = 0;
+        size_t draw_decoding_capacity_ = 0;
+
+        bool instancing_ = true;
+        // Packets that can gather instances, by mesh, until the queue is sorted.
+        std::unordered_map<const Mesh *, std::vector<uint32_t>> instance_heads_;
+        // Only the first n_instance_groups_ are used, the rest keep their memory for the next frames.
+        std::vector<InstanceGroup> instance_groups_;
+        size_t n_instance_groups_ = 0;
+        std::vector<InstanceTransforms> instance_data_;
+        GLuint instance_buffer_ = 0;
+        size_t instance_capacity_ = 0;
+
+        RenderQueueStats stats_;
+    };
+
+}
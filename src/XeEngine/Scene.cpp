@@ -8,41 +8,29 @@
 
 #include "Application/utils.h"
 #include "Camera.h"
+#include "GLState.h"
 
 namespace xe {
 
-    Scene::Scene() : n_lights_(0) {
-        glGenBuffers(1, &u_transform_buffer_);
-        glBindBuffer(GL_UNIFORM_BUFFER, u_transform_buffer_);
-        glBufferData(GL_UNIFORM_BUFFER, 16 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 1, u_transform_buffer_);
-
-
+    Scene::Scene() : root_(nullptr), camera_(nullptr), lod_threshold_(2.0f / 1080.0f), n_lights_(0) {
+        auto &state = GLState::current();
         glGenBuffers(1, &u_lights_buffer_);
-        glBindBuffer(GL_UNIFORM_BUFFER, u_lights_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, u_lights_buffer_);
         glBufferData(GL_UNIFORM_BUFFER, MAX_POINT_LIGHT * P_LIGHT_SIZE, nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 3, u_lights_buffer_);
-
-        glGenBuffers(1, &u_matrices_buffer_);
-        glBindBuffer(GL_UNIFORM_BUFFER, u_matrices_buffer_);
-        glBufferData(GL_UNIFORM_BUFFER, 32 * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-        glBindBufferBase(GL_UNIFORM_BUFFER, 2, u_matrices_buffer_);
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 3, u_lights_buffer_);
 
     }
 
-    void Scene::load_transform(const GLfloat *M) {
-        glBindBuffer(GL_UNIFORM_BUFFER, u_transform_buffer_);
-        OGL_CALL(glBufferSubData(GL_UNIFORM_BUFFER, 0, 16 * sizeof(float), M));
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
-    }
-
     void Scene::draw() {
+        // The application may have changed the state directly since the last frame.
+        auto &state = GLState::current();
+        state.invalidate();
+        // The lights binding is ours, set it again in case it was changed; the queue binds 1 and 2.
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 3, u_lights_buffer_);
+
         // send lights;
 
-        glBindBuffer(GL_UNIFORM_BUFFER, u_lights_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, u_lights_buffer_);
         size_t offset = 0;
         for (int i = 0; i < n_lights_; i++) {
             auto pos = glm::vec4(p_lights_[i].position_in_world_space, 1.0f);
@@ -52,16 +40,13 @@ namespace xe {
             offset += P_LIGHT_SIZE;
         }
 
+        queue_.clear();
         if (root_ != nullptr)
-            root_->draw(this);
-    }
+            root_->enqueue(this, &queue_);
+        queue_.submit();
 
-    void Scene::load_matrices(const glm::mat4& VM, const glm::mat3&N ) {
-        glBindBuffer(GL_UNIFORM_BUFFER, u_matrices_buffer_);
-        OGL_CALL(glBufferSubData(GL_UNIFORM_BUFFER, 0, 16 * sizeof(float), glm::value_ptr(VM)));
-        for(int i=0;i<3;i++)
-            OGL_CALL(glBufferSubData(GL_UNIFORM_BUFFER, 16 * sizeof(float)+i*4* sizeof(float), 3 * sizeof(float), glm::value_ptr(N[i])));
-        glBindBuffer(GL_UNIFORM_BUFFER, 0u);
+        // Leave no vertex array bound, an element buffer bound by the application would replace ours.
+        state.bind_vertex_array(0u);
     }
 
 }
\ No newline at end of file
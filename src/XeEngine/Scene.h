@@ -11,6 +11,7 @@
 #include "glm/glm.hpp"
 
 #include "Node.h"
+#include "RenderQueue.h"
 #include "lights.h"
 
 namespace xe {
@@ -35,19 +36,30 @@ namespace xe {
             p_lights_[n_lights_++] = p_light;
         }
 
-        void load_transform(const GLfloat *M);
-        void load_matrices(const glm::mat4& VM, const glm::mat3& N);
+        /**
+         * Largest simplification error, in normalized device coordinates, accepted when choosing the level of detail
+         * of a mesh. The default is about one pixel on a 1080 pixel high viewport.
+         */
+        void set_lod_threshold(float threshold) { lod_threshold_ = threshold; }
 
+        float lod_threshold() const { return lod_threshold_; }
+
+        /**
+         * Queues the draws of the scene graph and submits them sorted, see RenderQueue.
+         */
         void draw();
 
+        const RenderQueue &render_queue() const { return queue_; }
+
     private:
-        GLuint u_transform_buffer_;
-        GLuint u_matrices_buffer_;
         GLuint u_lights_buffer_;
+        RenderQueue queue_;
 
         Node *root_;
         Camera *camera_;
 
+        float lod_threshold_;
+
         unsigned int n_lights_;
         std::array<PointLight, MAX_POINT_LIGHT> p_lights_;
 
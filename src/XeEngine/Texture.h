@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+
+#include "glad/gl.h"
+
+#include "XeEngine/GLState.h"
+
+namespace xe {
+
+    /**
+     * Block compressed formats, 4x4 texels per block.
+     */
+    enum class BlockFormat {
+        None, BC1, BC3
+    };
+
+    inline size_t block_bytes(BlockFormat format) {
+        return format == BlockFormat::BC1 ? 8 : format == BlockFormat::BC3 ? 16 : 0;
+    }
+
+    /**
+     * Owns a GL texture object and deletes it with the last handle. Textures are shared through
+     * `std::shared_ptr<Texture>`, see TextureCache.
+     */
+    class Texture {
+    public:
+        Texture(GLuint id, GLsizei width, GLsizei height, GLint channels, GLsizei levels = 1,
+                BlockFormat block_format = BlockFormat::None)
+                : id_(id), width_(width), height_(height), channels_(channels), levels_(levels),
+                  block_format_(block_format) {}
+
+        Texture(const Texture &) = delete;
+
+        Texture &operator=(const Texture &) = delete;
+
+        ~Texture() {
+            if (id_ > 0)
+                GLState::current().delete_textures(1, &id_);
+        }
+
+        GLuint id() const { return id_; }
+
+        GLsizei width() const { return width_; }
+
+        GLsizei height() const { return height_; }
+
+        GLint channels() const { return channels_; }
+
+        GLsizei levels() const { return levels_; }
+
+        BlockFormat block_format() const { return block_format_; }
+
+        /**
+         * Size of the uploaded image in bytes, all mip levels included.
+         */
+        size_t size() const {
+            size_t size = 0;
+            for (GLsizei level = 0; level < levels_; level++) {
+                auto w = width_ >> level, h = height_ >> level;
+                w = w > 0 ? w : 1;
+                h = h > 0 ? h : 1;
+                if (block_format_ != BlockFormat::None)
+                    size += size_t((w + 3) / 4) * size_t((h + 3) / 4) * block_bytes(block_format_);
+                else
+                    size += size_t(w) * size_t(h) * size_t(channels_);
+            }
+            return size;
+        }
+
+    private:
+        GLuint id_;
+        GLsizei width_;
+        GLsizei height_;
+        GLint channels_;
+        GLsizei levels_;
+        BlockFormat block_format_;
+    };
+
+    /**
+     * Uploads an 8 bit image with 3 or 4 channels into a new immutable GL texture with the full mip chain generated
+     * by glGenerateMipmap. Returns 0 for other channel counts. TextureUploader streams the data through pixel buffers
+     * instead.
+     */
+    GLuint upload_texture(const unsigned char *pixels, GLsizei width, GLsizei height, GLint channels);
+
+}
@@ -0,0 +1,226 @@
+#include "TextureCache.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/parallel.h"
+#include "XeEngine/ImageDecoder.h"
+#include "XeEngine/block_compression.h"
+#include "XeEngine/content_hash.h"
+#include "XeEngine/mipmaps.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    std::string canonical_path(const std::string &path) {
+        std::error_code ec;
+        auto canonical = fs::weakly_canonical(path, ec);
+        if (ec)
+            return fs::path(path).lexically_normal().string();
+        return canonical.string();
+    }
+
+    template<typename Map>
+    void purge_expired(Map &map) {
+        for (auto it = map.begin(); it != map.end();) {
+            if (it->second.expired())
+                it = map.erase(it);
+            else
+                ++it;
+        }
+    }
+}
+
+namespace xe {
+
+    TextureCache &TextureCache::global() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    TextureCache::TextureCache(bool compress, bool use_cache) : compress_(compress), use_cache_(use_cache) {}
+
+    std::shared_ptr<Texture> TextureCache::get(const std::string &path) {
+        stats_.requests++;
+
+        auto key = canonical_path(path);
+        if (auto texture = find(key))
+            return texture;
+
+        // Hashing the file is much cheaper than decoding it, so a copy of a loaded image is never decoded.
+        uint64_t hash;
+        if (!file_content_hash(key, &hash)) {
+            spdlog::warn("Could not read image from file `{}'", key);
+            stats_.failures++;
+            return nullptr;
+        }
+        if (auto texture = find_content(key, hash))
+            return texture;
+
+        Image image;
+        if (!load_image(key, &image, load_options(1))) {
+            stats_.failures++;
+            return nullptr;
+        }
+        return add(key, image);
+    }
+
+    std::vector<std::shared_ptr<Texture>> TextureCache::get(const std::vector<std::string> &paths,
+                                                            unsigned int n_threads) {
+        std::vector<std::shared_ptr<Texture>> textures(paths.size());
+
+        // Images not in the cache, each decoded once however many requests and paths refer to its content. The files
+        // are hashed on the calling thread, which is much cheaper than decoding them.
+        struct Request {
+            std::string key;
+            size_t index;
+        };
+        std::vector<std::string> keys;
+        std::unordered_map<std::string, uint64_t> hashes;
+        std::unordered_map<uint64_t, std::vector<Request>> waiting;
+        for (size_t i = 0; i < paths.size(); i++) {
+            stats_.requests++;
+            auto key = canonical_path(paths[i]);
+            if ((textures[i] = find(key)))
+                continue;
+            auto hash = hashes.find(key);
+            if (hash == hashes.end()) {
+                uint64_t h;
+                if (!file_content_hash(key, &h)) {
+                    spdlog::warn("Could not read image from file `{}'", key);
+                    stats_.failures++;
+                    continue;
+                }
+                // A hit also registers the path, so the next request for it is found by `find`.
+                if ((textures[i] = find_content(key, h)))
+                    continue;
+                hash = hashes.emplace(key, h).first;
+            }
+            auto &&requests = waiting[hash->second];
+            if (requests.empty())
+                keys.push_back(key);
+            requests.push_back({key, i});
+        }
+        if (keys.empty())
+            return textures;
+
+        n_threads = static_cast<unsigned int>(std::min<size_t>(resolve_n_threads(n_threads), keys.size()));
+        // The workers also build the mip chains and compress them, leaving only the copies to the GL thread.
+        ImageDecoder decoder(n_threads, load_options(n_threads));
+        for (auto &&key: keys)
+            decoder.submit(key);
+
+        // Every image is uploaded as soon as it is decoded, while the workers go on with the rest.
+        ImageDecoder::Result result;
+        while (decoder.next(&result)) {
+            auto &&requests = waiting[hashes[result.path]];
+            if (!result.ok) {
+                stats_.failures += requests.size();
+                continue;
+            }
+            auto texture = add(result.path, result.image);
+            if (!texture) {
+                stats_.failures += requests.size() - 1;
+                continue;
+            }
+            // The first request was counted by add.
+            for (size_t r = 0; r < requests.size(); r++) {
+                textures[requests[r].index] = texture;
+                if (r == 0)
+                    continue;
+                if (requests[r].key == result.path) {
+                    stats_.path_hits++;
+                } else {
+                    stats_.content_hits++;
+                    by_path_[requests[r].key] = texture;
+                }
+                stats_.bytes_saved += texture->size();
+            }
+        }
+        return textures;
+    }
+
+    std::shared_ptr<Texture> TextureCache::find(const std::string &key) {
+        auto it = by_path_.find(key);
+        if (it == by_path_.end())
+            return nullptr;
+        auto texture = it->second.lock();
+        if (texture) {
+            stats_.path_hits++;
+            stats_.bytes_saved += texture->size();
+        }
+        return texture;
+    }
+
+    std::shared_ptr<Texture> TextureCache::find_content(const std::string &key, uint64_t hash) {
+        auto it = by_content_.find(hash);
+        if (it == by_content_.end())
+            return nullptr;
+        auto texture = it->second.lock();
+        if (texture) {
+            spdlog::debug("Texture `{}' has the same content as an already loaded one", key);
+            stats_.content_hits++;
+            stats_.bytes_saved += texture->size();
+            by_path_[key] = texture;
+        }
+        return texture;
+    }
+
+    std::shared_ptr<Texture> TextureCache::add(const std::string &key, const Image &image) {
+        if (!uploader_)
+            uploader_ = std::make_unique<TextureUploader>();
+        auto id = uploader_->upload(image);
+        if (id == 0) {
+            stats_.failures++;
+            return nullptr;
+        }
+
+        auto texture = std::make_shared<Texture>(id, image.width, image.height, image.channels,
+                                                 mip_levels(image.width, image.height), image.block_format);
+        stats_.misses++;
+        stats_.bytes_uploaded += texture->size();
+        by_path_[key] = texture;
+        by_content_[image.hash] = texture;
+        return texture;
+    }
+
+    ImageLoadOptions TextureCache::load_options(unsigned int n_threads) {
+        if (compress_ && !compression_checked_) {
+            compression_supported_ = block_compression_supported();
+            compression_checked_ = true;
+            if (!compression_supported_)
+                spdlog::warn("No S3TC support, textures are uploaded uncompressed");
+        }
+        ImageLoadOptions options;
+        options.mipmaps = true;
+        options.compress = compress_ && compression_supported_;
+        options.use_cache = use_cache_;
+        // Every image loading thread compresses on its share of the hardware threads.
+        options.compress_threads = std::max(1u, resolve_n_threads(0) / std::max(1u, n_threads));
+        return options;
+    }
+
+    size_t TextureCache::size() const {
+        size_t n = 0;
+        for (auto &&entry: by_content_)
+            if (!entry.second.expired())
+                n++;
+        return n;
+    }
+
+    void TextureCache::purge() {
+        purge_expired(by_path_);
+        purge_expired(by_content_);
+    }
+
+    void TextureCache::log_stats() const {
+        spdlog::info("Texture cache: {} requests, {} path hits, {} content hits, {} misses, {} failures, "
+                     "{:.1f} MB uploaded, {:.1f} MB saved, {} upload stalls", stats_.requests, stats_.path_hits,
+                     stats_.content_hits, stats_.misses, stats_.failures, stats_.bytes_uploaded / 1048576.0,
+                     stats_.bytes_saved / 1048576.0, uploader_ ? uploader_->stalls() : 0);
+    }
+
+}
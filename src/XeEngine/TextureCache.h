@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "XeEngine/ImageDecoder.h"
+#include "XeEngine/Texture.h"
+#include "XeEngine/TextureUploader.h"
+
+namespace xe {
+
+    struct TextureCacheStats {
+        size_t requests = 0;
+        // Found by the canonical path of the file.
+        size_t path_hits = 0;
+        // Found by the hash of the file content, e.g. the same image copied under another name.
+        size_t content_hits = 0;
+        // Decoded and uploaded.
+        size_t misses = 0;
+        // Images that could not be read or decoded.
+        size_t failures = 0;
+        size_t bytes_uploaded = 0;
+        // Bytes that would have been uploaded again without the cache, mip levels included.
+        size_t bytes_saved = 0;
+    };
+
+    /**
+     * Textures shared by the path and the content of the image file. The cache keeps weak references only: a texture
+     * lives as long as some material holds its handle and is decoded again when requested after that.
+     */
+    class TextureCache {
+    public:
+        /**
+         * @param compress upload the textures block compressed (BC1, or BC3 for images with transparency) when the
+         * context supports it, see compress_image. Off by default, as the compression is lossy.
+         * @param use_cache keep the compressed blocks in `.ktx2` files next to the images, see load_ktx2_cache. Off by
+         * default, as it writes next to the assets.
+         */
+        explicit TextureCache(bool compress = false, bool use_cache = false);
+
+        /**
+         * Cache used by load_mesh_from_obj when MeshLoadOptions::texture_cache is not set.
+         */
+        static TextureCache &global();
+
+        /**
+         * Returns the texture of the image file at `path` with its full mip chain, decoding and uploading it only when
+         * neither the path nor an identical file was requested before. Identical files are found by hashing the file
+         * before decoding it. Returns nullptr if the image cannot be read.
+         */
+        std::shared_ptr<Texture> get(const std::string &path);
+
+        /**
+         * Same as above for many images at once: the ones not in the cache are decoded concurrently on `n_threads`
+         * threads (0 means all) and uploaded on the calling thread, which must own the GL context, in the order they
+         * finish decoding. The textures are returned in the order of `paths`.
+         */
+        std::vector<std::shared_ptr<Texture>> get(const std::vector<std::string> &paths, unsigned int n_threads = 0);
+
+        const TextureCacheStats &stats() const { return stats_; }
+
+        /**
+         * Number of textures still alive.
+         */
+        size_t size() const;
+
+        /**
+         * Forgets the textures no handle refers to.
+         */
+        void purge();
+
+        /**
+         * Logs the stats at the info level. Not called by the loaders, call it when the numbers are wanted.
+         */
+        void log_stats() const;
+
+    private:
+        ImageLoadOptions load_options(unsigned int n_threads);
+
+        std::shared_ptr<Texture> find(const std::string &key);
+
+        std::shared_ptr<Texture> find_content(const std::string &key, uint64_t hash);
+
+        std::shared_ptr<Texture> add(const std::string &key, const Image &image);
+
+        std::unordered_map<std::string, std::weak_ptr<Texture>> by_path_;
+        std::unordered_map<uint64_t, std::weak_ptr<Texture>> by_content_;
+        TextureCacheStats stats_;
+        bool compress_;
+        bool use_cache_;
+        bool compression_checked_ = false;
+        bool compression_supported_ = false;
+        // Created with the first upload, when the GL context is surely current.
+        std::unique_ptr<TextureUploader> uploader_;
+    };
+
+}
@@ -0,0 +1,196 @@
+#include "TextureUploader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "XeEngine/GLState.h"
+#include "XeEngine/Texture.h"
+#include "XeEngine/block_compression.h"
+#include "XeEngine/mipmaps.h"
+
+namespace xe {
+
+    bool texture_formats(int channels, GLenum *internal_format, GLenum *format) {
+        switch (channels) {
+            case 3:
+                *internal_format = GL_RGB8;
+                *format = GL_RGB;
+                return true;
+            case 4:
+                *internal_format = GL_RGBA8;
+                *format = GL_RGBA;
+                return true;
+            default:
+                spdlog::warn("Unsupported number of image channels {}", channels);
+                return false;
+        }
+    }
+
+    // Only the per level allocation of OpenGL 4.1 needs the pixel and block formats.
+    void allocate_texture_storage(GLsizei levels, GLenum internal_format, [[maybe_unused]] GLenum format,
+                                  GLsizei width, GLsizei height, [[maybe_unused]] BlockFormat block_format) {
+#if __APPLE__
+        // OpenGL 4.1 has no glTexStorage2D, the levels are allocated one by one.
+        for (GLsizei level = 0; level < levels; level++) {
+            auto w = std::max(1, width >> level), h = std::max(1, height >> level);
+            if (block_format != BlockFormat::None)
+                glCompressedTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0,
+                                       ((w + 3) / 4) * ((h + 3) / 4) * block_bytes(block_format), nullptr);
+            else
+                glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, nullptr);
+        }
+#else
+        glTexStorage2D(GL_TEXTURE_2D, levels, internal_format, width, height);
+#endif
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    GLuint upload_texture(const unsigned char *pixels, GLsizei width, GLsizei height, GLint channels) {
+        GLenum internal_format, format;
+        if (!texture_formats(channels, &internal_format, &format))
+            return 0;
+
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLState::current().bind_texture(GL_TEXTURE_2D, texture);
+        auto levels = mip_levels(width, height);
+        allocate_texture_storage(levels, internal_format, format, width, height);
+
+        // Rows of RGB images are not 4 byte aligned in general.
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (levels > 1)
+            glGenerateMipmap(GL_TEXTURE_2D);
+
+        return texture;
+    }
+
+    TextureUploader::TextureUploader(size_t buffer_size, unsigned int n_buffers) : buffer_size_(buffer_size),
+                                                                                 buffers_(n_buffers) {
+        auto &state = GLState::current();
+        for (auto &&buffer: buffers_) {
+            glGenBuffers(1, &buffer.id);
+            state.bind_buffer(GL_PIXEL_UNPACK_BUFFER, buffer.id);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size_, nullptr, GL_STREAM_DRAW);
+            buffer.fence = nullptr;
+        }
+        state.bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0u);
+    }
+
+    TextureUploader::~TextureUploader() {
+        for (auto &&buffer: buffers_) {
+            if (buffer.fence)
+                glDeleteSync(buffer.fence);
+            GLState::current().delete_buffers(1, &buffer.id);
+        }
+    }
+
+    GLuint TextureUploader::upload(const Image &image) {
+        GLenum internal_format, format;
+        if (image.compressed()) {
+            internal_format = format = block_format_gl(image.block_format);
+        } else if (!texture_formats(image.channels, &internal_format, &format)) {
+            return 0;
+        }
+
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLState::current().bind_texture(GL_TEXTURE_2D, texture);
+        auto levels = mip_levels(image.width, image.height);
+        if (image.compressed())
+            levels = std::min(levels, image.levels);
+        allocate_texture_storage(levels, internal_format, format, image.width, image.height, image.block_format);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (int level = 0; level < std::min(levels, image.levels); level++)
+            upload_level(image, level, format);
+        // A bound unpack buffer changes the meaning of the pointers of every other upload, leave none.
+        GLState::current().bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0u);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        if (image.levels < levels) {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, image.levels - 1);
+            glGenerateMipmap(GL_TEXTURE_2D);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        }
+
+        return texture;
+    }
+
+    void TextureUploader::upload_level(const Image &image, int level, GLenum format) {
+        auto width = image.level_width(level);
+        auto height = image.level_height(level);
+        auto data = image.level_data(level);
+        // Compressed levels go in rows of blocks, four rows of texels each.
+        auto compressed = image.compressed();
+        auto rows_per_unit = compressed ? 4 : 1;
+        auto unit_size = compressed ? size_t((width + 3) / 4) * block_bytes(image.block_format)
+                                    : size_t(width) * size_t(image.channels);
+        auto n_units = compressed ? (height + 3) / 4 : height;
+
+        auto sub_image = [&](int unit, int units, const void *pixels) {
+            auto y = unit * rows_per_unit;
+            auto rows = std::min(units * rows_per_unit, height - y);
+            if (compressed)
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, width, rows, format,
+                                          static_cast<GLsizei>(units * unit_size), pixels);
+            else
+                glTexSubImage2D(GL_TEXTURE_2D, level, 0, y, width, rows, format, GL_UNSIGNED_BYTE, pixels);
+        };
+
+        if (buffers_.empty() || unit_size > buffer_size_) {
+            // Without buffers, or with rows that do not fit any, the data goes straight from the client memory.
+            GLState::current().bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0u);
+            sub_image(0, n_units, data);
+            return;
+        }
+
+        auto band = static_cast<int>(std::min<size_t>(buffer_size_ / unit_size, size_t(n_units)));
+        for (int unit = 0; unit < n_units; unit += band) {
+            auto units = std::min(band, n_units - unit);
+            auto size = size_t(units) * unit_size;
+            auto src = data + size_t(unit) * unit_size;
+
+            auto &&buffer = next_buffer();
+            GLState::current().bind_buffer(GL_PIXEL_UNPACK_BUFFER, buffer.id);
+            // The fence guarantees the GPU no longer reads the buffer, so no synchronization is needed when mapping.
+            auto dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, static_cast<GLsizeiptr>(size),
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            if (dst) {
+                std::memcpy(dst, src, size);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                sub_image(unit, units, nullptr);
+            } else {
+                spdlog::warn("Could not map the pixel unpack buffer, uploading directly");
+                GLState::current().bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0u);
+                sub_image(unit, units, src);
+            }
+            buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+
+    TextureUploader::Buffer &TextureUploader::next_buffer() {
+        auto &&buffer = buffers_[next_];
+        next_ = (next_ + 1) % buffers_.size();
+        if (buffer.fence) {
+            auto status = glClientWaitSync(buffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                stalls_++;
+                do {
+                    status = glClientWaitSync(buffer.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+                } while (status == GL_TIMEOUT_EXPIRED);
+            }
+            glDeleteSync(buffer.fence);
+            buffer.fence = nullptr;
+        }
+        return buffer;
+    }
+
+}
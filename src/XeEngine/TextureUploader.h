@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "glad/gl.h"
+
+#include "XeEngine/ImageDecoder.h"
+
+namespace xe {
+
+    /**
+     * Sized internal format and pixel format of an 8 bit image with `channels` channels. Returns false for channel
+     * counts other than 3 and 4.
+     */
+    bool texture_formats(int channels, GLenum *internal_format, GLenum *format);
+
+    /**
+     * Allocates the storage of `levels` levels for the texture bound to GL_TEXTURE_2D and sets trilinear filtering.
+     * Immutable storage (glTexStorage2D) where the context has it. Block compressed formats need `block_format`.
+     */
+    void allocate_texture_storage(GLsizei levels, GLenum internal_format, GLenum format, GLsizei width,
+                                  GLsizei height, BlockFormat block_format = BlockFormat::None);
+
+    /**
+     * Streams texture data through a ring of pixel unpack buffers. Each upload is copied into the next buffer of the
+     * ring and transferred by glTexSubImage2D from that buffer, so the call returns as soon as the copy is done and
+     * the driver moves the data while the CPU goes on. A fence per buffer tells when the GPU is done with it; only
+     * when all the buffers are still in flight does the uploader wait. Images larger than a buffer go in bands of
+     * rows. With no buffers the data is uploaded straight from the client memory.
+     *
+     * Needs a current GL context for its whole life.
+     */
+    class TextureUploader {
+    public:
+        explicit TextureUploader(size_t buffer_size = size_t(16) << 20, unsigned int n_buffers = 3);
+
+        TextureUploader(const TextureUploader &) = delete;
+
+        TextureUploader &operator=(const TextureUploader &) = delete;
+
+        ~TextureUploader();
+
+        /**
+         * Creates a texture with storage for the full mip chain and uploads the levels present in `image`. Missing
+         * levels are made with glGenerateMipmap, except for block compressed images which get only the levels they
+         * have. Returns 0 if the image has an unsupported number of channels.
+         */
+        GLuint upload(const Image &image);
+
+        /**
+         * How many times all the buffers were still in use and the uploader had to wait for one.
+         */
+        size_t stalls() const { return stalls_; }
+
+    private:
+        struct Buffer {
+            GLuint id;
+            GLsync fence;
+        };
+
+        void upload_level(const Image &image, int level, GLenum format);
+
+        Buffer &next_buffer();
+
+        size_t buffer_size_;
+        std::vector<Buffer> buffers_;
+        size_t next_ = 0;
+        size_t stalls_ = 0;
+    };
+
+}
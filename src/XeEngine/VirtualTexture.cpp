@@ -0,0 +1,447 @@
+#include "VirtualTexture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+
+#include "spdlog/spdlog.h"
+
+#include "XeEngine/GLState.h"
+#include "XeEngine/TextureUploader.h"
+#include "XeEngine/block_compression.h"
+#include "XeEngine/mipmaps.h"
+
+namespace xe {
+
+    const VirtualTexture *VirtualTexture::feedback_target_ = nullptr;
+
+    VirtualTexture::VirtualTexture(const VirtualTextureOptions &options) : options_(options) {
+        options_.pages_x = std::clamp(options_.pages_x, 1, 256);
+        options_.pages_y = std::clamp(options_.pages_y, 1, 256);
+        options_.feedback_scale = std::max(1, options_.feedback_scale);
+        options_.n_threads = std::max(1u, options_.n_threads);
+        options_.max_uploads = std::max<size_t>(1, options_.max_uploads);
+        options_.max_pending = std::max<size_t>(1, options_.max_pending);
+    }
+
+    VirtualTexture::~VirtualTexture() {
+        close();
+    }
+
+    void VirtualTexture::close() {
+        if (feedback_target_ == this)
+            feedback_target_ = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        job_ready_.notify_all();
+        for (auto &&w: workers_)
+            w.join();
+        workers_.clear();
+        jobs_.clear();
+        tiles_.clear();
+        in_flight_.clear();
+        stop_ = false;
+
+        for (auto &&r: read_backs_) {
+            if (r.fence)
+                glDeleteSync(r.fence);
+            GLState::current().delete_buffers(1, &r.buffer);
+        }
+        read_backs_.clear();
+        if (framebuffer_) {
+            GLState::current().delete_framebuffers(1, &framebuffer_);
+            glDeleteRenderbuffers(1, &color_buffer_);
+            glDeleteRenderbuffers(1, &depth_buffer_);
+            framebuffer_ = color_buffer_ = depth_buffer_ = 0;
+            feedback_width_ = feedback_height_ = 0;
+        }
+        if (page_cache_) {
+            GLuint textures[] = {page_cache_, page_table_};
+            GLState::current().delete_textures(2, textures);
+            page_cache_ = page_table_ = 0;
+        }
+        table_.clear();
+        slots_.clear();
+        free_slots_.clear();
+        lru_.clear();
+        resident_.clear();
+    }
+
+    bool VirtualTexture::open_image(const std::string &source, const PageFileOptions &options) {
+        auto path = page_file_path(source);
+        if (!page_file_up_to_date(source, path, options) && !build_page_file(source, path, options))
+            return false;
+        return open(path);
+    }
+
+    bool VirtualTexture::open(const std::string &path) {
+        close();
+        if (!file_.open(path))
+            return false;
+
+        auto format = file_.block_format();
+        GLenum internal_format, pixel_format = GL_RGBA;
+        if (format != BlockFormat::None) {
+            if (!block_compression_supported()) {
+                spdlog::warn("Page file `{}' has block compressed pages, which this context cannot sample", path);
+                return false;
+            }
+            internal_format = block_format_gl(format);
+        } else if (!texture_formats(int(file_.header().channels), &internal_format, &pixel_format)) {
+            return false;
+        }
+
+        // Tile coordinates are stored in 12 bits of the keys and the feedback.
+        if (file_.tiles_x(0) > 4096 || file_.tiles_y(0) > 4096) {
+            spdlog::warn("Page file `{}' has more than 4096 tiles in a row", path);
+            return false;
+        }
+
+        auto page_size = file_.page_size();
+        auto &state = GLState::current();
+        glGenTextures(1, &page_cache_);
+        state.bind_texture(GL_TEXTURE_2D, page_cache_);
+        allocate_texture_storage(1, internal_format, pixel_format, options_.pages_x * page_size,
+                                 options_.pages_y * page_size, format);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glGenTextures(1, &page_table_);
+        state.bind_texture(GL_TEXTURE_2D, page_table_);
+        allocate_texture_storage(file_.levels(), GL_RGBA8, GL_RGBA, file_.tiles_x(0), file_.tiles_y(0));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        table_.resize(file_.levels());
+        for (int level = 0; level < file_.levels(); level++)
+            table_[level].assign(size_t(file_.tiles_x(level)) * file_.tiles_y(level) * 4, 0);
+
+        auto n_slots = options_.pages_x * options_.pages_y;
+        slots_.assign(n_slots, Slot{0, 0, lru_.end(), false});
+        free_slots_.clear();
+        for (int slot = n_slots - 1; slot >= 0; slot--)
+            free_slots_.push_back(slot);
+
+        // The coarsest tile is the fallback of every lookup, it is read right away and never evicted.
+        std::ifstream in(path, std::ios::binary);
+        std::vector<uint8_t> page;
+        auto top = file_.levels() - 1;
+        if (!file_.read_tile(in, top, 0, 0, &page)) {
+            spdlog::warn("Cannot read the top tile of page file `{}'", path);
+            close();
+            return false;
+        }
+        auto slot = allocate_slot();
+        slots_[slot] = Slot{tile_key(top, 0, 0), 0, lru_.end(), true};
+        resident_[slots_[slot].key] = slot;
+        upload_page(slot, page.data());
+        update_page_table();
+
+        for (unsigned int i = 0; i < options_.n_threads; i++)
+            workers_.emplace_back(&VirtualTexture::work, this);
+
+        const auto &h = file_.header();
+        spdlog::info("Opened virtual texture `{}': {}x{}, {} levels, {}x{} pages of {} texels", path, h.width,
+                     h.height, h.levels, options_.pages_x, options_.pages_y, page_size);
+        return true;
+    }
+
+    void VirtualTexture::work() {
+        std::ifstream in(file_.path(), std::ios::binary);
+        while (true) {
+            uint32_t key;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                job_ready_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+                if (stop_)
+                    return;
+                key = jobs_.front();
+                jobs_.pop_front();
+            }
+
+            Tile tile{key, false, {}};
+            tile.ok = file_.read_tile(in, key_level(key), key_x(key), key_y(key), &tile.page);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            tiles_.push_back(std::move(tile));
+        }
+    }
+
+    float VirtualTexture::feedback_lod_bias() const {
+        return -std::log2(float(options_.feedback_scale));
+    }
+
+    void VirtualTexture::begin_feedback(GLsizei viewport_width, GLsizei viewport_height) {
+        if (!page_cache_)
+            return;
+        auto width = std::max(1, viewport_width / options_.feedback_scale);
+        auto height = std::max(1, viewport_height / options_.feedback_scale);
+        if (width != feedback_width_ || height != feedback_height_) {
+            if (!framebuffer_) {
+                glGenFramebuffers(1, &framebuffer_);
+                glGenRenderbuffers(1, &color_buffer_);
+                glGenRenderbuffers(1, &depth_buffer_);
+            }
+            glBindRenderbuffer(GL_RENDERBUFFER, color_buffer_);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+            glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer_);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+            glBindRenderbuffer(GL_RENDERBUFFER, 0u);
+            GLState::current().bind_framebuffer(GL_FRAMEBUFFER, framebuffer_);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_buffer_);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer_);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                spdlog::warn("Virtual texture feedback framebuffer is incomplete");
+            feedback_width_ = width;
+            feedback_height_ = height;
+        }
+
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved_framebuffer_);
+        glGetIntegerv(GL_VIEWPORT, saved_viewport_);
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, saved_clear_color_);
+        GLState::current().bind_framebuffer(GL_FRAMEBUFFER, framebuffer_);
+        glViewport(0, 0, width, height);
+        // Alpha 0 marks the pixels without any virtual texture.
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        feedback_target_ = this;
+    }
+
+    void VirtualTexture::end_feedback() {
+        if (feedback_target_ != this)
+            return;
+        feedback_target_ = nullptr;
+
+        if (read_backs_.empty()) {
+            // Two buffers: one being filled by the GPU while the other one waits for `update`.
+            read_backs_.resize(2, ReadBack{0, nullptr, 0, 0});
+            for (auto &&r: read_backs_)
+                glGenBuffers(1, &r.buffer);
+        }
+        auto &state = GLState::current();
+        auto &r = read_backs_[next_read_back_];
+        // A buffer still waiting to be read means `update` is behind, this feedback is dropped.
+        if (!r.fence) {
+            state.bind_buffer(GL_PIXEL_PACK_BUFFER, r.buffer);
+            if (r.width != feedback_width_ || r.height != feedback_height_) {
+                glBufferData(GL_PIXEL_PACK_BUFFER, GLsizeiptr(feedback_width_) * feedback_height_ * 4, nullptr,
+                             GL_STREAM_READ);
+                r.width = feedback_width_;
+                r.height = feedback_height_;
+            }
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glReadPixels(0, 0, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            // A bound pack buffer changes the meaning of glReadPixels elsewhere, leave none.
+            state.bind_buffer(GL_PIXEL_PACK_BUFFER, 0u);
+            r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            next_read_back_ = (next_read_back_ + 1) % read_backs_.size();
+        }
+
+        state.bind_framebuffer(GL_FRAMEBUFFER, GLuint(saved_framebuffer_));
+        glViewport(saved_viewport_[0], saved_viewport_[1], saved_viewport_[2], saved_viewport_[3]);
+        glClearColor(saved_clear_color_[0], saved_clear_color_[1], saved_clear_color_[2], saved_clear_color_[3]);
+    }
+
+    void VirtualTexture::read_feedback(const uint8_t *pixels, size_t n_pixels, std::vector<uint32_t> *requests) const {
+        // RGBA: low 8 bits of the tile x and y, their high 4 bits, level + 1.
+        for (size_t i = 0; i < n_pixels; i++, pixels += 4) {
+            if (pixels[3] == 0)
+                continue;
+            auto level = int(pixels[3]) - 1;
+            auto x = int(pixels[0]) | (int(pixels[2] & 0x0Fu) << 8);
+            auto y = int(pixels[1]) | (int(pixels[2] >> 4) << 8);
+            if (level < file_.levels() && x < file_.tiles_x(level) && y < file_.tiles_y(level))
+                requests->push_back(tile_key(level, x, y));
+        }
+    }
+
+    void VirtualTexture::touch(int slot) {
+        auto &s = slots_[slot];
+        s.last_used = frame_;
+        if (!s.pinned)
+            lru_.splice(lru_.begin(), lru_, s.lru);
+    }
+
+    int VirtualTexture::allocate_slot() {
+        if (!free_slots_.empty()) {
+            auto slot = free_slots_.back();
+            free_slots_.pop_back();
+            return slot;
+        }
+        if (lru_.empty() || slots_[lru_.back()].last_used == frame_)
+            return -1;
+        auto slot = lru_.back();
+        lru_.pop_back();
+        resident_.erase(slots_[slot].key);
+        slots_[slot].lru = lru_.end();
+        stats_.evictions++;
+        table_dirty_ = true;
+        return slot;
+    }
+
+    void VirtualTexture::schedule(const std::vector<uint32_t> &requests) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // Tiles queued for an older feedback and not started yet may no longer be needed.
+            for (auto key: jobs_)
+                in_flight_.erase(key);
+            jobs_.clear();
+            for (auto key: requests) {
+                if (in_flight_.size() >= options_.max_pending)
+                    break;
+                if (in_flight_.insert(key).second)
+                    jobs_.push_back(key);
+            }
+        }
+        job_ready_.notify_all();
+    }
+
+    void VirtualTexture::update() {
+        if (!page_cache_)
+            return;
+        frame_++;
+
+        std::vector<uint32_t> requests;
+        for (auto &&r: read_backs_) {
+            if (!r.fence)
+                continue;
+            auto status = glClientWaitSync(r.fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                continue;
+            glDeleteSync(r.fence);
+            r.fence = nullptr;
+            GLState::current().bind_buffer(GL_PIXEL_PACK_BUFFER, r.buffer);
+            auto size = GLsizeiptr(r.width) * r.height * 4;
+            auto pixels = static_cast<const uint8_t *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+                                                                        GL_MAP_READ_BIT));
+            if (pixels) {
+                read_feedback(pixels, size_t(r.width) * r.height, &requests);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            GLState::current().bind_buffer(GL_PIXEL_PACK_BUFFER, 0u);
+        }
+
+        if (!requests.empty()) {
+            std::sort(requests.begin(), requests.end());
+            requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+            stats_.requested = requests.size();
+
+            // Every requested tile and all its ancestors, which are the fallback while it is missing, are kept
+            // resident or loaded.
+            std::vector<uint32_t> missing;
+            for (auto key: requests) {
+                int level = key_level(key), x = key_x(key), y = key_y(key);
+                for (; level < file_.levels(); level++, x >>= 1, y >>= 1) {
+                    auto k = tile_key(level, x, y);
+                    auto it = resident_.find(k);
+                    if (it != resident_.end())
+                        touch(it->second);
+                    else if (file_.has_tile(level, x, y))
+                        missing.push_back(k);
+                }
+            }
+            // Coarse levels first: they cover more of the screen and are the fallback of the finer ones.
+            std::sort(missing.begin(), missing.end(), std::greater<>());
+            missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+            schedule(missing);
+        }
+
+        std::deque<Tile> tiles;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto n = std::min(options_.max_uploads, tiles_.size());
+            std::move(tiles_.begin(), tiles_.begin() + std::ptrdiff_t(n), std::back_inserter(tiles));
+            tiles_.erase(tiles_.begin(), tiles_.begin() + std::ptrdiff_t(n));
+        }
+        for (auto &&tile: tiles) {
+            in_flight_.erase(tile.key);
+            if (!tile.ok) {
+                spdlog::warn("Cannot read tile {} {} {} from page file `{}'", key_level(tile.key), key_x(tile.key),
+                             key_y(tile.key), file_.path());
+                continue;
+            }
+            if (resident_.count(tile.key))
+                continue;
+            auto slot = allocate_slot();
+            if (slot < 0) {
+                stats_.dropped++;
+                continue;
+            }
+            slots_[slot].key = tile.key;
+            slots_[slot].last_used = frame_;
+            slots_[slot].pinned = false;
+            lru_.push_front(slot);
+            slots_[slot].lru = lru_.begin();
+            resident_[tile.key] = slot;
+            upload_page(slot, tile.page.data());
+            stats_.uploads++;
+            table_dirty_ = true;
+        }
+
+        if (table_dirty_)
+            update_page_table();
+    }
+
+    void VirtualTexture::upload_page(int slot, const uint8_t *page) {
+        auto page_size = file_.page_size();
+        auto x = (slot % options_.pages_x) * page_size, y = (slot / options_.pages_x) * page_size;
+        GLState::current().bind_texture(GL_TEXTURE_2D, page_cache_);
+        auto format = file_.block_format();
+        if (format != BlockFormat::None) {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, x, y, page_size, page_size, block_format_gl(format),
+                                      GLsizei(file_.page_bytes()), page);
+        } else {
+            GLenum internal_format, pixel_format;
+            texture_formats(int(file_.header().channels), &internal_format, &pixel_format);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, page_size, page_size, pixel_format, GL_UNSIGNED_BYTE, page);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+    }
+
+    void VirtualTexture::update_page_table() {
+        // From the coarsest level down, a missing tile takes the entry of its parent.
+        for (int level = file_.levels() - 1; level >= 0; level--) {
+            auto width = file_.tiles_x(level), height = file_.tiles_y(level);
+            auto &entries = table_[level];
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    auto entry = entries.data() + (size_t(y) * width + x) * 4;
+                    auto it = resident_.find(tile_key(level, x, y));
+                    if (it != resident_.end()) {
+                        entry[0] = uint8_t(it->second % options_.pages_x);
+                        entry[1] = uint8_t(it->second / options_.pages_x);
+                        entry[2] = uint8_t(level);
+                        entry[3] = 255;
+                    } else if (level + 1 < file_.levels()) {
+                        auto parent_x = std::min(x >> 1, file_.tiles_x(level + 1) - 1);
+                        auto parent_y = std::min(y >> 1, file_.tiles_y(level + 1) - 1);
+                        std::copy_n(table_[level + 1].data() +
+                                    (size_t(parent_y) * file_.tiles_x(level + 1) + parent_x) * 4, 4, entry);
+                    }
+                }
+            }
+        }
+
+        GLState::current().bind_texture(GL_TEXTURE_2D, page_table_);
+        for (int level = 0; level < file_.levels(); level++)
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, file_.tiles_x(level), file_.tiles_y(level), GL_RGBA,
+                            GL_UNSIGNED_BYTE, table_[level].data());
+        table_dirty_ = false;
+    }
+
+    size_t VirtualTexture::memory() const {
+        size_t size = slots_.size() * file_.page_bytes();
+        for (auto &&entries: table_)
+            size += 2 * entries.size();
+        size += size_t(feedback_width_) * feedback_height_ * 8;
+        for (auto &&r: read_backs_)
+            size += size_t(r.width) * r.height * 4;
+        size += options_.max_pending * file_.page_bytes();
+        return size;
+    }
+
+}
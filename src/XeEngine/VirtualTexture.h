@@ -0,0 +1,240 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "glad/gl.h"
+
+#include "XeEngine/page_file.h"
+
+namespace xe {
+
+    struct VirtualTextureOptions {
+        /**
+         * Pages in the physical cache texture, at most 256 in each direction. The default 32 x 32 pages of 128
+         * texels is a 4096 x 4096 texture, 8 MB in BC1.
+         */
+        int pages_x = 32;
+        int pages_y = 32;
+
+        /**
+         * The feedback pass is rendered at 1 / feedback_scale of the viewport size.
+         */
+        int feedback_scale = 8;
+
+        /**
+         * Threads reading tiles from the page file.
+         */
+        unsigned int n_threads = 2;
+
+        /**
+         * Tiles uploaded by one `update` and tiles queued or being read at any time.
+         */
+        size_t max_uploads = 16;
+        size_t max_pending = 64;
+    };
+
+    struct VirtualTextureStats {
+        // Distinct tiles seen in the last feedback.
+        size_t requested = 0;
+        size_t uploads = 0;
+        size_t evictions = 0;
+        // Tiles read but not uploaded because every page was in use in the same frame.
+        size_t dropped = 0;
+    };
+
+    /**
+     * Texture far larger than fits in memory, streamed in tiles from a page file (see build_page_file).
+     *
+     * The GPU holds a fixed size page cache texture with the resident tiles and a page table texture with one texel
+     * per tile and a mip per level of the pyramid, each telling which page holds that tile or, when it is not
+     * resident, its nearest resident ancestor. The single tile of the coarsest level is always resident, so every
+     * lookup lands somewhere. VirtualTextureMaterial samples through the page table.
+     *
+     * Which tiles to load comes from a feedback pass: the meshes are drawn into a small framebuffer, the material
+     * writing the tile and level each pixel needs, and the frame is read back asynchronously through pixel pack
+     * buffers. Missing tiles and their missing ancestors are read by background threads, coarse levels first, and
+     * uploaded over the least recently used pages. Memory stays bounded by the page cache and the options whatever
+     * the size of the source image.
+     *
+     *     xe::VirtualTexture vt;
+     *     vt.open_image(ROOT_DIR "/Models/world.topo.21600x10800.jpg");
+     *     auto material = new xe::VirtualTextureMaterial({1, 1, 1, 1}, &vt);
+     *     ...
+     *     vt.begin_feedback(width, height);
+     *     scene.draw();
+     *     vt.end_feedback();
+     *     vt.update();
+     *     scene.draw();
+     *
+     * Needs a current GL context for its whole life.
+     */
+    class VirtualTexture {
+    public:
+        explicit VirtualTexture(const VirtualTextureOptions &options = {});
+
+        VirtualTexture(const VirtualTexture &) = delete;
+
+        VirtualTexture &operator=(const VirtualTexture &) = delete;
+
+        ~VirtualTexture();
+
+        /**
+         * Opens the page file, creates the textures and loads the coarsest tile. Returns false if the file cannot be
+         * read or its pages cannot be sampled by this context.
+         */
+        bool open(const std::string &path);
+
+        /**
+         * Opens the page file next to `source`, building it first if it is missing or stale.
+         */
+        bool open_image(const std::string &source, const PageFileOptions &options = {});
+
+        /**
+         * Binds the feedback framebuffer for a viewport of the given size. Meshes with a VirtualTextureMaterial
+         * using this texture drawn until `end_feedback` record the tiles they need; other virtual textures draw
+         * only depth. Draw other geometry with glColorMask off to let it occlude.
+         */
+        void begin_feedback(GLsizei viewport_width, GLsizei viewport_height);
+
+        /**
+         * Starts the read back of the feedback and restores the framebuffer and viewport.
+         */
+        void end_feedback();
+
+        /**
+         * Processes the feedback read back so far, queues the missing tiles and uploads the ones already read. Call
+         * once per frame, before drawing.
+         */
+        void update();
+
+        /**
+         * Texture being rendered by the current feedback pass, nullptr outside of it.
+         */
+        static const VirtualTexture *feedback_target() { return feedback_target_; }
+
+        /**
+         * Added to the level computed by the feedback pass, compensating for its smaller resolution.
+         */
+        float feedback_lod_bias() const;
+
+        GLuint page_cache() const { return page_cache_; }
+
+        GLuint page_table() const { return page_table_; }
+
+        const PageFile &page_file() const { return file_; }
+
+        int pages_x() const { return options_.pages_x; }
+
+        int pages_y() const { return options_.pages_y; }
+
+        /**
+         * Tiles currently in the page cache.
+         */
+        size_t resident() const { return resident_.size(); }
+
+        /**
+         * Bytes of the textures, read back buffers and tiles in flight, the bound on the memory used.
+         */
+        size_t memory() const;
+
+        const VirtualTextureStats &stats() const { return stats_; }
+
+    private:
+        struct Slot {
+            uint32_t key;
+            uint64_t last_used;
+            std::list<int>::iterator lru;
+            bool pinned;
+        };
+
+        struct Tile {
+            uint32_t key;
+            bool ok;
+            std::vector<uint8_t> page;
+        };
+
+        struct ReadBack {
+            GLuint buffer;
+            GLsync fence;
+            GLsizei width;
+            GLsizei height;
+        };
+
+        static uint32_t tile_key(int level, int x, int y) {
+            return (uint32_t(level) << 24) | (uint32_t(y) << 12) | uint32_t(x);
+        }
+
+        static int key_level(uint32_t key) { return int(key >> 24); }
+
+        static int key_x(uint32_t key) { return int(key & 0xFFFu); }
+
+        static int key_y(uint32_t key) { return int((key >> 12) & 0xFFFu); }
+
+        void close();
+
+        void work();
+
+        void read_feedback(const uint8_t *pixels, size_t n_pixels, std::vector<uint32_t> *requests) const;
+
+        void schedule(const std::vector<uint32_t> &requests);
+
+        void touch(int slot);
+
+        int allocate_slot();
+
+        void upload_page(int slot, const uint8_t *page);
+
+        void update_page_table();
+
+        static const VirtualTexture *feedback_target_;
+
+        VirtualTextureOptions options_;
+        PageFile file_;
+
+        GLuint page_cache_ = 0;
+        GLuint page_table_ = 0;
+        std::vector<std::vector<uint8_t>> table_;
+        bool table_dirty_ = false;
+
+        std::vector<Slot> slots_;
+        std::vector<int> free_slots_;
+        // Slot indices, the most recently used first; pinned slots are not in the list.
+        std::list<int> lru_;
+        std::unordered_map<uint32_t, int> resident_;
+        uint64_t frame_ = 0;
+
+        GLuint framebuffer_ = 0;
+        GLuint color_buffer_ = 0;
+        GLuint depth_buffer_ = 0;
+        GLsizei feedback_width_ = 0;
+        GLsizei feedback_height_ = 0;
+        GLint saved_framebuffer_ = 0;
+        GLint saved_viewport_[4] = {};
+        GLfloat saved_clear_color_[4] = {};
+        std::vector<ReadBack> read_backs_;
+        size_t next_read_back_ = 0;
+
+        // Keys queued, being read or read and not uploaded yet; only touched by the GL thread.
+        std::unordered_set<uint32_t> in_flight_;
+
+        std::vector<std::thread> workers_;
+        std::mutex mutex_;
+        std::condition_variable job_ready_;
+        std::deque<uint32_t> jobs_;
+        std::deque<Tile> tiles_;
+        bool stop_ = false;
+
+        VirtualTextureStats stats_;
+    };
+
+}
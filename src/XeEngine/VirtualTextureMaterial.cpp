@@ -0,0 +1,101 @@
+#include "VirtualTextureMaterial.h"
+
+#include "Application/utils.h"
+#include "XeEngine/GLState.h"
+#include "XeEngine/utils.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+    // Layout of the VirtualTexture uniform block (std140).
+    struct VirtualTextureBlock {
+        glm::vec4 Kd;
+        glm::vec2 virtual_size;
+        glm::vec2 cache_pages;
+        float tile_size;
+        float page_border;
+        float max_level;
+        float lod_bias;
+        GLint feedback;
+        GLint padding[3];
+    };
+
+    static_assert(sizeof(VirtualTextureBlock) == 64, "VirtualTexture uniform block is 64 bytes");
+}
+
+namespace xe {
+
+    GLuint VirtualTextureMaterial::shader_ = 0u;
+    GLuint VirtualTextureMaterial::uniform_buffer_ = 0u;
+
+    void VirtualTextureMaterial::bind() {
+        auto &state = GLState::current();
+        state.use_program(program());
+
+        const auto &h = texture_->page_file().header();
+        VirtualTextureBlock block{};
+        block.Kd = Kd_;
+        block.virtual_size = glm::vec2(h.width, h.height);
+        block.cache_pages = glm::vec2(texture_->pages_x(), texture_->pages_y());
+        block.tile_size = float(h.tile_size);
+        block.page_border = float(h.border);
+        block.max_level = float(h.levels - 1);
+
+        auto target = VirtualTexture::feedback_target();
+        if (target == texture_) {
+            block.feedback = 1;
+            block.lod_bias = texture_->feedback_lod_bias();
+        } else if (target) {
+            // Feedback pass of another virtual texture, only the depth counts.
+            state.color_mask(false);
+            color_masked_ = true;
+        }
+
+        state.bind_texture(0, GL_TEXTURE_2D, texture_->page_cache());
+        state.bind_texture(1, GL_TEXTURE_2D, texture_->page_table());
+
+        state.bind_buffer_base(GL_UNIFORM_BUFFER, 0, uniform_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, uniform_buffer_);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+    }
+
+    void VirtualTextureMaterial::unbind() {
+        if (color_masked_) {
+            GLState::current().color_mask(true);
+            color_masked_ = false;
+        }
+    }
+
+    void VirtualTextureMaterial::init() {
+
+        auto program = xe::utils::create_program(
+                {{GL_VERTEX_SHADER,   std::string(PROJECT_DIR) + "/shaders/color_vs.glsl"},
+                 {GL_FRAGMENT_SHADER, std::string(PROJECT_DIR) + "/shaders/virtual_texture_fs.glsl"}});
+        if (!program) {
+            std::cerr << "Invalid program" << std::endl;
+            exit(-1);
+        }
+
+        shader_ = program;
+
+        auto &state = GLState::current();
+        glGenBuffers(1, &uniform_buffer_);
+        state.bind_buffer(GL_UNIFORM_BUFFER, uniform_buffer_);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(VirtualTextureBlock), nullptr, GL_DYNAMIC_DRAW);
+
+#if __APPLE__
+        uniform_block_binding(shader_, "VirtualTexture", 0);
+        uniform_block_binding(shader_, "Transformations", 1);
+        uniform_block_binding(shader_, "VertexDecoding", 4);
+#endif
+
+        state.use_program(shader_);
+        for (auto [name, unit]: {std::pair<const char *, GLint>{"page_cache", 0}, {"page_table", 1}}) {
+            auto location = glGetUniformLocation(shader_, name);
+            if (location == -1)
+                spdlog::warn("Cannot get uniform {} location", name);
+            else
+                glUniform1i(location, unit);
+        }
+    }
+
+}
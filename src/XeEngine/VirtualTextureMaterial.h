@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Material.h"
+
+#include "XeEngine/VirtualTexture.h"
+
+namespace xe {
+
+    /**
+     * Colour material whose map is a VirtualTexture. In the feedback pass of its texture it writes the tiles the
+     * pixels need instead of the colour.
+     */
+    class VirtualTextureMaterial : public Material {
+    public:
+
+        static void init();
+
+        static GLuint program() { return shader_; }
+
+        VirtualTextureMaterial(const glm::vec4 color, const VirtualTexture *texture) : Kd_(color),
+                                                                                        texture_(texture) {}
+
+        void bind() override;
+
+        GLuint sort_program() const override { return shader_; }
+
+        GLuint sort_texture() const override { return texture_->page_cache(); }
+
+        bool transparent() const override { return Kd_.w < 1.0f; }
+
+        void unbind() override;
+
+    private:
+
+        static GLuint shader_;
+        static GLuint uniform_buffer_;
+
+        glm::vec4 Kd_;
+        const VirtualTexture *texture_;
+        bool color_masked_ = false;
+    };
+
+}
@@ -0,0 +1,363 @@
+#include "block_compression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/parallel.h"
+#include "XeEngine/mipmaps.h"
+
+namespace {
+
+    uint16_t pack_565(const float c[3]) {
+        auto r = static_cast<uint16_t>(std::lround(std::min(std::max(c[0], 0.0f), 255.0f) * 31.0f / 255.0f));
+        auto g = static_cast<uint16_t>(std::lround(std::min(std::max(c[1], 0.0f), 255.0f) * 63.0f / 255.0f));
+        auto b = static_cast<uint16_t>(std::lround(std::min(std::max(c[2], 0.0f), 255.0f) * 31.0f / 255.0f));
+        return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+    }
+
+    void unpack_565(uint16_t c, int out[3]) {
+        auto r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+        out[0] = (r << 3) | (r >> 2);
+        out[1] = (g << 2) | (g >> 4);
+        out[2] = (b << 3) | (b >> 2);
+    }
+
+    /**
+     * Picks the closest of the four palette colours for every texel. Returns the squared error of the block.
+     */
+    int assign_indices(const uint8_t rgba[64], uint16_t c0, uint16_t c1, uint8_t indices[16]) {
+        int palette[4][3];
+        unpack_565(c0, palette[0]);
+        unpack_565(c1, palette[1]);
+        for (int k = 0; k < 3; k++) {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        }
+        int error = 0;
+        for (int i = 0; i < 16; i++) {
+            int best = 0, best_d = 1 << 30;
+            for (int p = 0; p < 4; p++) {
+                int d = 0;
+                for (int k = 0; k < 3; k++) {
+                    auto e = int(rgba[4 * i + k]) - palette[p][k];
+                    d += e * e;
+                }
+                if (d < best_d) {
+                    best_d = d;
+                    best = p;
+                }
+            }
+            indices[i] = static_cast<uint8_t>(best);
+            error += best_d;
+        }
+        return error;
+    }
+
+    /**
+     * Least squares endpoints for the given indices, each texel being w * a + (1 - w) * b.
+     */
+    bool fit_endpoints(const uint8_t rgba[64], const uint8_t indices[16], float a[3], float b[3]) {
+        static const float weight[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+        float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+        float ax[3] = {0.0f, 0.0f, 0.0f}, bx[3] = {0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++) {
+            auto w = weight[indices[i]];
+            aa += w * w;
+            bb += (1.0f - w) * (1.0f - w);
+            ab += w * (1.0f - w);
+            for (int k = 0; k < 3; k++) {
+                ax[k] += w * rgba[4 * i + k];
+                bx[k] += (1.0f - w) * rgba[4 * i + k];
+            }
+        }
+        auto det = aa * bb - ab * ab;
+        if (std::abs(det) < 1e-6f)
+            return false;
+        for (int k = 0; k < 3; k++) {
+            a[k] = (ax[k] * bb - bx[k] * ab) / det;
+            b[k] = (bx[k] * aa - ax[k] * ab) / det;
+        }
+        return true;
+    }
+
+    void write_bc1(uint16_t c0, uint16_t c1, uint8_t indices[16], uint8_t out[8]) {
+        if (c0 < c1) {
+            // Four colour mode needs c0 > c1, swapping the endpoints swaps the indices 0 <-> 1 and 2 <-> 3.
+            std::swap(c0, c1);
+            for (int i = 0; i < 16; i++)
+                indices[i] ^= 1;
+        } else if (c0 == c1) {
+            std::fill(indices, indices + 16, uint8_t(0));
+        }
+        uint32_t bits = 0;
+        for (int i = 0; i < 16; i++)
+            bits |= uint32_t(indices[i]) << (2 * i);
+        out[0] = static_cast<uint8_t>(c0 & 0xff);
+        out[1] = static_cast<uint8_t>(c0 >> 8);
+        out[2] = static_cast<uint8_t>(c1 & 0xff);
+        out[3] = static_cast<uint8_t>(c1 >> 8);
+        std::memcpy(out + 4, &bits, sizeof(bits));
+    }
+
+    void encode_bc3_alpha(const uint8_t rgba[64], uint8_t out[8]) {
+        int lo = 255, hi = 0;
+        for (int i = 0; i < 16; i++) {
+            lo = std::min(lo, int(rgba[4 * i + 3]));
+            hi = std::max(hi, int(rgba[4 * i + 3]));
+        }
+        out[0] = static_cast<uint8_t>(hi);
+        out[1] = static_cast<uint8_t>(lo);
+        uint64_t bits = 0;
+        if (hi > lo) {
+            // With a0 > a1 the palette is a0, a1 and six values in between: index 8 - r holds rank r of 1..6.
+            for (int i = 0; i < 16; i++) {
+                auto r = (7 * (rgba[4 * i + 3] - lo) + (hi - lo) / 2) / (hi - lo);
+                uint64_t index = r == 7 ? 0 : r == 0 ? 1 : 8 - r;
+                bits |= index << (3 * i);
+            }
+        }
+        for (int i = 0; i < 6; i++)
+            out[2 + i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+
+    /**
+     * Gathers the 4x4 block at (bx, by) as RGBA, repeating the last row and column of the image past its edges.
+     */
+    void load_block(const uint8_t *pixels, int width, int height, int channels, int bx, int by, uint8_t rgba[64]) {
+        for (int y = 0; y < 4; y++) {
+            auto sy = std::min(4 * by + y, height - 1);
+            for (int x = 0; x < 4; x++) {
+                auto sx = std::min(4 * bx + x, width - 1);
+                auto src = pixels + (size_t(sy) * width + sx) * channels;
+                auto dst = rgba + 4 * (4 * y + x);
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+                dst[3] = channels == 4 ? src[3] : 255;
+            }
+        }
+    }
+
+    /**
+     * Endpoints whose 2/3 : 1/3 mix is closest to every 8 bit value, for 5 and 6 bit channels. Solid blocks are
+     * encoded with them, getting much closer to the colour than a single 565 endpoint.
+     */
+    struct SingleColor {
+        uint8_t e0[256];
+        uint8_t e1[256];
+
+        explicit SingleColor(int bits) {
+            auto max = (1 << bits) - 1;
+            auto expand = [bits](int e) { return (e << (8 - bits)) | (e >> (2 * bits - 8)); };
+            for (int v = 0; v < 256; v++) {
+                auto best = 1 << 30;
+                for (int a = 0; a <= max; a++) {
+                    for (int b = 0; b <= max; b++) {
+                        auto error = std::abs((2 * expand(a) + expand(b)) / 3 - v);
+                        if (error < best) {
+                            best = error;
+                            e0[v] = static_cast<uint8_t>(a);
+                            e1[v] = static_cast<uint8_t>(b);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    bool is_solid(const uint8_t rgba[64]) {
+        for (int i = 1; i < 16; i++)
+            if (rgba[4 * i] != rgba[0] || rgba[4 * i + 1] != rgba[1] || rgba[4 * i + 2] != rgba[2])
+                return false;
+        return true;
+    }
+
+    void encode_solid_bc1(const uint8_t rgb[3], uint8_t out[8]) {
+        static const SingleColor table5(5), table6(6);
+        auto c0 = static_cast<uint16_t>((table5.e0[rgb[0]] << 11) | (table6.e0[rgb[1]] << 5) | table5.e0[rgb[2]]);
+        auto c1 = static_cast<uint16_t>((table5.e1[rgb[0]] << 11) | (table6.e1[rgb[1]] << 5) | table5.e1[rgb[2]]);
+        uint8_t indices[16];
+        std::fill(indices, indices + 16, uint8_t(2));
+        write_bc1(c0, c1, indices, out);
+    }
+
+    bool has_transparency(const uint8_t *pixels, size_t n_pixels) {
+        for (size_t i = 0; i < n_pixels; i++)
+            if (pixels[4 * i + 3] != 255)
+                return true;
+        return false;
+    }
+}
+
+namespace xe {
+
+    GLenum block_format_gl(BlockFormat format) {
+        switch (format) {
+            case BlockFormat::BC1:
+                return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            case BlockFormat::BC3:
+                return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+            default:
+                return 0;
+        }
+    }
+
+    bool block_compression_supported() {
+        GLint n = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+        for (GLint i = 0; i < n; i++) {
+            auto name = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+            if (name && std::strcmp(name, "GL_EXT_texture_compression_s3tc") == 0)
+                return true;
+        }
+        return false;
+    }
+
+    void encode_bc1_block(const uint8_t rgba[64], uint8_t out[8]) {
+        if (is_solid(rgba)) {
+            encode_solid_bc1(rgba, out);
+            return;
+        }
+
+        float mean[3] = {0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++)
+            for (int k = 0; k < 3; k++)
+                mean[k] += rgba[4 * i + k] / 16.0f;
+
+        float cov[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++) {
+            float d[3];
+            for (int k = 0; k < 3; k++)
+                d[k] = rgba[4 * i + k] - mean[k];
+            cov[0] += d[0] * d[0];
+            cov[1] += d[0] * d[1];
+            cov[2] += d[0] * d[2];
+            cov[3] += d[1] * d[1];
+            cov[4] += d[1] * d[2];
+            cov[5] += d[2] * d[2];
+        }
+
+        // Principal axis by power iteration, starting from the covariance column of the channel varying the most.
+        // Any fixed start, e.g. grey, fails for colours varying orthogonally to it.
+        float axis[3];
+        if (cov[0] >= cov[3] && cov[0] >= cov[5]) {
+            axis[0] = cov[0];
+            axis[1] = cov[1];
+            axis[2] = cov[2];
+        } else if (cov[3] >= cov[5]) {
+            axis[0] = cov[1];
+            axis[1] = cov[3];
+            axis[2] = cov[4];
+        } else {
+            axis[0] = cov[2];
+            axis[1] = cov[4];
+            axis[2] = cov[5];
+        }
+        for (int it = 0; it < 8; it++) {
+            float v[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                          cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                          cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+            auto norm = std::max({std::abs(v[0]), std::abs(v[1]), std::abs(v[2])});
+            if (norm < 1e-6f)
+                break;
+            for (int k = 0; k < 3; k++)
+                axis[k] = v[k] / norm;
+        }
+
+        float t_min = 1e30f, t_max = -1e30f;
+        for (int i = 0; i < 16; i++) {
+            auto t = 0.0f;
+            for (int k = 0; k < 3; k++)
+                t += (rgba[4 * i + k] - mean[k]) * axis[k];
+            t_min = std::min(t_min, t);
+            t_max = std::max(t_max, t);
+        }
+        auto len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        float a[3], b[3];
+        for (int k = 0; k < 3; k++) {
+            a[k] = mean[k] + axis[k] * t_max / len2;
+            b[k] = mean[k] + axis[k] * t_min / len2;
+        }
+
+        uint8_t indices[16];
+        auto c0 = pack_565(a), c1 = pack_565(b);
+        auto error = assign_indices(rgba, c0, c1, indices);
+
+        if (error > 0 && fit_endpoints(rgba, indices, a, b)) {
+            uint8_t refined[16];
+            auto r0 = pack_565(a), r1 = pack_565(b);
+            auto refined_error = assign_indices(rgba, r0, r1, refined);
+            if (refined_error < error) {
+                c0 = r0;
+                c1 = r1;
+                std::copy(refined, refined + 16, indices);
+            }
+        }
+        write_bc1(c0, c1, indices, out);
+    }
+
+    void encode_bc3_block(const uint8_t rgba[64], uint8_t out[16]) {
+        encode_bc3_alpha(rgba, out);
+        encode_bc1_block(rgba, out + 8);
+    }
+
+    void compress_level(const uint8_t *pixels, int width, int height, int channels, BlockFormat format, uint8_t *dst,
+                        unsigned int n_threads) {
+        auto blocks_x = (width + 3) / 4;
+        auto blocks_y = (height + 3) / 4;
+        auto bytes = block_bytes(format);
+        parallel_for(static_cast<size_t>(blocks_y), n_threads, [&](size_t by) {
+            uint8_t rgba[64];
+            auto out = dst + by * blocks_x * bytes;
+            for (int bx = 0; bx < blocks_x; bx++, out += bytes) {
+                load_block(pixels, width, height, channels, bx, static_cast<int>(by), rgba);
+                if (format == BlockFormat::BC3)
+                    encode_bc3_block(rgba, out);
+                else
+                    encode_bc1_block(rgba, out);
+            }
+        });
+    }
+
+    bool compress_image(Image *image, unsigned int n_threads) {
+        if (image->compressed())
+            return true;
+        if (image->channels != 3 && image->channels != 4)
+            return false;
+        if (image->levels < mip_levels(image->width, image->height))
+            generate_mipmaps(image);
+
+        auto n_pixels = size_t(image->width) * size_t(image->height);
+        auto transparent = image->channels == 4 && has_transparency(image->pixels.get(), n_pixels);
+        auto format = transparent ? BlockFormat::BC3 : BlockFormat::BC1;
+
+        // The levels are read from the pixels while the blocks are written, the sizes come from a compressed view.
+        Image view;
+        view.width = image->width;
+        view.height = image->height;
+        view.levels = image->levels;
+        view.block_format = format;
+        size_t size = 0;
+        for (int level = 0; level < image->levels; level++)
+            size += view.level_size(level);
+
+        std::vector<unsigned char> blocks(size);
+        size_t offset = 0;
+        for (int level = 0; level < image->levels; level++) {
+            compress_level(image->level_data(level), image->level_width(level), image->level_height(level),
+                           image->channels, format, blocks.data() + offset, n_threads);
+            offset += view.level_size(level);
+        }
+
+        image->block_format = format;
+        image->blocks = std::move(blocks);
+        image->pixels.reset();
+        image->mips.clear();
+        image->mips.shrink_to_fit();
+        return true;
+    }
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+
+#include "glad/gl.h"
+
+#include "XeEngine/ImageDecoder.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+namespace xe {
+
+    /**
+     * GL internal format of the block format.
+     */
+    GLenum block_format_gl(BlockFormat format);
+
+    /**
+     * Whether the current GL context can sample BC1 and BC3 (EXT_texture_compression_s3tc).
+     */
+    bool block_compression_supported();
+
+    /**
+     * Encodes a 4x4 block of RGBA texels, row by row, as BC1 (opaque, four colour mode). The endpoints are fitted
+     * along the principal axis of the colours and refined once by least squares.
+     */
+    void encode_bc1_block(const uint8_t rgba[64], uint8_t out[8]);
+
+    /**
+     * Encodes a 4x4 block of RGBA texels as BC3: eight interpolated alpha values followed by a BC1 colour block.
+     */
+    void encode_bc3_block(const uint8_t rgba[64], uint8_t out[16]);
+
+    /**
+     * Encodes a width x height image with 3 or 4 channels into ((width + 3) / 4) * ((height + 3) / 4) blocks, rows of
+     * blocks are spread over `n_threads` threads (0 means all). Blocks on the right and top edges repeat the last
+     * texels.
+     */
+    void compress_level(const uint8_t *pixels, int width, int height, int channels, BlockFormat format, uint8_t *dst,
+                        unsigned int n_threads = 0);
+
+    /**
+     * Replaces the pixels of the image with the block compressed full mip chain, generating the mipmaps if needed.
+     * Images with some transparency become BC3, others BC1. Returns false for channel counts other than 3 and 4.
+     */
+    bool compress_image(Image *image, unsigned int n_threads = 0);
+
+}
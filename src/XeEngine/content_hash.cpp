@@ -0,0 +1,106 @@
+#include "content_hash.h"
+
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#include "ObjectReader/mapped_file.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+    const uint64_t P1 = 0x9E3779B185EBCA87ull;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t P3 = 0x165667B19E3779F9ull;
+    const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+    inline uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t read64(const unsigned char *p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        acc = rotl(acc, 31);
+        return acc * P1;
+    }
+
+    inline uint64_t merge(uint64_t acc, uint64_t lane) {
+        acc ^= round(0, lane);
+        return acc * P1 + P4;
+    }
+}
+
+namespace xe {
+
+    uint64_t content_hash(const void *data, size_t size, uint64_t seed) {
+        auto p = static_cast<const unsigned char *>(data);
+        auto end = p + size;
+        uint64_t h;
+
+        if (size >= 32) {
+            // Four independent lanes keep the multipliers busy.
+            uint64_t v1 = seed + P1 + P2;
+            uint64_t v2 = seed + P2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - P1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(h, v1);
+            h = merge(h, v2);
+            h = merge(h, v3);
+            h = merge(h, v4);
+        } else {
+            h = seed + P5;
+        }
+        h += static_cast<uint64_t>(size);
+
+        for (; p + 8 <= end; p += 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * P1 + P4;
+        }
+        for (; p < end; ++p) {
+            h ^= (*p) * P5;
+            h = rotl(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    bool file_content_hash(const std::string &path, uint64_t *hash) {
+        MappedFile file(path);
+        if (!file.is_open())
+            return false;
+        *hash = content_hash(file.data(), file.size());
+        return true;
+    }
+
+    bool file_stamp(const std::string &path, uint64_t *size, int64_t *mtime) {
+        std::error_code ec;
+        auto s = fs::file_size(path, ec);
+        if (ec)
+            return false;
+        auto t = fs::last_write_time(path, ec);
+        if (ec)
+            return false;
+        *size = static_cast<uint64_t>(s);
+        *mtime = static_cast<int64_t>(t.time_since_epoch().count());
+        return true;
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace xe {
+
+    /**
+     * Fast non cryptographic 64 bit hash used to detect changed asset files. It is built from xxHash64 style rounds
+     * but makes no promise to match any published hash.
+     */
+    uint64_t content_hash(const void *data, size_t size, uint64_t seed = 0);
+
+    /**
+     * Hash of the whole content of the file. Returns false if the file cannot be read.
+     */
+    bool file_content_hash(const std::string &path, uint64_t *hash);
+
+    /**
+     * Size and modification time of the file, the quick check whether a cache built from it is still up to date.
+     * Returns false if the file does not exist.
+     */
+    bool file_stamp(const std::string &path, uint64_t *size, int64_t *mtime);
+
+}
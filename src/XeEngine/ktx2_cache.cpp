@@ -0,0 +1,308 @@
+#include "ktx2_cache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/mapped_file.h"
+#include "XeEngine/content_hash.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    const uint8_t IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+    // VK_FORMAT_BC1_RGB_UNORM_BLOCK and VK_FORMAT_BC3_UNORM_BLOCK.
+    const uint32_t VK_FORMAT_BC1 = 131u;
+    const uint32_t VK_FORMAT_BC3 = 137u;
+
+    const char SOURCE_KEY[] = "XeSource";
+
+    struct Ktx2Header {
+        uint8_t identifier[12];
+        uint32_t vk_format;
+        uint32_t type_size;
+        uint32_t pixel_width;
+        uint32_t pixel_height;
+        uint32_t pixel_depth;
+        uint32_t layer_count;
+        uint32_t face_count;
+        uint32_t level_count;
+        uint32_t supercompression_scheme;
+
+        uint32_t dfd_byte_offset;
+        uint32_t dfd_byte_length;
+        uint32_t kvd_byte_offset;
+        uint32_t kvd_byte_length;
+        uint64_t sgd_byte_offset;
+        uint64_t sgd_byte_length;
+    };
+
+    struct Ktx2Level {
+        uint64_t byte_offset;
+        uint64_t byte_length;
+        uint64_t uncompressed_byte_length;
+    };
+
+    struct SourceStamp {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t hash;
+    };
+
+    static_assert(sizeof(Ktx2Header) == 80, "KTX2 header is 80 bytes");
+
+    uint64_t align(uint64_t offset, uint64_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * Data format descriptor with a single basic block, as in the KTX 2.0 and Khronos Data Format specifications.
+     */
+    std::vector<uint32_t> data_format_descriptor(xe::BlockFormat format) {
+        const uint32_t KHR_DF_MODEL_BC1A = 128u, KHR_DF_MODEL_BC3 = 130u;
+        const uint32_t KHR_DF_PRIMARIES_BT709 = 1u, KHR_DF_TRANSFER_LINEAR = 1u;
+        const uint32_t KHR_DF_CHANNEL_COLOR = 0u, KHR_DF_CHANNEL_BC3_ALPHA = 15u;
+
+        auto bc3 = format == xe::BlockFormat::BC3;
+        uint32_t n_samples = bc3 ? 2u : 1u;
+        uint32_t block_size = 24u + 16u * n_samples;
+        std::vector<uint32_t> dfd = {
+                4u + block_size,
+                0u,
+                2u | (block_size << 16),
+                (bc3 ? KHR_DF_MODEL_BC3 : KHR_DF_MODEL_BC1A) | (KHR_DF_PRIMARIES_BT709 << 8) |
+                (KHR_DF_TRANSFER_LINEAR << 16),
+                3u | (3u << 8),
+                static_cast<uint32_t>(xe::block_bytes(format)),
+                0u};
+        auto sample = [&dfd](uint32_t bit_offset, uint32_t channel) {
+            dfd.insert(dfd.end(), {bit_offset | (63u << 16) | (channel << 24), 0u, 0u, 0xFFFFFFFFu});
+        };
+        if (bc3) {
+            sample(0u, KHR_DF_CHANNEL_BC3_ALPHA);
+            sample(64u, KHR_DF_CHANNEL_COLOR);
+        } else {
+            sample(0u, KHR_DF_CHANNEL_COLOR);
+        }
+        return dfd;
+    }
+
+    void put_key_value(std::vector<char> *kvd, const char *key, const void *value, uint32_t value_size) {
+        auto key_size = static_cast<uint32_t>(std::strlen(key) + 1);
+        uint32_t length = key_size + value_size;
+        auto p = reinterpret_cast<const char *>(&length);
+        kvd->insert(kvd->end(), p, p + sizeof(length));
+        kvd->insert(kvd->end(), key, key + key_size);
+        p = static_cast<const char *>(value);
+        kvd->insert(kvd->end(), p, p + value_size);
+        kvd->resize(align(kvd->size(), 4));
+    }
+
+    /**
+     * Looks the key up in the key/value data, returns the offset of its value from `kvd` or 0 if missing.
+     */
+    size_t find_key_value(const char *kvd, size_t size, const char *key, uint32_t *value_size) {
+        auto key_size = std::strlen(key) + 1;
+        size_t offset = 0;
+        while (offset + sizeof(uint32_t) <= size) {
+            uint32_t length;
+            std::memcpy(&length, kvd + offset, sizeof(length));
+            auto entry = offset + sizeof(length);
+            if (length > size - entry)
+                return 0;
+            if (length >= key_size && std::memcmp(kvd + entry, key, key_size) == 0) {
+                *value_size = static_cast<uint32_t>(length - key_size);
+                return entry + key_size;
+            }
+            offset = align(entry + length, 4);
+        }
+        return 0;
+    }
+
+    bool in_file(uint64_t offset, uint64_t size, uint64_t file_size) {
+        return offset <= file_size && size <= file_size - offset;
+    }
+}
+
+namespace xe {
+
+    std::string ktx2_cache_path(const std::string &source) {
+        return source + ".ktx2";
+    }
+
+    bool load_ktx2_cache(const std::string &source, bool flip_vertically, Image *image) {
+        auto cache = ktx2_cache_path(source);
+        MappedFile file(cache);
+        if (!file.is_open())
+            return false;
+
+        Ktx2Header h;
+        auto size = file.size();
+        if (size < sizeof(h))
+            return false;
+        std::memcpy(&h, file.data(), sizeof(h));
+        if (std::memcmp(h.identifier, IDENTIFIER, sizeof(IDENTIFIER)) != 0 ||
+            (h.vk_format != VK_FORMAT_BC1 && h.vk_format != VK_FORMAT_BC3) || h.supercompression_scheme != 0 ||
+            h.level_count == 0 || h.face_count != 1 || h.layer_count > 1 || h.pixel_depth > 1 ||
+            !in_file(sizeof(h), h.level_count * sizeof(Ktx2Level), size) ||
+            !in_file(h.kvd_byte_offset, h.kvd_byte_length, size)) {
+            spdlog::debug("Texture cache `{}' has a different format", cache);
+            return false;
+        }
+
+        auto base = file.data();
+        uint32_t value_size = 0;
+        auto stamp_offset = find_key_value(base + h.kvd_byte_offset, h.kvd_byte_length, SOURCE_KEY, &value_size);
+        if (stamp_offset == 0 || value_size != sizeof(SourceStamp))
+            return false;
+        stamp_offset += h.kvd_byte_offset;
+        SourceStamp stamp;
+        std::memcpy(&stamp, base + stamp_offset, sizeof(stamp));
+
+        auto orientation_offset = find_key_value(base + h.kvd_byte_offset, h.kvd_byte_length, "KTXorientation",
+                                                 &value_size);
+        auto bottom_up = orientation_offset != 0 && value_size >= 2 &&
+                         base[h.kvd_byte_offset + orientation_offset + 1] == 'u';
+        if (bottom_up != flip_vertically)
+            return false;
+
+        uint64_t source_size;
+        int64_t source_mtime;
+        if (!file_stamp(source, &source_size, &source_mtime) || source_size != stamp.size)
+            return false;
+        // Touched but maybe not modified, compare the content before giving up on the cache.
+        auto touched = source_mtime != stamp.mtime;
+        if (touched) {
+            uint64_t hash;
+            if (!file_content_hash(source, &hash) || hash != stamp.hash)
+                return false;
+        }
+
+        Image result;
+        result.width = static_cast<int>(h.pixel_width);
+        result.height = static_cast<int>(std::max(1u, h.pixel_height));
+        result.block_format = h.vk_format == VK_FORMAT_BC3 ? BlockFormat::BC3 : BlockFormat::BC1;
+        result.channels = result.block_format == BlockFormat::BC3 ? 4 : 3;
+        result.levels = static_cast<int>(h.level_count);
+        result.hash = stamp.hash;
+
+        std::vector<Ktx2Level> levels(h.level_count);
+        std::memcpy(levels.data(), base + sizeof(h), levels.size() * sizeof(Ktx2Level));
+        size_t total = 0;
+        for (int level = 0; level < result.levels; level++) {
+            if (levels[level].byte_length != result.level_size(level) ||
+                !in_file(levels[level].byte_offset, levels[level].byte_length, size)) {
+                spdlog::warn("Texture cache `{}' is corrupted", cache);
+                return false;
+            }
+            total += levels[level].byte_length;
+        }
+        result.blocks.resize(total);
+        size_t offset = 0;
+        for (int level = 0; level < result.levels; level++) {
+            std::memcpy(result.blocks.data() + offset, base + levels[level].byte_offset, levels[level].byte_length);
+            offset += levels[level].byte_length;
+        }
+
+        // The blocks are copied, so the cache can be written anew with the new stamp. It is never patched in place,
+        // as other processes may be reading it.
+        if (touched) {
+            file.close();
+            save_ktx2_cache(source, flip_vertically, result);
+        }
+
+        *image = std::move(result);
+        spdlog::debug("Loaded texture `{}' from cache `{}'", source, cache);
+        return true;
+    }
+
+    bool save_ktx2_cache(const std::string &source, bool flip_vertically, const Image &image) {
+        if (!image.compressed())
+            return false;
+
+        // The hash is the one of the bytes the image was decoded from, the source is not read again.
+        SourceStamp stamp;
+        if (!file_stamp(source, &stamp.size, &stamp.mtime))
+            return false;
+        stamp.hash = image.hash;
+
+        Ktx2Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.identifier, IDENTIFIER, sizeof(IDENTIFIER));
+        h.vk_format = image.block_format == BlockFormat::BC3 ? VK_FORMAT_BC3 : VK_FORMAT_BC1;
+        h.type_size = 1;
+        h.pixel_width = static_cast<uint32_t>(image.width);
+        h.pixel_height = static_cast<uint32_t>(image.height);
+        h.face_count = 1;
+        h.level_count = static_cast<uint32_t>(image.levels);
+
+        auto dfd = data_format_descriptor(image.block_format);
+        // Keys sorted by their bytes, as the specification requires.
+        std::vector<char> kvd;
+        put_key_value(&kvd, "KTXorientation", flip_vertically ? "ru" : "rd", 3);
+        put_key_value(&kvd, "KTXwriter", "XeEngine", 9);
+        put_key_value(&kvd, SOURCE_KEY, &stamp, sizeof(stamp));
+
+        std::vector<Ktx2Level> levels(image.levels);
+        uint64_t offset = sizeof(h) + levels.size() * sizeof(Ktx2Level);
+        h.dfd_byte_offset = static_cast<uint32_t>(offset);
+        h.dfd_byte_length = static_cast<uint32_t>(dfd.size() * sizeof(uint32_t));
+        offset += h.dfd_byte_length;
+        h.kvd_byte_offset = static_cast<uint32_t>(offset);
+        h.kvd_byte_length = static_cast<uint32_t>(kvd.size());
+        offset += h.kvd_byte_length;
+
+        // The smallest level comes first in the file, each aligned to the block size.
+        auto alignment = block_bytes(image.block_format);
+        for (int level = image.levels - 1; level >= 0; level--) {
+            offset = align(offset, alignment);
+            levels[level] = {offset, image.level_size(level), image.level_size(level)};
+            offset += image.level_size(level);
+        }
+
+        // Write to a temporary file and rename it, so nobody ever reads a half written cache.
+        auto cache = ktx2_cache_path(source);
+        auto tmp = cache + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                spdlog::warn("Cannot write texture cache `{}'", tmp);
+                return false;
+            }
+            out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char *>(levels.data()),
+                      static_cast<std::streamsize>(levels.size() * sizeof(Ktx2Level)));
+            out.write(reinterpret_cast<const char *>(dfd.data()), h.dfd_byte_length);
+            out.write(kvd.data(), static_cast<std::streamsize>(kvd.size()));
+            uint64_t position = h.kvd_byte_offset + h.kvd_byte_length;
+            static const char zeros[16] = {};
+            for (int level = image.levels - 1; level >= 0; level--) {
+                out.write(zeros, static_cast<std::streamsize>(levels[level].byte_offset - position));
+                out.write(reinterpret_cast<const char *>(image.level_data(level)),
+                          static_cast<std::streamsize>(levels[level].byte_length));
+                position = levels[level].byte_offset + levels[level].byte_length;
+            }
+            if (!out) {
+                spdlog::warn("Cannot write texture cache `{}'", tmp);
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp, cache, ec);
+        if (ec) {
+            spdlog::warn("Cannot write texture cache `{}': {}", cache, ec.message());
+            fs::remove(tmp, ec);
+            return false;
+        }
+        spdlog::debug("Saved texture `{}' to cache `{}'", source, cache);
+        return true;
+    }
+
+}
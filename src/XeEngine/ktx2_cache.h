@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "XeEngine/ImageDecoder.h"
+
+namespace xe {
+
+    /**
+     * Block compressed texture cache.
+     *
+     * A `.ktx2` file stored next to the source image holds its full BC1 or BC3 mip chain in the KTX 2.0 container
+     * (no supercompression), so other tools can open it too. The size, modification time and content hash of the
+     * source are kept in the `XeSource` key/value entry and the row order in `KTXorientation`: `ru` for the
+     * vertically flipped images uploaded by the engine.
+     *
+     * A hit is a single file read, the source image is not read unless its modification time changed. If its content
+     * did not change either, the cache is written anew with the new stamp through save_ktx2_cache.
+     */
+    std::string ktx2_cache_path(const std::string &source);
+
+    /**
+     * Fills `image` with the cached blocks, its hash set to the content hash of the source. Returns false if there is
+     * no cache, it is stale or its row order differs from `flip_vertically`.
+     */
+    bool load_ktx2_cache(const std::string &source, bool flip_vertically, Image *image);
+
+    /**
+     * Writes the blocks of `image`, stamped with `image.hash`, which must be the content hash of the source it was
+     * decoded from.
+     */
+    bool save_ktx2_cache(const std::string &source, bool flip_vertically, const Image &image);
+
+}
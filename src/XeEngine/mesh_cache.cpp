@@ -0,0 +1,541 @@
+#include "mesh_cache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <type_traits>
+
+#include "spdlog/spdlog.h"
+
+#include "XeEngine/content_hash.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    const char MAGIC[8] = {'X', 'E', 'M', 'E', 'S', 'H', '\0', '\0'};
+    const uint32_t VERSION = 6u;
+    const uint64_t ALIGNMENT = 16u;
+
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t options;
+
+        uint64_t source_size;
+        int64_t source_mtime;
+        uint64_t source_hash;
+        uint64_t file_size;
+
+        uint32_t stride;
+        uint32_t n_attributes;
+        uint64_t n_vertices;
+        uint32_t index_type;
+        uint32_t n_ranges;
+        uint32_t n_submeshes;
+        uint32_t n_materials;
+        uint32_t n_clusters;
+        uint32_t n_lods;
+        float bb_min[3];
+        float bb_max[3];
+        float position_scale[3];
+        float position_offset[3];
+        int32_t normal_encoding;
+
+        uint64_t path_offset;
+        uint64_t path_size;
+        uint64_t attributes_offset;
+        uint64_t ranges_offset;
+        uint64_t submeshes_offset;
+        uint64_t submesh_bb_offset;
+        uint64_t clusters_offset;
+        uint64_t materials_offset;
+        uint64_t materials_size;
+        uint64_t lods_offset;
+        uint64_t lods_size;
+        uint64_t vertices_offset;
+        uint64_t vertices_size;
+        uint64_t indices_offset;
+        uint64_t indices_size;
+    };
+
+    struct CachedBox {
+        float min[3];
+        float max[3];
+        uint64_t n_points;
+    };
+
+    static_assert(std::is_trivially_copyable<CacheHeader>::value, "CacheHeader is written as raw bytes");
+    static_assert(std::is_trivially_copyable<xe::MeshCluster>::value, "MeshCluster is written as raw bytes");
+
+    uint64_t align(uint64_t offset) {
+        return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    std::string absolute_path(const std::string &source) {
+        std::error_code ec;
+        auto p = fs::absolute(source, ec);
+        return ec ? source : p.lexically_normal().string();
+    }
+
+    /**
+     * Materials are stored as a sequence of fields: strings as a 32 bit length followed by the characters,
+     * numbers in native representation.
+     */
+    class Writer {
+    public:
+        template<typename T>
+        void put(const T &value) {
+            auto p = reinterpret_cast<const char *>(&value);
+            bytes_.insert(bytes_.end(), p, p + sizeof(T));
+        }
+
+        void put_string(const std::string &str) {
+            put(static_cast<uint32_t>(str.size()));
+            bytes_.insert(bytes_.end(), str.begin(), str.end());
+        }
+
+        const std::vector<char> &bytes() const { return bytes_; }
+
+    private:
+        std::vector<char> bytes_;
+    };
+
+    class Reader {
+    public:
+        Reader(const char *begin, const char *end) : p_(begin), end_(end) {}
+
+        template<typename T>
+        bool get(T *value) {
+            if (static_cast<size_t>(end_ - p_) < sizeof(T))
+                return false;
+            std::memcpy(value, p_, sizeof(T));
+            p_ += sizeof(T);
+            return true;
+        }
+
+        bool get_string(std::string *str) {
+            uint32_t size;
+            if (!get(&size) || static_cast<size_t>(end_ - p_) < size)
+                return false;
+            str->assign(p_, size);
+            p_ += size;
+            return true;
+        }
+
+    private:
+        const char *p_;
+        const char *end_;
+    };
+
+    std::vector<char> serialize_materials(const std::vector<xe::mtl_material_t> &materials) {
+        Writer w;
+        for (auto &&m: materials) {
+            w.put_string(m.name);
+            w.put(static_cast<int32_t>(m.illum));
+            for (int i = 0; i < 3; i++) w.put(static_cast<float>(m.ambient[i]));
+            for (int i = 0; i < 3; i++) w.put(static_cast<float>(m.diffuse[i]));
+            for (int i = 0; i < 3; i++) w.put(static_cast<float>(m.specular[i]));
+            w.put(static_cast<float>(m.shininess));
+            w.put(static_cast<float>(m.dissolve));
+            w.put_string(m.diffuse_texname);
+        }
+        return w.bytes();
+    }
+
+    bool deserialize_materials(Reader r, uint32_t n_materials, std::vector<xe::mtl_material_t> *materials) {
+        materials->resize(n_materials);
+        for (auto &&m: *materials) {
+            int32_t illum;
+            float f;
+            if (!r.get_string(&m.name) || !r.get(&illum))
+                return false;
+            m.illum = illum;
+            for (int i = 0; i < 3; i++) {
+                if (!r.get(&f)) return false;
+                m.ambient[i] = f;
+            }
+            for (int i = 0; i < 3; i++) {
+                if (!r.get(&f)) return false;
+                m.diffuse[i] = f;
+            }
+            for (int i = 0; i < 3; i++) {
+                if (!r.get(&f)) return false;
+                m.specular[i] = f;
+            }
+            if (!r.get(&f)) return false;
+            m.shininess = f;
+            if (!r.get(&f)) return false;
+            m.dissolve = f;
+            if (!r.get_string(&m.diffuse_texname))
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<char> serialize_lods(const std::vector<xe::MeshLod> &lods) {
+        Writer w;
+        for (auto &&lod: lods) {
+            w.put(lod.error);
+            w.put(static_cast<uint32_t>(lod.ranges.size()));
+            for (auto &&r: lod.ranges)
+                w.put(r);
+        }
+        return w.bytes();
+    }
+
+    bool deserialize_lods(Reader r, uint32_t n_lods, std::vector<xe::MeshLod> *lods) {
+        lods->resize(n_lods);
+        for (auto &&lod: *lods) {
+            uint32_t n_ranges;
+            if (!r.get(&lod.error) || !r.get(&n_ranges))
+                return false;
+            lod.ranges.resize(n_ranges);
+            for (auto &&range: lod.ranges)
+                if (!r.get(&range))
+                    return false;
+        }
+        return true;
+    }
+
+    bool in_file(uint64_t offset, uint64_t size, uint64_t file_size) {
+        return offset <= file_size && size <= file_size - offset;
+    }
+
+    // Minimum value of GL_MAX_VERTEX_ATTRIBS, the cache is read before any context is queried.
+    const GLuint MAX_VERTEX_ATTRIBS = 16u;
+
+    /**
+     * Bytes read by the attribute from every vertex, 0 for sizes and types the engine never writes.
+     */
+    uint64_t attribute_bytes(const xe::VertexAttribute &a) {
+        if (a.size < 1 || a.size > 4)
+            return 0;
+        switch (a.type) {
+            case GL_BYTE:
+            case GL_UNSIGNED_BYTE:
+                return a.size;
+            case GL_SHORT:
+            case GL_UNSIGNED_SHORT:
+            case GL_HALF_FLOAT:
+                return 2u * a.size;
+            case GL_FLOAT:
+                return 4u * a.size;
+            case GL_INT_2_10_10_10_REV:
+            case GL_UNSIGNED_INT_2_10_10_10_REV:
+                return a.size == 4 ? 4u : 0u;
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Checks that every attribute has a distinct location below the guaranteed attribute limit and is read from
+     * inside the vertex, so a corrupted cache cannot make the vertex fetch read past the vertex buffer.
+     */
+    bool valid_attributes(const std::vector<xe::VertexAttribute> &attributes, uint32_t stride) {
+        uint32_t used = 0;
+        for (auto &&a: attributes) {
+            auto bytes = attribute_bytes(a);
+            if (a.index >= MAX_VERTEX_ATTRIBS || (used & (1u << a.index)) || bytes == 0 || a.offset > stride ||
+                bytes > stride - a.offset)
+                return false;
+            used |= 1u << a.index;
+        }
+        return true;
+    }
+
+    template<typename T>
+    uint64_t max_index(const void *indices, GLuint start, GLuint end) {
+        auto p = static_cast<const T *>(indices);
+        uint64_t result = 0;
+        for (auto i = start; i < end; i++)
+            result = std::max<uint64_t>(result, p[i]);
+        return result;
+    }
+
+    uint64_t max_index(const void *indices, GLenum type, GLuint start, GLuint end) {
+        switch (type) {
+            case GL_UNSIGNED_BYTE:
+                return max_index<uint8_t>(indices, start, end);
+            case GL_UNSIGNED_SHORT:
+                return max_index<uint16_t>(indices, start, end);
+            default:
+                return max_index<uint32_t>(indices, start, end);
+        }
+    }
+
+    /**
+     * Checks that the ranges stay inside `n_indices` indices and refer to existing submeshes and that every index
+     * they draw, plus the base vertex, is below `n_vertices`, so a corrupted cache cannot make the loader index past
+     * its tables or draw past the buffers.
+     */
+    bool valid_ranges(const std::vector<xe::IndexRange> &ranges, const void *indices, GLenum index_type,
+                      uint64_t n_indices, uint64_t n_vertices, uint32_t n_submeshes) {
+        for (auto &&r: ranges) {
+            if (r.submesh < 0 || static_cast<uint32_t>(r.submesh) >= n_submeshes || r.start > r.end ||
+                r.end > n_indices || r.base_vertex < 0)
+                return false;
+            if (r.start != r.end &&
+                static_cast<uint64_t>(r.base_vertex) + max_index(indices, index_type, r.start, r.end) >= n_vertices)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Clusters are drawn with the base vertex of their range, so they must lie inside it.
+     */
+    bool valid_clusters(const std::vector<xe::MeshCluster> &clusters, const std::vector<xe::IndexRange> &ranges) {
+        for (auto &&c: clusters) {
+            if (c.submesh < 0 || static_cast<size_t>(c.submesh) >= ranges.size() || c.start > c.end)
+                return false;
+            auto &&r = ranges[c.submesh];
+            if (c.start < r.start || c.end > r.end)
+                return false;
+        }
+        return true;
+    }
+
+    void write_padding(std::ofstream &out, uint64_t from, uint64_t to) {
+        static const char zeros[ALIGNMENT] = {};
+        out.write(zeros, static_cast<std::streamsize>(to - from));
+    }
+}
+
+namespace xe {
+
+    std::string mesh_cache_path(const std::string &source) {
+        return source + ".xemesh";
+    }
+
+    bool load_mesh_cache(const std::string &source, uint32_t options, MeshData *data) {
+        auto cache = mesh_cache_path(source);
+        MappedFile file(cache);
+        if (!file.is_open())
+            return false;
+
+        CacheHeader h;
+        if (file.size() < sizeof(h))
+            return false;
+        std::memcpy(&h, file.data(), sizeof(h));
+        if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION || h.options != options ||
+            h.file_size != file.size()) {
+            spdlog::debug("Mesh cache `{}' is stale or has a different format", cache);
+            return false;
+        }
+
+        auto size = file.size();
+        if (!in_file(h.path_offset, h.path_size, size) ||
+            !in_file(h.attributes_offset, h.n_attributes * sizeof(VertexAttribute), size) ||
+            !in_file(h.ranges_offset, h.n_ranges * sizeof(IndexRange), size) ||
+            !in_file(h.submeshes_offset, h.n_submeshes * sizeof(int32_t), size) ||
+            !in_file(h.submesh_bb_offset, h.n_submeshes * sizeof(CachedBox), size) ||
+            !in_file(h.clusters_offset, h.n_clusters * sizeof(MeshCluster), size) ||
+            !in_file(h.materials_offset, h.materials_size, size) ||
+            !in_file(h.lods_offset, h.lods_size, size) ||
+            !in_file(h.vertices_offset, h.vertices_size, size) ||
+            !in_file(h.indices_offset, h.indices_size, size) ||
+            (h.index_type != GL_UNSIGNED_BYTE && h.index_type != GL_UNSIGNED_SHORT &&
+             h.index_type != GL_UNSIGNED_INT) ||
+            h.stride == 0 || h.vertices_size % h.stride != 0 || h.vertices_size / h.stride != h.n_vertices) {
+            spdlog::warn("Mesh cache `{}' is corrupted", cache);
+            return false;
+        }
+
+        auto base = file.data();
+        if (std::string(base + h.path_offset, h.path_size) != absolute_path(source))
+            return false;
+
+        uint64_t source_size;
+        int64_t source_mtime;
+        if (!file_stamp(source, &source_size, &source_mtime) || source_size != h.source_size)
+            return false;
+        if (source_mtime != h.source_mtime) {
+            // Touched but maybe not modified, compare the content before giving up on the cache. The cache is left
+            // as it is: it is mapped here and may be read by other processes, so the content is compared again on
+            // every load until the cache is written anew.
+            uint64_t hash;
+            if (!file_content_hash(source, &hash) || hash != h.source_hash)
+                return false;
+            spdlog::debug("Mesh `{}' was touched but not modified, using cache `{}'", source, cache);
+        }
+
+        MeshData result;
+        result.stride = static_cast<GLsizei>(h.stride);
+        result.n_vertices = h.n_vertices;
+        result.attributes.resize(h.n_attributes);
+        std::memcpy(result.attributes.data(), base + h.attributes_offset, h.n_attributes * sizeof(VertexAttribute));
+        result.index_type = h.index_type;
+        result.ranges.resize(h.n_ranges);
+        std::memcpy(result.ranges.data(), base + h.ranges_offset, h.n_ranges * sizeof(IndexRange));
+        result.clusters.resize(h.n_clusters);
+        std::memcpy(result.clusters.data(), base + h.clusters_offset, h.n_clusters * sizeof(MeshCluster));
+        std::vector<int32_t> submesh_materials(h.n_submeshes);
+        std::memcpy(submesh_materials.data(), base + h.submeshes_offset, h.n_submeshes * sizeof(int32_t));
+        result.submesh_materials.assign(submesh_materials.begin(), submesh_materials.end());
+        std::vector<CachedBox> submesh_bb(h.n_submeshes);
+        std::memcpy(submesh_bb.data(), base + h.submesh_bb_offset, h.n_submeshes * sizeof(CachedBox));
+        for (auto &&b: submesh_bb)
+            result.submesh_bb.emplace_back(glm::vec3(b.min[0], b.min[1], b.min[2]),
+                                           glm::vec3(b.max[0], b.max[1], b.max[2]), b.n_points);
+        if (!deserialize_materials(Reader(base + h.materials_offset, base + h.materials_offset + h.materials_size),
+                                   h.n_materials, &result.materials) ||
+            !deserialize_lods(Reader(base + h.lods_offset, base + h.lods_offset + h.lods_size), h.n_lods,
+                              &result.lods)) {
+            spdlog::warn("Mesh cache `{}' is corrupted", cache);
+            return false;
+        }
+        auto indices = base + h.indices_offset;
+        auto n_indices = h.indices_size / index_type_size(h.index_type);
+        bool valid = valid_attributes(result.attributes, h.stride) &&
+                     valid_ranges(result.ranges, indices, h.index_type, n_indices, h.n_vertices, h.n_submeshes) &&
+                     valid_clusters(result.clusters, result.ranges);
+        for (auto &&lod: result.lods)
+            valid = valid && valid_ranges(lod.ranges, indices, h.index_type, n_indices, h.n_vertices, h.n_submeshes);
+        if (!valid) {
+            spdlog::warn("Mesh cache `{}' is corrupted", cache);
+            return false;
+        }
+        result.bb = BoundingBox<3>(glm::vec3(h.bb_min[0], h.bb_min[1], h.bb_min[2]),
+                                   glm::vec3(h.bb_max[0], h.bb_max[1], h.bb_max[2]), h.n_vertices);
+        result.decoding = VertexDecoding::identity();
+        for (int i = 0; i < 3; i++) {
+            result.decoding.position_scale[i] = h.position_scale[i];
+            result.decoding.position_offset[i] = h.position_offset[i];
+        }
+        result.decoding.normal_encoding = h.normal_encoding;
+
+        result.vertex_data = base + h.vertices_offset;
+        result.vertex_data_size = h.vertices_size;
+        result.index_data = base + h.indices_offset;
+        result.index_data_size = h.indices_size;
+        result.mapping = std::move(file);
+
+        *data = std::move(result);
+        spdlog::debug("Loaded mesh `{}' from cache `{}'", source, cache);
+        return true;
+    }
+
+    bool save_mesh_cache(const std::string &source, uint32_t options, const MeshData &data) {
+        CacheHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.options = options;
+        if (!file_stamp(source, &h.source_size, &h.source_mtime) || !file_content_hash(source, &h.source_hash))
+            return false;
+
+        auto path = absolute_path(source);
+        std::vector<int32_t> submesh_materials(data.submesh_materials.begin(), data.submesh_materials.end());
+        auto materials = serialize_materials(data.materials);
+        auto lods = serialize_lods(data.lods);
+        std::vector<CachedBox> submesh_bb;
+        for (auto &&bb: data.submesh_bb) {
+            CachedBox b;
+            for (int i = 0; i < 3; i++) {
+                b.min[i] = bb.min()[i];
+                b.max[i] = bb.max()[i];
+            }
+            b.n_points = bb.n_points();
+            submesh_bb.push_back(b);
+        }
+
+        h.stride = static_cast<uint32_t>(data.stride);
+        h.n_attributes = static_cast<uint32_t>(data.attributes.size());
+        h.n_vertices = data.n_vertices;
+        h.index_type = data.index_type;
+        h.n_ranges = static_cast<uint32_t>(data.ranges.size());
+        h.n_submeshes = static_cast<uint32_t>(submesh_materials.size());
+        h.n_materials = static_cast<uint32_t>(data.materials.size());
+        h.n_lods = static_cast<uint32_t>(data.lods.size());
+        h.n_clusters = static_cast<uint32_t>(data.clusters.size());
+        for (int i = 0; i < 3; i++) {
+            h.bb_min[i] = data.bb.min()[i];
+            h.bb_max[i] = data.bb.max()[i];
+        }
+        for (int i = 0; i < 3; i++) {
+            h.position_scale[i] = data.decoding.position_scale[i];
+            h.position_offset[i] = data.decoding.position_offset[i];
+        }
+        h.normal_encoding = data.decoding.normal_encoding;
+
+        uint64_t offset = sizeof(h);
+        h.path_offset = offset;
+        h.path_size = path.size();
+        offset = align(offset + h.path_size);
+        h.attributes_offset = offset;
+        offset = align(offset + h.n_attributes * sizeof(VertexAttribute));
+        h.ranges_offset = offset;
+        offset = align(offset + h.n_ranges * sizeof(IndexRange));
+        h.submeshes_offset = offset;
+        offset = align(offset + h.n_submeshes * sizeof(int32_t));
+        h.submesh_bb_offset = offset;
+        offset = align(offset + h.n_submeshes * sizeof(CachedBox));
+        h.clusters_offset = offset;
+        offset = align(offset + h.n_clusters * sizeof(MeshCluster));
+        h.materials_offset = offset;
+        h.materials_size = materials.size();
+        offset = align(offset + h.materials_size);
+        h.lods_offset = offset;
+        h.lods_size = lods.size();
+        offset = align(offset + h.lods_size);
+        h.vertices_offset = offset;
+        h.vertices_size = data.vertex_data_size;
+        offset = align(offset + h.vertices_size);
+        h.indices_offset = offset;
+        h.indices_size = data.index_data_size;
+        offset = offset + h.indices_size;
+        h.file_size = offset;
+
+        struct Block {
+            uint64_t offset;
+            const void *data;
+            uint64_t size;
+        };
+        const Block blocks[] = {
+                {0,                   &h,                       sizeof(h)},
+                {h.path_offset,       path.data(),              h.path_size},
+                {h.attributes_offset, data.attributes.data(),   h.n_attributes * sizeof(VertexAttribute)},
+                {h.ranges_offset,     data.ranges.data(),       h.n_ranges * sizeof(IndexRange)},
+                {h.submeshes_offset,  submesh_materials.data(), h.n_submeshes * sizeof(int32_t)},
+                {h.submesh_bb_offset, submesh_bb.data(),        h.n_submeshes * sizeof(CachedBox)},
+                {h.clusters_offset,   data.clusters.data(),     h.n_clusters * sizeof(MeshCluster)},
+                {h.materials_offset,  materials.data(),         h.materials_size},
+                {h.lods_offset,       lods.data(),              h.lods_size},
+                {h.vertices_offset,   data.vertex_data,         h.vertices_size},
+                {h.indices_offset,    data.index_data,          h.indices_size}};
+
+        // Write to a temporary file and rename it, so nobody ever maps a half written cache.
+        auto cache = mesh_cache_path(source);
+        auto tmp = cache + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!out) {
+                spdlog::warn("Cannot write mesh cache `{}'", cache);
+                return false;
+            }
+            uint64_t written = 0;
+            for (auto &&b: blocks) {
+                write_padding(out, written, b.offset);
+                out.write(static_cast<const char *>(b.data), static_cast<std::streamsize>(b.size));
+                written = b.offset + b.size;
+            }
+            if (!out) {
+                spdlog::warn("Error writing mesh cache `{}'", cache);
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp, cache, ec);
+        if (ec) {
+            spdlog::warn("Cannot write mesh cache `{}': {}", cache, ec.message());
+            fs::remove(tmp, ec);
+            return false;
+        }
+        spdlog::debug("Saved mesh `{}' to cache `{}'", source, cache);
+        return true;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "XeEngine/mesh_data.h"
+
+namespace xe {
+
+    /**
+     * Binary mesh cache.
+     *
+     * A `.xemesh` file stored next to the source OBJ holds the MeshData exactly as it is uploaded: the interleaved
+     * vertex blob, the index blob, the draw ranges and clusters, the materials and the
+     * bounds. The file is keyed by the absolute
+     * source path, its size and modification time and the content hash of the source, plus a version and an options
+     * word so that caches written with different load options or by an older engine are rejected.
+     *
+     * On a hit the cache file is memory mapped and MeshData points straight into the mapping. The cache is never
+     * modified in place: when only the modification time of the source differs, the content hashes are compared and
+     * the cache is used without updating its stamp.
+     */
+    std::string mesh_cache_path(const std::string &source);
+
+    bool load_mesh_cache(const std::string &source, uint32_t options, MeshData *data);
+
+    bool save_mesh_cache(const std::string &source, uint32_t options, const MeshData &data);
+
+}
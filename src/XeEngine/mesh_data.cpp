@@ -0,0 +1,203 @@
+#include "mesh_data.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/mesh_bounds.h"
+#include "XeEngine/vertex_format.h"
+#include "XeEngine/vertex_interleave.h"
+
+namespace {
+
+    float angle_degrees(const glm::vec3 &a, const glm::vec3 &b) {
+        auto la = glm::length(a), lb = glm::length(b);
+        if (la <= 0.0f || lb <= 0.0f)
+            return 0.0f;
+        auto c = std::max(-1.0, std::min(1.0, double(glm::dot(a, b)) / (double(la) * double(lb))));
+        return static_cast<float>(std::acos(c) * 180.0 / 3.14159265358979323846);
+    }
+
+    bool in_unit_square(const std::vector<glm::vec2> &uv) {
+        return std::all_of(uv.begin(), uv.end(), [](const glm::vec2 &t) {
+            return t.x >= 0.0f && t.x <= 1.0f && t.y >= 0.0f && t.y <= 1.0f;
+        });
+    }
+}
+
+namespace xe {
+
+    // The format of the example in vertex_format.h. It is instantiated in full, so that `setup`, `pack`, `unpack` and
+    // `interleave` are compiled with every build, and its layout is checked against the one written by hand.
+    template class VertexFormat<Position<f32x3>, UV0<u16x2n>, Normal<oct16>>;
+    using ExampleFormat = VertexFormat<Position<f32x3>, UV0<u16x2n>, Normal<oct16>>;
+    static_assert(ExampleFormat::n_attributes == 3 && ExampleFormat::stride == 12 + 4 + 4,
+                  "Wrong stride of the example vertex format");
+    static_assert(ExampleFormat::offsets[0] == 0 && ExampleFormat::offsets[1] == 12 && ExampleFormat::offsets[2] == 16,
+                  "Wrong offsets of the example vertex format");
+    static_assert(ExampleFormat::attributes[0].index == 0 && ExampleFormat::attributes[0].size == 3 &&
+                  ExampleFormat::attributes[0].type == GL_FLOAT && ExampleFormat::attributes[0].offset == 0 &&
+                  ExampleFormat::attributes[1].index == 1 && ExampleFormat::attributes[1].size == 2 &&
+                  ExampleFormat::attributes[1].type == GL_UNSIGNED_SHORT &&
+                  ExampleFormat::attributes[1].normalized == GL_TRUE && ExampleFormat::attributes[1].offset == 12 &&
+                  ExampleFormat::attributes[2].index == 5 && ExampleFormat::attributes[2].size == 2 &&
+                  ExampleFormat::attributes[2].type == GL_SHORT && ExampleFormat::attributes[2].offset == 16,
+                  "Wrong attribute table of the example vertex format");
+
+    MeshData build_mesh_data(const sMesh &smesh, const VertexEncoding &encoding, VertexEncodingReport *report) {
+        MeshData data;
+
+        auto n_vertices = smesh.vertex_coords.size();
+
+        // The bounds computed at load time are reused unless the vertices changed since (e.g. unused vertices were
+        // dropped by optimize_vertex_fetch, which can only make the box smaller).
+        data.bb = smesh.bb.n_points() == n_vertices ? smesh.bb : bounding_box(smesh.vertex_coords);
+        data.submesh_bb = smesh.submesh_bb.size() == smesh.submeshes.size() && smesh.bb.n_points() == n_vertices
+                          ? smesh.submesh_bb : submesh_bounding_boxes(smesh);
+
+        std::vector<InterleaveStream> streams;
+        // Encoded copies of the attributes, moving the inner vectors does not move their data.
+        std::vector<std::vector<uint8_t>> encoded;
+        GLuint offset = 0;
+        auto add_stream = [&](auto codec, GLuint index, const void *src) {
+            using Codec = decltype(codec);
+            data.attributes.push_back({index, Codec::components, Codec::type, Codec::normalized, offset});
+            streams.push_back({src, Codec::bytes, offset});
+            offset += Codec::bytes;
+        };
+        // Packs `get(i)` of every vertex with the codec and adds the result as a stream. `error(i, decoded)` is the
+        // error of the vertex after decoding, its maximum goes to `max_error`.
+        auto add_encoded_stream = [&](auto codec, GLuint index, auto &&get, auto &&error, float *max_error) {
+            using Codec = decltype(codec);
+            encoded.emplace_back(n_vertices * Codec::bytes);
+            auto dst = encoded.back().data();
+            for (size_t i = 0; i < n_vertices; i++, dst += Codec::bytes) {
+                Codec::pack(get(i), dst);
+                *max_error = std::max(*max_error, error(i, Codec::unpack(dst)));
+            }
+            add_stream(codec, index, encoded.back().data());
+        };
+
+        VertexEncodingReport r;
+        data.decoding = VertexDecoding::identity();
+
+        r.float_bytes_per_vertex += f32x3::bytes;
+        if (encoding.position == PositionEncoding::Unorm16) {
+            auto lo = data.bb.min();
+            auto scale = data.bb.max() - data.bb.min();
+            auto inv = glm::vec3(0.0f);
+            for (int k = 0; k < 3; k++)
+                inv[k] = scale[k] > 0.0f ? 1.0f / scale[k] : 0.0f;
+            auto &&p = smesh.vertex_coords;
+            add_encoded_stream(u16x3n{}, Position<u16x3n>::location,
+                               [&](size_t i) { return (p[i] - lo) * inv; },
+                               [&](size_t i, const glm::vec3 &q) { return glm::length(lo + scale * q - p[i]); },
+                               &r.position_error);
+            data.decoding.position_scale = glm::vec4(scale, 0.0f);
+            data.decoding.position_offset = glm::vec4(lo, 0.0f);
+        } else {
+            add_stream(f32x3{}, Position<f32x3>::location, smesh.vertex_coords.data());
+        }
+
+        for (int it = 0; it < xe::sMesh::MAX_TEXCOORDS; it++) {
+            if (!smesh.has_texcoords[it])
+                continue;
+            auto &&uv = smesh.vertex_texcoords[it];
+            auto location = UV0<f32x2>::location + it;
+            r.float_bytes_per_vertex += f32x2::bytes;
+            auto tex_encoding = encoding.texcoords;
+            if (tex_encoding == TexcoordEncoding::Unorm16 && !in_unit_square(uv)) {
+                spdlog::debug("Texcoords {} are outside [0, 1], using half floats instead of unorm16", it);
+                tex_encoding = TexcoordEncoding::Half;
+            }
+            auto get = [&uv](size_t i) { return uv[i]; };
+            auto error = [&uv](size_t i, const glm::vec2 &t) {
+                return std::max(std::abs(t.x - uv[i].x), std::abs(t.y - uv[i].y));
+            };
+            switch (tex_encoding) {
+                case TexcoordEncoding::Unorm16:
+                    add_encoded_stream(u16x2n{}, location, get, error, &r.texcoord_error);
+                    break;
+                case TexcoordEncoding::Half:
+                    add_encoded_stream(f16x2{}, location, get, error, &r.texcoord_error);
+                    break;
+                default:
+                    add_stream(f32x2{}, location, uv.data());
+            }
+        }
+
+        if (smesh.has_normals) {
+            auto &&n = smesh.vertex_normals;
+            r.float_bytes_per_vertex += f32x3::bytes;
+            if (encoding.normals == NormalEncoding::Oct16) {
+                add_encoded_stream(oct16{}, Normal<oct16>::location, [&n](size_t i) { return n[i]; },
+                                   [&n](size_t i, const glm::vec3 &d) { return angle_degrees(d, n[i]); },
+                                   &r.normal_error);
+                data.decoding.normal_encoding = 1;
+            } else {
+                add_stream(f32x3{}, Normal<f32x3>::location, n.data());
+            }
+        }
+
+        if (smesh.has_tangents) {
+            auto &&t = smesh.vertex_tangents;
+            r.float_bytes_per_vertex += f32x4::bytes;
+            if (encoding.tangents == TangentEncoding::Snorm10) {
+                add_encoded_stream(i10x3_2n{}, Tangent<i10x3_2n>::location, [&t](size_t i) { return t[i]; },
+                                   [&t](size_t i, const glm::vec4 &d) {
+                                       return d.w * t[i].w < 0.0f ? 180.0f :
+                                              angle_degrees(glm::vec3(d), glm::vec3(t[i]));
+                                   }, &r.tangent_error);
+            } else {
+                add_stream(f32x4{}, Tangent<f32x4>::location, t.data());
+            }
+        }
+        r.bytes_per_vertex = offset;
+        spdlog::debug("Vertex encoding: {} bytes per vertex instead of {}, max error: position {:.3g}, "
+                      "texcoords {:.3g}, normals {:.3g} deg, tangents {:.3g} deg", r.bytes_per_vertex,
+                      r.float_bytes_per_vertex, r.position_error, r.texcoord_error, r.normal_error, r.tangent_error);
+        if (report != nullptr)
+            *report = r;
+
+        data.stride = static_cast<GLsizei>(offset);
+        data.n_vertices = n_vertices;
+        data.vertex_storage.resize(n_vertices * offset);
+        interleave_vertices(streams, n_vertices, offset, data.vertex_storage.data());
+        data.vertex_data = data.vertex_storage.data();
+        data.vertex_data_size = data.vertex_storage.size();
+
+        auto indices = pack_indices(smesh);
+        data.index_type = indices.type;
+        data.ranges = std::move(indices.ranges);
+        for (auto &&lod: smesh.lods)
+            data.lods.push_back({lod.error, append_indices(indices, lod.faces, lod.submeshes)});
+        data.index_storage = std::move(indices.data);
+        data.index_data = data.index_storage.data();
+        data.index_data_size = data.index_storage.size();
+
+        // Meshlets and ranges both follow the index buffer order. A meshlet may straddle the boundary of two ranges
+        // of a split submesh, it is then cut in two.
+        auto &&meshlets = smesh.meshlets;
+        for (size_t i = 0; i < data.ranges.size(); i++) {
+            auto &&range = data.ranges[i];
+            auto it = std::partition_point(meshlets.begin(), meshlets.end(), [&range](const sMesh::Meshlet &m) {
+                return GLuint(m.end) <= range.start;
+            });
+            for (; it != meshlets.end() && GLuint(it->start) < range.end; ++it) {
+                auto start = std::max<GLuint>(range.start, it->start);
+                auto end = std::min<GLuint>(range.end, it->end);
+                if (start < end)
+                    data.clusters.push_back({start, end, GLint(i), it->center, it->radius, it->cone_axis,
+                                             it->cone_cutoff});
+            }
+        }
+
+        data.materials = smesh.materials;
+        for (auto &&sm: smesh.submeshes)
+            data.submesh_materials.push_back(sm.mat_idx);
+
+        return data;
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "glad/gl.h"
+#include "glm/glm.hpp"
+
+#include "ObjectReader/sMesh.h"
+#include "ObjectReader/mapped_file.h"
+#include "XeEngine/mesh_indices.h"
+#include "XeEngine/Mesh.h"
+#include "XeEngine/vertex_quantization.h"
+
+namespace xe {
+
+    /**
+     * Level of detail: draw ranges of a simplified version of the mesh stored after the full resolution indices.
+     * `error` is relative to the radius of the bounding box.
+     */
+    struct MeshLod {
+        float error;
+        std::vector<IndexRange> ranges;
+    };
+
+    /**
+     * Everything needed to create a Mesh, in the form it is uploaded to the GPU: the interleaved vertex blob and
+     * its layout, the packed index blob with the draw ranges, materials and bounds.
+     *
+     * The blobs are referenced through `vertex_data` and `index_data` which point either into the owned vectors or
+     * into a memory mapped cache file, so a cached mesh can be uploaded without copying.
+     */
+    struct MeshData {
+        MeshData() : stride(0), n_vertices(0), vertex_data(nullptr), vertex_data_size(0),
+                     index_type(GL_UNSIGNED_SHORT), index_data(nullptr), index_data_size(0),
+                     decoding(VertexDecoding::identity()) {}
+
+        MeshData(const MeshData &) = delete;
+
+        MeshData &operator=(const MeshData &) = delete;
+
+        MeshData(MeshData &&) = default;
+
+        MeshData &operator=(MeshData &&) = default;
+
+        GLsizei stride;
+        std::vector<VertexAttribute> attributes;
+        size_t n_vertices;
+        const void *vertex_data;
+        size_t vertex_data_size;
+
+        GLenum index_type;
+        std::vector<IndexRange> ranges;
+        const void *index_data;
+        size_t index_data_size;
+
+        // Coarser levels of detail, IndexRange::submesh refers to submesh_materials like for the ranges above.
+        std::vector<MeshLod> lods;
+
+        // Meshlets clipped to the draw ranges, MeshCluster::submesh is the index of the range.
+        std::vector<MeshCluster> clusters;
+
+        // Material index of every sMesh submesh, IndexRange::submesh refers to this table.
+        std::vector<int> submesh_materials;
+        std::vector<mtl_material_t> materials;
+
+        // Bounds of the mesh and of every sMesh submesh (indexed like submesh_materials).
+        BoundingBox<3> bb;
+        std::vector<BoundingBox<3>> submesh_bb;
+
+        // Scale and offset of quantized positions and the normal encoding, for the vertex shader.
+        VertexDecoding decoding;
+
+        std::vector<uint8_t> vertex_storage;
+        std::vector<uint8_t> index_storage;
+        MappedFile mapping;
+    };
+
+    /**
+     * Interleaves the vertex attributes in the given encoding and packs the indices. The size and the largest
+     * decoding error of the attributes are logged and, if `report` is not null, returned in it.
+     */
+    MeshData build_mesh_data(const sMesh &smesh, const VertexEncoding &encoding = VertexEncoding{},
+                             VertexEncodingReport *report = nullptr);
+
+}
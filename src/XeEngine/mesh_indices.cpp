@@ -0,0 +1,160 @@
+#include "mesh_indices.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+
+    const uint32_t U16_SPAN = 65536u;
+
+    using Faces = std::vector<xe::sMesh::Face>;
+    using SubMeshes = std::vector<xe::sMesh::SubMesh>;
+
+    std::vector<xe::IndexRange> whole_submeshes(const SubMeshes &submeshes) {
+        std::vector<xe::IndexRange> ranges;
+        ranges.reserve(submeshes.size());
+        for (size_t s = 0; s < submeshes.size(); s++) {
+            auto &&sm = submeshes[s];
+            ranges.push_back({GLuint(sm.start), GLuint(sm.end), 0, int(s)});
+        }
+        return ranges;
+    }
+
+    /**
+     * Splits every submesh into runs of consecutive faces whose vertex indices span less than 65536.
+     */
+    std::vector<xe::IndexRange> split_u16(const Faces &faces, const SubMeshes &submeshes) {
+        std::vector<xe::IndexRange> ranges;
+        for (size_t s = 0; s < submeshes.size(); s++) {
+            auto &&sm = submeshes[s];
+            size_t first = sm.start / 3;
+            size_t last = sm.end / 3;
+
+            auto chunk_start = first;
+            auto lo = std::numeric_limits<uint32_t>::max();
+            uint32_t hi = 0;
+            for (auto f = first; f < last; f++) {
+                auto &&v = faces[f].v;
+                auto f_lo = std::min({v[0], v[1], v[2]});
+                auto f_hi = std::max({v[0], v[1], v[2]});
+                if (std::max(hi, f_hi) - std::min(lo, f_lo) >= U16_SPAN) {
+                    ranges.push_back({GLuint(3 * chunk_start), GLuint(3 * f), GLint(lo), int(s)});
+                    chunk_start = f;
+                    lo = f_lo;
+                    hi = f_hi;
+                } else {
+                    lo = std::min(lo, f_lo);
+                    hi = std::max(hi, f_hi);
+                }
+            }
+            if (last > chunk_start)
+                ranges.push_back({GLuint(3 * chunk_start), GLuint(3 * last), GLint(lo), int(s)});
+        }
+        return ranges;
+    }
+
+    /**
+     * Appends the indices of `faces` drawn as `ranges` to the packed data. The ranges are counted from the start of
+     * `faces`.
+     */
+    template<typename T>
+    void write_indices(std::vector<uint8_t> &data, const Faces &faces, const std::vector<xe::IndexRange> &ranges) {
+        auto offset = data.size();
+        data.resize(offset + 3 * faces.size() * sizeof(T), 0);
+        auto out = reinterpret_cast<T *>(data.data() + offset);
+        for (auto &&r: ranges) {
+            auto base = static_cast<uint32_t>(r.base_vertex);
+            for (auto f = r.start / 3; f < r.end / 3; f++) {
+                auto &&v = faces[f].v;
+                out[3 * f + 0] = static_cast<T>(v[0] - base);
+                out[3 * f + 1] = static_cast<T>(v[1] - base);
+                out[3 * f + 2] = static_cast<T>(v[2] - base);
+            }
+        }
+    }
+}
+
+namespace xe {
+
+    size_t index_type_size(GLenum type) {
+        switch (type) {
+            case GL_UNSIGNED_BYTE:
+                return sizeof(GLubyte);
+            case GL_UNSIGNED_SHORT:
+                return sizeof(GLushort);
+            default:
+                return sizeof(GLuint);
+        }
+    }
+
+    size_t PackedIndices::index_size() const {
+        return index_type_size(type);
+    }
+
+    PackedIndices pack_indices(const sMesh &mesh, size_t min_bytes_saved_per_draw) {
+        PackedIndices packed;
+        auto n_vertices = mesh.vertex_coords.size();
+        auto n_indices = 3 * mesh.faces.size();
+
+        if (n_vertices <= 256u) {
+            packed.type = GL_UNSIGNED_BYTE;
+            packed.ranges = whole_submeshes(mesh.submeshes);
+        } else if (n_vertices <= U16_SPAN) {
+            packed.type = GL_UNSIGNED_SHORT;
+            packed.ranges = whole_submeshes(mesh.submeshes);
+        } else {
+            auto chunks = split_u16(mesh.faces, mesh.submeshes);
+            auto extra_draws = chunks.size() - mesh.submeshes.size();
+            auto bytes_saved = n_indices * (sizeof(GLuint) - sizeof(GLushort));
+            if (extra_draws == 0 || bytes_saved / extra_draws >= min_bytes_saved_per_draw) {
+                packed.type = GL_UNSIGNED_SHORT;
+                packed.ranges = std::move(chunks);
+            } else {
+                packed.type = GL_UNSIGNED_INT;
+                packed.ranges = whole_submeshes(mesh.submeshes);
+            }
+        }
+
+        packed.data.clear();
+        switch (packed.type) {
+            case GL_UNSIGNED_BYTE:
+                write_indices<GLubyte>(packed.data, mesh.faces, packed.ranges);
+                break;
+            case GL_UNSIGNED_SHORT:
+                write_indices<GLushort>(packed.data, mesh.faces, packed.ranges);
+                break;
+            default:
+                write_indices<GLuint>(packed.data, mesh.faces, packed.ranges);
+                break;
+        }
+
+        spdlog::debug("Packed {} indices of {} vertices as {} bit indices in {} ranges", n_indices, n_vertices,
+                      8 * packed.index_size(), packed.ranges.size());
+        return packed;
+    }
+
+    std::vector<IndexRange> append_indices(PackedIndices &packed, const std::vector<sMesh::Face> &faces,
+                                           const std::vector<sMesh::SubMesh> &submeshes) {
+        // Only split 16 bit indices carry a base vertex, with 8 bit indices all the vertices fit anyway.
+        auto ranges = packed.type == GL_UNSIGNED_SHORT ? split_u16(faces, submeshes) : whole_submeshes(submeshes);
+        switch (packed.type) {
+            case GL_UNSIGNED_BYTE:
+                write_indices<GLubyte>(packed.data, faces, ranges);
+                break;
+            case GL_UNSIGNED_SHORT:
+                write_indices<GLushort>(packed.data, faces, ranges);
+                break;
+            default:
+                write_indices<GLuint>(packed.data, faces, ranges);
+                break;
+        }
+        auto offset = static_cast<GLuint>(packed.n_indices() - 3 * faces.size());
+        for (auto &&r: ranges) {
+            r.start += offset;
+            r.end += offset;
+        }
+        return ranges;
+    }
+}
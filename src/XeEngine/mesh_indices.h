@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "glad/gl.h"
+
+#include "ObjectReader/sMesh.h"
+
+namespace xe {
+
+    /**
+     * Range of the packed index buffer drawn with one call. `start` and `end` are counted in indices, `base_vertex`
+     * is added to every index by glDrawElementsBaseVertex.
+     */
+    struct IndexRange {
+        GLuint start;
+        GLuint end;
+        GLint base_vertex;
+        int submesh;
+    };
+
+    /**
+     * Index buffer of an sMesh packed with the narrowest index type that fits.
+     */
+    struct PackedIndices {
+        GLenum type;
+        std::vector<uint8_t> data;
+        std::vector<IndexRange> ranges;
+
+        size_t index_size() const;
+
+        size_t n_indices() const { return data.size() / index_size(); }
+    };
+
+    size_t index_type_size(GLenum type);
+
+    /**
+     * Chooses the index type for the mesh and packs the faces accordingly.
+     *
+     * Meshes with at most 256 or 65536 vertices get 8 or 16 bit indices. For bigger meshes each submesh is split into
+     * consecutive runs of faces whose vertices span less than 65536 indices and drawn with a base vertex; this is used
+     * if every additional draw call saves at least `min_bytes_saved_per_draw` bytes of index data compared to 32 bit
+     * indices, otherwise 32 bit indices are used.
+     */
+    PackedIndices pack_indices(const sMesh &mesh, size_t min_bytes_saved_per_draw = 64 * 1024);
+
+    /**
+     * Appends another set of faces over the same vertices (e.g. a level of detail) to already packed indices, using
+     * their index type. Returns the draw ranges of the appended faces, counted from the start of the packed buffer.
+     */
+    std::vector<IndexRange> append_indices(PackedIndices &packed, const std::vector<sMesh::Face> &faces,
+                                           const std::vector<sMesh::SubMesh> &submeshes);
+
+}
@@ -15,109 +15,168 @@
 #include "glm/gtc/type_ptr.hpp"
 
 #include "ObjectReader/obj_reader.h"
+#include "ObjectReader/mesh_normals.h"
+#include "ObjectReader/mesh_optimizer.h"
+#include "ObjectReader/meshlets.h"
+#include "ObjectReader/simplify.h"
+#include "XeEngine/BufferArena.h"
 #include "XeEngine/ColorMaterial.h"
 #include "XeEngine/PhongMaterial.h"
 #include "XeEngine/Mesh.h"
+#include "XeEngine/mesh_data.h"
+#include "XeEngine/mesh_cache.h"
+#include "XeEngine/content_hash.h"
+#include "XeEngine/TextureCache.h"
 
 
 namespace {
-    xe::ColorMaterial *make_color_material(const xe::mtl_material_t &mat, std::string mtl_dir);
-    xe::PhongMaterial *make_phong_material(const xe::mtl_material_t &mat, std::string mtl_dir);
+    xe::ColorMaterial *make_color_material(const xe::mtl_material_t &mat, std::shared_ptr<xe::Texture> texture);
+    xe::PhongMaterial *make_phong_material(const xe::mtl_material_t &mat, std::shared_ptr<xe::Texture> texture);
 }
 
 namespace xe {
 
+    uint32_t MeshLoadOptions::cache_key() const {
+        uint32_t key = (optimize_vertex_cache ? 1u : 0u) | (optimize_overdraw ? 2u : 0u) | (build_meshlets ? 4u : 0u) |
+                       (generate_normals ? 16u : 0u) | (generate_tangents ? 32u : 0u);
+        // The rest of the options is hashed into the bits above the flags.
+        const uint32_t encoding[] = {static_cast<uint32_t>(vertex_encoding.position),
+                                     static_cast<uint32_t>(vertex_encoding.texcoords),
+                                     static_cast<uint32_t>(vertex_encoding.normals),
+                                     static_cast<uint32_t>(vertex_encoding.tangents)};
+        auto h = content_hash(encoding, sizeof(encoding));
+        if (generate_lods) {
+            h = content_hash(lod_ratios.data(), lod_ratios.size() * sizeof(float), h);
+            h = content_hash(&lod_max_error, sizeof(lod_max_error), h);
+            key |= 8u;
+        }
+        return key | (static_cast<uint32_t>(h) & ~0xffu);
+    }
+
 
     std::shared_ptr<Mesh> load_mesh_from_obj(std::string path, std::string mtl_dir) {
+        return load_mesh_from_obj(path, mtl_dir, MeshLoadOptions{});
+    }
 
-        auto smesh = xe::load_smesh_from_obj(path, mtl_dir);
-        if (smesh.vertex_coords.empty())
-            return nullptr;
+    std::shared_ptr<Mesh> load_mesh_from_obj(std::string path, std::string mtl_dir, const MeshLoadOptions &options) {
+
+        MeshData data;
+        // The materials depend on the MTL directory, so it is a part of the key as well.
+        auto key = options.cache_key() ^ static_cast<uint32_t>(content_hash(mtl_dir.data(), mtl_dir.size()));
+        if (!options.use_cache || !load_mesh_cache(path, key, &data)) {
+            auto smesh = xe::load_smesh_from_obj(path, mtl_dir);
+            if (smesh.vertex_coords.empty())
+                return nullptr;
+            if (options.generate_normals && !smesh.has_normals)
+                xe::compute_normals(smesh);
+            if (options.generate_tangents && !smesh.has_tangents && smesh.has_normals && smesh.has_texcoords[0])
+                xe::compute_tangents(smesh);
+            if (options.optimize_vertex_cache)
+                xe::optimize_vertex_cache(smesh);
+            if (options.optimize_overdraw) {
+                // The estimate rasterizes the whole mesh several times, so it is only done when it gets printed.
+                auto report = spdlog::should_log(spdlog::level::debug);
+                xe::OverdrawStats before{};
+                if (report)
+                    before = xe::estimate_overdraw(smesh);
+                xe::optimize_overdraw(smesh);
+                xe::optimize_vertex_fetch(smesh);
+                if (report)
+                    spdlog::debug("Overdraw {:.3f} -> {:.3f}", before.overdraw, xe::estimate_overdraw(smesh).overdraw);
+            }
+            if (options.build_meshlets)
+                xe::build_meshlets(smesh);
+            if (options.generate_lods)
+                xe::build_lod_chain(smesh, options.lod_ratios, options.lod_max_error);
+            data = build_mesh_data(smesh, options.vertex_encoding);
+            if (options.use_cache)
+                save_mesh_cache(path, key, data);
+        }
 
 
         auto mesh = new Mesh;
-        auto n_vertices = smesh.vertex_coords.size();
-        auto n_indices = 3 * smesh.faces.size();
-
 
-        glm::uint n_floats_per_vertex = 3;
-        for (auto &&t: smesh.has_texcoords) {
-            if (t)
-                n_floats_per_vertex += 2;
+        mesh->set_index_type(data.index_type);
+        auto arena = options.buffer_arena ? options.buffer_arena : &BufferArena::global();
+        if (!options.use_buffer_arena ||
+            !mesh->allocate_in_arena(*arena, data.attributes.data(), data.attributes.size(), data.stride,
+                                     data.vertex_data_size, data.vertex_data, data.index_data_size,
+                                     data.index_data)) {
+            if (options.use_buffer_arena)
+                spdlog::warn("Mesh {} does not fit in the buffer arena, using buffers of its own", path);
+            mesh->allocate_index_buffer(data.index_data_size, GL_STATIC_DRAW, data.index_data);
+            mesh->allocate_vertex_buffer(data.vertex_data_size, GL_STATIC_DRAW, data.vertex_data);
+            mesh->vertex_attrib_pointers(data.attributes.data(), data.attributes.size(), data.stride);
         }
-        if (smesh.has_normals)
-            n_floats_per_vertex += 3;
-        if (smesh.has_normals)
-            n_floats_per_vertex += 4;
-
-
-        size_t stride = n_floats_per_vertex * sizeof(GLfloat);
-
-
-        mesh->allocate_index_buffer(n_indices * sizeof(uint16_t), GL_STATIC_DRAW);
-        mesh->load_indices(0, n_indices * sizeof(uint16_t), smesh.faces.data());
-
-        mesh->allocate_vertex_buffer(n_vertices * n_floats_per_vertex * sizeof(float), GL_STATIC_DRAW);
-        mesh->vertex_attrib_pointer(0, 3, GL_FLOAT, n_floats_per_vertex * sizeof(GLfloat), 0);
-
-
-        auto v_ptr = reinterpret_cast<uint8_t *>(mesh->map_vertex_buffer());
-
-        size_t offset = 0;
-
-        {
-
-            auto v_offset = offset;
-            for (auto i = 0; i < smesh.vertex_coords.size(); i++, v_offset += stride) {
-                spdlog::debug("vertex[{}] {} ", i, glm::to_string(smesh.vertex_coords[i]));
-                std::memcpy(v_ptr + v_offset, glm::value_ptr(smesh.vertex_coords[i]), sizeof(glm::vec3));
+        mesh->set_vertex_decoding(data.decoding);
+
+
+        // One Material per MTL material, shared by all the submeshes using it.
+        std::vector<Material *> mtl_materials(data.materials.size(), nullptr);
+
+        // The textures of all the used materials are decoded concurrently before any material is made.
+        auto &textures = options.texture_cache ? *options.texture_cache : TextureCache::global();
+        std::vector<bool> used(data.materials.size(), false);
+        for (auto mat_idx: data.submesh_materials)
+            if (mat_idx >= 0 && mat_idx < used.size())
+                used[mat_idx] = true;
+        std::vector<std::string> texture_paths;
+        std::vector<int> texture_index(data.materials.size(), -1);
+        for (size_t m = 0; m < data.materials.size(); m++) {
+            if (used[m] && !data.materials[m].diffuse_texname.empty()) {
+                texture_index[m] = static_cast<int>(texture_paths.size());
+                texture_paths.push_back(mtl_dir + "/" + data.materials[m].diffuse_texname);
             }
         }
-        offset += 3 * sizeof(GLfloat);
-
-        for (int it = 0; it < xe::sMesh::MAX_TEXCOORDS; it++) {
-            if (smesh.has_texcoords[it]) {
-                mesh->vertex_attrib_pointer(1 + it, 2, GL_FLOAT, stride, offset);
-
-                auto v_offset = offset;
-                for (auto i = 0; i < smesh.vertex_texcoords[it].size(); i++, v_offset += stride) {
-                    std::memcpy(v_ptr + v_offset, glm::value_ptr(smesh.vertex_texcoords[0][i]), sizeof(glm::vec2));
+        auto mtl_textures = textures.get(texture_paths, options.texture_threads);
+
+        Material *default_material = nullptr;
+        std::vector<Material *> materials(data.submesh_materials.size(), nullptr);
+        for (int i = 0; i < data.submesh_materials.size(); i++) {
+            auto mat_idx = data.submesh_materials[i];
+            spdlog::debug("Adding submesh {:4d} material {:4d}", i, mat_idx);
+            Material *material = nullptr;
+            if (mat_idx >= 0 && mat_idx < mtl_materials.size()) {
+                material = mtl_materials[mat_idx];
+                if (material == nullptr) {
+                    auto &mat = data.materials[mat_idx];
+                    auto texture = texture_index[mat_idx] >= 0 ? mtl_textures[texture_index[mat_idx]] : nullptr;
+                    switch (mat.illum) {
+                        case 0:
+                            material = make_color_material(mat, texture);
+                            break;
+                        case 1:
+                            material = make_phong_material(mat, texture);
+                            break;
+                    }
+                    mtl_materials[mat_idx] = material;
                 }
-                offset += 2 * sizeof(GLfloat);
             }
-        }
-        if (smesh.has_normals) {
-            mesh->vertex_attrib_pointer(xe::sMesh::MAX_TEXCOORDS + 1, 3, GL_FLOAT, stride, offset);
-            offset += 3 * sizeof(GLfloat);
+            if (material == nullptr) {
+                if (default_material == nullptr)
+                    default_material = new xe::ColorMaterial(glm::vec4{1.0, 1.0, 1.0, 1.0});
+                material = default_material;
+            }
+            materials[i] = material;
         }
 
-        if (smesh.has_tangents) {
-            mesh->vertex_attrib_pointer(xe::sMesh::MAX_TEXCOORDS + 2, 4, GL_FLOAT, stride, offset);
-            offset += 4 * sizeof(GLfloat);
+        // Submeshes too big for 16 bit indices may come split into several ranges, each with its own base vertex.
+        // The ranges get the bounds of the whole submesh.
+        std::vector<BoundingBox<3>> submesh_bb;
+        for (auto &&r: data.ranges) {
+            mesh->add_submesh(r.start, r.end, materials[r.submesh], options.cull_face, r.base_vertex);
+            submesh_bb.push_back(data.submesh_bb[r.submesh]);
         }
+        mesh->set_submesh_bounding_boxes(std::move(submesh_bb));
+        mesh->set_clusters(std::move(data.clusters));
 
-        mesh->unmap_vertex_buffer();
-
-
-        for (int i = 0; i < smesh.submeshes.size(); i++) {
-            auto sm = smesh.submeshes[i];
-            spdlog::debug("Adding submesh {:4d} {:4d} {:4d}", i, sm.start, sm.end);
-            Material* material = new xe::ColorMaterial(glm::vec4{1.0, 1.0, 1.0, 1.0});
-            if (sm.mat_idx >= 0) {
-                auto mat = smesh.materials[sm.mat_idx];
-                switch (mat.illum) {
-                    case 0:
-                        material = make_color_material(mat, mtl_dir);
-                        break;
-                    case 1:
-                        material = make_phong_material(mat, mtl_dir);
-                        break;
-                }
-
-                mesh->add_submesh(sm.start, sm.end, material, false);
-            }
-
+        for (auto &&lod: data.lods) {
+            auto level = mesh->add_lod(lod.error);
+            for (auto &&r: lod.ranges)
+                mesh->add_lod_submesh(level, r.start, r.end, materials[r.submesh], options.cull_face, r.base_vertex);
         }
+        mesh->set_bounding_box(data.bb);
+
         return std::shared_ptr<Mesh>(mesh);
 
 
@@ -126,7 +185,7 @@ namespace xe {
 
     namespace {
 
-        xe::ColorMaterial *make_color_material(const xe::mtl_material_t &mat, std::string mtl_dir) {
+        xe::ColorMaterial *make_color_material(const xe::mtl_material_t &mat, std::shared_ptr<xe::Texture> texture) {
 
             glm::vec4 color;
             for (int i = 0; i < 3; i++)
@@ -134,18 +193,15 @@ namespace xe {
             color[3] = 1.0;
             spdlog::debug("Adding ColorMaterial {}", glm::to_string(color));
             auto material = new xe::ColorMaterial(color);
-            if (!mat.diffuse_texname.empty()) {
-                auto texture = xe::create_texture(mtl_dir + "/" + mat.diffuse_texname);
-                spdlog::debug("Adding Texture {} {:1d}", mat.diffuse_texname, texture);
-                if (texture > 0) {
-                    material->set_texture(texture);
-                }
+            if (texture) {
+                spdlog::debug("Adding Texture {} {:1d}", mat.diffuse_texname, texture->id());
+                material->set_texture(std::move(texture));
             }
 
             return material;
         }
 
-        xe::PhongMaterial *make_phong_material(const xe::mtl_material_t &mat, std::string mtl_dir) {
+        xe::PhongMaterial *make_phong_material(const xe::mtl_material_t &mat, std::shared_ptr<xe::Texture> texture) {
 
             glm::vec4 color;
             for (int i = 0; i < 3; i++)
@@ -153,12 +209,9 @@ namespace xe {
             color[3] = 1.0;
             spdlog::debug("Adding ColorMaterial {}", glm::to_string(color));
             auto material = new xe::PhongMaterial(color);
-            if (!mat.diffuse_texname.empty()) {
-                auto texture = xe::create_texture(mtl_dir + "/" + mat.diffuse_texname);
-                spdlog::debug("Adding Texture {} {:1d}", mat.diffuse_texname, texture);
-                if (texture > 0) {
-                    material->set_texture(texture);
-                }
+            if (texture) {
+                spdlog::debug("Adding Texture {} {:1d}", mat.diffuse_texname, texture->id());
+                material->set_texture(std::move(texture));
             }
 
             return material;
@@ -4,11 +4,99 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <memory>
+#include <vector>
+
+#include "XeEngine/vertex_quantization.h"
 
 namespace xe {
     class Mesh;
 
+    class TextureCache;
+
+    class BufferArena;
+
+    struct MeshLoadOptions {
+        /**
+         * Read the mesh from the `.xemesh` cache next to the OBJ file if it is up to date, write the cache otherwise.
+         * Off by default, as it writes next to the assets. Changes to the MTL files do not invalidate the cache,
+         * delete the `.xemesh` file in that case.
+         */
+        bool use_cache = false;
+
+        /**
+         * Generate normals for meshes that have none and tangents for meshes with normals and texcoords, see
+         * xe::compute_normals and xe::compute_tangents. Off by default, as they change the vertex layout and none of
+         * the engine shaders reads the tangents.
+         */
+        bool generate_normals = false;
+        bool generate_tangents = false;
+
+        /**
+         * Reorder the triangles for the post-transform vertex cache and the vertices for the vertex fetch,
+         * see xe::optimize_vertex_cache. Off by default, as it changes the order of the faces and the vertices.
+         */
+        bool optimize_vertex_cache = false;
+
+        /**
+         * Sort clusters of triangles inside every submesh to reduce overdraw, see xe::optimize_overdraw. With debug
+         * logging on, the overdraw estimated before and after is reported.
+         */
+        bool optimize_overdraw = false;
+
+        /**
+         * Split the submeshes into meshlets that are culled separately when drawing, see xe::build_meshlets and
+         * Mesh::draw(const glm::mat4 &, const glm::vec3 &).
+         */
+        bool build_meshlets = false;
+
+        /**
+         * Generate simplified levels of detail with `lod_ratios` of the faces each, see xe::build_lod_chain. They are
+         * stored in the Mesh and picked by Node::enqueue from the projected size of the mesh.
+         */
+        bool generate_lods = false;
+        std::vector<float> lod_ratios = {0.5f, 0.25f, 0.125f, 0.0625f};
+        float lod_max_error = 0.05f;
+
+        /**
+         * Encoding of the vertex attributes in the vertex buffer, e.g. VertexEncoding::compact() to quantize all of
+         * them. The size per vertex and the error of every attribute are logged at the debug level when the mesh is
+         * built.
+         */
+        VertexEncoding vertex_encoding;
+
+        /**
+         * Cache sharing the textures between materials and meshes, TextureCache::global() if not set. It must outlive
+         * the call only, the materials keep their textures alive.
+         */
+        TextureCache *texture_cache = nullptr;
+
+        /**
+         * Put the vertices and indices in the shared buffers of `buffer_arena`, BufferArena::global() if not set,
+         * instead of buffers of the mesh, see Mesh::allocate_in_arena.
+         */
+        bool use_buffer_arena = true;
+        BufferArena *buffer_arena = nullptr;
+
+        /**
+         * Threads decoding the textures of the mesh, 0 means all the available hardware threads.
+         */
+        unsigned int texture_threads = 0;
+
+        /**
+         * Enable back face culling for the submeshes. This also lets back-facing meshlets be skipped.
+         */
+        bool cull_face = false;
+
+        /**
+         * Options that change the content of the loaded mesh, caches written with different options are not used.
+         */
+        uint32_t cache_key() const;
+    };
+
     std::shared_ptr<Mesh> load_mesh_from_obj(std::string path, std::string mtl_dir);
+
+    std::shared_ptr<Mesh> load_mesh_from_obj(std::string path, std::string mtl_dir, const MeshLoadOptions &options);
 }
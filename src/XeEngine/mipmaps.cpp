@@ -0,0 +1,116 @@
+#include "mipmaps.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define XE_MIPMAPS_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define XE_MIPMAPS_NEON
+#endif
+
+namespace {
+
+    /**
+     * Averages the first `n` pixel pairs of two rows of an RGBA image, four output pixels per step.
+     * Returns the first output pixel not written.
+     */
+    int downsample_rgba_row(const uint8_t *row0, const uint8_t *row1, int n, uint8_t *dst) {
+        int x = 0;
+#if defined(XE_MIPMAPS_SSE2)
+        const auto zero = _mm_setzero_si128();
+        const auto two = _mm_set1_epi16(2);
+        for (; x + 4 <= n; x += 4) {
+            // 8 source pixels, two registers of 4 from each row.
+            auto a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 8 * x));
+            auto a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 8 * x + 16));
+            auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 8 * x));
+            auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 8 * x + 16));
+            // Vertical sums in 16 bit, two pixels per register.
+            auto s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+            auto s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+            auto s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+            auto s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+            // Horizontal sums of the pixel pairs end up in the low halves.
+            s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+            s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+            s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+            s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+            auto lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), two), 2);
+            auto hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), two), 2);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x), _mm_packus_epi16(lo, hi));
+        }
+#elif defined(XE_MIPMAPS_NEON)
+        for (; x + 4 <= n; x += 4) {
+            auto a0 = vld1q_u8(row0 + 8 * x), a1 = vld1q_u8(row0 + 8 * x + 16);
+            auto b0 = vld1q_u8(row1 + 8 * x), b1 = vld1q_u8(row1 + 8 * x + 16);
+            auto s0 = vaddl_u8(vget_low_u8(a0), vget_low_u8(b0));
+            auto s1 = vaddl_u8(vget_high_u8(a0), vget_high_u8(b0));
+            auto s2 = vaddl_u8(vget_low_u8(a1), vget_low_u8(b1));
+            auto s3 = vaddl_u8(vget_high_u8(a1), vget_high_u8(b1));
+            auto lo = vcombine_u16(vadd_u16(vget_low_u16(s0), vget_high_u16(s0)),
+                                   vadd_u16(vget_low_u16(s1), vget_high_u16(s1)));
+            auto hi = vcombine_u16(vadd_u16(vget_low_u16(s2), vget_high_u16(s2)),
+                                   vadd_u16(vget_low_u16(s3), vget_high_u16(s3)));
+            // Rounding narrowing shift, (s + 2) >> 2.
+            vst1q_u8(dst + 4 * x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+        }
+#endif
+        return x;
+    }
+}
+
+namespace xe {
+
+    int mip_levels(int width, int height) {
+        int levels = 1;
+        for (auto size = std::max(width, height); size > 1; size >>= 1)
+            levels++;
+        return levels;
+    }
+
+    void downsample_2x2(const uint8_t *src, int width, int height, int channels, uint8_t *dst) {
+        auto dst_width = std::max(1, width / 2);
+        auto dst_height = std::max(1, height / 2);
+        auto row_size = size_t(width) * channels;
+        for (int y = 0; y < dst_height; y++) {
+            auto row0 = src + size_t(2 * y) * row_size;
+            auto row1 = src + size_t(std::min(2 * y + 1, height - 1)) * row_size;
+            auto out = dst + size_t(y) * dst_width * channels;
+            int x = 0;
+            // Only pairs with both pixels inside the row take the SIMD path.
+            if (channels == 4)
+                x = downsample_rgba_row(row0, row1, width / 2, out);
+            for (; x < dst_width; x++) {
+                auto i0 = size_t(2 * x) * channels;
+                auto i1 = size_t(std::min(2 * x + 1, width - 1)) * channels;
+                for (int c = 0; c < channels; c++) {
+                    auto sum = row0[i0 + c] + row0[i1 + c] + row1[i0 + c] + row1[i1 + c];
+                    out[size_t(x) * channels + c] = static_cast<uint8_t>((sum + 2) >> 2);
+                }
+            }
+        }
+    }
+
+    void generate_mipmaps(Image *image) {
+        image->levels = mip_levels(image->width, image->height);
+        size_t size = 0;
+        for (int level = 1; level < image->levels; level++)
+            size += image->level_size(level);
+        image->mips.resize(size);
+
+        auto src = image->pixels.get();
+        auto dst = image->mips.data();
+        for (int level = 1; level < image->levels; level++) {
+            downsample_2x2(src, image->level_width(level - 1), image->level_height(level - 1), image->channels, dst);
+            src = dst;
+            dst += image->level_size(level);
+        }
+    }
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+#include "XeEngine/ImageDecoder.h"
+
+namespace xe {
+
+    /**
+     * Number of levels in the full mip chain of a width x height image.
+     */
+    int mip_levels(int width, int height);
+
+    /**
+     * 2x2 box filter of an 8 bit image with `channels` channels into a max(1, width / 2) x max(1, height / 2) image.
+     * The last row and column of odd sized images are dropped, except when the size is 1. SSE2/NEON for four
+     * channels.
+     */
+    void downsample_2x2(const uint8_t *src, int width, int height, int channels, uint8_t *dst);
+
+    /**
+     * Fills `image->mips` with the levels 1 and up of the full mip chain, each computed from the previous one.
+     */
+    void generate_mipmaps(Image *image);
+
+}
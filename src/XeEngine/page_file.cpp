@@ -0,0 +1,271 @@
+#include "page_file.h"
+
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#include "spdlog/spdlog.h"
+
+#include "ObjectReader/parallel.h"
+#include "XeEngine/ImageDecoder.h"
+#include "XeEngine/block_compression.h"
+#include "XeEngine/content_hash.h"
+#include "XeEngine/mipmaps.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+    const char MAGIC[4] = {'X', 'E', 'V', 'T'};
+    const uint32_t VERSION = 1u;
+
+    uint32_t next_power_of_two(uint32_t n) {
+        uint32_t p = 1u;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+    bool has_transparency(const xe::Image &image) {
+        if (image.channels != 4)
+            return false;
+        auto pixels = image.pixels.get();
+        for (size_t i = 3; i < image.size(); i += 4)
+            if (pixels[i] != 255)
+                return true;
+        return false;
+    }
+
+    /**
+     * Copies the tile with its border out of a width x height level, texels outside of the level repeat the edge.
+     */
+    void extract_page(const uint8_t *pixels, int width, int height, int channels, int x0, int y0, int page_size,
+                      uint8_t *page) {
+        for (int y = 0; y < page_size; y++) {
+            auto sy = std::clamp(y0 + y, 0, height - 1);
+            auto row = pixels + size_t(sy) * width * channels;
+            auto out = page + size_t(y) * page_size * channels;
+            for (int x = 0; x < page_size; x++) {
+                auto sx = std::clamp(x0 + x, 0, width - 1);
+                std::memcpy(out + size_t(x) * channels, row + size_t(sx) * channels, channels);
+            }
+        }
+    }
+
+    size_t page_bytes(const xe::PageFileHeader &h) {
+        auto page_size = size_t(h.tile_size + 2 * h.border);
+        auto format = static_cast<xe::BlockFormat>(h.block_format);
+        if (format != xe::BlockFormat::None)
+            return (page_size / 4) * (page_size / 4) * xe::block_bytes(format);
+        return page_size * page_size * h.channels;
+    }
+
+    bool read_header(const std::string &path, xe::PageFileHeader *h) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.read(reinterpret_cast<char *>(h), sizeof(*h)))
+            return false;
+        return std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 && h->version == VERSION;
+    }
+}
+
+namespace xe {
+
+    std::string page_file_path(const std::string &source) {
+        return source + ".vtex";
+    }
+
+    bool build_page_file(const std::string &source, const std::string &path, const PageFileOptions &options) {
+        auto tile_size = options.tile_size, border = options.border;
+        auto page_size = tile_size + 2 * border;
+        if (tile_size <= 0 || border < 0 || (options.compress && page_size % 4 != 0)) {
+            spdlog::warn("Invalid page size {} + 2 x {} for page file `{}'", tile_size, border, path);
+            return false;
+        }
+
+        PageFileHeader h;
+        std::memset(&h, 0, sizeof(h));
+        if (!file_stamp(source, &h.source_size, &h.source_mtime))
+            return false;
+        Image image;
+        if (!decode_image(source, &image, options.flip_vertically))
+            return false;
+        if (image.channels != 3 && image.channels != 4) {
+            spdlog::warn("Unsupported number of image channels {} in `{}'", image.channels, source);
+            return false;
+        }
+
+        auto format = BlockFormat::None;
+        if (options.compress)
+            format = has_transparency(image) ? BlockFormat::BC3 : BlockFormat::BC1;
+
+        h.version = VERSION;
+        h.width = static_cast<uint32_t>(image.width);
+        h.height = static_cast<uint32_t>(image.height);
+        h.channels = static_cast<uint32_t>(image.channels);
+        h.block_format = static_cast<uint32_t>(format);
+        h.tile_size = static_cast<uint32_t>(tile_size);
+        h.border = static_cast<uint32_t>(border);
+        h.tiles_x = next_power_of_two((h.width + h.tile_size - 1) / h.tile_size);
+        h.tiles_y = next_power_of_two((h.height + h.tile_size - 1) / h.tile_size);
+        h.levels = static_cast<uint32_t>(mip_levels(int(h.tiles_x), int(h.tiles_y)));
+        h.flip_vertically = options.flip_vertically ? 1u : 0u;
+
+        size_t n_entries = 0;
+        for (uint32_t level = 0; level < h.levels; level++)
+            n_entries += size_t(std::max(1u, h.tiles_x >> level)) * std::max(1u, h.tiles_y >> level);
+        std::vector<PageFileEntry> table(n_entries, PageFileEntry{0, 0});
+        auto bytes = ::page_bytes(h);
+
+        // Write to a temporary file and rename it, so nobody ever reads a half written page file.
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                spdlog::warn("Cannot write page file `{}'", tmp);
+                return false;
+            }
+            // The table is written again at the end, when the offsets are known.
+            out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char *>(table.data()),
+                      static_cast<std::streamsize>(table.size() * sizeof(PageFileEntry)));
+            uint64_t offset = sizeof(h) + table.size() * sizeof(PageFileEntry);
+
+            auto channels = image.channels;
+            int width = image.width, height = image.height;
+            const uint8_t *pixels = image.pixels.get();
+            std::vector<uint8_t> level_pixels, next_pixels;
+            std::vector<uint8_t> row;
+            size_t entry = 0;
+            for (uint32_t level = 0; level < h.levels; level++) {
+                auto grid_x = int(std::max(1u, h.tiles_x >> level)), grid_y = int(std::max(1u, h.tiles_y >> level));
+                auto n_x = std::min(grid_x, (width + tile_size - 1) / tile_size);
+                auto n_y = std::min(grid_y, (height + tile_size - 1) / tile_size);
+                row.resize(size_t(n_x) * bytes);
+                for (int y = 0; y < grid_y; y++) {
+                    if (y < n_y) {
+                        // The tiles of a row are encoded in parallel and written in order.
+                        parallel_for(size_t(n_x), options.n_threads, [&](size_t x) {
+                            std::vector<uint8_t> page(size_t(page_size) * page_size * channels);
+                            extract_page(pixels, width, height, channels, int(x) * tile_size - border,
+                                         y * tile_size - border, page_size, page.data());
+                            auto dst = row.data() + x * bytes;
+                            if (format != BlockFormat::None)
+                                compress_level(page.data(), page_size, page_size, channels, format, dst, 1);
+                            else
+                                std::memcpy(dst, page.data(), bytes);
+                        });
+                        out.write(reinterpret_cast<const char *>(row.data()), static_cast<std::streamsize>(row.size()));
+                        for (int x = 0; x < n_x; x++, offset += bytes)
+                            table[entry + size_t(y) * grid_x + x] = {offset, bytes};
+                    }
+                }
+                entry += size_t(grid_x) * grid_y;
+
+                if (level + 1 < h.levels) {
+                    next_pixels.resize(size_t(std::max(1, width / 2)) * std::max(1, height / 2) * channels);
+                    downsample_2x2(pixels, width, height, channels, next_pixels.data());
+                    std::swap(level_pixels, next_pixels);
+                    pixels = level_pixels.data();
+                    width = std::max(1, width / 2);
+                    height = std::max(1, height / 2);
+                    // The source pixels are the largest buffer, drop them as soon as possible.
+                    image.pixels.reset();
+                }
+            }
+
+            std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+            out.seekp(0);
+            out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char *>(table.data()),
+                      static_cast<std::streamsize>(table.size() * sizeof(PageFileEntry)));
+            if (!out) {
+                spdlog::warn("Cannot write page file `{}'", tmp);
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp, path, ec);
+        if (ec) {
+            spdlog::warn("Cannot write page file `{}': {}", path, ec.message());
+            fs::remove(tmp, ec);
+            return false;
+        }
+        spdlog::info("Built page file `{}' from `{}': {}x{}, {} levels, {} byte pages", path, source, h.width,
+                     h.height, h.levels, bytes);
+        return true;
+    }
+
+    bool page_file_up_to_date(const std::string &source, const std::string &path, const PageFileOptions &options) {
+        PageFileHeader h;
+        if (!read_header(path, &h))
+            return false;
+        uint64_t size;
+        int64_t mtime;
+        if (!file_stamp(source, &size, &mtime))
+            return false;
+        return size == h.source_size && mtime == h.source_mtime &&
+               h.tile_size == uint32_t(options.tile_size) && h.border == uint32_t(options.border) &&
+               (h.block_format != uint32_t(BlockFormat::None)) == options.compress &&
+               (h.flip_vertically != 0) == options.flip_vertically;
+    }
+
+    bool PageFile::open(const std::string &path) {
+        if (!read_header(path, &header_)) {
+            spdlog::warn("`{}' is not a page file", path);
+            return false;
+        }
+        std::error_code ec;
+        auto file_size = fs::file_size(path, ec);
+        if (ec || header_.levels == 0 || header_.levels > 16 || header_.tile_size == 0 ||
+            (header_.channels != 3 && header_.channels != 4) ||
+            header_.block_format > static_cast<uint32_t>(BlockFormat::BC3)) {
+            spdlog::warn("Page file `{}' is corrupted", path);
+            return false;
+        }
+
+        level_offsets_.resize(header_.levels);
+        size_t n_entries = 0;
+        for (int level = 0; level < levels(); level++) {
+            level_offsets_[level] = n_entries;
+            n_entries += size_t(tiles_x(level)) * tiles_y(level);
+        }
+        table_.resize(n_entries);
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(sizeof(header_));
+        if (!in.read(reinterpret_cast<char *>(table_.data()),
+                     static_cast<std::streamsize>(table_.size() * sizeof(PageFileEntry)))) {
+            spdlog::warn("Page file `{}' is corrupted", path);
+            return false;
+        }
+        auto bytes = page_bytes();
+        for (auto &&e: table_) {
+            if (e.size != 0 && (e.size != bytes || e.offset > file_size || e.size > file_size - e.offset)) {
+                spdlog::warn("Page file `{}' is corrupted", path);
+                return false;
+            }
+        }
+        path_ = path;
+        return true;
+    }
+
+    size_t PageFile::page_bytes() const {
+        return ::page_bytes(header_);
+    }
+
+    bool PageFile::has_tile(int level, int x, int y) const {
+        if (level < 0 || level >= levels() || x < 0 || y < 0 || x >= tiles_x(level) || y >= tiles_y(level))
+            return false;
+        return entry(level, x, y).size > 0;
+    }
+
+    bool PageFile::read_tile(std::ifstream &in, int level, int x, int y, std::vector<uint8_t> *page) const {
+        if (!has_tile(level, x, y))
+            return false;
+        auto &e = entry(level, x, y);
+        page->resize(e.size);
+        in.clear();
+        in.seekg(static_cast<std::streamoff>(e.offset));
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(page->data()), static_cast<std::streamsize>(e.size)));
+    }
+
+}
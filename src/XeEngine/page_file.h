@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "XeEngine/Texture.h"
+
+namespace xe {
+
+    /**
+     * Tiled mip pyramid of a large image, the backing store of a VirtualTexture.
+     *
+     * Every level is cut into tiles of `tile_size` x `tile_size` texels, stored with a `border` of texels copied from
+     * the neighbours (clamped at the image edges) so a tile can be filtered on its own: a page of
+     * `tile_size + 2 * border` texels square, BC1/BC3 blocks or raw RGB(A) ready for upload. The tile grid of level
+     * 0 is rounded up to a power of two in each direction and halved from level to level, as the mips of a texture
+     * with one texel per tile, down to a single tile. Level L holds the image downsampled L times, its tiles outside
+     * of the image are not stored.
+     */
+    struct PageFileOptions {
+        int tile_size = 120;
+        int border = 4;
+
+        /**
+         * BC1 pages, or BC3 for images with transparency. The page size has to be a multiple of 4.
+         */
+        bool compress = true;
+        bool flip_vertically = true;
+
+        /**
+         * Threads encoding the tiles, 0 means all.
+         */
+        unsigned int n_threads = 0;
+    };
+
+    struct PageFileHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        uint32_t block_format;
+        uint32_t tile_size;
+        uint32_t border;
+        uint32_t tiles_x;
+        uint32_t tiles_y;
+        uint32_t levels;
+        uint32_t flip_vertically;
+        // Stamp of the source image, see file_stamp.
+        uint64_t source_size;
+        int64_t source_mtime;
+    };
+
+    /**
+     * Tile table entry, `size` is 0 for tiles outside of the image.
+     */
+    struct PageFileEntry {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::string page_file_path(const std::string &source);
+
+    /**
+     * Tiles the image at `source` into the page file `path`. The whole source is decoded at once, so this is meant
+     * to run offline or once per source, see VirtualTexture::open_image. Returns false if the image cannot be
+     * decoded or the file cannot be written.
+     */
+    bool build_page_file(const std::string &source, const std::string &path, const PageFileOptions &options = {});
+
+    /**
+     * Whether the page file was built from the current `source` with the same options.
+     */
+    bool page_file_up_to_date(const std::string &source, const std::string &path, const PageFileOptions &options = {});
+
+    /**
+     * Read access to the header and tile table of a page file. The tiles are read with `read_tile` through a stream
+     * owned by the caller, so every loader thread can have its own.
+     */
+    class PageFile {
+    public:
+        bool open(const std::string &path);
+
+        const std::string &path() const { return path_; }
+
+        const PageFileHeader &header() const { return header_; }
+
+        BlockFormat block_format() const { return static_cast<BlockFormat>(header_.block_format); }
+
+        int page_size() const { return int(header_.tile_size + 2 * header_.border); }
+
+        /**
+         * Bytes of one page.
+         */
+        size_t page_bytes() const;
+
+        int levels() const { return int(header_.levels); }
+
+        int tiles_x(int level) const { return std::max(1, int(header_.tiles_x) >> level); }
+
+        int tiles_y(int level) const { return std::max(1, int(header_.tiles_y) >> level); }
+
+        /**
+         * Whether the tile is inside the grid of its level and stored in the file.
+         */
+        bool has_tile(int level, int x, int y) const;
+
+        bool read_tile(std::ifstream &in, int level, int x, int y, std::vector<uint8_t> *page) const;
+
+    private:
+        const PageFileEntry &entry(int level, int x, int y) const {
+            return table_[level_offsets_[level] + size_t(y) * tiles_x(level) + x];
+        }
+
+        std::string path_;
+        PageFileHeader header_{};
+        std::vector<size_t> level_offsets_;
+        std::vector<PageFileEntry> table_;
+    };
+
+}
@@ -0,0 +1,25 @@
+#version 460
+
+layout(location=0) out vec4 vFragColor;
+
+struct Material {
+    vec4 Kd;
+    int use_map_Kd;
+};
+
+layout(std430, binding=5) readonly buffer Materials {
+    Material materials[];
+};
+
+in vec2 vertex_texcoords_0;
+flat in uint material_index;
+
+uniform sampler2D map_Kd;
+
+void main() {
+    Material material = materials[material_index];
+    if (material.use_map_Kd != 0)
+    vFragColor = material.Kd*texture(map_Kd, vertex_texcoords_0);
+    else
+    vFragColor = material.Kd;
+}
@@ -0,0 +1,38 @@
+#version 460
+
+layout(location=0) in vec4 a_vertex_position;
+layout(location=1) in vec2 a_vertex_texcoords_0;
+layout(location=2) in vec2 a_vertex_texcoords_1;
+layout(location=3) in vec2 a_vertex_texcoords_2;
+layout(location=4) in vec2 a_vertex_texcoords_3;
+
+layout(std140, binding=1) uniform Transformations {
+    mat4 PVM;
+};
+
+struct VertexDecoding {
+    vec4 position_scale;
+    vec4 position_offset;
+    int normal_encoding;
+};
+
+// Material of every command of the current glMultiDrawElementsIndirect.
+layout(std430, binding=6) readonly buffer DrawMaterials {
+    uint draw_material[];
+};
+
+// Vertex decoding of every command, the meshes of one draw may be quantized differently.
+layout(std430, binding=7) readonly buffer DrawDecodings {
+    VertexDecoding draw_decoding[];
+};
+
+out vec2 vertex_texcoords_0;
+flat out uint material_index;
+
+void main() {
+    VertexDecoding decoding = draw_decoding[gl_DrawID];
+    vec4 position = vec4(decoding.position_offset.xyz + decoding.position_scale.xyz * a_vertex_position.xyz, 1.0);
+    vertex_texcoords_0 = a_vertex_texcoords_0;
+    material_index = draw_material[gl_DrawID];
+    gl_Position =  PVM * position;
+}
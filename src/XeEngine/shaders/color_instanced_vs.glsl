@@ -0,0 +1,27 @@
+#version 460
+
+layout(location=0) in vec4 a_vertex_position;
+layout(location=1) in vec2 a_vertex_texcoords_0;
+layout(location=2) in vec2 a_vertex_texcoords_1;
+layout(location=3) in vec2 a_vertex_texcoords_2;
+layout(location=4) in vec2 a_vertex_texcoords_3;
+// Per instance, see xe::Mesh::draw_instanced.
+layout(location=7) in mat4 a_instance_PVM;
+
+#if __VERSION__ > 410
+layout(std140, binding=4) uniform VertexDecoding {
+#else
+    layout(std140) uniform VertexDecoding {
+#endif
+    vec4 position_scale;
+    vec4 position_offset;
+    int normal_encoding;
+};
+
+out vec2 vertex_texcoords_0;
+
+void main() {
+    vec4 position = vec4(position_offset.xyz + position_scale.xyz * a_vertex_position.xyz, 1.0);
+    vertex_texcoords_0 = a_vertex_texcoords_0;
+    gl_Position =  a_instance_PVM * position;
+}
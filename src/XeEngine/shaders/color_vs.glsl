@@ -14,9 +14,20 @@ layout(std140, binding=1) uniform Transformations {
     mat4 PVM;
 };
 
+#if __VERSION__ > 410
+layout(std140, binding=4) uniform VertexDecoding {
+#else
+    layout(std140) uniform VertexDecoding {
+#endif
+    vec4 position_scale;
+    vec4 position_offset;
+    int normal_encoding;
+};
+
 out vec2 vertex_texcoords_0;
 
 void main() {
+    vec4 position = vec4(position_offset.xyz + position_scale.xyz * a_vertex_position.xyz, 1.0);
     vertex_texcoords_0 = a_vertex_texcoords_0;
-    gl_Position =  PVM * a_vertex_position;
+    gl_Position =  PVM * position;
 }
@@ -0,0 +1,51 @@
+#version 460
+
+layout(location=0) in vec4 a_vertex_position;
+
+
+layout(location=1) in vec2 a_vertex_texcoords_0;
+layout(location=2) in vec2 a_vertex_texcoords_1;
+layout(location=3) in vec2 a_vertex_texcoords_2;
+layout(location=4) in vec2 a_vertex_texcoords_3;
+layout(location=5) in vec3 a_vertex_normal;
+// Per instance, see xe::Mesh::draw_instanced.
+layout(location=7) in mat4 a_instance_PVM;
+layout(location=11) in mat4 a_instance_VM;
+
+
+#if __VERSION__ > 410
+layout(std140, binding=4) uniform VertexDecoding {
+#else
+    layout(std140) uniform VertexDecoding {
+#endif
+    vec4 position_scale;
+    vec4 position_offset;
+    int normal_encoding;
+};
+
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+
+out vec2 vertex_texcoords_0;
+out vec3 vertex_coords_in_viewspace;
+out vec3 vertex_normal_in_viewspace;
+
+
+void main() {
+    // The normal matrix up to a scale, the cofactors of the rotation part.
+    mat3 R = mat3(a_instance_VM);
+    mat3 N = mat3(cross(R[1], R[2]), cross(R[2], R[0]), cross(R[0], R[1]));
+
+    vec4 position = vec4(position_offset.xyz + position_scale.xyz * a_vertex_position.xyz, 1.0);
+    vec3 normal = normal_encoding == 1 ? oct_decode(a_vertex_normal.xy) : a_vertex_normal;
+    vertex_texcoords_0 = a_vertex_texcoords_0;
+    vec4 vertex_coords_in_viewspace4 = a_instance_VM*position;
+    vertex_coords_in_viewspace = vertex_coords_in_viewspace4.xyz/vertex_coords_in_viewspace4.w;
+    vertex_normal_in_viewspace = normalize(N * normal);
+    gl_Position =  a_instance_PVM*position;
+}
@@ -26,6 +26,23 @@ layout(std140, binding=2) uniform Matrices {
     mat3 N;
 };
 
+#if __VERSION__ > 410
+layout(std140, binding=4) uniform VertexDecoding {
+#else
+    layout(std140) uniform VertexDecoding {
+#endif
+    vec4 position_scale;
+    vec4 position_offset;
+    int normal_encoding;
+};
+
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
 
 out vec2 vertex_texcoords_0;
 out vec3 vertex_coords_in_viewspace;
@@ -34,9 +51,11 @@ out vec3 vertex_normal_in_viewspace;
 
 void main() {
 
+    vec4 position = vec4(position_offset.xyz + position_scale.xyz * a_vertex_position.xyz, 1.0);
+    vec3 normal = normal_encoding == 1 ? oct_decode(a_vertex_normal.xy) : a_vertex_normal;
     vertex_texcoords_0 = a_vertex_texcoords_0;
-    vec4 vertex_coords_in_viewspace4 = VM*a_vertex_position;
+    vec4 vertex_coords_in_viewspace4 = VM*position;
     vertex_coords_in_viewspace = vertex_coords_in_viewspace4.xyz/vertex_coords_in_viewspace4.w;
-    vertex_normal_in_viewspace = normalize(N * a_vertex_normal);
-    gl_Position =  PVM*a_vertex_position;
+    vertex_normal_in_viewspace = normalize(N * normal);
+    gl_Position =  PVM*position;
 }
@@ -0,0 +1,56 @@
+#version 460
+
+layout(location=0) out vec4 vFragColor;
+
+#if __VERSION__ > 410
+layout(std140, binding=0) uniform VirtualTexture {
+#else
+    layout(std140) uniform VirtualTexture {
+    #endif
+    vec4  Kd;
+    vec2  virtual_size;
+    vec2  cache_pages;
+    float tile_size;
+    float page_border;
+    float max_level;
+    float lod_bias;
+    bool  feedback;
+};
+
+in vec2 vertex_texcoords_0;
+
+uniform sampler2D page_cache;
+uniform sampler2D page_table;
+
+// Texel coordinates of the image at the given level, whose size is the size of level 0 halved and rounded down.
+vec2 level_texel(float level) {
+    return vertex_texcoords_0 * max(floor(virtual_size * exp2(-level)), vec2(1.0));
+}
+
+void main() {
+    vec2 texel = vertex_texcoords_0 * virtual_size;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + lod_bias;
+    int level = int(clamp(floor(lod), 0.0, max_level));
+
+    ivec2 tile = clamp(ivec2(floor(level_texel(float(level)) / tile_size)), ivec2(0),
+    textureSize(page_table, level) - 1);
+
+    if (feedback) {
+        // Low 8 bits of the tile coordinates, their high 4 bits and the level + 1, see VirtualTexture.
+        vFragColor = vec4(float(tile.x & 255), float(tile.y & 255), float((tile.x >> 8) | ((tile.y >> 8) << 4)),
+        float(level + 1)) / 255.0;
+        return;
+    }
+
+    // The page holding the tile or its nearest resident ancestor.
+    vec4 entry = texelFetch(page_table, tile, level) * 255.0;
+    int page_level = int(entry.b + 0.5);
+    ivec2 page_tile = tile >> max(page_level - level, 0);
+    vec2 in_tile = level_texel(float(page_level)) - vec2(page_tile) * tile_size;
+
+    float page_size = tile_size + 2.0 * page_border;
+    vec2 uv = (floor(entry.rg + 0.5) * page_size + page_border + in_tile) / (cache_pages * page_size);
+    vFragColor = Kd * textureLod(page_cache, uv, 0.0);
+}
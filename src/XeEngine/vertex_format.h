@@ -0,0 +1,281 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <utility>
+
+#include "glad/gl.h"
+#include "glm/glm.hpp"
+
+#include "XeEngine/Mesh.h"
+#include "XeEngine/vertex_quantization.h"
+
+/**
+ * Vertex layouts described by types, e.g.
+ *
+ *     using Format = xe::VertexFormat<xe::Position<xe::f32x3>, xe::UV0<xe::u16x2n>, xe::Normal<xe::oct16>>;
+ *     std::vector<uint8_t> vertices(n * Format::stride);
+ *     Format::interleave(n, vertices.data(), positions, uvs, normals);
+ *     mesh->allocate_vertex_buffer(vertices.size(), GL_STATIC_DRAW, vertices.data());
+ *     Format::setup(*mesh);
+ *
+ * Stride and offsets are compile time constants and the per vertex packing is a fixed sequence of stores, so the
+ * interleave loop has no branches and is unrolled over the attributes.
+ */
+namespace xe {
+
+    /**
+     * Attribute codecs: how a `value_type` is stored in the vertex buffer. Each knows its glVertexAttribPointer
+     * parameters; `pack` writes `bytes` bytes and `unpack` returns what the vertex shader sees.
+     */
+    struct f32x2 {
+        using value_type = glm::vec2;
+        static constexpr GLint components = 2;
+        static constexpr GLenum type = GL_FLOAT;
+        static constexpr GLboolean normalized = GL_FALSE;
+        static constexpr GLuint bytes = 2 * sizeof(GLfloat);
+
+        static void pack(const value_type &v, uint8_t *dst) { std::memcpy(dst, &v[0], bytes); }
+
+        static value_type unpack(const uint8_t *src) {
+            value_type v;
+            std::memcpy(&v[0], src, bytes);
+            return v;
+        }
+    };
+
+    struct f32x3 {
+        using value_type = glm::vec3;
+        static constexpr GLint components = 3;
+        static constexpr GLenum type = GL_FLOAT;
+        static constexpr GLboolean normalized = GL_FALSE;
+        static constexpr GLuint bytes = 3 * sizeof(GLfloat);
+
+        static void pack(const value_type &v, uint8_t *dst) { std::memcpy(dst, &v[0], bytes); }
+
+        static value_type unpack(const uint8_t *src) {
+            value_type v;
+            std::memcpy(&v[0], src, bytes);
+            return v;
+        }
+    };
+
+    struct f32x4 {
+        using value_type = glm::vec4;
+        static constexpr GLint components = 4;
+        static constexpr GLenum type = GL_FLOAT;
+        static constexpr GLboolean normalized = GL_FALSE;
+        static constexpr GLuint bytes = 4 * sizeof(GLfloat);
+
+        static void pack(const value_type &v, uint8_t *dst) { std::memcpy(dst, &v[0], bytes); }
+
+        static value_type unpack(const uint8_t *src) {
+            value_type v;
+            std::memcpy(&v[0], src, bytes);
+            return v;
+        }
+    };
+
+    struct f16x2 {
+        using value_type = glm::vec2;
+        static constexpr GLint components = 2;
+        static constexpr GLenum type = GL_HALF_FLOAT;
+        static constexpr GLboolean normalized = GL_FALSE;
+        static constexpr GLuint bytes = 2 * sizeof(uint16_t);
+
+        static void pack(const value_type &v, uint8_t *dst) {
+            uint16_t q[2] = {float_to_half(v.x), float_to_half(v.y)};
+            std::memcpy(dst, q, bytes);
+        }
+
+        static value_type unpack(const uint8_t *src) {
+            uint16_t q[2];
+            std::memcpy(q, src, bytes);
+            return {half_to_float(q[0]), half_to_float(q[1])};
+        }
+    };
+
+    /**
+     * Two values in [0, 1].
+     */
+    struct u16x2n {
+        using value_type = glm::vec2;
+        static constexpr GLint components = 2;
+        static constexpr GLenum type = GL_UNSIGNED_SHORT;
+        static constexpr GLboolean normalized = GL_TRUE;
+        static constexpr GLuint bytes = 2 * sizeof(uint16_t);
+
+        static void pack(const value_type &v, uint8_t *dst) {
+            uint16_t q[2] = {pack_unorm16(v.x), pack_unorm16(v.y)};
+            std::memcpy(dst, q, bytes);
+        }
+
+        static value_type unpack(const uint8_t *src) {
+            uint16_t q[2];
+            std::memcpy(q, src, bytes);
+            return {unpack_unorm16(q[0]), unpack_unorm16(q[1])};
+        }
+    };
+
+    /**
+     * Three values in [0, 1], padded to 8 bytes.
+     */
+    struct u16x3n {
+        using value_type = glm::vec3;
+        static constexpr GLint components = 3;
+        static constexpr GLenum type = GL_UNSIGNED_SHORT;
+        static constexpr GLboolean normalized = GL_TRUE;
+        static constexpr GLuint bytes = 4 * sizeof(uint16_t);
+
+        static void pack(const value_type &v, uint8_t *dst) {
+            uint16_t q[4] = {pack_unorm16(v.x), pack_unorm16(v.y), pack_unorm16(v.z), 0};
+            std::memcpy(dst, q, bytes);
+        }
+
+        static value_type unpack(const uint8_t *src) {
+            uint16_t q[4];
+            std::memcpy(q, src, bytes);
+            return {unpack_unorm16(q[0]), unpack_unorm16(q[1]), unpack_unorm16(q[2])};
+        }
+    };
+
+    /**
+     * Unit vector in octahedral mapping, the shader decodes it (see VertexDecoding::normal_encoding).
+     */
+    struct oct16 {
+        using value_type = glm::vec3;
+        static constexpr GLint components = 2;
+        static constexpr GLenum type = GL_SHORT;
+        static constexpr GLboolean normalized = GL_TRUE;
+        static constexpr GLuint bytes = 2 * sizeof(int16_t);
+
+        static void pack(const value_type &v, uint8_t *dst) {
+            int16_t q[2];
+            pack_oct16(v, q);
+            std::memcpy(dst, q, bytes);
+        }
+
+        static value_type unpack(const uint8_t *src) {
+            int16_t q[2];
+            std::memcpy(q, src, bytes);
+            return unpack_oct16(q);
+        }
+    };
+
+    /**
+     * Tangent with the bitangent sign in w, as GL_INT_2_10_10_10_REV.
+     */
+    struct i10x3_2n {
+        using value_type = glm::vec4;
+        static constexpr GLint components = 4;
+        static constexpr GLenum type = GL_INT_2_10_10_10_REV;
+        static constexpr GLboolean normalized = GL_TRUE;
+        static constexpr GLuint bytes = sizeof(uint32_t);
+
+        static void pack(const value_type &v, uint8_t *dst) {
+            auto q = pack_snorm_10_10_10_2(v);
+            std::memcpy(dst, &q, bytes);
+        }
+
+        static value_type unpack(const uint8_t *src) {
+            uint32_t q;
+            std::memcpy(&q, src, bytes);
+            return unpack_snorm_10_10_10_2(q);
+        }
+    };
+
+    /**
+     * Codec bound to an attribute location.
+     */
+    template<GLuint Location, typename Codec>
+    struct Attribute {
+        static constexpr GLuint location = Location;
+        using codec = Codec;
+    };
+
+    // Locations used by the XeEngine shaders.
+    template<typename Codec> using Position = Attribute<0, Codec>;
+    template<typename Codec> using UV0 = Attribute<1, Codec>;
+    template<typename Codec> using UV1 = Attribute<2, Codec>;
+    template<typename Codec> using UV2 = Attribute<3, Codec>;
+    template<typename Codec> using UV3 = Attribute<4, Codec>;
+    template<typename Codec> using Normal = Attribute<5, Codec>;
+    template<typename Codec> using Tangent = Attribute<6, Codec>;
+
+    namespace detail {
+        template<GLuint... Bytes>
+        constexpr std::array<GLuint, sizeof...(Bytes)> exclusive_scan() {
+            std::array<GLuint, sizeof...(Bytes)> offsets{};
+            const GLuint sizes[] = {Bytes...};
+            GLuint offset = 0;
+            for (size_t i = 0; i < sizeof...(Bytes); i++) {
+                offsets[i] = offset;
+                offset += sizes[i];
+            }
+            return offsets;
+        }
+
+        template<typename... Attributes, size_t... I>
+        constexpr std::array<VertexAttribute, sizeof...(Attributes)>
+        make_attributes(const std::array<GLuint, sizeof...(Attributes)> &offsets, std::index_sequence<I...>) {
+            return {VertexAttribute{Attributes::location, Attributes::codec::components, Attributes::codec::type,
+                                    Attributes::codec::normalized, offsets[I]}...};
+        }
+    }
+
+    template<typename... Attributes>
+    class VertexFormat {
+        static_assert(sizeof...(Attributes) > 0, "A vertex format needs at least one attribute");
+
+        using indices = std::index_sequence_for<Attributes...>;
+
+    public:
+        static constexpr size_t n_attributes = sizeof...(Attributes);
+
+        static constexpr GLsizei stride = (0 + ... + Attributes::codec::bytes);
+
+        // Offsets of the attributes inside the vertex, in the order of the template arguments.
+        static constexpr std::array<GLuint, n_attributes> offsets =
+                detail::exclusive_scan<Attributes::codec::bytes...>();
+
+        static constexpr std::array<VertexAttribute, n_attributes> attributes =
+                detail::make_attributes<Attributes...>(offsets, indices{});
+
+        using values = std::tuple<typename Attributes::codec::value_type...>;
+
+        /**
+         * Sets up all the attribute pointers of the mesh vertex array.
+         */
+        static void setup(Mesh &mesh) { mesh.vertex_attrib_pointers(attributes.data(), n_attributes, stride); }
+
+        static void pack(void *vertex, const typename Attributes::codec::value_type &... values) {
+            pack(static_cast<uint8_t *>(vertex), indices{}, values...);
+        }
+
+        static values unpack(const void *vertex) { return unpack(static_cast<const uint8_t *>(vertex), indices{}); }
+
+        /**
+         * Packs `n` vertices from one array per attribute into `dst`, which must hold `n * stride` bytes.
+         */
+        static void interleave(size_t n, void *dst, const typename Attributes::codec::value_type *... src) {
+            auto out = static_cast<uint8_t *>(dst);
+            for (size_t i = 0; i < n; i++, out += stride)
+                pack(out, indices{}, src[i]...);
+        }
+
+    private:
+        template<size_t... I>
+        static void pack(uint8_t *vertex, std::index_sequence<I...>,
+                         const typename Attributes::codec::value_type &... values) {
+            (Attributes::codec::pack(values, vertex + offsets[I]), ...);
+        }
+
+        template<size_t... I>
+        static values unpack(const uint8_t *vertex, std::index_sequence<I...>) {
+            return values(Attributes::codec::unpack(vertex + offsets[I])...);
+        }
+    };
+
+}
@@ -0,0 +1,90 @@
+#include "vertex_interleave.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define XE_INTERLEAVE_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define XE_INTERLEAVE_NEON
+#endif
+
+#include "ObjectReader/parallel.h"
+
+namespace {
+
+    const size_t VERTICES_PER_TASK = 1u << 15;
+
+    inline void copy16(uint8_t *dst, const uint8_t *src) {
+#if defined(XE_INTERLEAVE_SSE2)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+#elif defined(XE_INTERLEAVE_NEON)
+        vst1q_u8(dst, vld1q_u8(src));
+#else
+        std::memcpy(dst, src, 16);
+#endif
+    }
+
+    void interleave_scalar(const std::vector<xe::InterleaveStream> &streams, size_t begin, size_t end, size_t stride,
+                           uint8_t *dst) {
+        for (auto &&s: streams) {
+            auto src = static_cast<const uint8_t *>(s.src) + begin * s.size;
+            auto out = dst + begin * stride + s.offset;
+            for (auto i = begin; i < end; ++i, src += s.size, out += stride)
+                std::memcpy(out, src, s.size);
+        }
+    }
+
+    void interleave_wide(const std::vector<xe::InterleaveStream> &streams, size_t begin, size_t end, size_t stride,
+                         uint8_t *dst) {
+        auto out = dst + begin * stride;
+        for (auto i = begin; i < end; ++i, out += stride) {
+            // Streams are sorted by offset, so each store overwrites only what the previous one spilled.
+            for (auto &&s: streams)
+                copy16(out + s.offset, static_cast<const uint8_t *>(s.src) + i * s.size);
+        }
+    }
+}
+
+namespace xe {
+
+    void interleave_vertices(std::vector<InterleaveStream> streams, size_t n_vertices, size_t stride, void *dst) {
+        auto out = static_cast<uint8_t *>(dst);
+        std::sort(streams.begin(), streams.end(), [](const InterleaveStream &a, const InterleaveStream &b) {
+            return a.offset < b.offset;
+        });
+
+        bool wide = true;
+        uint32_t covered = 0;
+        size_t tail = 0;
+        for (auto &&s: streams) {
+            if (s.offset != covered || s.size > 16 || s.size == 0)
+                wide = false;
+            else
+                tail = std::max<size_t>(tail, (16 + s.size - 1) / s.size - 1);
+            covered = s.offset + s.size;
+        }
+        // With vertices shorter than 16 bytes a spill could reach past the next vertex.
+        if (covered != stride || stride < 16)
+            wide = false;
+
+        // A 16 byte load of one of the last `tail` elements would read past the end of its stream.
+        auto safe_end = n_vertices > tail ? n_vertices - tail : 0;
+        auto n_tasks = (n_vertices + VERTICES_PER_TASK - 1) / VERTICES_PER_TASK;
+        xe::parallel_for(n_tasks, 0, [&](size_t task) {
+            auto begin = task * VERTICES_PER_TASK;
+            auto end = std::min(begin + VERTICES_PER_TASK, n_vertices);
+            // The last vertex of the task spills into the first vertex of the next task, which may be written
+            // concurrently by another thread.
+            auto wide_end = wide ? std::max(begin, std::min(end - 1, safe_end)) : begin;
+            interleave_wide(streams, begin, wide_end, stride, out);
+            interleave_scalar(streams, wide_end, end, stride, out);
+        });
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace xe {
+
+    /**
+     * One tightly packed attribute array that is copied into the interleaved vertex buffer. `size` is the size of
+     * one element in bytes (at most 16), `offset` is its position inside the vertex.
+     */
+    struct InterleaveStream {
+        const void *src;
+        uint32_t size;
+        uint32_t offset;
+    };
+
+    /**
+     * Interleaves the attribute streams into `dst`, which must hold `n_vertices * stride` bytes.
+     *
+     * The streams must tile the vertex without holes when sorted by offset. This lets the kernel move every
+     * attribute with a single unaligned 16 byte load and store: whatever spills past the attribute is overwritten by
+     * the next attribute or by the next vertex. Vertices shorter than 16 bytes, and the vertices where a load could
+     * read past the source or a store could leave the buffer or race with another thread, are copied with memcpy.
+     * Large meshes are split between threads.
+     */
+    void interleave_vertices(std::vector<InterleaveStream> streams, size_t n_vertices, size_t stride, void *dst);
+
+}
@@ -0,0 +1,109 @@
+#include "vertex_quantization.h"
+
+#include <cstring>
+
+namespace xe {
+
+    uint16_t float_to_half(float f) {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        auto sign = static_cast<uint16_t>((x >> 16) & 0x8000u);
+        auto abs = x & 0x7fffffffu;
+        if (abs >= 0x7f800000u)
+            return sign | 0x7c00u | (abs > 0x7f800000u ? 0x0200u : 0u);
+        // 65520 and above round to infinity.
+        if (abs >= 0x477ff000u)
+            return sign | 0x7c00u;
+        if (abs < 0x38800000u) {
+            // Subnormal halves are multiples of 2^-24.
+            float a;
+            std::memcpy(&a, &abs, sizeof(a));
+            return sign | static_cast<uint16_t>(std::nearbyint(a * 16777216.0f));
+        }
+        // Rebias the exponent and round the mantissa to nearest even.
+        auto rounded = abs + 0x0fffu + ((abs >> 13) & 1u);
+        return sign | static_cast<uint16_t>((rounded - 0x38000000u) >> 13);
+    }
+
+    float half_to_float(uint16_t h) {
+        uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+        uint32_t exponent = (h >> 10) & 0x1fu;
+        uint32_t mantissa = h & 0x3ffu;
+        uint32_t x;
+        if (exponent == 0) {
+            auto f = static_cast<float>(mantissa) / 16777216.0f;
+            std::memcpy(&x, &f, sizeof(x));
+            x |= sign;
+        } else if (exponent == 31) {
+            x = sign | 0x7f800000u | (mantissa << 13);
+        } else {
+            x = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    glm::vec2 oct_encode(const glm::vec3 &n) {
+        auto l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if (l1 <= 0.0f)
+            return glm::vec2(0.0f);
+        glm::vec2 e(n.x / l1, n.y / l1);
+        if (n.z < 0.0f) {
+            // Fold the lower hemisphere over the diagonals.
+            e = glm::vec2((1.0f - std::abs(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f),
+                          (1.0f - std::abs(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f));
+        }
+        return e;
+    }
+
+    glm::vec3 oct_decode(const glm::vec2 &e) {
+        glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+        auto t = std::max(-n.z, 0.0f);
+        n.x += n.x >= 0.0f ? -t : t;
+        n.y += n.y >= 0.0f ? -t : t;
+        return glm::normalize(n);
+    }
+
+    void pack_oct16(const glm::vec3 &n, int16_t out[2]) {
+        auto e = oct_encode(n);
+        auto fx = std::floor(glm::clamp(e.x, -1.0f, 1.0f) * 32767.0f);
+        auto fy = std::floor(glm::clamp(e.y, -1.0f, 1.0f) * 32767.0f);
+        auto best = -2.0f;
+        for (int dx = 0; dx < 2; dx++) {
+            for (int dy = 0; dy < 2; dy++) {
+                int16_t c[2] = {static_cast<int16_t>(std::min(fx + dx, 32767.0f)),
+                                static_cast<int16_t>(std::min(fy + dy, 32767.0f))};
+                auto d = glm::dot(unpack_oct16(c), n);
+                if (d > best) {
+                    best = d;
+                    out[0] = c[0];
+                    out[1] = c[1];
+                }
+            }
+        }
+    }
+
+    glm::vec3 unpack_oct16(const int16_t in[2]) {
+        return oct_decode(glm::vec2(unpack_snorm16(in[0]), unpack_snorm16(in[1])));
+    }
+
+    uint32_t pack_snorm_10_10_10_2(const glm::vec4 &v) {
+        auto pack = [](float f, float max, uint32_t mask) {
+            auto i = static_cast<int32_t>(std::round(glm::clamp(f, -1.0f, 1.0f) * max));
+            return static_cast<uint32_t>(i) & mask;
+        };
+        return pack(v.x, 511.0f, 0x3ffu) | (pack(v.y, 511.0f, 0x3ffu) << 10) | (pack(v.z, 511.0f, 0x3ffu) << 20) |
+               (pack(v.w, 1.0f, 0x3u) << 30);
+    }
+
+    glm::vec4 unpack_snorm_10_10_10_2(uint32_t p) {
+        // Sign extend each field by shifting it to the top of a signed 32 bit integer.
+        auto field = [p](int shift, int bits, float max) {
+            auto i = static_cast<int32_t>(p << (32 - shift - bits)) >> (32 - bits);
+            return std::max(static_cast<float>(i) / max, -1.0f);
+        };
+        return glm::vec4(field(0, 10, 511.0f), field(10, 10, 511.0f), field(20, 10, 511.0f), field(30, 2, 1.0f));
+    }
+
+}
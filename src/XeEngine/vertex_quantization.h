@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "glm/glm.hpp"
+
+namespace xe {
+
+    /**
+     * Float: three 32 bit floats (12 bytes).
+     * Unorm16: three normalized 16 bit integers spanning the mesh bounding box, padded to 8 bytes. The vertex shader
+     * gets them back with the scale and offset from the VertexDecoding uniform block.
+     */
+    enum class PositionEncoding {
+        Float, Unorm16
+    };
+
+    /**
+     * Float: two 32 bit floats (8 bytes). Half: two half floats (4 bytes). Unorm16: two normalized 16 bit integers
+     * (4 bytes), only for texcoords inside [0, 1], other meshes fall back to Half.
+     */
+    enum class TexcoordEncoding {
+        Float, Half, Unorm16
+    };
+
+    /**
+     * Float: three 32 bit floats (12 bytes). Oct16: octahedral mapping stored in two normalized 16 bit integers
+     * (4 bytes), decoded by the vertex shader.
+     */
+    enum class NormalEncoding {
+        Float, Oct16
+    };
+
+    /**
+     * Float: four 32 bit floats (16 bytes). Snorm10: GL_INT_2_10_10_10_REV (4 bytes), the bitangent sign in the
+     * two bit w component.
+     */
+    enum class TangentEncoding {
+        Float, Snorm10
+    };
+
+    struct VertexEncoding {
+        PositionEncoding position = PositionEncoding::Float;
+        TexcoordEncoding texcoords = TexcoordEncoding::Float;
+        NormalEncoding normals = NormalEncoding::Float;
+        TangentEncoding tangents = TangentEncoding::Float;
+
+        /**
+         * Smallest encodings: 8 + 4 + 4 + 4 bytes per vertex instead of 12 + 8 + 12 + 16.
+         */
+        static VertexEncoding compact() {
+            return {PositionEncoding::Unorm16, TexcoordEncoding::Unorm16, NormalEncoding::Oct16,
+                    TangentEncoding::Snorm10};
+        }
+    };
+
+    /**
+     * Size of the encoded vertex compared to plain floats and the largest error of every attribute after decoding:
+     * distance for positions (in model units), absolute difference for texcoords and angle in degrees for normals
+     * and tangents.
+     */
+    struct VertexEncodingReport {
+        size_t float_bytes_per_vertex = 0;
+        size_t bytes_per_vertex = 0;
+        float position_error = 0.0f;
+        float texcoord_error = 0.0f;
+        float normal_error = 0.0f;
+        float tangent_error = 0.0f;
+    };
+
+    uint16_t float_to_half(float f);
+
+    float half_to_float(uint16_t h);
+
+    inline uint16_t pack_unorm16(float v) {
+        return static_cast<uint16_t>(std::round(glm::clamp(v, 0.0f, 1.0f) * 65535.0f));
+    }
+
+    inline float unpack_unorm16(uint16_t v) { return static_cast<float>(v) / 65535.0f; }
+
+    inline int16_t pack_snorm16(float v) {
+        return static_cast<int16_t>(std::round(glm::clamp(v, -1.0f, 1.0f) * 32767.0f));
+    }
+
+    inline float unpack_snorm16(int16_t v) { return std::max(static_cast<float>(v) / 32767.0f, -1.0f); }
+
+    /**
+     * Octahedral mapping of a unit vector onto [-1, 1]^2.
+     */
+    glm::vec2 oct_encode(const glm::vec3 &n);
+
+    glm::vec3 oct_decode(const glm::vec2 &e);
+
+    /**
+     * Octahedral encoding in two snorm16 values, picking the rounding whose decoded vector is closest to `n`.
+     */
+    void pack_oct16(const glm::vec3 &n, int16_t out[2]);
+
+    glm::vec3 unpack_oct16(const int16_t in[2]);
+
+    /**
+     * x, y, z in 10 bit and w in 2 bit signed normalized integers, as read by GL_INT_2_10_10_10_REV.
+     */
+    uint32_t pack_snorm_10_10_10_2(const glm::vec4 &v);
+
+    glm::vec4 unpack_snorm_10_10_10_2(uint32_t p);
+
+}